@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+'''
+Local regtest scenario measuring block propagation.
+
+Starts a line of nodes (node0 -> node1 -> ... ), fills their mempools with
+transactions, then mines blocks on node0 and reports, for every block, how
+long it took to reach the last node and how many bytes each node received
+for it (block, cmpctblock, getblocktxn and blocktxn messages), next to the
+serialized size of the block itself.
+
+No wallet is needed: coins are held in 1-of-n multisigs for a well-known
+key, and transactions are signed with signrawtransaction.
+
+Example:
+
+    contrib/devtools/block-relay-bench.py --nodes 3 --txs 500 --blocks 5
+    contrib/devtools/block-relay-bench.py --blocksonly   # every tx comes through getblocktxn
+'''
+import argparse
+import base64
+import hashlib
+import http.client
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+# Private key 1 and its compressed public key (the secp256k1 generator).
+PUBKEY = '0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798'
+PRIVKEY = (1).to_bytes(32, 'big')
+B58 = '123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz'
+RELAY_MSGS = ('block', 'cmpctblock', 'getblocktxn', 'blocktxn')
+
+
+def base58check(payload):
+    data = payload + hashlib.sha256(hashlib.sha256(payload).digest()).digest()[:4]
+    n = int.from_bytes(data, 'big')
+    out = ''
+    while n:
+        n, r = divmod(n, 58)
+        out = B58[r] + out
+    return '1' * (len(data) - len(data.lstrip(b'\0'))) + out
+
+
+class Node(object):
+    def __init__(self, binary, root, index, extra_args):
+        self.index = index
+        self.datadir = os.path.join(root, 'node%d' % index)
+        self.port = 30000 + index
+        self.rpcport = 31000 + index
+        os.makedirs(self.datadir)
+        with open(os.path.join(self.datadir, 'lbrycrd.conf'), 'w') as f:
+            f.write('regtest=1\nrpcuser=bench\nrpcpassword=bench\nlisten=1\nserver=1\n')
+        args = [binary, '-datadir=' + self.datadir, '-port=%d' % self.port, '-rpcport=%d' % self.rpcport,
+                '-discover=0', '-dnsseed=0', '-debug=cmpctblock'] + extra_args
+        self.process = subprocess.Popen(args, stdout=subprocess.DEVNULL)
+        self.auth = 'Basic ' + base64.b64encode(b'bench:bench').decode()
+        deadline = time.time() + 60
+        while True:
+            try:
+                self.call('getblockcount')
+                break
+            except (ConnectionError, OSError, RuntimeError):
+                if time.time() > deadline:
+                    raise
+                time.sleep(0.2)
+
+    def call(self, method, *params):
+        conn = http.client.HTTPConnection('127.0.0.1', self.rpcport, timeout=600)
+        conn.request('POST', '/', json.dumps({'id': 0, 'method': method, 'params': list(params)}),
+                     {'Authorization': self.auth, 'Content-Type': 'application/json'})
+        reply = json.loads(conn.getresponse().read().decode())
+        conn.close()
+        if reply.get('error'):
+            raise RuntimeError('%s: %s' % (method, reply['error']))
+        return reply['result']
+
+    def relay_bytes(self):
+        total = 0
+        for peer in self.call('getpeerinfo'):
+            per_msg = peer.get('bytesrecv_per_msg', {})
+            total += sum(per_msg.get(msg, 0) for msg in RELAY_MSGS)
+        return total
+
+    def stop(self):
+        try:
+            self.call('stop')
+        except Exception:
+            pass
+        self.process.wait()
+
+
+def wait_until(predicate, timeout=120):
+    deadline = time.time() + timeout
+    while not predicate():
+        if time.time() > deadline:
+            raise RuntimeError('timeout')
+        time.sleep(0.005)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--bindir', default=os.path.join(os.path.dirname(__file__), '..', '..', 'src'))
+    parser.add_argument('--nodes', type=int, default=3, help='length of the node chain')
+    parser.add_argument('--txs', type=int, default=200, help='transactions per block')
+    parser.add_argument('--blocks', type=int, default=5, help='blocks to measure')
+    parser.add_argument('--blocksonly', action='store_true',
+                        help='run the relaying nodes with -blocksonly, so their mempools stay empty')
+    args = parser.parse_args()
+
+    binary = os.path.join(args.bindir, 'lbrycrdd')
+    root = tempfile.mkdtemp(prefix='block-relay-bench')
+    nodes = []
+    try:
+        for i in range(args.nodes):
+            extra = ['-blocksonly'] if args.blocksonly and i > 0 else []
+            nodes.append(Node(binary, root, i, extra))
+        for i in range(1, args.nodes):
+            nodes[i].call('addnode', '127.0.0.1:%d' % nodes[i - 1].port, 'onetry')
+        wait_until(lambda: all(len(n.call('getpeerinfo')) >= (1 if n.index in (0, args.nodes - 1) else 2) for n in nodes))
+
+        # 1-of-n multisigs over the same key give up to 16 distinct addresses
+        # we can sign for, so one transaction can split a coinbase 16 ways.
+        scripts = []
+        for n in range(1, 17):
+            multisig = nodes[0].call('createmultisig', 1, [PUBKEY] * n)
+            spk = nodes[0].call('validateaddress', multisig['address'])['scriptPubKey']
+            scripts.append((multisig['address'], spk, multisig['redeemScript']))
+        wif = base58check(bytes([239]) + PRIVKEY + b'\x01')
+
+        def sign_and_send(coins, outputs):
+            raw = nodes[0].call('createrawtransaction', [{'txid': c[0], 'vout': c[1]} for c in coins], outputs)
+            prevtxs = [{'txid': c[0], 'vout': c[1], 'scriptPubKey': c[2], 'redeemScript': c[3]} for c in coins]
+            signed = nodes[0].call('signrawtransaction', raw, prevtxs, [wif])
+            if not signed['complete']:
+                raise RuntimeError('signing failed')
+            return nodes[0].call('sendrawtransaction', signed['hex'])
+
+        # Mature enough coinbases, then split each into one output per script.
+        address = scripts[0][0]
+        needed = args.txs * args.blocks
+        nodes[0].call('generatetoaddress', 101 + (needed + 15) // 16, address)
+        coins = []
+        for h in range(1, nodes[0].call('getblockcount') - 99):
+            if len(coins) >= needed:
+                break
+            cb = nodes[0].call('getrawtransaction', nodes[0].call('getblock', nodes[0].call('getblockhash', h))['tx'][0], 1)
+            each = float('%.8f' % ((cb['vout'][0]['value'] - 0.01) / len(scripts)))
+            txid = sign_and_send([(cb['txid'], 0, scripts[0][1], scripts[0][2])],
+                                 dict((addr, each) for addr, _, _ in scripts))
+            for out in nodes[0].call('getrawtransaction', txid, 1)['vout']:
+                spk = out['scriptPubKey']['hex']
+                coins.append((txid, out['n'], spk, [r for _, s, r in scripts if s == spk][0], out['value']))
+        nodes[0].call('generatetoaddress', 1, address)
+        wait_until(lambda: len(set(n.call('getbestblockhash') for n in nodes)) == 1)
+
+        print('%d nodes in a line, %d txs per block%s' % (args.nodes, args.txs, ', relays in -blocksonly' if args.blocksonly else ''))
+        print('%6s %10s %12s  %s' % ('block', 'size', 'to last (ms)', 'bytes received per node'))
+        for b in range(args.blocks):
+            for _ in range(args.txs):
+                coin = coins.pop()
+                sign_and_send([coin], {address: float('%.8f' % (coin[4] - 0.001))})
+            if not args.blocksonly:
+                size = nodes[0].call('getmempoolinfo')['size']
+                wait_until(lambda: all(n.call('getmempoolinfo')['size'] >= size for n in nodes))
+            before = [n.relay_bytes() for n in nodes]
+            start = time.time()
+            tip = nodes[0].call('generatetoaddress', 1, address)[0]
+            wait_until(lambda: nodes[-1].call('getbestblockhash') == tip)
+            elapsed = time.time() - start
+            size = nodes[0].call('getblock', tip)['size']
+            received = [n.relay_bytes() - x for n, x in zip(nodes, before)]
+            print('%6d %10d %12.1f  %s' % (b, size, 1000 * elapsed, ' '.join(str(r) for r in received[1:])))
+    finally:
+        for node in nodes:
+            node.stop()
+        shutil.rmtree(root, ignore_errors=True)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+'''
+Loopback stress harness for the P2P socket handler.
+
+Opens many connections to a local node, completes the version handshake on
+all of them, then keeps a subset busy with ping/pong round trips while the
+rest stay idle. At the end it reports the node's CPU time (read from
+/proc/<pid>/stat) per message handled, which makes it easy to compare
+-socketevents=select and -socketevents=epoll.
+
+Example, against a regtest node:
+
+    lbrycrdd -regtest -maxconnections=5000 -socketevents=epoll &
+    contrib/devtools/p2p-stress.py --pid $! --idle 4000 --active 100
+'''
+import argparse
+import hashlib
+import os
+import random
+import resource
+import selectors
+import socket
+import struct
+import sys
+import time
+
+PROTOCOL_VERSION = 70013
+MAGIC = {
+    'main': bytes.fromhex('fae4aaf1'),
+    'testnet': bytes.fromhex('fae4aae1'),
+    'regtest': bytes.fromhex('fae4aad1'),
+}
+PORT = {'main': 9246, 'testnet': 19246, 'regtest': 29246}
+
+
+def sha256d(data):
+    return hashlib.sha256(hashlib.sha256(data).digest()).digest()
+
+
+def message(magic, command, payload):
+    return (magic + command.encode().ljust(12, b'\0') + struct.pack('<I', len(payload)) +
+            sha256d(payload)[:4] + payload)
+
+
+def address(ip, port):
+    return struct.pack('<Q', 1) + b'\0' * 10 + b'\xff\xff' + socket.inet_aton(ip) + struct.pack('>H', port)
+
+
+def version_payload(ip, port):
+    return (struct.pack('<iQq', PROTOCOL_VERSION, 1, int(time.time())) + address(ip, port) +
+            address('127.0.0.1', 0) + struct.pack('<Q', random.getrandbits(64)) +
+            b'\x0a/p2pstress/' + struct.pack('<i?', 0, False))
+
+
+class Peer(object):
+    def __init__(self, sock, active):
+        self.sock = sock
+        self.active = active
+        self.recvbuf = b''
+        self.sendbuf = b''
+        self.ready = False
+        self.outstanding = 0
+
+
+def read_cpu_seconds(pid):
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    # utime and stime are fields 14 and 15, counted from 1 including pid and comm
+    return (int(fields[11]) + int(fields[12])) / float(os.sysconf('SC_CLK_TCK'))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--network', choices=sorted(MAGIC), default='regtest')
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, help='P2P port (default: the network default)')
+    parser.add_argument('--pid', type=int, help='process id of the node, to measure its CPU time')
+    parser.add_argument('--idle', type=int, default=1000, help='connections that only complete the handshake')
+    parser.add_argument('--active', type=int, default=100, help='connections that keep pinging')
+    parser.add_argument('--pipeline', type=int, default=4, help='pings in flight per active connection')
+    parser.add_argument('--duration', type=float, default=30.0, help='seconds to measure for')
+    args = parser.parse_args()
+
+    magic = MAGIC[args.network]
+    port = args.port or PORT[args.network]
+    total = args.idle + args.active
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < total + 64:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, total + 64), hard))
+
+    sel = selectors.DefaultSelector()
+    peers = []
+    for i in range(total):
+        sock = socket.create_connection((args.host, port))
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        sock.setblocking(False)
+        peer = Peer(sock, i < args.active)
+        peer.sendbuf = message(magic, 'version', version_payload(args.host, port))
+        peers.append(peer)
+        sel.register(sock, selectors.EVENT_READ | selectors.EVENT_WRITE, peer)
+
+    stats = {'messages': 0, 'closed': 0}
+    ping = message(magic, 'ping', struct.pack('<Q', 0))
+
+    def on_message(peer, command, payload):
+        stats['messages'] += 1
+        if command == 'verack':
+            peer.sendbuf += message(magic, 'verack', b'')
+            peer.ready = True
+            if peer.active:
+                peer.sendbuf += ping * args.pipeline
+                peer.outstanding = args.pipeline
+        elif command == 'ping':
+            peer.sendbuf += message(magic, 'pong', payload)
+        elif command == 'pong' and peer.active:
+            peer.sendbuf += ping
+
+    def service(timeout):
+        for key, mask in sel.select(timeout):
+            peer = key.data
+            try:
+                if mask & selectors.EVENT_READ:
+                    data = peer.sock.recv(65536)
+                    if not data:
+                        raise ConnectionError('closed by peer')
+                    peer.recvbuf += data
+                    while len(peer.recvbuf) >= 24:
+                        length = struct.unpack('<I', peer.recvbuf[16:20])[0]
+                        if len(peer.recvbuf) < 24 + length:
+                            break
+                        command = peer.recvbuf[4:16].rstrip(b'\0').decode()
+                        on_message(peer, command, peer.recvbuf[24:24 + length])
+                        peer.recvbuf = peer.recvbuf[24 + length:]
+                if peer.sendbuf:
+                    sent = peer.sock.send(peer.sendbuf)
+                    peer.sendbuf = peer.sendbuf[sent:]
+            except (BlockingIOError, InterruptedError):
+                pass
+            except (ConnectionError, OSError):
+                sel.unregister(peer.sock)
+                peer.sock.close()
+                stats['closed'] += 1
+                continue
+            sel.modify(peer.sock, selectors.EVENT_READ | (selectors.EVENT_WRITE if peer.sendbuf else 0), peer)
+
+    deadline = time.time() + 60
+    while sum(1 for p in peers if p.ready) + stats['closed'] < total and time.time() < deadline:
+        service(1.0)
+    ready = sum(1 for p in peers if p.ready)
+    print('%d of %d connections completed the handshake (%d closed)' % (ready, total, stats['closed']))
+
+    stats['messages'] = 0
+    cpu_start = read_cpu_seconds(args.pid) if args.pid else None
+    start = time.time()
+    while time.time() - start < args.duration:
+        service(0.1)
+    elapsed = time.time() - start
+    messages = stats['messages']
+    print('%d messages in %.1fs (%.0f/s)' % (messages, elapsed, messages / elapsed))
+    if cpu_start is not None:
+        cpu = read_cpu_seconds(args.pid) - cpu_start
+        print('node CPU: %.2fs (%.1f%%), %.1f us per message' % (cpu, 100.0 * cpu / elapsed,
+              1e6 * cpu / messages if messages else float('nan')))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+'''
+Local regtest scenario measuring batched claim lookups over JSON-RPC.
+
+Starts a node, creates a number of claims, then sends JSON-RPC batches of
+getvalueforname and getclaimsfortx calls, the way an indexer does, and
+reports how long a batch takes. The node is restarted for every batch
+concurrency given, and every run must return the same replies as the first.
+
+No wallet is needed: coins are held in a 1-of-1 multisig for a well-known
+key, claims pay to that key directly, and transactions are signed with
+signrawtransaction.
+
+Example:
+
+    contrib/devtools/rpc-batch-bench.py --claims 500 --batch 500 --concurrency 1,2,4,8
+'''
+import argparse
+import base64
+import hashlib
+import http.client
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+# Private key 1 and its compressed public key (the secp256k1 generator).
+PUBKEY = '0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798'
+PRIVKEY = (1).to_bytes(32, 'big')
+B58 = '123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz'
+OP_CLAIM_NAME, OP_2DROP, OP_DROP, OP_CHECKSIG = 0xb5, 0x6d, 0x75, 0xac
+
+
+def base58check(payload):
+    data = payload + hashlib.sha256(hashlib.sha256(payload).digest()).digest()[:4]
+    n = int.from_bytes(data, 'big')
+    out = ''
+    while n:
+        n, r = divmod(n, 58)
+        out = B58[r] + out
+    return '1' * (len(data) - len(data.lstrip(b'\0'))) + out
+
+
+def push(data):
+    return bytes([len(data)]) + data
+
+
+class Node(object):
+    def __init__(self, binary, datadir, extra_args):
+        self.datadir = datadir
+        self.port = 30000
+        self.rpcport = 31000
+        if not os.path.exists(self.datadir):
+            os.makedirs(self.datadir)
+            with open(os.path.join(self.datadir, 'lbrycrd.conf'), 'w') as f:
+                f.write('regtest=1\nrpcuser=bench\nrpcpassword=bench\nlisten=0\nserver=1\n')
+        args = [binary, '-datadir=' + self.datadir, '-port=%d' % self.port, '-rpcport=%d' % self.rpcport,
+                '-discover=0', '-dnsseed=0'] + extra_args
+        self.process = subprocess.Popen(args, stdout=subprocess.DEVNULL)
+        self.auth = 'Basic ' + base64.b64encode(b'bench:bench').decode()
+        deadline = time.time() + 60
+        while True:
+            try:
+                self.call('getblockcount')
+                break
+            except (ConnectionError, OSError, RuntimeError):
+                if time.time() > deadline:
+                    raise
+                time.sleep(0.2)
+
+    def post(self, request):
+        conn = http.client.HTTPConnection('127.0.0.1', self.rpcport, timeout=600)
+        conn.request('POST', '/', json.dumps(request),
+                     {'Authorization': self.auth, 'Content-Type': 'application/json'})
+        reply = json.loads(conn.getresponse().read().decode())
+        conn.close()
+        return reply
+
+    def call(self, method, *params):
+        reply = self.post({'id': 0, 'method': method, 'params': list(params)})
+        if reply.get('error'):
+            raise RuntimeError('%s: %s' % (method, reply['error']))
+        return reply['result']
+
+    def stop(self):
+        try:
+            self.call('stop')
+        except Exception:
+            pass
+        self.process.wait()
+
+
+def create_claims(node, count):
+    multisig = node.call('createmultisig', 1, [PUBKEY])
+    address = multisig['address']
+    spk = node.call('validateaddress', address)['scriptPubKey']
+    wif = base58check(bytes([239]) + PRIVKEY + b'\x01')
+    pay_to_key = push(bytes.fromhex(PUBKEY)) + bytes([OP_CHECKSIG])
+
+    # Every claim spends a mature coinbase of its own
+    node.call('generatetoaddress', 101 + count, address)
+    txids = []
+    for h in range(1, count + 1):
+        cb = node.call('getrawtransaction', node.call('getblock', node.call('getblockhash', h))['tx'][0], 1)
+        raw = node.call('createrawtransaction', [{'txid': cb['txid'], 'vout': 0}],
+                        {address: float('%.8f' % (cb['vout'][0]['value'] - 0.001))})
+        name = ('name%d' % h).encode()
+        claim = bytes([OP_CLAIM_NAME]) + push(name) + push(b'value%d' % h) + bytes([OP_2DROP, OP_DROP]) + pay_to_key
+        raw = raw.replace(push(bytes.fromhex(spk)).hex(), push(claim).hex())
+        prevtxs = [{'txid': cb['txid'], 'vout': 0, 'scriptPubKey': spk, 'redeemScript': multisig['redeemScript']}]
+        signed = node.call('signrawtransaction', raw, prevtxs, [wif])
+        if not signed['complete']:
+            raise RuntimeError('signing failed')
+        txids.append(node.call('sendrawtransaction', signed['hex']))
+    node.call('generatetoaddress', 1, address)
+    return txids
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--bindir', default=os.path.join(os.path.dirname(__file__), '..', '..', 'src'))
+    parser.add_argument('--claims', type=int, default=200, help='claims to create')
+    parser.add_argument('--batch', type=int, default=500, help='requests per batch')
+    parser.add_argument('--batches', type=int, default=20, help='batches to measure per run')
+    parser.add_argument('--concurrency', default='1,2,4,8',
+                        help='comma separated -rpcbatchconcurrency values to run with, 1 runs batches in order')
+    args = parser.parse_args()
+
+    binary = os.path.join(args.bindir, 'lbrycrdd')
+    root = tempfile.mkdtemp(prefix='rpc-batch-bench')
+    datadir = os.path.join(root, 'node0')
+    node = None
+    try:
+        node = Node(binary, datadir, [])
+        txids = create_claims(node, args.claims)
+        node.stop()
+        node = None
+
+        batch = []
+        for i in range(args.batch):
+            if i % 2:
+                batch.append({'id': i, 'method': 'getvalueforname', 'params': ['name%d' % (1 + i % args.claims)]})
+            else:
+                batch.append({'id': i, 'method': 'getclaimsfortx', 'params': [txids[i % args.claims]]})
+
+        print('%d claims, batches of %d lookups' % (args.claims, args.batch))
+        print('%12s %14s %14s' % ('concurrency', 'ms per batch', 'lookups per s'))
+        expected = None
+        for concurrency in [int(c) for c in args.concurrency.split(',')]:
+            node = Node(binary, datadir, ['-rpcbatchthreads=%d' % max(concurrency - 1, 0),
+                                          '-rpcbatchconcurrency=%d' % concurrency])
+            replies = node.post(batch)
+            if any(reply['error'] for reply in replies):
+                raise RuntimeError('lookup failed: %s' % [reply for reply in replies if reply['error']][0])
+            if expected is None:
+                expected = replies
+            start = time.time()
+            for _ in range(args.batches):
+                if node.post(batch) != expected:
+                    raise RuntimeError('replies differ from the first run')
+            elapsed = (time.time() - start) / args.batches
+            print('%12d %14.1f %14.0f' % (concurrency, 1000 * elapsed, args.batch / elapsed))
+            node.stop()
+            node = None
+    finally:
+        if node:
+            node.stop()
+        shutil.rmtree(root, ignore_errors=True)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -96,6 +96,7 @@ testScripts = [
     'mempool_spendcoinbase.py',
     'mempool_reorg.py',
     'mempool_limit.py',
+    'mempool_persist.py',
     'httpbasics.py',
     'multi_rpc.py',
     'zapwallettxes.py',
@@ -117,6 +118,8 @@ testScripts = [
     'invalidtxrequest.py',
     'abandonconflict.py',
     'p2p-versionbits-warning.py',
+    'p2p-servethreads.py',
+    'p2p-socketevents.py',
     'importprunedfunds.py',
 ]
 testScriptsExt = [
@@ -0,0 +1,71 @@
+#!/usr/bin/env python2
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test mempool persistence.
+#
+# node0 gets a few wallet transactions, a claim and a support for it, and a
+# fee delta. After a restart it should have read all of them back from
+# mempool.dat with their original entry times and modified fees. node1 runs
+# with -persistmempool=0 and should come back with an empty mempool.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import time
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def setup_network(self):
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir))
+        self.nodes.append(start_node(1, self.options.tmpdir))
+        connect_nodes(self.nodes[0], 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def wait_for_mempool(self, node, size):
+        for i in range(600):
+            if len(node.getrawmempool()) == size:
+                return
+            time.sleep(0.1)
+        raise AssertionError("mempool did not reach %d transactions" % size)
+
+    def run_test(self):
+        address = self.nodes[0].getnewaddress()
+        for i in range(5):
+            self.nodes[0].sendtoaddress(address, Decimal("0.1"))
+        claim_txid = self.nodes[0].claimname("persist", "deadbeef", Decimal("0.01"))
+        self.sync_all()
+        claim_id = self.nodes[0].getclaimsfortx(claim_txid)[0]["claimId"]
+        support_txid = self.nodes[0].supportclaim("persist", claim_id, Decimal("0.01"))
+        self.nodes[0].prioritisetransaction(claim_txid, 0, 12345)
+        self.sync_all()
+
+        mempool = self.nodes[0].getrawmempool(True)
+        assert_equal(len(mempool), 7)
+        assert(support_txid in mempool)
+        assert_equal(len(self.nodes[1].getrawmempool()), 7)
+
+        stop_nodes(self.nodes)
+        wait_bitcoinds()
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir))
+        self.nodes.append(start_node(1, self.options.tmpdir, ["-persistmempool=0"]))
+
+        self.wait_for_mempool(self.nodes[0], 7)
+        reloaded = self.nodes[0].getrawmempool(True)
+        for txid in mempool:
+            assert_equal(reloaded[txid]["time"], mempool[txid]["time"])
+            assert_equal(reloaded[txid]["modifiedfee"], mempool[txid]["modifiedfee"])
+        assert_equal(reloaded[claim_txid]["modifiedfee"], reloaded[claim_txid]["fee"] + Decimal("0.00012345"))
+        assert_equal(len(self.nodes[1].getrawmempool()), 0)
+
+        # The reloaded transactions can be mined, claim and support included
+        self.nodes[0].generate(1)
+        assert_equal(len(self.nodes[0].getrawmempool()), 0)
+        assert_equal(self.nodes[0].getvalueforname("persist")["claimId"], claim_id)
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
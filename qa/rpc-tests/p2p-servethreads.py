@@ -0,0 +1,84 @@
+#!/usr/bin/env python2
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test serving getdata requests on -servethreads workers.
+#
+# node0 serves blocks and transactions on two worker threads with a send
+# buffer of a single kB, so nearly every getdata response fills it and has
+# to wait for the socket handler to drain it. node1 syncs from node0 on
+# -servethreads=2 too, node2 serves from its message handler. No wallet is
+# needed: coins are mined to a P2SH address of OP_TRUE and spent by raw
+# transactions.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.mininode import CTransaction, FromHex, ToHex
+from test_framework.script import CScript, OP_TRUE
+
+class ServeThreadsTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 3)
+
+    def setup_network(self):
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir, ["-servethreads=2", "-maxsendbuffer=1"]))
+        self.nodes.append(start_node(1, self.options.tmpdir, ["-servethreads=2"]))
+        self.nodes.append(start_node(2, self.options.tmpdir, ["-servethreads=0"]))
+        self.is_network_split = False
+
+    # Spend output n of txid, which pays to the P2SH address of OP_TRUE, back
+    # to that address
+    def spend(self, node, txid, n, fee):
+        value = node.gettxout(txid, n)["value"]
+        rawtx = node.createrawtransaction([{"txid": txid, "vout": n}], {self.address: value - fee})
+        tx = CTransaction()
+        FromHex(tx, rawtx)
+        tx.vin[0].scriptSig = CScript([self.redeem_script])
+        return node.sendrawtransaction(ToHex(tx))
+
+    def run_test(self):
+        self.redeem_script = CScript([OP_TRUE])
+        self.address = self.nodes[0].decodescript(bytes_to_hex_str(self.redeem_script))["p2sh"]
+
+        # node1 downloads the whole chain through node0's full send buffer
+        hashes = self.nodes[0].generatetoaddress(250, self.address)
+        connect_nodes(self.nodes[1], 0)
+        sync_blocks(self.nodes[:2])
+        assert_equal(self.nodes[1].getbestblockhash(), hashes[-1])
+
+        # Transactions are relayed to node1 through it too, and end up in
+        # a block several times the size of the send buffer
+        fee = Decimal("0.01")
+        txids = []
+        for i in range(50):
+            coinbase = self.nodes[0].getblock(hashes[i])["tx"][0]
+            txids.append(self.spend(self.nodes[0], coinbase, 0, fee))
+        sync_mempools(self.nodes[:2])
+        assert_equal(set(self.nodes[1].getrawmempool()), set(txids))
+        hashes += self.nodes[0].generatetoaddress(1, self.address)
+        sync_blocks(self.nodes[:2])
+        assert_equal(len(self.nodes[1].getblock(hashes[-1])["tx"]), 51)
+        assert_equal(len(self.nodes[1].getrawmempool()), 0)
+        assert_greater_than(self.nodes[1].getblock(hashes[-1])["size"], 4000)
+
+        # node2 syncs from both, then its own transactions go the other way
+        connect_nodes(self.nodes[2], 0)
+        connect_nodes(self.nodes[2], 1)
+        sync_blocks(self.nodes)
+        txids = [self.spend(self.nodes[2], txid, 0, fee) for txid in txids[:10]]
+        sync_mempools(self.nodes)
+        for node in self.nodes:
+            assert_equal(set(node.getrawmempool()), set(txids))
+        hashes += self.nodes[1].generatetoaddress(1, self.address)
+        sync_blocks(self.nodes)
+        for node in self.nodes:
+            assert_equal(node.getbestblockhash(), hashes[-1])
+            assert_equal(len(node.getrawmempool()), 0)
+
+if __name__ == '__main__':
+    ServeThreadsTest().main()
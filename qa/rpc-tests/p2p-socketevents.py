@@ -0,0 +1,94 @@
+#!/usr/bin/env python2
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the -socketevents=epoll socket handler.
+#
+# node0 and node1 run with -socketevents=epoll, node2 with the default
+# select loop, connected as node2 -> node1 -> node0. Blocks and transactions
+# cross the epoll nodes in both directions, and peers are disconnected on
+# either end of a connection and reconnected. Coins are mined to the P2SH
+# address of OP_TRUE, so no wallet is needed.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.mininode import CTransaction, FromHex, ToHex
+from test_framework.script import CScript, OP_TRUE
+
+class SocketEventsTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 3)
+
+    def setup_network(self):
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir, ["-socketevents=epoll"]))
+        self.nodes.append(start_node(1, self.options.tmpdir, ["-socketevents=epoll"]))
+        self.nodes.append(start_node(2, self.options.tmpdir))
+        connect_nodes(self.nodes[1], 0)
+        connect_nodes(self.nodes[2], 1)
+        self.is_network_split = False
+
+    def spend_to_op_true(self, node, txid, fee):
+        value = node.gettxout(txid, 0)["value"]
+        rawtx = node.createrawtransaction([{"txid": txid, "vout": 0}], {self.address: value - fee})
+        tx = CTransaction()
+        FromHex(tx, rawtx)
+        tx.vin[0].scriptSig = CScript([self.redeem_script])
+        return node.sendrawtransaction(ToHex(tx))
+
+    def wait_for_peers(self, node, count):
+        for i in range(100):
+            if len(node.getpeerinfo()) == count:
+                return
+            time.sleep(0.1)
+        raise AssertionError("node did not get to %d peers" % count)
+
+    def run_test(self):
+        self.redeem_script = CScript([OP_TRUE])
+        self.address = self.nodes[0].decodescript(bytes_to_hex_str(self.redeem_script))["p2sh"]
+
+        # Blocks from node0 reach node2 through node1
+        hashes = self.nodes[0].generatetoaddress(120, self.address)
+        sync_blocks(self.nodes)
+
+        # Transactions from node2 reach node0 through node1, and are mined
+        fee = Decimal("0.01")
+        txids = []
+        for i in range(10):
+            coinbase = self.nodes[2].getblock(hashes[i])["tx"][0]
+            txids.append(self.spend_to_op_true(self.nodes[2], coinbase, fee))
+        sync_mempools(self.nodes)
+        assert_equal(set(self.nodes[0].getrawmempool()), set(txids))
+        self.nodes[0].generatetoaddress(1, self.address)
+        sync_blocks(self.nodes)
+        for node in self.nodes:
+            assert_equal(len(node.getrawmempool()), 0)
+
+        # node1 drops its outbound connection to node0; the chains part
+        # until it connects again
+        self.nodes[1].disconnectnode("127.0.0.1:" + str(p2p_port(0)))
+        self.wait_for_peers(self.nodes[0], 0)
+        self.wait_for_peers(self.nodes[1], 1)
+        self.nodes[0].generatetoaddress(5, self.address)
+        self.nodes[1].generatetoaddress(1, self.address)
+        connect_nodes(self.nodes[1], 0)
+        sync_blocks(self.nodes)
+        assert_equal(self.nodes[2].getblockcount(), 126)
+
+        # node1 drops node2's inbound connection
+        inbound = [peer["addr"] for peer in self.nodes[1].getpeerinfo() if peer["inbound"]]
+        assert_equal(len(inbound), 1)
+        self.nodes[1].disconnectnode(inbound[0])
+        self.wait_for_peers(self.nodes[2], 0)
+        self.wait_for_peers(self.nodes[1], 1)
+        connect_nodes(self.nodes[2], 1)
+        hashes = self.nodes[2].generatetoaddress(1, self.address)
+        sync_blocks(self.nodes)
+        assert_equal(self.nodes[0].getbestblockhash(), hashes[0])
+
+if __name__ == '__main__':
+    SocketEventsTest().main()
@@ -9,6 +9,8 @@
 #include "serialize.h"
 #include "streams.h"
 
+#include <limits>
+
 int CAddrInfo::GetTriedBucket(const uint256& nKey) const
 {
     uint64_t hash1 = (CHashWriter(SER_GETHASH, 0) << nKey << GetKey()).GetHash().GetCheapHash();
@@ -72,29 +74,103 @@ double CAddrInfo::GetChance(int64_t nNow) const
     return fChance;
 }
 
+CAddrBucketTable::CAddrBucketTable(int nBuckets) :
+    vId(nBuckets * ADDRMAN_BUCKET_SIZE, -1),
+    vOccupiedIndex(nBuckets * ADDRMAN_BUCKET_SIZE, -1),
+    vBucketBits(nBuckets, 0)
+{
+}
+
+void CAddrBucketTable::Set(int nBucket, int nPos, int nId)
+{
+    int nSlot = nBucket * ADDRMAN_BUCKET_SIZE + nPos;
+    if (vId[nSlot] == -1) {
+        vOccupiedIndex[nSlot] = vOccupied.size();
+        vOccupied.push_back(nSlot);
+        vBucketBits[nBucket] |= (uint64_t)1 << nPos;
+    }
+    vId[nSlot] = nId;
+}
+
+void CAddrBucketTable::Erase(int nBucket, int nPos)
+{
+    int nSlot = nBucket * ADDRMAN_BUCKET_SIZE + nPos;
+    if (vId[nSlot] == -1)
+        return;
+
+    // Move the last occupied position into the hole to keep vOccupied dense.
+    int nIndex = vOccupiedIndex[nSlot];
+    int nSlotLast = vOccupied.back();
+    vOccupied[nIndex] = nSlotLast;
+    vOccupiedIndex[nSlotLast] = nIndex;
+    vOccupied.pop_back();
+
+    vOccupiedIndex[nSlot] = -1;
+    vId[nSlot] = -1;
+    vBucketBits[nBucket] &= ~((uint64_t)1 << nPos);
+}
+
+void CAddrBucketTable::Clear()
+{
+    std::fill(vId.begin(), vId.end(), -1);
+    std::fill(vOccupiedIndex.begin(), vOccupiedIndex.end(), -1);
+    std::fill(vBucketBits.begin(), vBucketBits.end(), 0);
+    vOccupied.clear();
+}
+
+int CAddrBucketTable::BucketSize(int nBucket) const
+{
+    int nSize = 0;
+    for (uint64_t nBits = vBucketBits[nBucket]; nBits; nBits &= nBits - 1)
+        nSize++;
+    return nSize;
+}
+
+CNetAddrHasher::CNetAddrHasher() :
+    k0(GetRand(std::numeric_limits<uint64_t>::max())),
+    k1(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+}
+
+size_t CNetAddrHasher::operator()(const CNetAddr& addr) const
+{
+    uint64_t nHigh = 0, nLow = 0;
+    for (int n = 0; n < 8; n++) {
+        nLow |= (uint64_t)addr.GetByte(n) << (8 * n);
+        nHigh |= (uint64_t)addr.GetByte(n + 8) << (8 * n);
+    }
+    return CSipHasher(k0, k1).Write(nLow).Write(nHigh).Finalize();
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
+    boost::unordered_map<CNetAddr, int, CNetAddrHasher>::iterator it = mapAddr.find(addr);
     if (it == mapAddr.end())
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
-    if (it2 != mapInfo.end())
-        return &(*it2).second;
+    if (IsUsed((*it).second))
+        return &vInfo[(*it).second];
     return NULL;
 }
 
 CAddrInfo* CAddrMan::Create(const CAddress& addr, const CNetAddr& addrSource, int* pnId)
 {
-    int nId = nIdCount++;
-    mapInfo[nId] = CAddrInfo(addr, addrSource);
+    int nId;
+    if (!vFreeIds.empty()) {
+        nId = vFreeIds.back();
+        vFreeIds.pop_back();
+        vInfo[nId] = CAddrInfo(addr, addrSource);
+    } else {
+        nId = vInfo.size();
+        vInfo.push_back(CAddrInfo(addr, addrSource));
+    }
     mapAddr[addr] = nId;
-    mapInfo[nId].nRandomPos = vRandom.size();
+    vInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
     if (pnId)
         *pnId = nId;
-    return &mapInfo[nId];
+    return &vInfo[nId];
 }
 
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
@@ -107,11 +183,11 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     int nId1 = vRandom[nRndPos1];
     int nId2 = vRandom[nRndPos2];
 
-    assert(mapInfo.count(nId1) == 1);
-    assert(mapInfo.count(nId2) == 1);
+    assert(IsUsed(nId1));
+    assert(IsUsed(nId2));
 
-    mapInfo[nId1].nRandomPos = nRndPos2;
-    mapInfo[nId2].nRandomPos = nRndPos1;
+    vInfo[nId1].nRandomPos = nRndPos2;
+    vInfo[nId2].nRandomPos = nRndPos1;
 
     vRandom[nRndPos1] = nId2;
     vRandom[nRndPos2] = nId1;
@@ -119,27 +195,28 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
 
 void CAddrMan::Delete(int nId)
 {
-    assert(mapInfo.count(nId) != 0);
-    CAddrInfo& info = mapInfo[nId];
+    assert(IsUsed(nId));
+    CAddrInfo& info = vInfo[nId];
     assert(!info.fInTried);
     assert(info.nRefCount == 0);
 
     SwapRandom(info.nRandomPos, vRandom.size() - 1);
     vRandom.pop_back();
     mapAddr.erase(info);
-    mapInfo.erase(nId);
+    info = CAddrInfo();
+    vFreeIds.push_back(nId);
     nNew--;
 }
 
 void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
 {
     // if there is an entry in the specified bucket, delete it.
-    if (vvNew[nUBucket][nUBucketPos] != -1) {
-        int nIdDelete = vvNew[nUBucket][nUBucketPos];
-        CAddrInfo& infoDelete = mapInfo[nIdDelete];
+    if (vvNew.Get(nUBucket, nUBucketPos) != -1) {
+        int nIdDelete = vvNew.Get(nUBucket, nUBucketPos);
+        CAddrInfo& infoDelete = vInfo[nIdDelete];
         assert(infoDelete.nRefCount > 0);
         infoDelete.nRefCount--;
-        vvNew[nUBucket][nUBucketPos] = -1;
+        vvNew.Erase(nUBucket, nUBucketPos);
         if (infoDelete.nRefCount == 0) {
             Delete(nIdDelete);
         }
@@ -148,11 +225,11 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
 
 void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 {
-    // remove the entry from all new buckets
-    for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
+    // remove the entry from all new buckets (it is in nRefCount of them)
+    for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT && info.nRefCount > 0; bucket++) {
         int pos = info.GetBucketPosition(nKey, true, bucket);
-        if (vvNew[bucket][pos] == nId) {
-            vvNew[bucket][pos] = -1;
+        if (vvNew.Get(bucket, pos) == nId) {
+            vvNew.Erase(bucket, pos);
             info.nRefCount--;
         }
     }
@@ -165,31 +242,31 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     int nKBucketPos = info.GetBucketPosition(nKey, false, nKBucket);
 
     // first make space to add it (the existing tried entry there is moved to new, deleting whatever is there).
-    if (vvTried[nKBucket][nKBucketPos] != -1) {
+    if (vvTried.Get(nKBucket, nKBucketPos) != -1) {
         // find an item to evict
-        int nIdEvict = vvTried[nKBucket][nKBucketPos];
-        assert(mapInfo.count(nIdEvict) == 1);
-        CAddrInfo& infoOld = mapInfo[nIdEvict];
+        int nIdEvict = vvTried.Get(nKBucket, nKBucketPos);
+        assert(IsUsed(nIdEvict));
+        CAddrInfo& infoOld = vInfo[nIdEvict];
 
         // Remove the to-be-evicted item from the tried set.
         infoOld.fInTried = false;
-        vvTried[nKBucket][nKBucketPos] = -1;
+        vvTried.Erase(nKBucket, nKBucketPos);
         nTried--;
 
         // find which new bucket it belongs to
         int nUBucket = infoOld.GetNewBucket(nKey);
         int nUBucketPos = infoOld.GetBucketPosition(nKey, true, nUBucket);
         ClearNew(nUBucket, nUBucketPos);
-        assert(vvNew[nUBucket][nUBucketPos] == -1);
+        assert(vvNew.Get(nUBucket, nUBucketPos) == -1);
 
         // Enter it into the new set again.
         infoOld.nRefCount = 1;
-        vvNew[nUBucket][nUBucketPos] = nIdEvict;
+        vvNew.Set(nUBucket, nUBucketPos, nIdEvict);
         nNew++;
     }
-    assert(vvTried[nKBucket][nKBucketPos] == -1);
+    assert(vvTried.Get(nKBucket, nKBucketPos) == -1);
 
-    vvTried[nKBucket][nKBucketPos] = nId;
+    vvTried.Set(nKBucket, nKBucketPos, nId);
     nTried++;
     info.fInTried = true;
 }
@@ -226,7 +303,7 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     for (unsigned int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++) {
         int nB = (n + nRnd) % ADDRMAN_NEW_BUCKET_COUNT;
         int nBpos = info.GetBucketPosition(nKey, true, nB);
-        if (vvNew[nB][nBpos] == nId) {
+        if (vvNew.Get(nB, nBpos) == nId) {
             nUBucket = nB;
             break;
         }
@@ -289,10 +366,10 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
 
     int nUBucket = pinfo->GetNewBucket(nKey, source);
     int nUBucketPos = pinfo->GetBucketPosition(nKey, true, nUBucket);
-    if (vvNew[nUBucket][nUBucketPos] != nId) {
-        bool fInsert = vvNew[nUBucket][nUBucketPos] == -1;
+    if (vvNew.Get(nUBucket, nUBucketPos) != nId) {
+        bool fInsert = vvNew.Get(nUBucket, nUBucketPos) == -1;
         if (!fInsert) {
-            CAddrInfo& infoExisting = mapInfo[vvNew[nUBucket][nUBucketPos]];
+            CAddrInfo& infoExisting = vInfo[vvNew.Get(nUBucket, nUBucketPos)];
             if (infoExisting.IsTerrible() || (infoExisting.nRefCount > 1 && pinfo->nRefCount == 0)) {
                 // Overwrite the existing new table entry.
                 fInsert = true;
@@ -301,7 +378,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         if (fInsert) {
             ClearNew(nUBucket, nUBucketPos);
             pinfo->nRefCount++;
-            vvNew[nUBucket][nUBucketPos] = nId;
+            vvNew.Set(nUBucket, nUBucketPos, nId);
         } else {
             if (pinfo->nRefCount == 0) {
                 Delete(nId);
@@ -339,20 +416,17 @@ CAddrInfo CAddrMan::Select_(bool newOnly)
         return CAddrInfo();
 
     // Use a 50% chance for choosing between tried and new table entries.
+    // Within a table every occupied bucket position is equally likely, and
+    // is picked directly from the list of occupied positions rather than by
+    // probing for one, which takes long when the table is sparse.
     if (!newOnly &&
        (nTried > 0 && (nNew == 0 || RandomInt(2) == 0))) { 
         // use a tried node
         double fChanceFactor = 1.0;
         while (1) {
-            int nKBucket = RandomInt(ADDRMAN_TRIED_BUCKET_COUNT);
-            int nKBucketPos = RandomInt(ADDRMAN_BUCKET_SIZE);
-            while (vvTried[nKBucket][nKBucketPos] == -1) {
-                nKBucket = (nKBucket + insecure_rand()) % ADDRMAN_TRIED_BUCKET_COUNT;
-                nKBucketPos = (nKBucketPos + insecure_rand()) % ADDRMAN_BUCKET_SIZE;
-            }
-            int nId = vvTried[nKBucket][nKBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
+            int nId = vvTried.GetOccupied(RandomInt(vvTried.size()));
+            assert(IsUsed(nId));
+            CAddrInfo& info = vInfo[nId];
             if (RandomInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
                 return info;
             fChanceFactor *= 1.2;
@@ -361,15 +435,9 @@ CAddrInfo CAddrMan::Select_(bool newOnly)
         // use a new node
         double fChanceFactor = 1.0;
         while (1) {
-            int nUBucket = RandomInt(ADDRMAN_NEW_BUCKET_COUNT);
-            int nUBucketPos = RandomInt(ADDRMAN_BUCKET_SIZE);
-            while (vvNew[nUBucket][nUBucketPos] == -1) {
-                nUBucket = (nUBucket + insecure_rand()) % ADDRMAN_NEW_BUCKET_COUNT;
-                nUBucketPos = (nUBucketPos + insecure_rand()) % ADDRMAN_BUCKET_SIZE;
-            }
-            int nId = vvNew[nUBucket][nUBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
+            int nId = vvNew.GetOccupied(RandomInt(vvNew.size()));
+            assert(IsUsed(nId));
+            CAddrInfo& info = vInfo[nId];
             if (RandomInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
                 return info;
             fChanceFactor *= 1.2;
@@ -386,9 +454,10 @@ int CAddrMan::Check_()
     if (vRandom.size() != nTried + nNew)
         return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-        int n = (*it).first;
-        CAddrInfo& info = (*it).second;
+    for (int n = 0; n < (int)vInfo.size(); n++) {
+        if (!IsUsed(n))
+            continue;
+        CAddrInfo& info = vInfo[n];
         if (info.fInTried) {
             if (!info.nLastSuccess)
                 return -1;
@@ -417,33 +486,42 @@ int CAddrMan::Check_()
     if (mapNew.size() != nNew)
         return -10;
 
+    size_t nTriedSlots = 0;
     for (int n = 0; n < ADDRMAN_TRIED_BUCKET_COUNT; n++) {
         for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
-             if (vvTried[n][i] != -1) {
-                 if (!setTried.count(vvTried[n][i]))
+             int nId = vvTried.Get(n, i);
+             if (nId != -1) {
+                 if (!setTried.count(nId))
                      return -11;
-                 if (mapInfo[vvTried[n][i]].GetTriedBucket(nKey) != n)
+                 if (vInfo[nId].GetTriedBucket(nKey) != n)
                      return -17;
-                 if (mapInfo[vvTried[n][i]].GetBucketPosition(nKey, false, n) != i)
+                 if (vInfo[nId].GetBucketPosition(nKey, false, n) != i)
                      return -18;
-                 setTried.erase(vvTried[n][i]);
+                 setTried.erase(nId);
+                 nTriedSlots++;
              }
         }
     }
 
+    size_t nNewSlots = 0;
     for (int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++) {
         for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
-            if (vvNew[n][i] != -1) {
-                if (!mapNew.count(vvNew[n][i]))
+            int nId = vvNew.Get(n, i);
+            if (nId != -1) {
+                if (!mapNew.count(nId))
                     return -12;
-                if (mapInfo[vvNew[n][i]].GetBucketPosition(nKey, true, n) != i)
+                if (vInfo[nId].GetBucketPosition(nKey, true, n) != i)
                     return -19;
-                if (--mapNew[vvNew[n][i]] == 0)
-                    mapNew.erase(vvNew[n][i]);
+                if (--mapNew[nId] == 0)
+                    mapNew.erase(nId);
+                nNewSlots++;
             }
         }
     }
 
+    if (nTriedSlots != vvTried.size() || nNewSlots != vvNew.size())
+        return -20;
+
     if (setTried.size())
         return -13;
     if (mapNew.size())
@@ -468,9 +546,9 @@ void CAddrMan::GetAddr_(std::vector<CAddress>& vAddr)
 
         int nRndPos = RandomInt(vRandom.size() - n) + n;
         SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
+        assert(IsUsed(vRandom[n]));
 
-        const CAddrInfo& ai = mapInfo[vRandom[n]];
+        const CAddrInfo& ai = vInfo[vRandom[n]];
         if (!ai.IsTerrible())
             vAddr.push_back(ai);
     }
@@ -18,6 +18,8 @@
 #include <stdint.h>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 /**
  * Extended statistics about a CAddress
  */
@@ -167,6 +169,76 @@ public:
 //! the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+#if ADDRMAN_BUCKET_SIZE > 64
+#error "bucket occupancy is kept in a 64-bit bitmap"
+#endif
+
+/**
+ * One table of address buckets ("new" or "tried"), stored flat: the nId in
+ * every position (-1 when empty), an occupancy bitmap per bucket, and a dense
+ * list of the occupied positions, so that a random entry can be picked in
+ * constant time however sparse the table is.
+ */
+class CAddrBucketTable
+{
+private:
+    //! nId in every position (nBucket * ADDRMAN_BUCKET_SIZE + nPos), or -1
+    std::vector<int> vId;
+
+    //! index of every occupied position in vOccupied, or -1
+    std::vector<int> vOccupiedIndex;
+
+    //! all occupied positions, in no particular order
+    std::vector<int> vOccupied;
+
+    //! which positions of every bucket are occupied
+    std::vector<uint64_t> vBucketBits;
+
+public:
+    explicit CAddrBucketTable(int nBuckets);
+
+    //! The nId in a position, or -1 if it is empty.
+    int Get(int nBucket, int nPos) const
+    {
+        return vId[nBucket * ADDRMAN_BUCKET_SIZE + nPos];
+    }
+
+    //! Store nId in a position, replacing whatever is there.
+    void Set(int nBucket, int nPos, int nId);
+
+    //! Empty a position.
+    void Erase(int nBucket, int nPos);
+
+    //! Empty all positions.
+    void Clear();
+
+    //! Number of occupied positions in a bucket.
+    int BucketSize(int nBucket) const;
+
+    //! Number of occupied positions in the table.
+    size_t size() const
+    {
+        return vOccupied.size();
+    }
+
+    //! The nId in the n-th occupied position (0 <= n < size()), in no particular order.
+    int GetOccupied(size_t n) const
+    {
+        return vId[vOccupied[n]];
+    }
+};
+
+/** Salted hash of a network address, so that peers cannot choose addresses that collide. */
+class CNetAddrHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CNetAddrHasher();
+    size_t operator()(const CNetAddr& addr) const;
+};
+
 /** 
  * Stochastical (IP) address manager 
  */
@@ -176,14 +248,14 @@ private:
     //! critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
-    //! last used nId
-    int nIdCount;
+    //! table with information about all nIds, indexed by nId; unused entries have nRandomPos == -1
+    std::vector<CAddrInfo> vInfo;
 
-    //! table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    //! unused nIds in vInfo, handed out again before vInfo grows
+    std::vector<int> vFreeIds;
 
     //! find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    boost::unordered_map<CNetAddr, int, CNetAddrHasher> mapAddr;
 
     //! randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -192,13 +264,19 @@ private:
     int nTried;
 
     //! list of "tried" buckets
-    int vvTried[ADDRMAN_TRIED_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+    CAddrBucketTable vvTried;
 
     //! number of (unique) "new" entries
     int nNew;
 
     //! list of "new" buckets
-    int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+    CAddrBucketTable vvNew;
+
+    //! Whether nId is the id of an entry in use.
+    bool IsUsed(int nId) const
+    {
+        return nId >= 0 && (size_t)nId < vInfo.size() && vInfo[nId].nRandomPos != -1;
+    }
 
 protected:
     //! secret key to randomize bucket select with
@@ -293,37 +371,34 @@ public:
 
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
-        std::map<int, int> mapUnkIds;
+        std::vector<int> vUnkIds(vInfo.size(), -1);
         int nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            mapUnkIds[(*it).first] = nIds;
-            const CAddrInfo &info = (*it).second;
-            if (info.nRefCount) {
+        for (size_t nId = 0; nId < vInfo.size(); nId++) {
+            const CAddrInfo &info = vInfo[nId];
+            if (info.nRandomPos != -1 && info.nRefCount) {
                 assert(nIds != nNew); // this means nNew was wrong, oh ow
+                vUnkIds[nId] = nIds;
                 s << info;
                 nIds++;
             }
         }
         nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            const CAddrInfo &info = (*it).second;
-            if (info.fInTried) {
+        for (size_t nId = 0; nId < vInfo.size(); nId++) {
+            const CAddrInfo &info = vInfo[nId];
+            if (info.nRandomPos != -1 && info.fInTried) {
                 assert(nIds != nTried); // this means nTried was wrong, oh ow
                 s << info;
                 nIds++;
             }
         }
         for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
-            int nSize = 0;
-            for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
-                if (vvNew[bucket][i] != -1)
-                    nSize++;
-            }
+            int nSize = vvNew.BucketSize(bucket);
             s << nSize;
-            for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
-                if (vvNew[bucket][i] != -1) {
-                    int nIndex = mapUnkIds[vvNew[bucket][i]];
+            for (int i = 0; i < ADDRMAN_BUCKET_SIZE && nSize > 0; i++) {
+                if (vvNew.Get(bucket, i) != -1) {
+                    int nIndex = vUnkIds[vvNew.Get(bucket, i)];
                     s << nIndex;
+                    nSize--;
                 }
             }
         }
@@ -350,9 +425,16 @@ public:
             nUBuckets ^= (1 << 30);
         }
 
+        if (nNew < 0 || nTried < 0 || nNew > ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE || nTried > ADDRMAN_TRIED_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE)
+            throw std::ios_base::failure("Corrupt table sizes in addrman deserialization");
+        vInfo.reserve(nNew + nTried);
+        vRandom.reserve(nNew + nTried);
+        mapAddr.reserve(nNew + nTried);
+
         // Deserialize entries from the new table.
+        vInfo.resize(nNew);
         for (int n = 0; n < nNew; n++) {
-            CAddrInfo &info = mapInfo[n];
+            CAddrInfo &info = vInfo[n];
             s >> info;
             mapAddr[info] = n;
             info.nRandomPos = vRandom.size();
@@ -362,13 +444,12 @@ public:
                 // immediately try to give them a reference based on their primary source address.
                 int nUBucket = info.GetNewBucket(nKey);
                 int nUBucketPos = info.GetBucketPosition(nKey, true, nUBucket);
-                if (vvNew[nUBucket][nUBucketPos] == -1) {
-                    vvNew[nUBucket][nUBucketPos] = n;
+                if (vvNew.Get(nUBucket, nUBucketPos) == -1) {
+                    vvNew.Set(nUBucket, nUBucketPos, n);
                     info.nRefCount++;
                 }
             }
         }
-        nIdCount = nNew;
 
         // Deserialize entries from the tried table.
         int nLost = 0;
@@ -377,14 +458,14 @@ public:
             s >> info;
             int nKBucket = info.GetTriedBucket(nKey);
             int nKBucketPos = info.GetBucketPosition(nKey, false, nKBucket);
-            if (vvTried[nKBucket][nKBucketPos] == -1) {
+            if (vvTried.Get(nKBucket, nKBucketPos) == -1) {
+                int nId = vInfo.size();
                 info.nRandomPos = vRandom.size();
                 info.fInTried = true;
-                vRandom.push_back(nIdCount);
-                mapInfo[nIdCount] = info;
-                mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
-                nIdCount++;
+                vRandom.push_back(nId);
+                vInfo.push_back(info);
+                mapAddr[info] = nId;
+                vvTried.Set(nKBucket, nKBucketPos, nId);
             } else {
                 nLost++;
             }
@@ -399,11 +480,11 @@ public:
                 int nIndex = 0;
                 s >> nIndex;
                 if (nIndex >= 0 && nIndex < nNew) {
-                    CAddrInfo &info = mapInfo[nIndex];
+                    CAddrInfo &info = vInfo[nIndex];
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
-                    if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
+                    if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew.Get(bucket, nUBucketPos) == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
-                        vvNew[bucket][nUBucketPos] = nIndex;
+                        vvNew.Set(bucket, nUBucketPos, nIndex);
                     }
                 }
             }
@@ -411,13 +492,10 @@ public:
 
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); ) {
-            if (it->second.fInTried == false && it->second.nRefCount == 0) {
-                std::map<int, CAddrInfo>::const_iterator itCopy = it++;
-                Delete(itCopy->first);
+        for (int n = 0; n < nNew; n++) {
+            if (IsUsed(n) && vInfo[n].fInTried == false && vInfo[n].nRefCount == 0) {
+                Delete(n);
                 nLostUnk++;
-            } else {
-                it++;
             }
         }
         if (nLost + nLostUnk > 0) {
@@ -435,24 +513,18 @@ public:
     void Clear()
     {
         std::vector<int>().swap(vRandom);
+        std::vector<CAddrInfo>().swap(vInfo);
+        std::vector<int>().swap(vFreeIds);
+        mapAddr.clear();
         nKey = GetRandHash();
-        for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
-            for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
-                vvNew[bucket][entry] = -1;
-            }
-        }
-        for (size_t bucket = 0; bucket < ADDRMAN_TRIED_BUCKET_COUNT; bucket++) {
-            for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
-                vvTried[bucket][entry] = -1;
-            }
-        }
+        vvNew.Clear();
+        vvTried.Clear();
 
-        nIdCount = 0;
         nTried = 0;
         nNew = 0;
     }
 
-    CAddrMan()
+    CAddrMan() : vvTried(ADDRMAN_TRIED_BUCKET_COUNT), vvNew(ADDRMAN_NEW_BUCKET_COUNT)
     {
         Clear();
     }
@@ -0,0 +1,112 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "addrman.h"
+#include "clientversion.h"
+#include "random.h"
+#include "streams.h"
+#include "utiltime.h"
+
+#include <vector>
+
+//! Addresses fed to addrman, and the number of peers they are learned from
+static const int BENCH_ADDRESSES = 100000;
+static const int BENCH_SOURCES = 100;
+
+// Random routable IPv4 addresses, as learned from BENCH_SOURCES peers.
+static void CreateAddresses(std::vector<CAddress>& vAddr, std::vector<CNetAddr>& vSource)
+{
+    seed_insecure_rand(true);
+    int64_t nNow = GetTime();
+    while ((int)vAddr.size() < BENCH_ADDRESSES) {
+        struct in_addr ip;
+        ip.s_addr = insecure_rand();
+        CAddress addr(CService(CNetAddr(ip), 9246));
+        if (!addr.IsRoutable())
+            continue;
+        addr.nTime = nNow - insecure_rand() % (24 * 60 * 60);
+        vAddr.push_back(addr);
+    }
+    while ((int)vSource.size() < BENCH_SOURCES) {
+        struct in_addr ip;
+        ip.s_addr = insecure_rand();
+        CNetAddr source(ip);
+        if (source.IsRoutable())
+            vSource.push_back(source);
+    }
+}
+
+static void FillAddrMan(CAddrMan& addrman, const std::vector<CAddress>& vAddr, const std::vector<CNetAddr>& vSource)
+{
+    size_t nPerSource = vAddr.size() / vSource.size();
+    for (size_t i = 0; i < vSource.size(); i++) {
+        std::vector<CAddress> vBatch(vAddr.begin() + i * nPerSource, vAddr.begin() + (i + 1) * nPerSource);
+        addrman.Add(vBatch, vSource[i]);
+    }
+}
+
+static void AddrManAdd(benchmark::State& state)
+{
+    std::vector<CAddress> vAddr;
+    std::vector<CNetAddr> vSource;
+    CreateAddresses(vAddr, vSource);
+    while (state.KeepRunning()) {
+        CAddrMan addrman;
+        FillAddrMan(addrman, vAddr, vSource);
+    }
+}
+
+static void AddrManSelect(benchmark::State& state)
+{
+    std::vector<CAddress> vAddr;
+    std::vector<CNetAddr> vSource;
+    CreateAddresses(vAddr, vSource);
+    CAddrMan addrman;
+    FillAddrMan(addrman, vAddr, vSource);
+    // A few tried entries, as a node that has been up for a while has.
+    for (int i = 0; i < 100; i++)
+        addrman.Good(vAddr[i * (vAddr.size() / 100)]);
+    while (state.KeepRunning()) {
+        CAddrInfo addr = addrman.Select();
+        assert(addr.IsRoutable());
+    }
+}
+
+static void AddrManGood(benchmark::State& state)
+{
+    std::vector<CAddress> vAddr;
+    std::vector<CNetAddr> vSource;
+    CreateAddresses(vAddr, vSource);
+    CAddrMan addrman;
+    FillAddrMan(addrman, vAddr, vSource);
+    size_t n = 0;
+    while (state.KeepRunning()) {
+        addrman.Good(vAddr[n]);
+        n = (n + 7919) % vAddr.size();
+    }
+}
+
+// Reading peers.dat at startup.
+static void AddrManLoad(benchmark::State& state)
+{
+    std::vector<CAddress> vAddr;
+    std::vector<CNetAddr> vSource;
+    CreateAddresses(vAddr, vSource);
+    CAddrMan addrman;
+    FillAddrMan(addrman, vAddr, vSource);
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers << addrman;
+    while (state.KeepRunning()) {
+        CDataStream ss(ssPeers);
+        CAddrMan addrman2;
+        ss >> addrman2;
+    }
+}
+
+BENCHMARK(AddrManAdd);
+BENCHMARK(AddrManSelect);
+BENCHMARK(AddrManGood);
+BENCHMARK(AddrManLoad);
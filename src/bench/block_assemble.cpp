@@ -0,0 +1,74 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "miner.h"
+#include "random.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <boost/foreach.hpp>
+
+//! Size of the mempool the selection runs on, in bytes of transactions
+static const size_t BENCH_MEMPOOL_BYTES = 300 * 1000 * 1000;
+//! Padding that brings every transaction to about 1 kB
+static const size_t BENCH_TX_PADDING = 950;
+
+static CTransaction CreateTx(const COutPoint& prevout)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(BENCH_TX_PADDING, 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 100000000;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    return tx;
+}
+
+static void AddTx(CTxMemPool& pool, const CTransaction& tx, CAmount nFee)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, 0, 0.0, 1, false, 0, false, 1, LockPoints()));
+}
+
+// Fill the mempool with chains of nChainLength transactions. Fees are
+// random, so children often pay for parents with a lower fee rate.
+static void FillMempool(CTxMemPool& pool, int nChainLength)
+{
+    size_t nBytes = 0;
+    while (nBytes < BENCH_MEMPOOL_BYTES) {
+        COutPoint prevout(GetRandHash(), 0);
+        for (int i = 0; i < nChainLength; i++) {
+            CTransaction tx = CreateTx(prevout);
+            AddTx(pool, tx, 1000 + insecure_rand() % 100000);
+            nBytes += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            prevout = COutPoint(tx.GetHash(), 0);
+        }
+    }
+}
+
+static void AssembleBlock(benchmark::State& state, int nChainLength)
+{
+    CTxMemPool pool(CFeeRate(0));
+    LOCK(pool.cs);
+    FillMempool(pool, nChainLength);
+    std::vector<CTxMemPool::txiter> vSelected;
+    while (state.KeepRunning()) {
+        SelectBlockTransactions(pool, 1, 0, vSelected);
+    }
+}
+
+static void AssembleBlockIndependentTxs(benchmark::State& state)
+{
+    AssembleBlock(state, 1);
+}
+
+static void AssembleBlockTxChains(benchmark::State& state)
+{
+    AssembleBlock(state, 10);
+}
+
+BENCHMARK(AssembleBlockIndependentTxs);
+BENCHMARK(AssembleBlockTxChains);
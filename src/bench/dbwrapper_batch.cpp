@@ -0,0 +1,70 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "claimtrie.h"
+#include "coins.h"
+#include "dbwrapper.h"
+#include "random.h"
+
+#include <boost/foreach.hpp>
+
+#include <vector>
+
+//! Entries written to the batch in every iteration, about a large cache flush
+static const int BENCH_ENTRIES = 100000;
+
+static std::vector<unsigned char> CreateObfuscateKey()
+{
+    std::vector<unsigned char> key(8);
+    GetRandBytes(&key[0], key.size());
+    return key;
+}
+
+static void DBBatchCoins(benchmark::State& state)
+{
+    std::vector<unsigned char> obfuscate_key = CreateObfuscateKey();
+    std::vector<std::pair<uint256, CCoins> > vCoins(BENCH_ENTRIES);
+    for (int i = 0; i < BENCH_ENTRIES; i++) {
+        vCoins[i].first = GetRandHash();
+        CCoins& coins = vCoins[i].second;
+        coins.nVersion = 1;
+        coins.nHeight = i;
+        coins.vout.resize(2);
+        for (int j = 0; j < 2; j++) {
+            coins.vout[j].nValue = 100000000;
+            coins.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, j) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+    }
+
+    while (state.KeepRunning()) {
+        CDBBatch batch(&obfuscate_key);
+        for (std::vector<std::pair<uint256, CCoins> >::const_iterator it = vCoins.begin(); it != vCoins.end(); ++it)
+            batch.Write(std::make_pair('c', it->first), it->second);
+    }
+}
+
+static void DBBatchClaimTrie(benchmark::State& state)
+{
+    std::vector<unsigned char> obfuscate_key = CreateObfuscateKey();
+    std::vector<namedNodeType> vNodes(BENCH_ENTRIES);
+    for (int i = 0; i < BENCH_ENTRIES; i++) {
+        vNodes[i].first = GetRandHash().GetHex().substr(0, 1 + i % 32);
+        CClaimTrieNode& node = vNodes[i].second;
+        node.hash = GetRandHash();
+        node.nHeightOfLastTakeover = i;
+        for (int j = 0; j < 1 + i % 3; j++)
+            node.claims.push_back(CClaimValue(COutPoint(GetRandHash(), j), uint160(), 100000000, i, i));
+    }
+
+    while (state.KeepRunning()) {
+        CDBBatch batch(&obfuscate_key);
+        BOOST_FOREACH(const namedNodeType& node, vNodes)
+            batch.Write(std::make_pair(TRIE_NODE, node.first), node.second);
+    }
+}
+
+BENCHMARK(DBBatchCoins);
+BENCHMARK(DBBatchClaimTrie);
@@ -0,0 +1,95 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "main.h"
+#include "random.h"
+#include "txmempool.h"
+
+#include <vector>
+
+static CTransaction CreateTx(const std::vector<COutPoint>& vPrevouts, unsigned int nOutputs = 1)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(vPrevouts.size());
+    for (unsigned int i = 0; i < vPrevouts.size(); i++)
+        tx.vin[i].prevout = vPrevouts[i];
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].nValue = 100000000;
+        tx.vout[i].scriptPubKey = CScript() << OP_1;
+    }
+    return tx;
+}
+
+static void AddTx(CTxMemPool& pool, const CTransaction& tx)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 10000, 0, 0.0, 1, false, 0, false, 1, LockPoints()));
+}
+
+// Add a chain of nLength transactions and return the outpoint that extends it
+static COutPoint AddChain(CTxMemPool& pool, unsigned int nLength)
+{
+    std::vector<COutPoint> vPrevouts(1, COutPoint(GetRandHash(), 0));
+    for (unsigned int i = 0; i < nLength; i++) {
+        CTransaction tx = CreateTx(vPrevouts);
+        AddTx(pool, tx);
+        vPrevouts[0] = COutPoint(tx.GetHash(), 0);
+    }
+    return vPrevouts[0];
+}
+
+// Time the ancestor limit check that AcceptToMemoryPool runs for tx, with
+// the default limits.
+static void RunAncestorCheck(benchmark::State& state, const CTxMemPool& pool, const CTransaction& tx, bool fExpected)
+{
+    CTxMemPoolEntry entry(tx, 10000, 0, 0.0, 1, false, 0, false, 1, LockPoints());
+    LOCK(pool.cs);
+    while (state.KeepRunning()) {
+        CTxMemPool::setEntries setAncestors;
+        std::string errString;
+        bool fResult = pool.CalculateMemPoolAncestors(entry, setAncestors,
+            DEFAULT_ANCESTOR_LIMIT, DEFAULT_ANCESTOR_SIZE_LIMIT * 1000,
+            DEFAULT_DESCENDANT_LIMIT, DEFAULT_DESCENDANT_SIZE_LIMIT * 1000, errString);
+        assert(fResult == fExpected);
+    }
+}
+
+// Extending a chain that is one transaction short of the ancestor limit
+static void MempoolAncestorsDeepChain(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    COutPoint tip = AddChain(pool, DEFAULT_ANCESTOR_LIMIT - 1);
+    RunAncestorCheck(state, pool, CreateTx(std::vector<COutPoint>(1, tip)), true);
+}
+
+// Extending a chain that is already at the ancestor limit
+static void MempoolAncestorsDeepChainRejected(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    COutPoint tip = AddChain(pool, DEFAULT_ANCESTOR_LIMIT);
+    RunAncestorCheck(state, pool, CreateTx(std::vector<COutPoint>(1, tip)), false);
+}
+
+// Spending every output of a fan: one root, its children, and a transaction
+// that spends all of the children, so the root is reached through each of them.
+static void MempoolAncestorsWideFan(benchmark::State& state)
+{
+    const unsigned int nChildren = DEFAULT_ANCESTOR_LIMIT - 2;
+    CTxMemPool pool(CFeeRate(0));
+    CTransaction root = CreateTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), nChildren);
+    AddTx(pool, root);
+    std::vector<COutPoint> vPrevouts;
+    for (unsigned int i = 0; i < nChildren; i++) {
+        CTransaction child = CreateTx(std::vector<COutPoint>(1, COutPoint(root.GetHash(), i)));
+        AddTx(pool, child);
+        vPrevouts.push_back(COutPoint(child.GetHash(), 0));
+    }
+    RunAncestorCheck(state, pool, CreateTx(vPrevouts), true);
+}
+
+BENCHMARK(MempoolAncestorsDeepChain);
+BENCHMARK(MempoolAncestorsDeepChainRejected);
+BENCHMARK(MempoolAncestorsWideFan);
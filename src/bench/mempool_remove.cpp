@@ -0,0 +1,119 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "random.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <boost/foreach.hpp>
+
+#include <list>
+#include <vector>
+
+//! Size of the mempool the block is connected against, in bytes of transactions
+static const size_t BENCH_MEMPOOL_BYTES = 300 * 1000 * 1000;
+//! Size of the connected block, in bytes of transactions
+static const size_t BENCH_BLOCK_BYTES = 4 * 1000 * 1000;
+//! Padding that brings every transaction to about 1 kB
+static const size_t BENCH_TX_PADDING = 950;
+//! Length of the transaction chains in the mempool
+static const int BENCH_CHAIN_LENGTH = 10;
+//! One in this many chains is double spent by the block
+static const int BENCH_CONFLICT_INTERVAL = 50;
+
+static CTransaction CreateTx(const COutPoint& prevout, unsigned char nTag = 0)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(BENCH_TX_PADDING, nTag);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 100000000;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    return tx;
+}
+
+// A chain of mempool transactions the block touches, with the entries that
+// have to be put back after every run.
+struct BenchChain
+{
+    std::vector<CTxMemPoolEntry> vEntries;
+    size_t nConfirmed; // length of the prefix that is in the block; 0 if the block double spends the chain
+};
+
+// Fill the mempool with chains of BENCH_CHAIN_LENGTH transactions. The block
+// confirms a prefix of the first chains, leaving their tails in the mempool,
+// and double spends the root of every BENCH_CONFLICT_INTERVAL-th of them.
+static void FillMempool(CTxMemPool& pool, std::vector<BenchChain>& vChains, std::vector<CTransaction>& vtxBlock)
+{
+    size_t nBytes = 0, nBlockBytes = 0;
+    while (nBytes < BENCH_MEMPOOL_BYTES) {
+        bool fInBlock = nBlockBytes < BENCH_BLOCK_BYTES;
+        BenchChain chain;
+        chain.nConfirmed = 1 + insecure_rand() % BENCH_CHAIN_LENGTH;
+        COutPoint prevout(GetRandHash(), 0);
+        if (fInBlock && vChains.size() % BENCH_CONFLICT_INTERVAL == 0) {
+            chain.nConfirmed = 0;
+            vtxBlock.push_back(CreateTx(prevout, 1));
+        }
+        for (int i = 0; i < BENCH_CHAIN_LENGTH; i++) {
+            CTransaction tx = CreateTx(prevout);
+            CTxMemPoolEntry entry(tx, 1000 + insecure_rand() % 100000, 0, 0.0, 1, i == 0, 0, false, 1, LockPoints());
+            pool.addUnchecked(tx.GetHash(), entry);
+            size_t nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            nBytes += nSize;
+            if (fInBlock) {
+                chain.vEntries.push_back(entry);
+                if ((size_t)i < chain.nConfirmed) {
+                    vtxBlock.push_back(tx);
+                    nBlockBytes += nSize;
+                }
+            }
+            prevout = COutPoint(tx.GetHash(), 0);
+        }
+        if (fInBlock)
+            vChains.push_back(chain);
+    }
+}
+
+// Undo the block, as a reorg would: the confirmed transactions go back in
+// front of their unconfirmed children, and the double spent chains return.
+static void RestoreMempool(CTxMemPool& pool, const std::vector<BenchChain>& vChains)
+{
+    std::vector<uint256> vHashUpdate;
+    BOOST_FOREACH(const BenchChain& chain, vChains) {
+        size_t nRestore = chain.nConfirmed ? chain.nConfirmed : chain.vEntries.size();
+        for (size_t i = 0; i < nRestore; i++) {
+            const CTransaction& tx = chain.vEntries[i].GetTx();
+            pool.addUnchecked(tx.GetHash(), chain.vEntries[i], false);
+            if (chain.nConfirmed)
+                vHashUpdate.push_back(tx.GetHash());
+        }
+    }
+    pool.UpdateTransactionsFromBlock(vHashUpdate);
+}
+
+// Connecting a 4 MB block against a full mempool. Every run also puts the
+// block's transactions back, which costs the same before and after any
+// change to the removal itself.
+static void MempoolRemoveForBlock(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<BenchChain> vChains;
+    std::vector<CTransaction> vtxBlock;
+    FillMempool(pool, vChains, vtxBlock);
+    const size_t nPoolSize = pool.size();
+    unsigned int nHeight = 2;
+    while (state.KeepRunning()) {
+        std::list<CTransaction> conflicts;
+        pool.removeForBlock(vtxBlock, nHeight++, conflicts, true);
+        assert(!conflicts.empty());
+        RestoreMempool(pool, vChains);
+        assert(pool.size() == nPoolSize);
+    }
+}
+
+BENCHMARK(MempoolRemoveForBlock);
@@ -0,0 +1,50 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "policy/fees.h"
+#include "random.h"
+#include "txmempool.h"
+
+#include <boost/foreach.hpp>
+
+#include <vector>
+
+//! Number of transactions in the connected block
+static const int BENCH_BLOCK_TXS = 4000;
+
+// Connecting a block of BENCH_BLOCK_TXS transactions that entered the mempool
+// over the last MAX_BLOCK_CONFIRMS blocks. One in five is a priority
+// transaction, the rest spread over the fee rate buckets. The estimator's
+// data points only line up with the block height once, so every run starts
+// from a fresh estimator.
+static void PolicyEstimatorProcessBlock(benchmark::State& state)
+{
+    const unsigned int nBlockHeight = MAX_BLOCK_CONFIRMS + 1;
+    std::vector<CTxMemPoolEntry> vEntries;
+    for (int i = 0; i < BENCH_BLOCK_TXS; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 100000000;
+        tx.vout[0].scriptPubKey = CScript() << OP_1;
+        bool fPriority = i % 5 == 0;
+        CAmount nFee = fPriority ? 0 : 100 + insecure_rand() % 100000;
+        double dPriority = fPriority ? 1e8 * (1 + insecure_rand() % 1000) : 0;
+        unsigned int nHeight = nBlockHeight - 1 - i % MAX_BLOCK_CONFIRMS;
+        vEntries.push_back(CTxMemPoolEntry(tx, nFee, 0, dPriority, nHeight, true, 0, false, 1, LockPoints()));
+    }
+    std::vector<const CTxMemPoolEntry*> vpEntries;
+    BOOST_FOREACH(const CTxMemPoolEntry& entry, vEntries)
+        vpEntries.push_back(&entry);
+
+    while (state.KeepRunning()) {
+        CBlockPolicyEstimator estimator(CFeeRate(1000));
+        estimator.processBlock(nBlockHeight, vpEntries, true);
+    }
+}
+
+BENCHMARK(PolicyEstimatorProcessBlock);
@@ -0,0 +1,112 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "hash.h"
+#include "pow.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+// Build regtest headers with valid proof of work, as LoadBlockIndexGuts
+// would find them on disk. They are left unlinked, so each one hashes
+// with a null hashPrevBlock.
+static std::vector<CBlockIndex*> CreateBlockIndex(const Consensus::Params& params, int nCount)
+{
+    std::vector<CBlockIndex*> vIndex;
+    for (int i = 0; i < nCount; i++) {
+        CBlockHeader header;
+        header.nVersion = 4;
+        header.nTime = 1466646588 + i * 150;
+        header.nBits = 0x207fffff;
+        while (!CheckProofOfWork(header.GetPoWHash(), header.nBits, params))
+            header.nNonce++;
+        vIndex.push_back(new CBlockIndex(header));
+    }
+    return vIndex;
+}
+
+static void CheckBlockIndexPoW(benchmark::State& state, int nThreads)
+{
+    const Consensus::Params& params = Params(CBaseChainParams::REGTEST).GetConsensus();
+    std::vector<CBlockIndex*> vIndex = CreateBlockIndex(params, 10000);
+    while (state.KeepRunning()) {
+        assert(CheckBlockIndexProofOfWork(vIndex, params, nThreads) == NULL);
+    }
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        delete pindex;
+}
+
+static void CheckBlockIndexPoWSerial(benchmark::State& state)
+{
+    CheckBlockIndexPoW(state, 1);
+}
+
+static void CheckBlockIndexPoWParallel(benchmark::State& state)
+{
+    CheckBlockIndexPoW(state, GetNumCores());
+}
+
+// Hash 64 headers, one at a time or through the multi-lane kernels.
+static void PoWHashHeaders(benchmark::State& state, bool fBatch)
+{
+    std::vector<CBlockHeader> vHeaders(64);
+    for (size_t i = 0; i < vHeaders.size(); i++)
+        vHeaders[i].nNonce = i;
+    std::vector<uint256> vHashes(vHeaders.size());
+    while (state.KeepRunning()) {
+        if (fBatch) {
+            GetPoWHashes(vHeaders, vHashes);
+        } else {
+            for (size_t i = 0; i < vHeaders.size(); i++)
+                vHashes[i] = vHeaders[i].GetPoWHash();
+        }
+    }
+}
+
+// The stream and vector based path GetPoWHash used before SerializeHeader.
+static void PoWHashStream(benchmark::State& state)
+{
+    CBlockHeader header;
+    uint256 hash;
+    while (state.KeepRunning()) {
+        CDataStream ds(SER_GETHASH, PROTOCOL_VERSION);
+        ds << header;
+        std::vector<unsigned char> input(ds.begin(), ds.end());
+        hash = PoWHash(input);
+        header.nNonce++;
+    }
+}
+
+static void PoWHashHeader(benchmark::State& state)
+{
+    CBlockHeader header;
+    uint256 hash;
+    while (state.KeepRunning()) {
+        hash = header.GetPoWHash();
+        header.nNonce++;
+    }
+}
+
+static void PoWHashSingle(benchmark::State& state)
+{
+    PoWHashHeaders(state, false);
+}
+
+static void PoWHashBatched(benchmark::State& state)
+{
+    PoWHashHeaders(state, true);
+}
+
+BENCHMARK(CheckBlockIndexPoWSerial);
+BENCHMARK(CheckBlockIndexPoWParallel);
+BENCHMARK(PoWHashStream);
+BENCHMARK(PoWHashHeader);
+BENCHMARK(PoWHashSingle);
+BENCHMARK(PoWHashBatched);
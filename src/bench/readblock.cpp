@@ -0,0 +1,126 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "blockfilemap.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "consensus/merkle.h"
+#include "main.h"
+#include "pow.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+//! Blocks written to disk and read back in every iteration
+static const int BENCH_BLOCKS = 10000;
+
+static CMutableTransaction CreateTx(int nOutputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 0) << std::vector<unsigned char>(33, 0);
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        tx.vout[i].nValue = 100000000;
+        tx.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return tx;
+}
+
+// Write small regtest blocks with valid proof of work to the block files, as
+// they would be stored after syncing, and index them.
+static std::vector<CBlockIndex*> WriteBlocks(const CChainParams& chainparams, std::vector<uint256>& vHashes)
+{
+    std::vector<CBlockIndex*> vIndex;
+    vHashes.resize(BENCH_BLOCKS);
+    CDiskBlockPos pos(0, 0);
+    for (int i = 0; i < BENCH_BLOCKS; i++) {
+        CBlock block;
+        block.nVersion = 4;
+        block.nTime = 1466646588 + i * 150;
+        block.nBits = 0x207fffff;
+        block.vtx.push_back(CreateTx(1));
+        for (int j = 0; j < 3; j++)
+            block.vtx.push_back(CreateTx(2));
+        block.hashMerkleRoot = BlockMerkleRoot(block);
+        while (!CheckProofOfWork(block.GetPoWHash(), block.nBits, chainparams.GetConsensus()))
+            block.nNonce++;
+
+        CDiskBlockPos blockPos = pos;
+        bool fWritten = WriteBlockToDisk(block, blockPos, chainparams.MessageStart());
+        assert(fWritten);
+        pos.nPos = blockPos.nPos + ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+
+        vHashes[i] = block.GetHash();
+        CBlockIndex* pindex = new CBlockIndex(block);
+        pindex->phashBlock = &vHashes[i];
+        pindex->nFile = blockPos.nFile;
+        pindex->nDataPos = blockPos.nPos;
+        pindex->nStatus |= BLOCK_HAVE_DATA;
+        vIndex.push_back(pindex);
+    }
+    return vIndex;
+}
+
+static void ReadBlocks(benchmark::State& state, bool fIndexed, bool fMapped = false)
+{
+    // Block files go to a throwaway data directory.
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / strprintf("bench_readblock_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    ClearDatadirCache();
+    SelectParams(CBaseChainParams::REGTEST);
+    const CChainParams& chainparams = Params();
+
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex*> vIndex = WriteBlocks(chainparams, vHashes);
+    if (fMapped)
+        pblockfilemap = new CBlockFileMap(8);
+    while (state.KeepRunning()) {
+        CBlock block;
+        BOOST_FOREACH(const CBlockIndex* pindex, vIndex) {
+            bool fRead = fIndexed ?
+                ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()) :
+                ReadBlockFromDisk(block, pindex->GetBlockPos(), chainparams.GetConsensus());
+            assert(fRead);
+        }
+    }
+
+    delete pblockfilemap;
+    pblockfilemap = NULL;
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        delete pindex;
+    mapArgs.erase("-datadir");
+    ClearDatadirCache();
+    boost::filesystem::remove_all(pathTemp);
+}
+
+// Reading by position only, which has to check the proof of work.
+static void ReadBlockFromDiskPos(benchmark::State& state)
+{
+    ReadBlocks(state, false);
+}
+
+// Reading an indexed block, as getdata, getblock, REST, rescans and reorgs do.
+static void ReadBlockFromDiskIndexed(benchmark::State& state)
+{
+    ReadBlocks(state, true);
+}
+
+// The same, with the block files mapped into memory (-blockfilemaps).
+static void ReadBlockFromDiskIndexedMapped(benchmark::State& state)
+{
+    ReadBlocks(state, true, true);
+}
+
+BENCHMARK(ReadBlockFromDiskPos);
+BENCHMARK(ReadBlockFromDiskIndexed);
+BENCHMARK(ReadBlockFromDiskIndexedMapped);
@@ -0,0 +1,114 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "chain.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    munmap((void*)pdata, nSize);
+#endif
+}
+
+CBlockFileMap::CBlockFileMap(unsigned int nMaxFilesIn) : nMaxFiles(nMaxFilesIn)
+{
+}
+
+CBlockFileMap::MappedFilePtr CBlockFileMap::Map(const CDiskBlockPos& pos, const char* prefix, uint64_t nMinSize)
+{
+    FileKey key(prefix, pos.nFile);
+    std::map<FileKey, std::pair<MappedFilePtr, LRUList::iterator> >::iterator it = mapFiles.find(key);
+    if (it != mapFiles.end()) {
+        lruFiles.splice(lruFiles.begin(), lruFiles, it->second.second);
+        if (it->second.first->size() >= nMinSize)
+            return it->second.first;
+        // Blocks were appended since the file was mapped
+        lruFiles.erase(it->second.second);
+        mapFiles.erase(it);
+    }
+
+#ifdef WIN32
+    return MappedFilePtr();
+#else
+    boost::filesystem::path path = GetBlockPosFilename(pos, prefix);
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return MappedFilePtr();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size < nMinSize) {
+        close(fd);
+        return MappedFilePtr();
+    }
+    void* pdata = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (pdata == MAP_FAILED) {
+        LogPrintf("Unable to map %s: %s\n", path.string(), strerror(errno));
+        close(fd);
+        return MappedFilePtr();
+    }
+    close(fd);
+    MappedFilePtr file(new CMappedBlockFile((const char*)pdata, st.st_size));
+
+    lruFiles.push_front(key);
+    mapFiles[key] = std::make_pair(file, lruFiles.begin());
+    while (lruFiles.size() > nMaxFiles) {
+        mapFiles.erase(lruFiles.back());
+        lruFiles.pop_back();
+    }
+    return file;
+#endif
+}
+
+bool CBlockFileMap::MapRecord(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailer, CMappedRecord& record)
+{
+    // The record is preceded by the message start and its size
+    if (pos.IsNull() || pos.nPos < 8)
+        return false;
+
+    LOCK(cs);
+    MappedFilePtr file = Map(pos, prefix, pos.nPos);
+    if (!file)
+        return false;
+    uint64_t nEnd = (uint64_t)pos.nPos + ReadLE32((const unsigned char*)file->data() + pos.nPos - 4) + nTrailer;
+    if (nEnd > file->size()) {
+        file = Map(pos, prefix, nEnd);
+        if (!file)
+            return false;
+    }
+
+    record.file = file;
+    record.begin = file->data() + pos.nPos;
+    record.end = file->data() + nEnd;
+    return true;
+}
+
+void CBlockFileMap::Invalidate(int nFile)
+{
+    LOCK(cs);
+    const char* prefixes[] = {"blk", "rev"};
+    for (unsigned int i = 0; i < 2; i++) {
+        std::map<FileKey, std::pair<MappedFilePtr, LRUList::iterator> >::iterator it = mapFiles.find(FileKey(prefixes[i], nFile));
+        if (it != mapFiles.end()) {
+            lruFiles.erase(it->second.second);
+            mapFiles.erase(it);
+        }
+    }
+}
+
+size_t CBlockFileMap::GetMappedFiles()
+{
+    LOCK(cs);
+    return mapFiles.size();
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILEMAP_H
+#define BITCOIN_BLOCKFILEMAP_H
+
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+struct CDiskBlockPos;
+
+//! -blockfilemaps default: read block and undo files through stdio
+static const unsigned int DEFAULT_BLOCK_FILE_MAPS = 0;
+
+/** A read-only memory mapping of a whole block or undo file */
+class CMappedBlockFile : private boost::noncopyable
+{
+private:
+    const char* pdata;
+    size_t nSize;
+
+public:
+    CMappedBlockFile(const char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    ~CMappedBlockFile();
+
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
+/** A block or undo record inside a mapped file, see CBlockFileMap::MapRecord */
+struct CMappedRecord
+{
+    //! Keeps the mapping alive while the record is read
+    boost::shared_ptr<const CMappedBlockFile> file;
+    const char* begin;
+    const char* end;
+
+    CMappedRecord() : begin(NULL), end(NULL) {}
+};
+
+/**
+ * Keeps the most recently read blk?????.dat and rev?????.dat files mapped
+ * into memory, so reading a block or its undo data deserializes straight
+ * from the page cache instead of opening, seeking and reading the file.
+ *
+ * At most nMaxFiles files are mapped; the least recently used mapping is
+ * dropped first. A mapping that is dropped while a reader still holds one
+ * of its records stays valid until that reader is done.
+ *
+ * Files only ever grow while they are mapped, by appending blocks, and a
+ * record past the end of a mapping maps the file again. Anything that
+ * truncates or removes a file (finalizing or pruning it) has to call
+ * Invalidate, as touching a mapped page past the end of its file raises
+ * SIGBUS.
+ */
+class CBlockFileMap
+{
+private:
+    typedef std::pair<std::string, int> FileKey;
+    typedef boost::shared_ptr<const CMappedBlockFile> MappedFilePtr;
+    typedef std::list<FileKey> LRUList;
+
+    CCriticalSection cs;
+    unsigned int nMaxFiles;
+    //! Mapped files, with their position in lruFiles
+    std::map<FileKey, std::pair<MappedFilePtr, LRUList::iterator> > mapFiles;
+    //! Mapped files, most recently used first
+    LRUList lruFiles;
+
+    //! Return a mapping of the given file that covers at least its first nMinSize bytes
+    MappedFilePtr Map(const CDiskBlockPos& pos, const char* prefix, uint64_t nMinSize);
+
+public:
+    CBlockFileMap(unsigned int nMaxFilesIn);
+
+    /**
+     * Find the record WriteBlockToDisk or UndoWriteToDisk stored at pos: it
+     * starts at pos, is nSize bytes long as given by the size field in front
+     * of it, and is followed by nTrailer more bytes that belong to it.
+     * Returns false if the file cannot be mapped or is too short to hold
+     * the record; the caller then reads it through stdio instead.
+     */
+    bool MapRecord(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailer, CMappedRecord& record);
+
+    //! Drop the mappings of the block and undo file nFile
+    void Invalidate(int nFile);
+
+    //! Number of files currently mapped
+    size_t GetMappedFiles();
+};
+
+#endif // BITCOIN_BLOCKFILEMAP_H
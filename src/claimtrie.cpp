@@ -147,30 +147,6 @@ bool CClaimTrie::empty() const
     return root.empty();
 }
 
-template<typename K> bool CClaimTrie::keyTypeEmpty(char keyType, K& dummy) const
-{
-    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
-    
-    while (pcursor->Valid())
-    {
-        std::pair<char, K> key;
-        if (pcursor->GetKey(key))
-        {
-            if (key.first == keyType)
-            {
-                return false;
-            }
-        }
-        else
-        {
-            break;
-        }
-        pcursor->Next();
-    }
-    return true;
-}
-
 bool CClaimTrie::queueEmpty() const
 {
     for (claimQueueType::const_iterator itRow = dirtyQueueRows.begin(); itRow != dirtyQueueRows.end(); ++itRow)
@@ -178,8 +154,7 @@ bool CClaimTrie::queueEmpty() const
         if (!itRow->second.empty())
             return false;
     }
-    int dummy;
-    return keyTypeEmpty(CLAIM_QUEUE_ROW, dummy);
+    return db.IsEmpty(CLAIM_QUEUE_ROW);
 }
 
 bool CClaimTrie::expirationQueueEmpty() const
@@ -189,8 +164,7 @@ bool CClaimTrie::expirationQueueEmpty() const
         if (!itRow->second.empty())
             return false;
     }
-    int dummy;
-    return keyTypeEmpty(EXP_QUEUE_ROW, dummy);
+    return db.IsEmpty(EXP_QUEUE_ROW);
 }
 
 bool CClaimTrie::supportEmpty() const
@@ -200,8 +174,7 @@ bool CClaimTrie::supportEmpty() const
         if (!itNode->second.empty())
             return false;
     }
-    std::string dummy;
-    return keyTypeEmpty(SUPPORT, dummy);
+    return db.IsEmpty(SUPPORT);
 }
 
 bool CClaimTrie::supportQueueEmpty() const
@@ -211,8 +184,7 @@ bool CClaimTrie::supportQueueEmpty() const
         if (!itRow->second.empty())
             return false;
     }
-    int dummy;
-    return keyTypeEmpty(SUPPORT_QUEUE_ROW, dummy);
+    return db.IsEmpty(SUPPORT_QUEUE_ROW);
 }
 
 void CClaimTrie::setExpirationTime(int t)
@@ -1092,29 +1064,25 @@ bool CClaimTrie::ReadFromDisk(bool check)
         LogPrintf("%s: Couldn't read the best block's hash\n", __func__);
     if (!db.Read(CURRENT_HEIGHT, nCurrentHeight))
         LogPrintf("%s: Couldn't read the current height\n", __func__);
-    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
-    
+    boost::scoped_ptr<CDBPrefixIterator> pcursor(db.NewPrefixIterator(TRIE_NODE));
+
     while (pcursor->Valid())
     {
         std::pair<char, std::string> key;
         if (pcursor->GetKey(key))
         {
-            if (key.first == TRIE_NODE)
+            CClaimTrieNode* node = new CClaimTrieNode();
+            if (pcursor->GetValue(*node))
             {
-                CClaimTrieNode* node = new CClaimTrieNode();
-                if (pcursor->GetValue(*node))
-                {
-                    if (!InsertFromDisk(key.second, node))
-                    {
-                        return error("%s(): error restoring claim trie from disk", __func__);
-                    }
-                }
-                else
+                if (!InsertFromDisk(key.second, node))
                 {
-                    return error("%s(): error reading claim trie from disk", __func__);
+                    return error("%s(): error restoring claim trie from disk", __func__);
                 }
             }
+            else
+            {
+                return error("%s(): error reading claim trie from disk", __func__);
+            }
         }
         pcursor->Next();
     }
@@ -2437,6 +2405,77 @@ void CClaimTrieCache::setBestBlock(const uint256& hashBlockIn)
     hashBlock = hashBlockIn;
 }
 
+static void relinkChildren(nodeCacheType& nodes, const std::map<const CClaimTrieNode*, CClaimTrieNode*>& mapCopies)
+{
+    for (nodeCacheType::iterator itNode = nodes.begin(); itNode != nodes.end(); ++itNode)
+    {
+        for (nodeMapType::iterator itChild = itNode->second->children.begin(); itChild != itNode->second->children.end(); ++itChild)
+        {
+            std::map<const CClaimTrieNode*, CClaimTrieNode*>::const_iterator itCopy = mapCopies.find(itChild->second);
+            if (itCopy != mapCopies.end())
+                itChild->second = itCopy->second;
+        }
+    }
+}
+
+CClaimTrieCache::CClaimTrieCache(const CClaimTrieCache& other)
+    : base(other.base),
+      fRequireTakeoverHeights(other.fRequireTakeoverHeights),
+      dirtyHashes(other.dirtyHashes),
+      cacheHashes(other.cacheHashes),
+      claimQueueCache(other.claimQueueCache),
+      claimQueueNameCache(other.claimQueueNameCache),
+      expirationQueueCache(other.expirationQueueCache),
+      supportCache(other.supportCache),
+      supportQueueCache(other.supportQueueCache),
+      supportQueueNameCache(other.supportQueueNameCache),
+      supportExpirationQueueCache(other.supportExpirationQueueCache),
+      namesToCheckForTakeover(other.namesToCheckForTakeover),
+      cacheTakeoverHeights(other.cacheTakeoverHeights),
+      nCurrentHeight(other.nCurrentHeight),
+      hashBlock(other.hashBlock)
+{
+    // Cached nodes link to each other (and to nodes of the base trie) through
+    // their children, so point the copies at each other instead.
+    std::map<const CClaimTrieNode*, CClaimTrieNode*> mapCopies;
+    for (nodeCacheType::const_iterator itCache = other.cache.begin(); itCache != other.cache.end(); ++itCache)
+    {
+        CClaimTrieNode* copy = new CClaimTrieNode(*(itCache->second));
+        cache[itCache->first] = copy;
+        mapCopies[itCache->second] = copy;
+    }
+    for (nodeCacheType::const_iterator itOriginals = other.block_originals.begin(); itOriginals != other.block_originals.end(); ++itOriginals)
+    {
+        block_originals[itOriginals->first] = new CClaimTrieNode(*(itOriginals->second));
+    }
+    relinkChildren(cache, mapCopies);
+    relinkChildren(block_originals, mapCopies);
+}
+
+CClaimTrieCache& CClaimTrieCache::operator=(const CClaimTrieCache& other)
+{
+    // Take over a copy's state; this cache's nodes are freed with the copy
+    CClaimTrieCache copy(other);
+    std::swap(base, copy.base);
+    std::swap(fRequireTakeoverHeights, copy.fRequireTakeoverHeights);
+    cache.swap(copy.cache);
+    block_originals.swap(copy.block_originals);
+    dirtyHashes.swap(copy.dirtyHashes);
+    cacheHashes.swap(copy.cacheHashes);
+    claimQueueCache.swap(copy.claimQueueCache);
+    claimQueueNameCache.swap(copy.claimQueueNameCache);
+    expirationQueueCache.swap(copy.expirationQueueCache);
+    supportCache.swap(copy.supportCache);
+    supportQueueCache.swap(copy.supportQueueCache);
+    supportQueueNameCache.swap(copy.supportQueueNameCache);
+    supportExpirationQueueCache.swap(copy.supportExpirationQueueCache);
+    namesToCheckForTakeover.swap(copy.namesToCheckForTakeover);
+    cacheTakeoverHeights.swap(copy.cacheTakeoverHeights);
+    std::swap(nCurrentHeight, copy.nCurrentHeight);
+    std::swap(hashBlock, copy.hashBlock);
+    return *this;
+}
+
 bool CClaimTrieCache::clear() const
 {
     for (nodeCacheType::iterator itcache = cache.begin(); itcache != cache.end(); ++itcache)
@@ -390,7 +390,6 @@ private:
     void BatchWriteSupportQueueRows(CDBBatch& batch);
     void BatchWriteSupportQueueNameRows(CDBBatch& batch);
     void BatchWriteSupportExpirationQueueRows(CDBBatch& batch);
-    template<typename K> bool keyTypeEmpty(char key, K& dummy) const;
     
     CClaimTrieNode root;
     uint256 hashBlock;
@@ -441,6 +440,13 @@ public:
         assert(base);
         nCurrentHeight = base->nCurrentHeight;
     }
+
+    /**
+     * Copy the changes made on top of the base trie, so the copy can be
+     * modified (e.g. by incrementBlock) independently of this cache.
+     */
+    CClaimTrieCache(const CClaimTrieCache& other);
+    CClaimTrieCache& operator=(const CClaimTrieCache& other);
     
     uint256 getMerkleHash() const;
     
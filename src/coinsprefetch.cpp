@@ -0,0 +1,167 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsprefetch.h"
+
+#include "primitives/block.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <set>
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+CCoinsViewPrefetch::CCoinsViewPrefetch(CCoinsView *viewIn, CCoinsView *pdbviewIn) : CCoinsViewBacked(viewIn), pdbview(pdbviewIn), nGeneration(0), nHits(0), nSavedMicros(0) {}
+
+bool CCoinsViewPrefetch::GetCoins(const uint256 &txid, CCoins &coins) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CPrefetchMap::iterator it = mapPrefetched.find(txid);
+        if (it != mapPrefetched.end()) {
+            // The cache above us keeps its own copy from now on.
+            coins.swap(it->second.coins);
+            nHits++;
+            nSavedMicros += it->second.nReadMicros;
+            mapPrefetched.erase(it);
+            return true;
+        }
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewPrefetch::HaveCoins(const uint256 &txid) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (mapPrefetched.count(txid))
+            return true;
+    }
+    return base->HaveCoins(txid);
+}
+
+bool CCoinsViewPrefetch::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock)
+{
+    // The base view may consume mapCoins, so remember what is being written first.
+    std::vector<uint256> vWritten;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY)
+            vWritten.push_back(it->first);
+    }
+    bool fOk = base->BatchWrite(mapCoins, hashBlock);
+    // Only invalidate once the write has landed: a read started before this
+    // point is discarded through nGeneration, one that completed already is
+    // erased here.
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nGeneration++;
+    BOOST_FOREACH(const uint256& hash, vWritten)
+        mapPrefetched.erase(hash);
+    return fOk;
+}
+
+void CCoinsViewPrefetch::Enqueue(const CBlock& block)
+{
+    std::set<uint256> setCreated;
+    std::set<uint256> setSpent;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                // Outputs created earlier in the same block are not on disk yet.
+                if (!setCreated.count(txin.prevout.hash))
+                    setSpent.insert(txin.prevout.hash);
+            }
+        }
+        setCreated.insert(tx.GetHash());
+    }
+    if (setSpent.empty())
+        return;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (queue.size() >= MAX_PREFETCH_QUEUE)
+        return;
+    queue.push_back(std::vector<uint256>(setSpent.begin(), setSpent.end()));
+    cond.notify_one();
+}
+
+void CCoinsViewPrefetch::Prefetch(const std::vector<uint256>& vHash)
+{
+    uint64_t nStartGeneration;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nStartGeneration = nGeneration;
+    }
+
+    std::vector<std::pair<uint256, CPrefetchEntry> > vRead;
+    vRead.reserve(vHash.size());
+    BOOST_FOREACH(const uint256& hash, vHash) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (mapPrefetched.count(hash))
+                continue;
+        }
+        int64_t nStart = GetTimeMicros();
+        CPrefetchEntry entry;
+        try {
+            if (!pdbview->GetCoins(hash, entry.coins))
+                continue;
+        } catch (const std::runtime_error& e) {
+            // Leave it to the synchronous path to report database errors.
+            LogPrint("coindb", "%s: %s\n", __func__, e.what());
+            continue;
+        }
+        entry.nReadMicros = GetTimeMicros() - nStart;
+        vRead.push_back(std::make_pair(hash, entry));
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (nGeneration != nStartGeneration)
+        return;
+    for (size_t i = 0; i < vRead.size(); i++) {
+        if (mapPrefetched.insert(vRead[i]).second)
+            vPrefetchedOrder.push_back(vRead[i].first);
+    }
+    // Evict the oldest entries; some will already have been fetched.
+    while (mapPrefetched.size() > MAX_PREFETCH_COINS && !vPrefetchedOrder.empty()) {
+        mapPrefetched.erase(vPrefetchedOrder.front());
+        vPrefetchedOrder.pop_front();
+    }
+    if (vPrefetchedOrder.size() > 2 * MAX_PREFETCH_COINS) {
+        std::deque<uint256> vOrder;
+        BOOST_FOREACH(const uint256& hash, vPrefetchedOrder) {
+            if (mapPrefetched.count(hash))
+                vOrder.push_back(hash);
+        }
+        vPrefetchedOrder.swap(vOrder);
+    }
+}
+
+void CCoinsViewPrefetch::ThreadPrefetch()
+{
+    while (true) {
+        std::vector<uint256> vHash;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queue.empty())
+                cond.wait(lock); // interruption point
+            vHash.swap(queue.front());
+            queue.pop_front();
+        }
+        boost::this_thread::interruption_point();
+        Prefetch(vHash);
+    }
+}
+
+size_t CCoinsViewPrefetch::GetCacheSize() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return mapPrefetched.size();
+}
+
+void CCoinsViewPrefetch::GetStats(uint64_t& nHitsOut, int64_t& nSavedMicrosOut) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nHitsOut = nHits;
+    nSavedMicrosOut = nSavedMicros;
+}
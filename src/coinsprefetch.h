@@ -0,0 +1,93 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSPREFETCH_H
+#define BITCOIN_COINSPREFETCH_H
+
+#include "coins.h"
+
+#include <deque>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CBlock;
+
+//! -prefetchcoins default
+static const bool DEFAULT_PREFETCH_COINS = true;
+//! Maximum number of prefetched transactions kept waiting to be connected
+static const unsigned int MAX_PREFETCH_COINS = 100000;
+//! Maximum number of blocks waiting to be prefetched
+static const unsigned int MAX_PREFETCH_QUEUE = 64;
+
+/**
+ * CCoinsView layer that sits between pcoinsTip and the coin database and
+ * warms up the inputs of blocks that have been received but not yet
+ * connected. A background thread reads the coins for every outpoint a
+ * queued block spends straight from the database, so the disk latency
+ * overlaps with the connection of the preceding blocks; ConnectBlock then
+ * finds them in memory when pcoinsTip misses its cache.
+ *
+ * Only positive lookups are kept, and every entry touched by a BatchWrite
+ * is dropped, so the layer never returns anything but what the backing
+ * view would have returned.
+ */
+class CCoinsViewPrefetch : public CCoinsViewBacked
+{
+private:
+    struct CPrefetchEntry
+    {
+        CCoins coins;
+        //! Time (in microseconds) it took to read this entry from disk
+        int64_t nReadMicros;
+    };
+    typedef boost::unordered_map<uint256, CPrefetchEntry, CCoinsKeyHasher> CPrefetchMap;
+
+    //! The view read from by the prefetch thread (not synchronized by cs_main)
+    CCoinsView *pdbview;
+
+    //! Mutex to protect the inner state
+    mutable boost::mutex mutex;
+    //! The prefetch thread blocks on this when out of work
+    boost::condition_variable cond;
+
+    //! Warmed-up coins, waiting to be fetched by the cache above us
+    mutable CPrefetchMap mapPrefetched;
+    //! Insertion order of mapPrefetched, oldest first, used for eviction
+    std::deque<uint256> vPrefetchedOrder;
+    //! Blocks (as lists of spent txids) waiting to be prefetched
+    std::deque<std::vector<uint256> > queue;
+    //! Bumped on every BatchWrite so reads racing a write are discarded
+    uint64_t nGeneration;
+
+    //! Statistics, for -debug=bench
+    mutable uint64_t nHits;
+    mutable int64_t nSavedMicros;
+
+public:
+    CCoinsViewPrefetch(CCoinsView *viewIn, CCoinsView *pdbviewIn);
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    //! Queue the inputs of a checked block for prefetching
+    void Enqueue(const CBlock& block);
+
+    //! Read the given txids from the database into the warm-up cache
+    void Prefetch(const std::vector<uint256>& vHash);
+
+    //! Worker thread: prefetch queued blocks until interrupted
+    void ThreadPrefetch();
+
+    //! Number of entries currently warmed up
+    size_t GetCacheSize() const;
+
+    //! Cumulative number of lookups served from the warm-up cache and the disk time they saved
+    void GetStats(uint64_t& nHitsOut, int64_t& nSavedMicrosOut) const;
+};
+
+#endif // BITCOIN_COINSPREFETCH_H
@@ -0,0 +1,97 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
+#include "crypto/multihash.h"
+
+#include "crypto/common.h"
+#include "crypto/ripemd160.h"
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+
+// Internal implementation code.
+namespace
+{
+/// Single-lane fallback on top of the regular hashers.
+namespace scalar
+{
+void SHA256(unsigned char* out, const unsigned char* in, size_t len)
+{
+    CSHA256().Write(in, len).Finalize(out);
+}
+
+void SHA512(unsigned char* out, const unsigned char* in, size_t len)
+{
+    CSHA512().Write(in, len).Finalize(out);
+}
+
+void RIPEMD160(unsigned char* out, const unsigned char* in, size_t len)
+{
+    CRIPEMD160().Write(in, len).Finalize(out);
+}
+
+void SHA256Midstate(unsigned char* out, const uint32_t* midstate, uint64_t nPrefixLen, const unsigned char* in, size_t len)
+{
+    CSHA256().SetMidstate(midstate, nPrefixLen).Write(in, len).Finalize(out);
+}
+
+const multihash::Implementation implementation = {"scalar", 1, SHA256, SHA512, RIPEMD160, SHA256Midstate};
+} // namespace scalar
+
+#if (defined(ENABLE_SSE41) || defined(ENABLE_AVX2)) && !defined(BUILD_BITCOIN_INTERNAL)
+void inline cpuid(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+    __asm__ ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "0"(leaf), "2"(subleaf));
+}
+
+/** Whether the OS saves the AVX (YMM) register state on context switches. */
+bool inline AVXEnabled()
+{
+    uint32_t a, d;
+    __asm__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 6) == 6;
+}
+#endif
+
+std::vector<const multihash::Implementation*> Detect()
+{
+    std::vector<const multihash::Implementation*> ret;
+    ret.push_back(&scalar::implementation);
+#if (defined(ENABLE_SSE41) || defined(ENABLE_AVX2)) && !defined(BUILD_BITCOIN_INTERNAL)
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, eax, ebx, ecx, edx);
+    uint32_t nMaxLeaf = eax;
+    cpuid(1, 0, eax, ebx, ecx, edx);
+#if defined(ENABLE_SSE41)
+    if ((ecx >> 19) & 1)
+        ret.push_back(&multihash::sse41::implementation);
+#endif
+#if defined(ENABLE_AVX2)
+    bool fAVX = ((ecx >> 27) & 1) && ((ecx >> 28) & 1) && AVXEnabled();
+    if (fAVX && nMaxLeaf >= 7) {
+        cpuid(7, 0, eax, ebx, ecx, edx);
+        if ((ebx >> 5) & 1)
+            ret.push_back(&multihash::avx2::implementation);
+    }
+#endif
+    (void)nMaxLeaf;
+#endif
+    return ret;
+}
+} // namespace
+
+const multihash::Implementation& multihash::Best()
+{
+    static const Implementation* best = Available().back();
+    return *best;
+}
+
+std::vector<const multihash::Implementation*> multihash::Available()
+{
+    static const std::vector<const Implementation*> available = Detect();
+    return available;
+}
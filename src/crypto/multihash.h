@@ -0,0 +1,59 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MULTIHASH_H
+#define BITCOIN_CRYPTO_MULTIHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+/**
+ * Multi-lane SHA-256, SHA-512 and RIPEMD-160.
+ *
+ * Each function hashes nLanes messages of the same length at once: the
+ * messages are stored back to back in the input (nLanes * len bytes), and
+ * the digests are written back to back to the output. SIMD
+ * implementations run every lane in its own vector element; the scalar
+ * one has a single lane.
+ */
+namespace multihash
+{
+//! Upper bound on nLanes over all implementations
+static const size_t MAX_LANES = 8;
+
+typedef void (*HashLanesFn)(unsigned char* out, const unsigned char* in, size_t len);
+
+/**
+ * Like HashLanesFn, but every lane continues from the same SHA-256 midstate
+ * (see CSHA256::GetMidstate) taken after a common nPrefixLen-byte prefix, so
+ * the input holds only the len bytes that follow it in each message.
+ */
+typedef void (*HashLanesMidstateFn)(unsigned char* out, const uint32_t* midstate, uint64_t nPrefixLen, const unsigned char* in, size_t len);
+
+struct Implementation
+{
+    const char* name;
+    size_t nLanes;
+    HashLanesFn sha256;
+    HashLanesFn sha512;
+    HashLanesFn ripemd160;
+    HashLanesMidstateFn sha256Midstate;
+};
+
+/** The widest implementation supported by this CPU, detected on first use. */
+const Implementation& Best();
+
+/** All implementations supported by this CPU, scalar first. */
+std::vector<const Implementation*> Available();
+
+#if defined(ENABLE_SSE41) && !defined(BUILD_BITCOIN_INTERNAL)
+namespace sse41 { extern const Implementation implementation; }
+#endif
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+namespace avx2 { extern const Implementation implementation; }
+#endif
+} // namespace multihash
+
+#endif // BITCOIN_CRYPTO_MULTIHASH_H
@@ -0,0 +1,22 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// 8-lane hash kernels. This file is compiled with the AVX2 code
+// generation flags, and only called after a CPU feature check.
+
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
+#define MULTIHASH_LANES 8
+#define MULTIHASH_NAMESPACE avx2
+#include "crypto/multihash_impl.h"
+
+namespace multihash
+{
+namespace avx2
+{
+const Implementation implementation = {"avx2", LANES, sha256::Hash, sha512::Hash, ripemd160::Hash, sha256::HashMidstate};
+}
+}
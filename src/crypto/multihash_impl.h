@@ -0,0 +1,315 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Generic multi-lane hash kernels, written with GCC/Clang vector extensions.
+// Included by the per-instruction-set translation units (built with the
+// matching -m flags) after defining MULTIHASH_LANES and MULTIHASH_NAMESPACE.
+
+#ifndef BITCOIN_CRYPTO_MULTIHASH_IMPL_H
+#define BITCOIN_CRYPTO_MULTIHASH_IMPL_H
+
+#include "crypto/common.h"
+#include "crypto/multihash.h"
+
+#include <string.h>
+
+namespace multihash
+{
+namespace MULTIHASH_NAMESPACE
+{
+static const size_t LANES = MULTIHASH_LANES;
+
+typedef uint32_t u32v __attribute__((vector_size(4 * MULTIHASH_LANES)));
+typedef uint64_t u64v __attribute__((vector_size(8 * MULTIHASH_LANES)));
+
+/// Multi-lane SHA-256.
+namespace sha256
+{
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t INIT[8] = {
+    0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul, 0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul};
+
+u32v inline Ch(u32v x, u32v y, u32v z) { return z ^ (x & (y ^ z)); }
+u32v inline Maj(u32v x, u32v y, u32v z) { return (x & y) | (z & (x | y)); }
+u32v inline Sigma0(u32v x) { return (x >> 2 | x << 30) ^ (x >> 13 | x << 19) ^ (x >> 22 | x << 10); }
+u32v inline Sigma1(u32v x) { return (x >> 6 | x << 26) ^ (x >> 11 | x << 21) ^ (x >> 25 | x << 7); }
+u32v inline sigma0(u32v x) { return (x >> 7 | x << 25) ^ (x >> 18 | x << 14) ^ (x >> 3); }
+u32v inline sigma1(u32v x) { return (x >> 17 | x << 15) ^ (x >> 19 | x << 13) ^ (x >> 10); }
+
+/** Perform one SHA-256 transformation per lane, processing one 64-byte chunk each. */
+void Transform(u32v* s, const unsigned char* const* chunks)
+{
+    u32v w[16];
+    for (int i = 0; i < 16; i++)
+        for (size_t l = 0; l < LANES; l++)
+            w[i][l] = ReadBE32(chunks[l] + 4 * i);
+
+    u32v a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        if (i >= 16)
+            w[i & 15] += sigma1(w[(i + 14) & 15]) + w[(i + 9) & 15] + sigma0(w[(i + 1) & 15]);
+        u32v t1 = h + Sigma1(e) + Ch(e, f, g) + K[i] + w[i & 15];
+        u32v t2 = Sigma0(a) + Maj(a, b, c);
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+    s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+void HashMidstate(unsigned char* out, const uint32_t* midstate, uint64_t nPrefixLen, const unsigned char* in, size_t len)
+{
+    u32v s[8];
+    for (int i = 0; i < 8; i++)
+        for (size_t l = 0; l < LANES; l++)
+            s[i][l] = midstate[i];
+
+    const unsigned char* chunks[LANES];
+    size_t pos = 0;
+    for (; pos + 64 <= len; pos += 64) {
+        for (size_t l = 0; l < LANES; l++)
+            chunks[l] = in + l * len + pos;
+        Transform(s, chunks);
+    }
+
+    // The padding is the same for every lane, as the lengths are.
+    unsigned char tail[LANES][128];
+    size_t rem = len - pos;
+    size_t tailsize = rem + 9 <= 64 ? 64 : 128;
+    for (size_t l = 0; l < LANES; l++) {
+        memcpy(tail[l], in + l * len + pos, rem);
+        tail[l][rem] = 0x80;
+        memset(tail[l] + rem + 1, 0, tailsize - rem - 9);
+        WriteBE64(tail[l] + tailsize - 8, (nPrefixLen + len) << 3);
+    }
+    for (size_t off = 0; off < tailsize; off += 64) {
+        for (size_t l = 0; l < LANES; l++)
+            chunks[l] = tail[l] + off;
+        Transform(s, chunks);
+    }
+
+    for (size_t l = 0; l < LANES; l++)
+        for (int i = 0; i < 8; i++)
+            WriteBE32(out + 32 * l + 4 * i, s[i][l]);
+}
+
+void Hash(unsigned char* out, const unsigned char* in, size_t len)
+{
+    HashMidstate(out, INIT, 0, in, len);
+}
+} // namespace sha256
+
+/// Multi-lane SHA-512.
+namespace sha512
+{
+static const uint64_t K[80] = {
+    0x428a2f98d728ae22ull, 0x7137449123ef65cdull, 0xb5c0fbcfec4d3b2full, 0xe9b5dba58189dbbcull,
+    0x3956c25bf348b538ull, 0x59f111f1b605d019ull, 0x923f82a4af194f9bull, 0xab1c5ed5da6d8118ull,
+    0xd807aa98a3030242ull, 0x12835b0145706fbeull, 0x243185be4ee4b28cull, 0x550c7dc3d5ffb4e2ull,
+    0x72be5d74f27b896full, 0x80deb1fe3b1696b1ull, 0x9bdc06a725c71235ull, 0xc19bf174cf692694ull,
+    0xe49b69c19ef14ad2ull, 0xefbe4786384f25e3ull, 0x0fc19dc68b8cd5b5ull, 0x240ca1cc77ac9c65ull,
+    0x2de92c6f592b0275ull, 0x4a7484aa6ea6e483ull, 0x5cb0a9dcbd41fbd4ull, 0x76f988da831153b5ull,
+    0x983e5152ee66dfabull, 0xa831c66d2db43210ull, 0xb00327c898fb213full, 0xbf597fc7beef0ee4ull,
+    0xc6e00bf33da88fc2ull, 0xd5a79147930aa725ull, 0x06ca6351e003826full, 0x142929670a0e6e70ull,
+    0x27b70a8546d22ffcull, 0x2e1b21385c26c926ull, 0x4d2c6dfc5ac42aedull, 0x53380d139d95b3dfull,
+    0x650a73548baf63deull, 0x766a0abb3c77b2a8ull, 0x81c2c92e47edaee6ull, 0x92722c851482353bull,
+    0xa2bfe8a14cf10364ull, 0xa81a664bbc423001ull, 0xc24b8b70d0f89791ull, 0xc76c51a30654be30ull,
+    0xd192e819d6ef5218ull, 0xd69906245565a910ull, 0xf40e35855771202aull, 0x106aa07032bbd1b8ull,
+    0x19a4c116b8d2d0c8ull, 0x1e376c085141ab53ull, 0x2748774cdf8eeb99ull, 0x34b0bcb5e19b48a8ull,
+    0x391c0cb3c5c95a63ull, 0x4ed8aa4ae3418acbull, 0x5b9cca4f7763e373ull, 0x682e6ff3d6b2b8a3ull,
+    0x748f82ee5defb2fcull, 0x78a5636f43172f60ull, 0x84c87814a1f0ab72ull, 0x8cc702081a6439ecull,
+    0x90befffa23631e28ull, 0xa4506cebde82bde9ull, 0xbef9a3f7b2c67915ull, 0xc67178f2e372532bull,
+    0xca273eceea26619cull, 0xd186b8c721c0c207ull, 0xeada7dd6cde0eb1eull, 0xf57d4f7fee6ed178ull,
+    0x06f067aa72176fbaull, 0x0a637dc5a2c898a6ull, 0x113f9804bef90daeull, 0x1b710b35131c471bull,
+    0x28db77f523047d84ull, 0x32caab7b40c72493ull, 0x3c9ebe0a15c9bebcull, 0x431d67c49c100d4cull,
+    0x4cc5d4becb3e42b6ull, 0x597f299cfc657e2aull, 0x5fcb6fab3ad6faecull, 0x6c44198c4a475817ull};
+
+static const uint64_t INIT[8] = {
+    0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull, 0x3c6ef372fe94f82bull, 0xa54ff53a5f1d36f1ull,
+    0x510e527fade682d1ull, 0x9b05688c2b3e6c1full, 0x1f83d9abfb41bd6bull, 0x5be0cd19137e2179ull};
+
+u64v inline Ch(u64v x, u64v y, u64v z) { return z ^ (x & (y ^ z)); }
+u64v inline Maj(u64v x, u64v y, u64v z) { return (x & y) | (z & (x | y)); }
+u64v inline Sigma0(u64v x) { return (x >> 28 | x << 36) ^ (x >> 34 | x << 30) ^ (x >> 39 | x << 25); }
+u64v inline Sigma1(u64v x) { return (x >> 14 | x << 50) ^ (x >> 18 | x << 46) ^ (x >> 41 | x << 23); }
+u64v inline sigma0(u64v x) { return (x >> 1 | x << 63) ^ (x >> 8 | x << 56) ^ (x >> 7); }
+u64v inline sigma1(u64v x) { return (x >> 19 | x << 45) ^ (x >> 61 | x << 3) ^ (x >> 6); }
+
+/** Perform one SHA-512 transformation per lane, processing one 128-byte chunk each. */
+void Transform(u64v* s, const unsigned char* const* chunks)
+{
+    u64v w[16];
+    for (int i = 0; i < 16; i++)
+        for (size_t l = 0; l < LANES; l++)
+            w[i][l] = ReadBE64(chunks[l] + 8 * i);
+
+    u64v a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 80; i++) {
+        if (i >= 16)
+            w[i & 15] += sigma1(w[(i + 14) & 15]) + w[(i + 9) & 15] + sigma0(w[(i + 1) & 15]);
+        u64v t1 = h + Sigma1(e) + Ch(e, f, g) + K[i] + w[i & 15];
+        u64v t2 = Sigma0(a) + Maj(a, b, c);
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+    s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+void Hash(unsigned char* out, const unsigned char* in, size_t len)
+{
+    u64v s[8];
+    for (int i = 0; i < 8; i++)
+        for (size_t l = 0; l < LANES; l++)
+            s[i][l] = INIT[i];
+
+    const unsigned char* chunks[LANES];
+    size_t pos = 0;
+    for (; pos + 128 <= len; pos += 128) {
+        for (size_t l = 0; l < LANES; l++)
+            chunks[l] = in + l * len + pos;
+        Transform(s, chunks);
+    }
+
+    unsigned char tail[LANES][256];
+    size_t rem = len - pos;
+    size_t tailsize = rem + 17 <= 128 ? 128 : 256;
+    for (size_t l = 0; l < LANES; l++) {
+        memcpy(tail[l], in + l * len + pos, rem);
+        tail[l][rem] = 0x80;
+        memset(tail[l] + rem + 1, 0, tailsize - rem - 9);
+        WriteBE64(tail[l] + tailsize - 8, (uint64_t)len << 3);
+    }
+    for (size_t off = 0; off < tailsize; off += 128) {
+        for (size_t l = 0; l < LANES; l++)
+            chunks[l] = tail[l] + off;
+        Transform(s, chunks);
+    }
+
+    for (size_t l = 0; l < LANES; l++)
+        for (int i = 0; i < 8; i++)
+            WriteBE64(out + 64 * l + 8 * i, s[i][l]);
+}
+} // namespace sha512
+
+/// Multi-lane RIPEMD-160.
+namespace ripemd160
+{
+static const int RL[80] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    7, 4, 13, 1, 10, 6, 15, 3, 12, 0, 9, 5, 2, 14, 11, 8,
+    3, 10, 14, 4, 9, 15, 8, 1, 2, 7, 0, 6, 13, 11, 5, 12,
+    1, 9, 11, 10, 0, 8, 12, 4, 13, 3, 7, 15, 14, 5, 6, 2,
+    4, 0, 5, 9, 7, 12, 2, 10, 14, 1, 3, 8, 11, 6, 15, 13};
+static const int RR[80] = {
+    5, 14, 7, 0, 9, 2, 11, 4, 13, 6, 15, 8, 1, 10, 3, 12,
+    6, 11, 3, 7, 0, 13, 5, 10, 14, 15, 8, 12, 4, 9, 1, 2,
+    15, 5, 1, 3, 7, 14, 6, 9, 11, 8, 12, 2, 10, 0, 4, 13,
+    8, 6, 4, 1, 3, 11, 15, 0, 5, 12, 2, 13, 9, 7, 10, 14,
+    12, 15, 10, 4, 1, 5, 8, 7, 6, 2, 13, 14, 0, 3, 9, 11};
+static const int SL[80] = {
+    11, 14, 15, 12, 5, 8, 7, 9, 11, 13, 14, 15, 6, 7, 9, 8,
+    7, 6, 8, 13, 11, 9, 7, 15, 7, 12, 15, 9, 11, 7, 13, 12,
+    11, 13, 6, 7, 14, 9, 13, 15, 14, 8, 13, 6, 5, 12, 7, 5,
+    11, 12, 14, 15, 14, 15, 9, 8, 9, 14, 5, 6, 8, 6, 5, 12,
+    9, 15, 5, 11, 6, 8, 13, 12, 5, 12, 13, 14, 11, 8, 5, 6};
+static const int SR[80] = {
+    8, 9, 9, 11, 13, 15, 15, 5, 7, 7, 8, 11, 14, 14, 12, 6,
+    9, 13, 15, 7, 12, 8, 9, 11, 7, 7, 12, 7, 6, 15, 13, 11,
+    9, 7, 15, 11, 8, 6, 6, 14, 12, 13, 5, 14, 13, 13, 7, 5,
+    15, 5, 8, 11, 14, 14, 6, 14, 6, 9, 12, 9, 12, 5, 15, 8,
+    8, 5, 12, 9, 12, 5, 14, 6, 8, 13, 6, 5, 15, 13, 11, 11};
+static const uint32_t KL[5] = {0, 0x5A827999ul, 0x6ED9EBA1ul, 0x8F1BBCDCul, 0xA953FD4Eul};
+static const uint32_t KR[5] = {0x50A28BE6ul, 0x5C4DD124ul, 0x6D703EF3ul, 0x7A6D76E9ul, 0};
+
+static const uint32_t INIT[5] = {0x67452301ul, 0xEFCDAB89ul, 0x98BADCFEul, 0x10325476ul, 0xC3D2E1F0ul};
+
+/** The boolean function of round group j (0..4); the right line uses them in reverse. */
+u32v inline f(int j, u32v x, u32v y, u32v z)
+{
+    switch (j) {
+    case 0: return x ^ y ^ z;
+    case 1: return (x & y) | (~x & z);
+    case 2: return (x | ~y) ^ z;
+    case 3: return (x & z) | (y & ~z);
+    default: return x ^ (y | ~z);
+    }
+}
+
+u32v inline rol(u32v x, int i) { return (x << i) | (x >> (32 - i)); }
+
+/** Perform one RIPEMD-160 transformation per lane, processing one 64-byte chunk each. */
+void Transform(u32v* s, const unsigned char* const* chunks)
+{
+    u32v w[16];
+    for (int i = 0; i < 16; i++)
+        for (size_t l = 0; l < LANES; l++)
+            w[i][l] = ReadLE32(chunks[l] + 4 * i);
+
+    u32v a1 = s[0], b1 = s[1], c1 = s[2], d1 = s[3], e1 = s[4];
+    u32v a2 = a1, b2 = b1, c2 = c1, d2 = d1, e2 = e1;
+    for (int i = 0; i < 80; i++) {
+        int j = i >> 4;
+        u32v t = rol(a1 + f(j, b1, c1, d1) + w[RL[i]] + KL[j], SL[i]) + e1;
+        a1 = e1; e1 = d1; d1 = rol(c1, 10); c1 = b1; b1 = t;
+        t = rol(a2 + f(4 - j, b2, c2, d2) + w[RR[i]] + KR[j], SR[i]) + e2;
+        a2 = e2; e2 = d2; d2 = rol(c2, 10); c2 = b2; b2 = t;
+    }
+
+    u32v t = s[0];
+    s[0] = s[1] + c1 + d2;
+    s[1] = s[2] + d1 + e2;
+    s[2] = s[3] + e1 + a2;
+    s[3] = s[4] + a1 + b2;
+    s[4] = t + b1 + c2;
+}
+
+void Hash(unsigned char* out, const unsigned char* in, size_t len)
+{
+    u32v s[5];
+    for (int i = 0; i < 5; i++)
+        for (size_t l = 0; l < LANES; l++)
+            s[i][l] = INIT[i];
+
+    const unsigned char* chunks[LANES];
+    size_t pos = 0;
+    for (; pos + 64 <= len; pos += 64) {
+        for (size_t l = 0; l < LANES; l++)
+            chunks[l] = in + l * len + pos;
+        Transform(s, chunks);
+    }
+
+    unsigned char tail[LANES][128];
+    size_t rem = len - pos;
+    size_t tailsize = rem + 9 <= 64 ? 64 : 128;
+    for (size_t l = 0; l < LANES; l++) {
+        memcpy(tail[l], in + l * len + pos, rem);
+        tail[l][rem] = 0x80;
+        memset(tail[l] + rem + 1, 0, tailsize - rem - 9);
+        WriteLE64(tail[l] + tailsize - 8, (uint64_t)len << 3);
+    }
+    for (size_t off = 0; off < tailsize; off += 64) {
+        for (size_t l = 0; l < LANES; l++)
+            chunks[l] = tail[l] + off;
+        Transform(s, chunks);
+    }
+
+    for (size_t l = 0; l < LANES; l++)
+        for (int i = 0; i < 5; i++)
+            WriteLE32(out + 20 * l + 4 * i, s[i][l]);
+}
+} // namespace ripemd160
+} // namespace MULTIHASH_NAMESPACE
+} // namespace multihash
+
+#endif // BITCOIN_CRYPTO_MULTIHASH_IMPL_H
@@ -6,6 +6,7 @@
 
 #include "crypto/common.h"
 
+#include <assert.h>
 #include <string.h>
 
 // Internal implementation code.
@@ -187,3 +188,17 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+void CSHA256::GetMidstate(uint32_t midstate[8]) const
+{
+    assert(bytes % 64 == 0);
+    memcpy(midstate, s, sizeof(s));
+}
+
+CSHA256& CSHA256::SetMidstate(const uint32_t midstate[8], uint64_t nBytes)
+{
+    assert(nBytes % 64 == 0);
+    memcpy(s, midstate, sizeof(s));
+    bytes = nBytes;
+    return *this;
+}
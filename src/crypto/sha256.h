@@ -23,6 +23,14 @@ public:
     CSHA256& Write(const unsigned char* data, size_t len);
     void Finalize(unsigned char hash[OUTPUT_SIZE]);
     CSHA256& Reset();
+
+    /**
+     * Copy out the internal state after a whole number of 64-byte blocks,
+     * so that messages sharing that prefix can skip rehashing it.
+     */
+    void GetMidstate(uint32_t midstate[8]) const;
+    /** Continue from a midstate taken after nBytes bytes (a multiple of 64). */
+    CSHA256& SetMidstate(const uint32_t midstate[8], uint64_t nBytes);
 };
 
 #endif // BITCOIN_CRYPTO_SHA256_H
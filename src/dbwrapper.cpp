@@ -136,6 +136,19 @@ bool CDBWrapper::IsEmpty()
     return !(it->Valid());
 }
 
+CDBPrefixIterator *CDBWrapper::NewPrefixIterator(char chKeyType) const
+{
+    leveldb::Iterator *piter = pdb->NewIterator(iteroptions);
+    piter->Seek(leveldb::Slice(&chKeyType, 1));
+    return new CDBPrefixIterator(piter, &obfuscate_key, chKeyType);
+}
+
+bool CDBWrapper::IsEmpty(char chKeyType) const
+{
+    boost::scoped_ptr<CDBPrefixIterator> it(NewPrefixIterator(chKeyType));
+    return !it->Valid();
+}
+
 const std::vector<unsigned char>& CDBWrapper::GetObfuscateKey() const
 {
     return obfuscate_key;
@@ -150,3 +163,29 @@ CDBIterator::~CDBIterator() { delete piter; }
 bool CDBIterator::Valid() { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
 void CDBIterator::Next() { piter->Next(); }
+
+CDBPrefixIterator::CDBPrefixIterator(leveldb::Iterator *piterIn, const std::vector<unsigned char>* obfuscate_key, char chKeyTypeIn) :
+    piter(piterIn), obfuscate_key(obfuscate_key), fObfuscated(false), chKeyType(chKeyTypeIn)
+{
+    for (unsigned int i = 0; i < obfuscate_key->size(); i++)
+        fObfuscated |= (*obfuscate_key)[i] != 0;
+}
+
+CDBPrefixIterator::~CDBPrefixIterator() { delete piter; }
+void CDBPrefixIterator::Next() { piter->Next(); }
+
+CBufferReader CDBPrefixIterator::GetValueReader()
+{
+    leveldb::Slice slValue = piter->value();
+    if (!fObfuscated)
+        return CBufferReader(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+
+    const std::vector<unsigned char>& key = *obfuscate_key;
+    vchValue.assign(slValue.data(), slValue.data() + slValue.size());
+    for (size_t i = 0, j = 0; i < vchValue.size(); i++) {
+        vchValue[i] ^= key[j++];
+        if (j == key.size())
+            j = 0;
+    }
+    return CBufferReader(vchValue.empty() ? NULL : &vchValue[0], vchValue.empty() ? NULL : &vchValue[0] + vchValue.size(), SER_DISK, CLIENT_VERSION);
+}
@@ -34,22 +34,26 @@ private:
     leveldb::WriteBatch batch;
     const std::vector<unsigned char> *obfuscate_key;
 
+    //! Scratch streams reused for every entry, so they only allocate when
+    //! an entry outgrows the largest one serialized so far
+    CDataStream ssKey;
+    CDataStream ssValue;
+
 public:
     /**
      * @param[in] obfuscate_key    If passed, XOR data with this key.
      */
-    CDBBatch(const std::vector<unsigned char> *obfuscate_key) : obfuscate_key(obfuscate_key) { };
+    CDBBatch(const std::vector<unsigned char> *obfuscate_key) :
+        obfuscate_key(obfuscate_key), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION) { };
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey.clear();
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.reserve(ssValue.GetSerializeSize(value));
+        ssValue.clear();
         ssValue << value;
         ssValue.Xor(*obfuscate_key);
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
@@ -60,8 +64,7 @@ public:
     template <typename K>
     void Erase(const K& key)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey.clear();
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
@@ -132,6 +135,78 @@ public:
 
 };
 
+/**
+ * Iterator over the entries whose keys start with one key type character,
+ * in key order. LevelDB has no iteration bounds, so it seeks to the first
+ * key of the type and is no longer Valid() at the first key of another
+ * type; only the first byte of each key is looked at to tell.
+ *
+ * Keys and values are deserialized straight from LevelDB's buffers, and
+ * GetValueReader hands a value out as a span without copying it. Only a
+ * value of an obfuscated database is copied, to undo the obfuscation.
+ */
+class CDBPrefixIterator
+{
+private:
+    leveldb::Iterator *piter;
+    const std::vector<unsigned char> *obfuscate_key;
+    //! The obfuscation key is not all zeroes
+    bool fObfuscated;
+    char chKeyType;
+    //! De-obfuscated copy of the current value
+    std::vector<char> vchValue;
+
+public:
+    /**
+     * @param[in] piterIn          The original leveldb iterator, already positioned.
+     * @param[in] obfuscate_key    XOR data with this key.
+     * @param[in] chKeyTypeIn      The first byte of the keys to iterate over.
+     */
+    CDBPrefixIterator(leveldb::Iterator *piterIn, const std::vector<unsigned char>* obfuscate_key, char chKeyTypeIn);
+    ~CDBPrefixIterator();
+
+    bool Valid() const
+    {
+        if (!piter->Valid())
+            return false;
+        leveldb::Slice slKey = piter->key();
+        return !slKey.empty() && slKey[0] == chKeyType;
+    }
+
+    void Next();
+
+    template<typename K> bool GetKey(K& key) {
+        leveldb::Slice slKey = piter->key();
+        try {
+            CBufferReader reader(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            reader >> key;
+        } catch (const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * The value of the current entry. It points into the iterator's buffers
+     * and stays valid until the iterator moves on.
+     */
+    CBufferReader GetValueReader();
+
+    template<typename V> bool GetValue(V& value) {
+        try {
+            CBufferReader reader = GetValueReader();
+            reader >> value;
+        } catch (const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    unsigned int GetValueSize() {
+        return piter->value().size();
+    }
+};
+
 class CDBWrapper
 {
 private:
@@ -259,11 +334,22 @@ public:
         return new CDBIterator(pdb->NewIterator(iteroptions), &obfuscate_key);
     }
 
+    /**
+     * Return an iterator over the entries whose keys start with chKeyType,
+     * the key type character of a key serialized as std::make_pair(chKeyType, ...).
+     */
+    CDBPrefixIterator *NewPrefixIterator(char chKeyType) const;
+
     /**
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
 
+    /**
+     * Return true if the database contains no entries with keys of type chKeyType.
+     */
+    bool IsEmpty(char chKeyType) const;
+
     /**
      * Accessor for obfuscate_key.
      */
@@ -0,0 +1,73 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_GETDATAQUEUE_H
+#define BITCOIN_GETDATAQUEUE_H
+
+#include "net.h"
+
+#include <deque>
+#include <set>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * Peers with getdata requests waiting for a -servethreads worker. Every
+ * peer is queued at most once, and a worker serves a single slice of a
+ * peer's requests (up to the first block, or until its send buffer is
+ * full) before putting it back at the end of the queue, so peers asking
+ * for many blocks do not starve the others.
+ */
+class CGetDataQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<CNode*> queue;
+    std::set<CNode*> setQueued;
+
+public:
+    //! Queue pnode, unless it is already waiting or being served
+    void Push(CNode* pnode)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!setQueued.insert(pnode).second)
+            return;
+        {
+            LOCK(cs_vNodes);
+            pnode->AddRef();
+        }
+        queue.push_back(pnode);
+        cond.notify_one();
+    }
+
+    //! Wait for the next peer to serve
+    CNode* Pop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty())
+            cond.wait(lock); // interruption point
+        CNode* pnode = queue.front();
+        queue.pop_front();
+        return pnode;
+    }
+
+    //! Requeue pnode if it has more to be served now, release it otherwise
+    void Done(CNode* pnode, bool fMore)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fMore) {
+            queue.push_back(pnode);
+            cond.notify_one();
+            return;
+        }
+        setQueued.erase(pnode);
+        LOCK(cs_vNodes);
+        pnode->Release();
+    }
+};
+
+#endif // BITCOIN_GETDATAQUEUE_H
@@ -6,6 +6,7 @@
 #include "crypto/common.h"
 #include "crypto/ripemd160.h"
 #include "crypto/hmac_sha512.h"
+#include "crypto/multihash.h"
 #include "crypto/sha512.h"
 #include "pubkey.h"
 
@@ -17,41 +18,91 @@ inline uint32_t ROTL32(uint32_t x, int8_t r)
 
 uint256 PoWHash(const std::vector<unsigned char>& input)
 {
+    return PoWHash(input.empty() ? NULL : &input[0], input.size());
+}
+
+uint256 PoWHash(const unsigned char* pinput, size_t nLen)
+{
+    unsigned char out512[CSHA512::OUTPUT_SIZE];
+    unsigned char out160[CRIPEMD160::OUTPUT_SIZE];
+    uint256 result;
+
+    CHash256().Write(pinput, nLen).Finalize(out512);
+    CSHA512().Write(out512, CHash256::OUTPUT_SIZE).Finalize(out512);
+
     CHash256 h256;
-    CSHA512 h512;
-    CRIPEMD160 h160;
-    
-    std::vector<unsigned char> out;
-    out.resize(h512.OUTPUT_SIZE);
-    
-    std::vector<unsigned char> out_small;
-    out_small.resize(h160.OUTPUT_SIZE);
-    
-    h256.Write(input.data(), input.size());
-    h256.Finalize(&out[0]);
-    h256.Reset();
-    
-    h512.Write(out.data(), h256.OUTPUT_SIZE);
-    h512.Finalize(&out[0]);
-
-
-    h160.Write(out.data(), h512.OUTPUT_SIZE / 2);
-    h160.Finalize(&out_small[0]);
-    h160.Reset();
-
-    h256.Write(out_small.data(), h160.OUTPUT_SIZE);
-
-    h160.Write(out.data() + h512.OUTPUT_SIZE / 2, h512.OUTPUT_SIZE / 2);
-    h160.Finalize(&out_small[0]);
-
-    out.resize(h256.OUTPUT_SIZE);
-    h256.Write(out_small.data(), h160.OUTPUT_SIZE);
-    h256.Finalize(&out[0]);
-
-    uint256 result(out);
+    CRIPEMD160().Write(out512, CSHA512::OUTPUT_SIZE / 2).Finalize(out160);
+    h256.Write(out160, CRIPEMD160::OUTPUT_SIZE);
+    CRIPEMD160().Write(out512 + CSHA512::OUTPUT_SIZE / 2, CSHA512::OUTPUT_SIZE / 2).Finalize(out160);
+    h256.Write(out160, CRIPEMD160::OUTPUT_SIZE);
+    h256.Finalize(result.begin());
     return result;
 }
 
+/** PoWHashBatch, continuing the first SHA-256 from midstate unless it is NULL. */
+static void PoWHashBatchFrom(const uint32_t* midstate, size_t nPrefixLen, const unsigned char* pinput, size_t nLen, size_t nCount, uint256* phashes)
+{
+    const multihash::Implementation& impl = multihash::Best();
+    const size_t nLanes = impl.nLanes;
+
+    // Same chain as PoWHash, for nLanes inputs at a time.
+    std::vector<unsigned char> vPartial;
+    unsigned char out256[multihash::MAX_LANES * CSHA256::OUTPUT_SIZE];
+    unsigned char out512[multihash::MAX_LANES * CSHA512::OUTPUT_SIZE];
+    unsigned char half[2][multihash::MAX_LANES * CSHA512::OUTPUT_SIZE / 2];
+    unsigned char out160[2][multihash::MAX_LANES * CRIPEMD160::OUTPUT_SIZE];
+    unsigned char cat[multihash::MAX_LANES * 2 * CRIPEMD160::OUTPUT_SIZE];
+    for (size_t nDone = 0; nDone < nCount; nDone += nLanes) {
+        const unsigned char* in = pinput + nDone * nLen;
+        size_t nLeft = std::min(nLanes, nCount - nDone);
+        if (nLeft < nLanes) {
+            // Fill the unused lanes of the last pass with copies of the last input.
+            vPartial.resize(nLanes * nLen);
+            memcpy(&vPartial[0], in, nLeft * nLen);
+            for (size_t l = nLeft; l < nLanes; l++)
+                memcpy(&vPartial[l * nLen], in + (nLeft - 1) * nLen, nLen);
+            in = &vPartial[0];
+        }
+
+        if (midstate)
+            impl.sha256Midstate(out256, midstate, nPrefixLen, in, nLen);
+        else
+            impl.sha256(out256, in, nLen);
+        impl.sha256(out256, out256, CSHA256::OUTPUT_SIZE);
+        impl.sha512(out512, out256, CSHA256::OUTPUT_SIZE);
+        for (size_t l = 0; l < nLanes; l++) {
+            memcpy(half[0] + l * 32, out512 + l * 64, 32);
+            memcpy(half[1] + l * 32, out512 + l * 64 + 32, 32);
+        }
+        impl.ripemd160(out160[0], half[0], 32);
+        impl.ripemd160(out160[1], half[1], 32);
+        for (size_t l = 0; l < nLanes; l++) {
+            memcpy(cat + l * 40, out160[0] + l * 20, 20);
+            memcpy(cat + l * 40 + 20, out160[1] + l * 20, 20);
+        }
+        impl.sha256(out256, cat, 40);
+        impl.sha256(out256, out256, CSHA256::OUTPUT_SIZE);
+
+        for (size_t l = 0; l < nLeft; l++)
+            memcpy(phashes[nDone + l].begin(), out256 + l * 32, 32);
+    }
+}
+
+void PoWHashBatch(const unsigned char* pinput, size_t nLen, size_t nCount, uint256* phashes)
+{
+    PoWHashBatchFrom(NULL, 0, pinput, nLen, nCount, phashes);
+}
+
+void PoWHashBatchMidstate(const uint32_t* midstate, size_t nPrefixLen, const unsigned char* pinput, size_t nLen, size_t nCount, uint256* phashes)
+{
+    PoWHashBatchFrom(midstate, nPrefixLen, pinput, nLen, nCount, phashes);
+}
+
+size_t PoWHashLanes()
+{
+    return multihash::Best().nLanes;
+}
+
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash)
 {
     // The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
@@ -120,3 +171,98 @@ void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char he
     num[3] = (nChild >>  0) & 0xFF;
     CHMAC_SHA512(chainCode.begin(), chainCode.size()).Write(&header, 1).Write(data, 32).Write(num, 4).Finalize(output);
 }
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; \
+    v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; \
+    v2 = ROTL(v2, 32); \
+} while (0)
+
+CSipHasher::CSipHasher(uint64_t k0, uint64_t k1)
+{
+    v[0] = 0x736f6d6570736575ULL ^ k0;
+    v[1] = 0x646f72616e646f6dULL ^ k1;
+    v[2] = 0x6c7967656e657261ULL ^ k0;
+    v[3] = 0x7465646279746573ULL ^ k1;
+    count = 0;
+}
+
+CSipHasher& CSipHasher::Write(uint64_t data)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+    v3 ^= data;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= data;
+
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+    v[3] = v3;
+
+    count++;
+    return *this;
+}
+
+uint64_t CSipHasher::Finalize() const
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+    uint64_t t = ((uint64_t)count) << 59;
+    v3 ^= t;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= t;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
+{
+    /* Specialized implementation for efficiency */
+    uint64_t d = val.GetUint64(0);
+
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1 ^ d;
+
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(1);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(2);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(3);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    v3 ^= ((uint64_t)4) << 59;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= ((uint64_t)4) << 59;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
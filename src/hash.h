@@ -169,8 +169,52 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
 
 uint256 PoWHash(const std::vector<unsigned char>& input);
 
+/** PoWHash of nLen bytes at pinput, without any heap allocation. */
+uint256 PoWHash(const unsigned char* pinput, size_t nLen);
+
+/**
+ * Compute PoWHash for nCount inputs of nLen bytes each, stored back to back
+ * in pinput, writing the results to phashes. Runs the multi-lane hash
+ * kernels supported by this CPU, PoWHashLanes() inputs at a time.
+ */
+void PoWHashBatch(const unsigned char* pinput, size_t nLen, size_t nCount, uint256* phashes);
+
+/**
+ * PoWHashBatch for inputs that all start with the same nPrefixLen bytes (a
+ * multiple of 64): midstate is the SHA-256 state after that prefix (see
+ * CSHA256::GetMidstate), and pinput holds only the nLen bytes after it.
+ */
+void PoWHashBatchMidstate(const uint32_t* midstate, size_t nPrefixLen, const unsigned char* pinput, size_t nLen, size_t nCount, uint256* phashes);
+
+/** Number of inputs PoWHashBatch hashes in one pass; batches should be a multiple of it. */
+size_t PoWHashLanes();
+
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
+/** SipHash-2-4, can only be used for full 64-bit words. */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    int count;
+
+public:
+    /** Construct a SipHash calculator initialized with 128-bit key (k0, k1) */
+    CSipHasher(uint64_t k0, uint64_t k1);
+    /** Hash a 64-bit integer worth of data
+     *  It is treated as if this was the little-endian interpretation of 8 bytes.
+     */
+    CSipHasher& Write(uint64_t data);
+    /** Compute the 64-bit SipHash-2-4 of the data written so far. The object remains untouched. */
+    uint64_t Finalize() const;
+};
+
+/** Optimized SipHash-2-4 implementation for uint256, equivalent to
+ *  CSipHasher(k0, k1).Write(val.GetUint64(0))...Write(val.GetUint64(3)).Finalize(),
+ *  which is how compact block short transaction IDs are computed.
+ */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 #endif // BITCOIN_HASH_H
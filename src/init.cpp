@@ -14,6 +14,8 @@
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "blockfilemap.h"
+#include "coinsprefetch.h"
 #include "compat/sanity.h"
 #include "consensus/validation.h"
 #include "httpserver.h"
@@ -94,6 +96,7 @@ enum BindFlags {
 };
 
 static const char* FEE_ESTIMATES_FILENAME="fee_estimates.dat";
+static bool fDumpMempoolLater = false;
 CClientUIInterface uiInterface; // Declared but not defined in ui_interface.h
 
 //////////////////////////////////////////////////////////////////////////////
@@ -199,6 +202,9 @@ void Shutdown()
     StopTorControl();
     UnregisterNodeSignals(GetNodeSignals());
 
+    if (fDumpMempoolLater)
+        DumpMempool();
+
     if (fFeeEstimatesInitialized)
     {
         boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
@@ -217,6 +223,8 @@ void Shutdown()
         }
         delete pcoinsTip;
         pcoinsTip = NULL;
+        delete pcoinsPrefetch;
+        pcoinsPrefetch = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
         delete pcoinsdbview;
@@ -225,6 +233,8 @@ void Shutdown()
         pblocktree = NULL;
         delete pclaimTrie;
         pclaimTrie = NULL;
+        delete pblockfilemap;
+        pblockfilemap = NULL;
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -318,6 +328,9 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+#ifndef WIN32
+    strUsage += HelpMessageOpt("-blockfilemaps=<n>", strprintf(_("Keep up to <n> recently read block and undo files mapped into memory (default: %u)"), DEFAULT_BLOCK_FILE_MAPS));
+#endif
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
@@ -342,10 +355,13 @@ std::string HelpMessage(HelpMessageMode mode)
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), BITCOIN_PID_FILENAME));
 #endif
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
+    strUsage += HelpMessageOpt("-prefetchcoins", strprintf(_("Read the inputs of downloaded blocks from the coin database ahead of connecting them during initial block download (default: %u)"), DEFAULT_PREFETCH_COINS));
     strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode is incompatible with -txindex and -rescan. "
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current blk000??.dat files on startup"));
+    strUsage += HelpMessageOpt("-reindex-claimtrie", _("Rebuild the claim trie from the blocks on disk on startup, keeping the block index and chain state"));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
@@ -375,7 +391,13 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-port=<port>", strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), Params(CBaseChainParams::MAIN).GetDefaultPort(), Params(CBaseChainParams::TESTNET).GetDefaultPort()));
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), DEFAULT_PROXYRANDOMIZE));
+    strUsage += HelpMessageOpt("-servethreads=<n>", strprintf(_("Number of threads serving blocks and transactions requested by peers (0 = serve them from the message handler thread, default: %d)"), DEFAULT_SERVE_THREADS));
     strUsage += HelpMessageOpt("-seednode=<ip>", _("Connect to a node to retrieve peer addresses, and disconnect"));
+#ifdef HAVE_SYS_EPOLL_H
+    strUsage += HelpMessageOpt("-socketevents=<mode>", strprintf(_("Socket events mode, which must be one of: %s (default: %s)"), "select, epoll", DEFAULT_SOCKET_EVENTS));
+#else
+    strUsage += HelpMessageOpt("-socketevents=<mode>", strprintf(_("Socket events mode, which must be one of: %s (default: %s)"), "select", DEFAULT_SOCKET_EVENTS));
+#endif
     strUsage += HelpMessageOpt("-timeout=<n>", strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT));
     strUsage += HelpMessageOpt("-torcontrol=<ip>:<port>", strprintf(_("Tor control port to use if onion listening enabled (default: %s)"), DEFAULT_TOR_CONTROL));
     strUsage += HelpMessageOpt("-torpassword=<pass>", _("Tor control port password (default: empty)"));
@@ -422,7 +444,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-limitdescendantcount=<n>", strprintf("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)", DEFAULT_DESCENDANT_LIMIT));
         strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u).", DEFAULT_DESCENDANT_SIZE_LIMIT));
     }
-    string debugCategories = "addrman, alert, bench, coindb, db, lock, rand, rpc, selectcoins, mempool, mempoolrej, net, proxy, prune, http, libevent, tor, zmq"; // Don't translate these and qt below
+    string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, lock, rand, rpc, selectcoins, mempool, mempoolrej, net, proxy, prune, http, libevent, tor, zmq"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
         debugCategories += ", qt";
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
@@ -439,6 +461,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-logtimemicros", strprintf("Add microsecond precision to debug timestamps (default: %u)", DEFAULT_LOGTIMEMICROS));
         strUsage += HelpMessageOpt("-mocktime=<n>", "Replace actual time with <n> seconds since epoch (default: 0)");
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", DEFAULT_LIMITFREERELAY));
+        strUsage += HelpMessageOpt("-reindexthreads=<n>", strprintf("Set the number of threads reading block files during -reindex (1 to %d, 0 = auto, default: %d)", MAX_REINDEX_THREADS, DEFAULT_REINDEX_THREADS));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", DEFAULT_RELAYPRIORITY));
         strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
         strUsage += HelpMessageOpt("-maxtipage=<n>", strprintf("Maximum tip age in seconds to consider node in initial block download (default: %u)", DEFAULT_MAX_TIP_AGE));
@@ -484,6 +507,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-rpcthreads=<n>", strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_HTTP_THREADS));
     if (showDebug) {
         strUsage += HelpMessageOpt("-rpcworkqueue=<n>", strprintf("Set the depth of the work queue to service RPC calls (default: %d)", DEFAULT_HTTP_WORKQUEUE));
+        strUsage += HelpMessageOpt("-rpcbatchthreads=<n>", strprintf("Set the number of threads to run the requests of JSON-RPC batches in parallel, 0 = off (default: %d)", DEFAULT_RPC_BATCH_THREADS));
+        strUsage += HelpMessageOpt("-rpcbatchconcurrency=<n>", strprintf("Maximum number of threads, including the one that received it, to run one batch on (default: %d)", DEFAULT_RPC_BATCH_CONCURRENCY));
         strUsage += HelpMessageOpt("-rpcservertimeout=<n>", strprintf("Timeout during HTTP requests (default: %d)", DEFAULT_HTTP_SERVER_TIMEOUT));
     }
 
@@ -577,18 +602,7 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(chainparams, file, &pos);
-            nFile++;
-        }
+        ReindexBlockFiles(chainparams);
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -627,6 +641,13 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL) && !ShutdownRequested()) {
+        LoadMempool();
+        // Only write mempool.dat back once it has been read completely, so an
+        // early shutdown does not truncate it.
+        fDumpMempoolLater = !ShutdownRequested();
+    }
 }
 
 /** Sanity checks
@@ -845,8 +866,21 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     int nUserMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
     nMaxConnections = std::max(nUserMaxConnections, 0);
 
+    std::string strSocketEvents = GetArg("-socketevents", DEFAULT_SOCKET_EVENTS);
+    if (strSocketEvents == "epoll") {
+#ifdef HAVE_SYS_EPOLL_H
+        fSocketEpoll = true;
+#else
+        return InitError(_("-socketevents=epoll is not supported on this platform"));
+#endif
+    } else if (strSocketEvents != "select") {
+        return InitError(strprintf(_("Unknown -socketevents mode: '%s'"), strSocketEvents));
+    }
+
     // Trim requested connection counts, to fit into system limitations
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    // (select() cannot wait on descriptors past FD_SETSIZE)
+    if (!fSocketEpoll)
+        nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -1026,6 +1060,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
 
+    int nServeThreads = std::max(0, std::min((int)GetArg("-servethreads", DEFAULT_SERVE_THREADS), MAX_SERVE_THREADS));
+    LogPrintf("Using %u threads for serving getdata requests\n", nServeThreads);
+    StartServeThreads(threadGroup, nServeThreads);
+
     // Start the lightweight task scheduler thread
     CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &scheduler);
     threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
@@ -1185,6 +1223,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     // ********************************************************* Step 7: load block chain
 
     fReindex = GetBoolArg("-reindex", false);
+    bool fReindexClaimTrie = GetBoolArg("-reindex-claimtrie", false);
 
     // Upgrading to 0.8; hard-link the old blknnnn.dat files into /blocks/
     boost::filesystem::path blocksDir = GetDataDir() / "blocks";
@@ -1213,6 +1252,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+#ifndef WIN32
+    int nBlockFileMaps = GetArg("-blockfilemaps", DEFAULT_BLOCK_FILE_MAPS);
+    if (nBlockFileMaps > 0)
+        pblockfilemap = new CBlockFileMap(nBlockFileMaps);
+#endif
+
     // cache size calculations
     int64_t nTotalCache = (GetArg("-dbcache", nDefaultDbCache) << 20);
     nTotalCache = std::max(nTotalCache, nMinDbCache << 20); // total cache cannot be less than nMinDbCache
@@ -1232,6 +1277,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     bool fLoaded = false;
     while (!fLoaded) {
         bool fReset = fReindex;
+        bool fClaimTrieError = false;
         std::string strLoadError;
 
         uiInterface.InitMessage(_("Loading block index..."));
@@ -1241,6 +1287,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinsPrefetch;
                 delete pcoinsdbview;
                 delete pcoinscatcher;
                 delete pblocktree;
@@ -1249,8 +1296,18 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
-                pcoinsTip = new CCoinsViewCache(pcoinscatcher);
-                pclaimTrie = new CClaimTrie(false, fReindex);
+                if (GetBoolArg("-prefetchcoins", DEFAULT_PREFETCH_COINS)) {
+                    pcoinsPrefetch = new CCoinsViewPrefetch(pcoinscatcher, pcoinsdbview);
+                    pcoinsTip = new CCoinsViewCache(pcoinsPrefetch);
+                } else {
+                    pcoinsPrefetch = NULL;
+                    pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                }
+                // Finish a rebuild of the claim trie that was interrupted
+                bool fReindexingClaimTrie = false;
+                if (pblocktree->ReadFlag("reindexclaimtrie", fReindexingClaimTrie) && fReindexingClaimTrie)
+                    fReindexClaimTrie = true;
+                pclaimTrie = new CClaimTrie(false, fReindex || fReindexClaimTrie);
 
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
@@ -1284,9 +1341,20 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 if (!pclaimTrie->ReadFromDisk(true))
                 {
                     strLoadError = _("Error loading the claim trie from disk");
+                    fClaimTrieError = true;
                     break;
                 }
 
+                if (fReindexClaimTrie && !fReindex) {
+                    uiInterface.InitMessage(_("Rebuilding the claim trie..."));
+                    if (!RebuildClaimTrie(chainparams)) {
+                        strLoadError = _("Error rebuilding the claim trie");
+                        break;
+                    }
+                    if (fRequestShutdown)
+                        break;
+                }
+
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
                 // in the past, but is now trying to run unpruned.
                 if (fHavePruned && !fPruneMode) {
@@ -1325,7 +1393,22 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             fLoaded = true;
         } while(false);
 
-        if (!fLoaded) {
+        if (!fLoaded && fRequestShutdown) {
+            // the claim trie rebuild was interrupted
+            break;
+        } else if (!fLoaded && fClaimTrieError && !fReindexClaimTrie) {
+            // the block database is fine, so first suggest rebuilding just the claim trie
+            bool fRet = uiInterface.ThreadSafeMessageBox(
+                strLoadError + ".\n\n" + _("Do you want to rebuild the claim trie now?"),
+                "", CClientUIInterface::MSG_ERROR | CClientUIInterface::BTN_ABORT);
+            if (fRet) {
+                fReindexClaimTrie = true;
+                fRequestShutdown = false;
+            } else {
+                LogPrintf("Aborted claim trie rebuild. Exiting.\n");
+                return false;
+            }
+        } else if (!fLoaded) {
             // first suggest a reindex
             if (!fReset) {
                 bool fRet = uiInterface.ThreadSafeMessageBox(
@@ -1354,6 +1437,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    if (pcoinsPrefetch) {
+        boost::function<void()> prefetchLoop = boost::bind(&CCoinsViewPrefetch::ThreadPrefetch, pcoinsPrefetch);
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "prefetch", prefetchLoop));
+    }
+
     boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
     CAutoFile est_filein(fopen(est_path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
     // Allowed to fail as this file IS missing on first startup.
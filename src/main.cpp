@@ -7,12 +7,16 @@
 
 #include "addrman.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
+#include "blockfilemap.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinsprefetch.h"
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "getdataqueue.h"
 #include "hash.h"
 #include "init.h"
 #include "merkleblock.h"
@@ -41,9 +45,12 @@
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/function.hpp>
 #include <boost/math/distributions/poisson.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -197,9 +204,13 @@ namespace {
         uint256 hash;
         CBlockIndex* pindex;     //!< Optional.
         bool fValidatedHeaders;  //!< Whether this block has validated headers at the time of request.
+        boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
+    /** Stack of nodes which we have set to announce using compact blocks */
+    list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
@@ -266,6 +277,10 @@ struct CNodeState {
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
     bool fPreferHeaders;
+    //! Whether this peer wants invs or cmpctblocks (when possible) for block announcements.
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer will send us cmpctblocks if we request them
+    bool fProvidesHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -282,6 +297,8 @@ struct CNodeState {
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
     }
 };
 
@@ -334,6 +351,7 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     }
     EraseOrphansFor(nodeid);
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
@@ -373,14 +391,26 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns false, still setting pit, if the block was already in flight from the same peer.
+// pit will only be valid as long as the same cs_main lock is being held.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator **pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    // Short-circuit most stuff in case it's from the same node
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit)
+            *pit = &itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
     QueuedBlock newentry = {hash, pindex, pindex != NULL};
+    if (pit)
+        newentry.partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
@@ -391,7 +421,39 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     if (state->nBlocksInFlightValidHeaders == 1 && pindex != NULL) {
         nPeersWithValidatedDownloads++;
     }
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    itInFlight = mapBlocksInFlight.insert(std::make_pair(hash, std::make_pair(nodeid, it))).first;
+    if (pit)
+        *pit = &itInFlight->second.second;
+    return true;
+}
+
+// Requires cs_main.
+// Ask the peer to announce new blocks to us as compact blocks, as it seems
+// to be the first to provide them; only the last few such peers are kept.
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom) {
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+    BOOST_FOREACH(const NodeId nodeid, lNodesAnnouncingHeaderAndIDs)
+        if (nodeid == pfrom->GetId())
+            return;
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_ANNOUNCERS) {
+        // As per BIP152, we only get 3 of our peers to announce
+        // blocks using compact encodings.
+        NodeId nodeStop = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeStop) {
+                pnode->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+    }
+    fAnnounceUsingCMPCTBLOCK = true;
+    pfrom->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
 }
 
 /** Check whether the last unknown block a peer advertised is not yet known. */
@@ -597,6 +659,8 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewPrefetch *pcoinsPrefetch = NULL;
+CBlockFileMap *pblockfilemap = NULL;
 CClaimTrie *pclaimTrie = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
@@ -1016,7 +1080,7 @@ std::string FormatStateMessage(const CValidationState &state)
 }
 
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
-                              bool* pfMissingInputs, CFeeRate* txFeeRate, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
+                              bool* pfMissingInputs, int64_t nAcceptTime, CFeeRate* txFeeRate, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
                               std::vector<uint256>& vHashTxnToUncache)
 {
     const uint256 hash = tx.GetHash();
@@ -1179,7 +1243,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
             }
         }
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOps, lp);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOps, lp);
         unsigned int nSize = entry.GetTxSize();
         if (txFeeRate) {
             *txFeeRate = CFeeRate(nFees, nSize);
@@ -1230,6 +1294,11 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                 REJECT_HIGHFEE, "absurdly-high-fee",
                 strprintf("%d > %d", nFees, nAbsurdFee));
 
+        // The ancestor walk needs pool.cs. Holding it from here on also
+        // keeps allConflicting below complete; the subsequent RemoveStaged()
+        // and addUnchecked() calls don't guarantee mempool consistency for us.
+        LOCK(pool.cs);
+
         // Calculate in-mempool ancestors, up to a limit.
         CTxMemPool::setEntries setAncestors;
         size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
@@ -1265,10 +1334,6 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         uint64_t nConflictingCount = 0;
         CTxMemPool::setEntries allConflicting;
 
-        // If we don't hold the lock allConflicting might be incomplete; the
-        // subsequent RemoveStaged() and addUnchecked() calls don't guarantee
-        // mempool consistency for us.
-        LOCK(pool.cs);
         if (setConflicts.size())
         {
             CFeeRate newFeeRate(nModifiedFees, nSize);
@@ -1431,11 +1496,11 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
     return true;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, CFeeRate* txFeeRate, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, CFeeRate* txFeeRate, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
 {
     std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, txFeeRate, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, txFeeRate, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
     if (!res) {
         BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
             pcoinsTip->Uncache(hashTx);
@@ -1443,6 +1508,12 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return res;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, CFeeRate* txFeeRate, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), txFeeRate, fOverrideMempoolLimit, nAbsurdFee);
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1535,10 +1606,23 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+/** Deserialize the block stored at pos, without checking anything about it. */
+static bool ReadBlockFromDiskUnchecked(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
+    CMappedRecord record;
+    if (pblockfilemap && pblockfilemap->MapRecord(pos, "blk", 0, record)) {
+        try {
+            CBufferReader filein(record.begin, record.end, SER_DISK, CLIENT_VERSION);
+            filein >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+        return true;
+    }
+
     // Open history file to read
     CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -1551,6 +1635,13 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
     }
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+{
+    if (!ReadBlockFromDiskUnchecked(block, pos))
+        return false;
 
     // Check the header
     if (!CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
@@ -1559,13 +1650,60 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hash)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), consensusParams))
+    if (!ReadBlockFromDiskUnchecked(block, pos))
         return false;
-    if (block.GetHash() != pindex->GetBlockHash())
-        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
-                pindex->ToString(), pindex->GetBlockPos().ToString());
+
+    // The indexed header passed CheckProofOfWork when it was accepted or
+    // loaded, so matching its hash vouches for the header as well, without
+    // paying for the PoW hash again.
+    if (block.GetHash() != hash)
+        return error("ReadBlockFromDisk: GetHash() doesn't match index for %s at %s", hash.ToString(), pos.ToString());
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    return ReadBlockFromDisk(block, pindex->GetBlockPos(), pindex->GetBlockHash());
+}
+
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vBlock, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    // The block is preceded by the message start and its size (see WriteBlockToDisk).
+    CDiskBlockPos hpos = pos;
+    if (hpos.nPos < 8)
+        return error("%s: invalid block position %s", __func__, pos.ToString());
+    hpos.nPos -= 8;
+
+    CMappedRecord record;
+    if (pblockfilemap && pblockfilemap->MapRecord(pos, "blk", 0, record)) {
+        if (memcmp(record.begin - 8, messageStart, MESSAGE_START_SIZE) != 0)
+            return error("%s: block start mismatch at %s", __func__, pos.ToString());
+        if (record.end - record.begin > MAX_BLOCK_SIZE)
+            return error("%s: block size %u too large at %s", __func__, (unsigned int)(record.end - record.begin), pos.ToString());
+        vBlock.assign(record.begin, record.end);
+        return true;
+    }
+
+    CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blkStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blkStart) >> nSize;
+        if (memcmp(blkStart, messageStart, MESSAGE_START_SIZE) != 0)
+            return error("%s: block start mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_BLOCK_SIZE)
+            return error("%s: block size %u too large at %s", __func__, nSize, pos.ToString());
+        vBlock.resize(nSize);
+        filein.read((char*)begin_ptr(vBlock), nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
     return true;
 }
 
@@ -1977,19 +2115,31 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenBlockFile failed", __func__);
-
-    // Read block
     uint256 hashChecksum;
-    try {
-        filein >> blockundo;
-        filein >> hashChecksum;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    CMappedRecord record;
+    if (pblockfilemap && pblockfilemap->MapRecord(pos, "rev", sizeof(hashChecksum), record)) {
+        try {
+            CBufferReader filein(record.begin, record.end, SER_DISK, CLIENT_VERSION);
+            filein >> blockundo;
+            filein >> hashChecksum;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s", __func__, e.what());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: OpenBlockFile failed", __func__);
+
+        // Read block
+        try {
+            filein >> blockundo;
+            filein >> hashChecksum;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Verify checksum
@@ -2242,6 +2392,10 @@ void static FlushBlockFile(bool fFinalize = false)
         FileCommit(fileOld);
         fclose(fileOld);
     }
+
+    // Mappings of the files may now reach past their end
+    if (fFinalize && pblockfilemap)
+        pblockfilemap->Invalidate(nLastBlockFile);
 }
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
@@ -2368,6 +2522,126 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
+/**
+ * Apply the claim operations of a transaction to the trie cache: spend the
+ * claims and supports among the outputs it spends, given in vSpent with
+ * their heights (a NULL script for an output that is not needed), and add
+ * those among its outputs. The valid heights of the spent claims and
+ * supports go in mClaimUndoHeights, by input.
+ */
+static void ApplyTxClaims(const CTransaction& tx, const std::vector<std::pair<const CScript*, int> >& vSpent, int nHeight, CClaimTrieCache& trieCache, std::map<unsigned int, unsigned int>& mClaimUndoHeights)
+{
+    // To handle claim updates, stick all claims found in the inputs into a map of
+    // name: (txhash, nOut). When running through the outputs, if any claim's
+    // name is found in the map, send the name's txhash and nOut to the trie cache,
+    // and then remove the name: (txhash, nOut) mapping from the map.
+    // If there are two or more claims in the inputs with the same name, only
+    // use the first.
+
+    typedef std::vector<std::pair<std::string, uint160> > spentClaimsType;
+    spentClaimsType spentClaims;
+    
+    for (unsigned int i = 0; i < tx.vin.size(); ++i)
+    {
+        const CTxIn& txin = tx.vin[i];
+
+        int op;
+        std::vector<std::vector<unsigned char> > vvchParams;
+        if (vSpent[i].first && DecodeClaimScript(*vSpent[i].first, op, vvchParams))
+        {
+            if (op == OP_CLAIM_NAME || op == OP_UPDATE_CLAIM)
+            {
+                uint160 claimId;
+                if (op == OP_CLAIM_NAME)
+                {
+                    assert(vvchParams.size() == 2);
+                    claimId = ClaimIdHash(txin.prevout.hash, txin.prevout.n);
+                }
+                else if (op == OP_UPDATE_CLAIM)
+                {
+                    assert(vvchParams.size() == 3);
+                    claimId = uint160(vvchParams[1]);
+                }
+                std::string name(vvchParams[0].begin(), vvchParams[0].end());
+                int nValidAtHeight;
+                LogPrintf("%s: Removing %s from the claim trie. Tx: %s, nOut: %d\n", __func__, name, txin.prevout.hash.GetHex(), txin.prevout.n);
+                if (trieCache.spendClaim(name, COutPoint(txin.prevout.hash, txin.prevout.n), vSpent[i].second, nValidAtHeight))
+                {
+                    mClaimUndoHeights[i] = nValidAtHeight;
+                    std::pair<std::string, uint160> entry(name, claimId);
+                    spentClaims.push_back(entry);
+                }
+            }
+            else if (op == OP_SUPPORT_CLAIM)
+            {
+                assert(vvchParams.size() == 2);
+                std::string name(vvchParams[0].begin(), vvchParams[0].end());
+                uint160 supportedClaimId(vvchParams[1]);
+                int nValidAtHeight;
+                LogPrintf("%s: Removing support for %s in %s. Tx: %s, nOut: %d, removed txid: %s\n", __func__, supportedClaimId.ToString(), name, txin.prevout.hash.ToString(), txin.prevout.n,tx.GetHash().ToString());
+                if (trieCache.spendSupport(name, COutPoint(txin.prevout.hash, txin.prevout.n), vSpent[i].second, nValidAtHeight))
+                {
+                    mClaimUndoHeights[i] = nValidAtHeight;
+                }
+            }
+        }
+    }
+    
+    for (unsigned int i = 0; i < tx.vout.size(); ++i)
+    {
+        const CTxOut& txout = tx.vout[i];
+
+        int op;
+        std::vector<std::vector<unsigned char> > vvchParams;
+        if (DecodeClaimScript(txout.scriptPubKey, op, vvchParams))
+        {
+            if (op == OP_CLAIM_NAME)
+            {
+                assert(vvchParams.size() == 2);
+                std::string name(vvchParams[0].begin(), vvchParams[0].end());
+                LogPrintf("%s: Inserting %s into the claim trie. Tx: %s, nOut: %d\n", __func__, name, tx.GetHash().GetHex(), i);
+                if (!trieCache.addClaim(name, COutPoint(tx.GetHash(), i), ClaimIdHash(tx.GetHash(), i), txout.nValue, nHeight))
+                {
+                    LogPrintf("%s: Something went wrong inserting the claim\n", __func__);
+                }
+            }
+            else if (op == OP_UPDATE_CLAIM)
+            {
+                assert(vvchParams.size() == 3);
+                std::string name(vvchParams[0].begin(), vvchParams[0].end());
+                uint160 claimId(vvchParams[1]);
+                LogPrintf("%s: Got a claim update. Name: %s, claimId: %s, new txid: %s, nOut: %d\n", __func__, name, claimId.GetHex(), tx.GetHash().GetHex(), i);
+                spentClaimsType::iterator itSpent;
+                for (itSpent = spentClaims.begin(); itSpent != spentClaims.end(); ++itSpent)
+                {
+                    if (itSpent->first == name && itSpent->second == claimId)
+                    {
+                        break;
+                    }
+                }
+                if (itSpent != spentClaims.end())
+                {
+                    spentClaims.erase(itSpent);
+                    if (!trieCache.addClaim(name, COutPoint(tx.GetHash(), i), claimId, txout.nValue, nHeight))
+                    {
+                        LogPrintf("%s: Something went wrong updating the claim\n", __func__);
+                    }
+                }
+            }
+            else if (op == OP_SUPPORT_CLAIM)
+            {
+                assert(vvchParams.size() == 2);
+                std::string name(vvchParams[0].begin(), vvchParams[0].end());
+                uint160 supportedClaimId(vvchParams[1]);
+                if (!trieCache.addSupport(name, COutPoint(tx.GetHash(), i), txout.nValue, supportedClaimId, nHeight))
+                {
+                    LogPrintf("%s: Something went wrong inserting the support\n", __func__);
+                }
+            }
+        }
+    }
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, CClaimTrieCache& trieCache, bool fJustCheck)
 {
     const CChainParams& chainparams = Params();
@@ -2539,117 +2813,15 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                     tx.GetHash().ToString(), FormatStateMessage(state));
             control.Add(vChecks);
 
-            // To handle claim updates, stick all claims found in the inputs into a map of
-            // name: (txhash, nOut). When running through the outputs, if any claim's
-            // name is found in the map, send the name's txhash and nOut to the trie cache,
-            // and then remove the name: (txhash, nOut) mapping from the map.
-            // If there are two or more claims in the inputs with the same name, only
-            // use the first.
-
-            typedef std::vector<std::pair<std::string, uint160> > spentClaimsType;
-            spentClaimsType spentClaims;
-            
-            for (unsigned int i = 0; i < tx.vin.size(); ++i)
+            std::vector<std::pair<const CScript*, int> > vSpent;
+            vSpent.reserve(tx.vin.size());
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
             {
-                const CTxIn& txin = tx.vin[i];
                 const CCoins* coins = view.AccessCoins(txin.prevout.hash);
                 assert(coins);
-
-                int op;
-                std::vector<std::vector<unsigned char> > vvchParams;
-                if (DecodeClaimScript(coins->vout[txin.prevout.n].scriptPubKey, op, vvchParams))
-                {
-                    if (op == OP_CLAIM_NAME || op == OP_UPDATE_CLAIM)
-                    {
-                        uint160 claimId;
-                        if (op == OP_CLAIM_NAME)
-                        {
-                            assert(vvchParams.size() == 2);
-                            claimId = ClaimIdHash(txin.prevout.hash, txin.prevout.n);
-                        }
-                        else if (op == OP_UPDATE_CLAIM)
-                        {
-                            assert(vvchParams.size() == 3);
-                            claimId = uint160(vvchParams[1]);
-                        }
-                        std::string name(vvchParams[0].begin(), vvchParams[0].end());
-                        int nValidAtHeight;
-                        LogPrintf("%s: Removing %s from the claim trie. Tx: %s, nOut: %d\n", __func__, name, txin.prevout.hash.GetHex(), txin.prevout.n);
-                        if (trieCache.spendClaim(name, COutPoint(txin.prevout.hash, txin.prevout.n), coins->nHeight, nValidAtHeight))
-                        {
-                            mClaimUndoHeights[i] = nValidAtHeight;
-                            std::pair<std::string, uint160> entry(name, claimId);
-                            spentClaims.push_back(entry);
-                        }
-                    }
-                    else if (op == OP_SUPPORT_CLAIM)
-                    {
-                        assert(vvchParams.size() == 2);
-                        std::string name(vvchParams[0].begin(), vvchParams[0].end());
-                        uint160 supportedClaimId(vvchParams[1]);
-                        int nValidAtHeight;
-                        LogPrintf("%s: Removing support for %s in %s. Tx: %s, nOut: %d, removed txid: %s\n", __func__, supportedClaimId.ToString(), name, txin.prevout.hash.ToString(), txin.prevout.n,tx.GetHash().ToString());
-                        if (trieCache.spendSupport(name, COutPoint(txin.prevout.hash, txin.prevout.n), coins->nHeight, nValidAtHeight))
-                        {
-                            mClaimUndoHeights[i] = nValidAtHeight;
-                        }
-                    }
-                }
-            }
-            
-            for (unsigned int i = 0; i < tx.vout.size(); ++i)
-            {
-                const CTxOut& txout = tx.vout[i];
-
-                int op;
-                std::vector<std::vector<unsigned char> > vvchParams;
-                if (DecodeClaimScript(txout.scriptPubKey, op, vvchParams))
-                {
-                    if (op == OP_CLAIM_NAME)
-                    {
-                        assert(vvchParams.size() == 2);
-                        std::string name(vvchParams[0].begin(), vvchParams[0].end());
-                        LogPrintf("%s: Inserting %s into the claim trie. Tx: %s, nOut: %d\n", __func__, name, tx.GetHash().GetHex(), i);
-                        if (!trieCache.addClaim(name, COutPoint(tx.GetHash(), i), ClaimIdHash(tx.GetHash(), i), txout.nValue, pindex->nHeight))
-                        {
-                            LogPrintf("%s: Something went wrong inserting the claim\n", __func__);
-                        }
-                    }
-                    else if (op == OP_UPDATE_CLAIM)
-                    {
-                        assert(vvchParams.size() == 3);
-                        std::string name(vvchParams[0].begin(), vvchParams[0].end());
-                        uint160 claimId(vvchParams[1]);
-                        LogPrintf("%s: Got a claim update. Name: %s, claimId: %s, new txid: %s, nOut: %d\n", __func__, name, claimId.GetHex(), tx.GetHash().GetHex(), i);
-                        spentClaimsType::iterator itSpent;
-                        for (itSpent = spentClaims.begin(); itSpent != spentClaims.end(); ++itSpent)
-                        {
-                            if (itSpent->first == name && itSpent->second == claimId)
-                            {
-                                break;
-                            }
-                        }
-                        if (itSpent != spentClaims.end())
-                        {
-                            spentClaims.erase(itSpent);
-                            if (!trieCache.addClaim(name, COutPoint(tx.GetHash(), i), claimId, txout.nValue, pindex->nHeight))
-                            {
-                                LogPrintf("%s: Something went wrong updating the claim\n", __func__);
-                            }
-                        }
-                    }
-                    else if (op == OP_SUPPORT_CLAIM)
-                    {
-                        assert(vvchParams.size() == 2);
-                        std::string name(vvchParams[0].begin(), vvchParams[0].end());
-                        uint160 supportedClaimId(vvchParams[1]);
-                        if (!trieCache.addSupport(name, COutPoint(tx.GetHash(), i), txout.nValue, supportedClaimId, pindex->nHeight))
-                        {
-                            LogPrintf("%s: Something went wrong inserting the support\n", __func__);
-                        }
-                    }
-                }
+                vSpent.push_back(std::make_pair(&coins->vout[txin.prevout.n].scriptPubKey, coins->nHeight));
             }
+            ApplyTxClaims(tx, vSpent, pindex->nHeight, trieCache, mClaimUndoHeights);
         }
 
         CTxUndo undoDummy;
@@ -2990,6 +3162,8 @@ static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
 static int64_t nTimePostConnect = 0;
+static uint64_t nPrefetchHits = 0;
+static int64_t nTimePrefetchSaved = 0;
 
 /**
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
@@ -3023,6 +3197,14 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         mapBlockSource.erase(pindexNew->GetBlockHash());
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
+        if (pcoinsPrefetch) {
+            uint64_t nHits;
+            int64_t nSaved;
+            pcoinsPrefetch->GetStats(nHits, nSaved);
+            LogPrint("bench", "  - Prefetched inputs: %u (%.2fms stall saved) [%u, %.2fs]\n", (unsigned)(nHits - nPrefetchHits), (nSaved - nTimePrefetchSaved) * 0.001, (unsigned)nHits, nSaved * 0.000001);
+            nPrefetchHits = nHits;
+            nTimePrefetchSaved = nSaved;
+        }
         assert(view.Flush());
         assert(trieCache.flush());
     }
@@ -3667,7 +3849,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fCheckPOW=true)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3686,7 +3868,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state))
+        if (!CheckBlockHeader(block, state, fCheckPOW))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -3721,7 +3903,8 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
 
     CBlockIndex *&pindex = *ppindex;
 
-    if (!AcceptBlockHeader(block, state, chainparams, &pindex))
+    // A block that passed CheckBlock already had its proof of work checked
+    if (!AcceptBlockHeader(block, state, chainparams, &pindex, !block.fChecked))
         return false;
 
     // Try to process all requested blocks that we don't have, but only
@@ -3807,6 +3990,9 @@ bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, c
         CheckBlockIndex(chainparams.GetConsensus());
         if (!ret)
             return error("%s: AcceptBlock FAILED", __func__);
+        // Warm up the inputs of blocks that are still waiting to be connected.
+        if (pcoinsPrefetch && pindex && pindex->pprev != chainActive.Tip() && IsInitialBlockDownload())
+            pcoinsPrefetch->Enqueue(*pblock);
     }
 
     if (!ActivateBestChain(state, chainparams, pblock))
@@ -3893,6 +4079,8 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        if (pblockfilemap)
+            pblockfilemap->Invalidate(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -4124,6 +4312,125 @@ bool static LoadBlockIndexDB()
     return true;
 }
 
+static bool IsClaimScriptPrefix(const CScript& script)
+{
+    return !script.empty() && (script[0] == OP_CLAIM_NAME || script[0] == OP_SUPPORT_CLAIM || script[0] == OP_UPDATE_CLAIM);
+}
+
+bool RebuildClaimTrie(const CChainParams& chainparams)
+{
+    LOCK(cs_main);
+    if (chainActive.Tip() == NULL)
+        return true;
+    if (!pclaimTrie->empty())
+        return error("%s: the claim trie is not empty", __func__);
+    if (!pblocktree->WriteFlag("reindexclaimtrie", true))
+        return error("%s: failed to write to the block index database", __func__);
+
+    LogPrintf("Rebuilding the claim trie from %d blocks\n", chainActive.Height() + 1);
+    uiInterface.ShowProgress(_("Rebuilding the claim trie..."), 0);
+    int64_t nStart = GetTimeMillis();
+    int64_t nLastWrite = nStart;
+    int nLastWriteHeight = 0;
+    // Heights of the outputs with a claim script that are not spent yet, as
+    // the undo data only records the height of an output that was the last
+    // one unspent of its transaction
+    std::map<COutPoint, int> mapClaimHeights;
+    for (CBlockIndex* pindex = chainActive.Genesis(); pindex; pindex = chainActive.Next(pindex))
+    {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+        {
+            LogPrintf("%s: interrupted at height %d, rebuilding again on the next start\n", __func__, pindex->nHeight);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
+            return error("%s: failed to read block %s at height %d; the claim trie can only be rebuilt from unpruned blocks", __func__, pindex->GetBlockHash().ToString(), pindex->nHeight);
+        CBlockUndo blockUndo;
+        if (pindex->pprev)
+        {
+            CDiskBlockPos pos = pindex->GetUndoPos();
+            if (pos.IsNull() || !UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash()))
+                return error("%s: failed to read the undo data of block %s at height %d", __func__, pindex->GetBlockHash().ToString(), pindex->nHeight);
+            if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
+                return error("%s: undo data of block %s does not match the block", __func__, pindex->GetBlockHash().ToString());
+        }
+
+        // Only transactions that create or spend claim scripts are applied;
+        // their scripts are not verified
+        CClaimTrieCache trieCache(pclaimTrie);
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+        {
+            const CTransaction& tx = block.vtx[i];
+            bool fClaims = false;
+            std::vector<std::pair<const CScript*, int> > vSpent(tx.vin.size(), std::make_pair((const CScript*)NULL, 0));
+            if (!tx.IsCoinBase())
+            {
+                const CTxUndo& txundo = blockUndo.vtxundo[i - 1];
+                if (txundo.vprevout.size() != tx.vin.size())
+                    return error("%s: undo data of transaction %s does not match it", __func__, tx.GetHash().ToString());
+                for (unsigned int j = 0; j < tx.vin.size(); j++)
+                {
+                    const CScript& scriptSpent = txundo.vprevout[j].txout.scriptPubKey;
+                    if (!IsClaimScriptPrefix(scriptSpent))
+                        continue;
+                    std::map<COutPoint, int>::iterator it = mapClaimHeights.find(tx.vin[j].prevout);
+                    if (it == mapClaimHeights.end())
+                        return error("%s: transaction %s spends an unknown claim output", __func__, tx.GetHash().ToString());
+                    vSpent[j] = std::make_pair(&scriptSpent, it->second);
+                    mapClaimHeights.erase(it);
+                    fClaims = true;
+                }
+            }
+            for (unsigned int j = 0; j < tx.vout.size(); j++)
+            {
+                if (IsClaimScriptPrefix(tx.vout[j].scriptPubKey))
+                {
+                    mapClaimHeights[COutPoint(tx.GetHash(), j)] = pindex->nHeight;
+                    fClaims = true;
+                }
+            }
+            // Claims are only processed outside of the coinbase, see ConnectBlock
+            if (fClaims && !tx.IsCoinBase())
+            {
+                std::map<unsigned int, unsigned int> mClaimUndoHeights;
+                ApplyTxClaims(tx, vSpent, pindex->nHeight, trieCache, mClaimUndoHeights);
+            }
+        }
+
+        CBlockUndo undoDummy;
+        if (!trieCache.incrementBlock(undoDummy.insertUndo, undoDummy.expireUndo, undoDummy.insertSupportUndo, undoDummy.expireSupportUndo, undoDummy.takeoverHeightUndo))
+            return error("%s: failed to move the claim trie to height %d", __func__, pindex->nHeight);
+        if (trieCache.getMerkleHash() != pindex->hashClaimTrie)
+            return error("%s: the merkle root of the claim trie does not match block %s at height %d (actual=%s vs block=%s)", __func__,
+                         pindex->GetBlockHash().ToString(), pindex->nHeight, trieCache.getMerkleHash().GetHex(), pindex->hashClaimTrie.GetHex());
+        trieCache.setBestBlock(pindex->GetBlockHash());
+        if (!trieCache.flush())
+            return error("%s: failed to update the claim trie", __func__);
+
+        int64_t nNow = GetTimeMillis();
+        if (nNow > nLastWrite + (int64_t)CLAIMTRIE_REBUILD_WRITE_INTERVAL * 1000 || pindex == chainActive.Tip())
+        {
+            if (!pclaimTrie->WriteToDisk())
+                return error("%s: failed to write to the claim trie database", __func__);
+            LogPrintf("Rebuilt the claim trie to height %d (%.1f blocks/s)\n", pindex->nHeight,
+                      1000.0 * (pindex->nHeight - nLastWriteHeight) / std::max<int64_t>(nNow - nLastWrite, 1));
+            uiInterface.ShowProgress(_("Rebuilding the claim trie..."), std::max(1, std::min(99, (int)(pindex->nHeight * 100.0 / std::max(chainActive.Height(), 1)))));
+            nLastWrite = nNow;
+            nLastWriteHeight = pindex->nHeight;
+        }
+    }
+
+    if (!pblocktree->WriteFlag("reindexclaimtrie", false))
+        return error("%s: failed to write to the block index database", __func__);
+    int64_t nElapsed = std::max<int64_t>(GetTimeMillis() - nStart, 1);
+    LogPrintf("Rebuilt the claim trie from %d blocks in %dms (%.1f blocks/s)\n", chainActive.Height() + 1, nElapsed, 1000.0 * (chainActive.Height() + 1) / nElapsed);
+    uiInterface.ShowProgress("", 100);
+    return true;
+}
+
 CVerifyDB::CVerifyDB()
 {
     uiInterface.ShowProgress(_("Verifying blocks..."), 0);
@@ -4335,100 +4642,313 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+namespace {
+
+/** A block found in a block file */
+struct CFileBlock
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    boost::shared_ptr<const CBlock> pblock;
+    uint256 hash;
+    CDiskBlockPos pos;
+    unsigned int nSize;
+};
 
-    int nLoaded = 0;
-    try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
+/** Called for every block ScanBlockFile finds; returning false stops the scan */
+typedef boost::function<bool (const CFileBlock&)> BlockFileVisitor;
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
+/**
+ * Scan a block file for blocks: every message start followed by a plausible
+ * size and a block that deserializes. Blocks are reported with their
+ * position in the file, for file number nFile.
+ */
+void ScanBlockFile(const CChainParams& chainparams, FILE* fileIn, int nFile, const BlockFileVisitor& visitor)
+{
+    // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+    CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+    uint64_t nRewind = blkdat.GetPos();
+    while (!blkdat.eof()) {
+        boost::this_thread::interruption_point();
+
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[MESSAGE_START_SIZE];
+            blkdat.FindByte(chainparams.MessageStart()[0]);
+            nRewind = blkdat.GetPos()+1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            break;
+        }
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            blkdat.SetLimit(nBlockPos + nSize);
+            blkdat.SetPos(nBlockPos);
+            boost::shared_ptr<CBlock> pblock(new CBlock());
+            blkdat >> *pblock;
+            nRewind = blkdat.GetPos();
+
+            CFileBlock fileBlock;
+            fileBlock.pblock = pblock;
+            fileBlock.hash = pblock->GetHash();
+            fileBlock.pos = CDiskBlockPos(nFile, nBlockPos);
+            fileBlock.nSize = nSize;
+            if (!visitor(fileBlock))
                 break;
-            }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        }
+    }
+}
 
-                // process in case the block isn't known yet
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0)) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, chainparams, NULL, &block, true, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+/** Blocks of the block files whose parent is not known yet, by parent (only used for reindex) */
+std::multimap<uint256, CFileBlock> mapBlocksUnknownParent;
+/** Memory used by the blocks kept in mapBlocksUnknownParent */
+uint64_t nBlocksUnknownParentSize = 0;
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
-                        {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, chainparams, NULL, &block, true, &it->second))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                    }
+/**
+ * Hand a block found in a block file to ProcessNewBlock, and then its
+ * descendants that were found before it. With fReindex set, the block is
+ * stored where it was found, and one whose parent is not known yet is put
+ * aside until the parent turns up. Returns false on an error that should
+ * stop the import.
+ */
+bool ImportBlock(const CChainParams& chainparams, const CFileBlock& fileBlock, bool fReindex, int& nLoaded)
+{
+    const uint256& hash = fileBlock.hash;
+    CDiskBlockPos pos = fileBlock.pos;
+    CDiskBlockPos* dbp = fReindex ? &pos : NULL;
+
+    // detect out of order blocks, and store them for later
+    if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(fileBlock.pblock->hashPrevBlock) == mapBlockIndex.end()) {
+        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                fileBlock.pblock->hashPrevBlock.ToString());
+        if (fReindex) {
+            // Keep the block itself while that is cheap, else read it again later
+            CFileBlock parked = fileBlock;
+            if (nBlocksUnknownParentSize + fileBlock.nSize <= MAX_REINDEX_UNKNOWN_PARENT_SIZE)
+                nBlocksUnknownParentSize += fileBlock.nSize;
+            else
+                parked.pblock.reset();
+            mapBlocksUnknownParent.insert(std::make_pair(fileBlock.pblock->hashPrevBlock, parked));
+        }
+        return true;
+    }
+
+    // process in case the block isn't known yet
+    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+        CValidationState state;
+        if (ProcessNewBlock(state, chainparams, NULL, fileBlock.pblock.get(), true, dbp))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+        LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    }
+
+    // Recursively process earlier encountered successors of this block
+    deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, CFileBlock>::iterator, std::multimap<uint256, CFileBlock>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, CFileBlock>::iterator it = range.first;
+            boost::shared_ptr<const CBlock> pblock = it->second.pblock;
+            if (pblock) {
+                nBlocksUnknownParentSize -= it->second.nSize;
+            } else {
+                boost::shared_ptr<CBlock> pblockRead(new CBlock());
+                if (ReadBlockFromDisk(*pblockRead, it->second.pos, chainparams.GetConsensus()))
+                    pblock = pblockRead;
+            }
+            if (pblock) {
+                LogPrintf("%s: Processing out of order child %s of %s\n", __func__, it->second.hash.ToString(),
+                        head.ToString());
+                CValidationState dummy;
+                if (ProcessNewBlock(dummy, chainparams, NULL, pblock.get(), true, &it->second.pos))
+                {
+                    nLoaded++;
+                    queue.push_back(it->second.hash);
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
         }
+    }
+    return true;
+}
+
+bool ImportFileBlock(const CChainParams& chainparams, const CFileBlock& fileBlock, bool fReindex, int& nLoaded)
+{
+    try {
+        return ImportBlock(chainparams, fileBlock, fReindex, nLoaded);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+    }
+    return true;
+}
+
+/**
+ * Reads the block files for -reindex on a few threads while the thread that
+ * owns it connects their blocks, file by file and in the order they were
+ * stored. The readers also run the context-free checks (proof of work,
+ * merkle root, transactions), which CheckBlock records on the block, so
+ * only the contextual checks and the connection are left to the connecting
+ * thread.
+ *
+ * Every file being read has a queue of its own, bounded in size, and
+ * readers stay within a window of files ahead of the one being connected.
+ * A reader working ahead therefore never holds up the file that is needed.
+ */
+class CReindexPipeline
+{
+private:
+    struct CFileQueue
+    {
+        std::deque<CFileBlock> blocks;
+        //! Size of the blocks in the queue
+        uint64_t nSize;
+        //! The reader has reached the end of the file, or found it missing
+        bool fDone;
+        //! The file is no longer wanted; the reader stops and removes the queue
+        bool fDiscard;
+
+        CFileQueue() : nSize(0), fDone(false), fDiscard(false) {}
+    };
+
+    const CChainParams& chainparams;
+    boost::mutex mutex;
+    //! Readers wait on this for room in their queue or a file to read
+    boost::condition_variable condRead;
+    //! The connecting thread waits on this for blocks
+    boost::condition_variable condConnect;
+    //! Next file for a reader to take
+    int nNextFile;
+    //! File whose blocks are being connected
+    int nConnectFile;
+    //! First file that does not exist, once a reader has found it
+    int nEndFile;
+    //! Readers do not start on files more than this far past nConnectFile
+    int nWindow;
+    std::map<int, CFileQueue> mapQueues;
+
+    bool PushBlock(int nFile, const CFileBlock& fileBlock)
+    {
+        // CheckBlock is context-free; the result is left to ProcessNewBlock
+        CValidationState state;
+        CheckBlock(*fileBlock.pblock, state);
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CFileQueue& queue = mapQueues[nFile];
+        while (!queue.fDiscard && !queue.blocks.empty() && queue.nSize + fileBlock.nSize > MAX_REINDEX_QUEUE_SIZE)
+            condRead.wait(lock);
+        if (queue.fDiscard)
+            return false;
+        queue.blocks.push_back(fileBlock);
+        queue.nSize += fileBlock.nSize;
+        condConnect.notify_all();
+        return true;
+    }
+
+public:
+    CReindexPipeline(const CChainParams& chainparamsIn, int nReaders) :
+        chainparams(chainparamsIn), nNextFile(0), nConnectFile(0), nEndFile(std::numeric_limits<int>::max()), nWindow(2 * nReaders) {}
+
+    //! Reader thread: read files until there are none left
+    void ThreadRead()
+    {
+        while (true) {
+            int nFile;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (nNextFile < nEndFile && nNextFile >= nConnectFile + nWindow)
+                    condRead.wait(lock);
+                if (nNextFile >= nEndFile)
+                    return;
+                nFile = nNextFile++;
+                mapQueues[nFile];
+            }
+
+            CDiskBlockPos pos(nFile, 0);
+            FILE *file = NULL;
+            if (boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
+                file = OpenBlockFile(pos, true); // This error is logged in OpenBlockFile
+            if (file) {
+                LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+                try {
+                    ScanBlockFile(chainparams, file, nFile, boost::bind(&CReindexPipeline::PushBlock, this, nFile, _1));
+                } catch (const std::runtime_error& e) {
+                    AbortNode(std::string("System error: ") + e.what());
+                }
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!file)
+                nEndFile = std::min(nEndFile, nFile);
+            CFileQueue& queue = mapQueues[nFile];
+            if (queue.fDiscard)
+                mapQueues.erase(nFile);
+            else
+                queue.fDone = true;
+            condConnect.notify_all();
+            condRead.notify_all();
+        }
+    }
+
+    //! Take the next block of file nFile, waiting for it. Returns false at the end of the file.
+    bool PopBlock(int nFile, CFileBlock& fileBlock)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CFileQueue& queue = mapQueues[nFile];
+        while (queue.blocks.empty() && !queue.fDone)
+            condConnect.wait(lock);
+        if (queue.blocks.empty())
+            return false;
+        fileBlock = queue.blocks.front();
+        queue.blocks.pop_front();
+        queue.nSize -= fileBlock.nSize;
+        condRead.notify_all();
+        return true;
+    }
+
+    //! Move on from file nFile. Returns false if it was the first missing file.
+    bool FinishFile(int nFile)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CFileQueue& queue = mapQueues[nFile];
+        if (queue.fDone) {
+            mapQueues.erase(nFile);
+        } else {
+            queue.fDiscard = true;
+            queue.blocks.clear();
+        }
+        nConnectFile = nFile + 1;
+        condRead.notify_all();
+        return nFile < nEndFile;
+    }
+};
+
+} // anon namespace
+
+bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        ScanBlockFile(chainparams, fileIn, dbp ? dbp->nFile : 0, boost::bind(&ImportFileBlock, boost::cref(chainparams), _1, dbp != NULL, boost::ref(nLoaded)));
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
@@ -4437,6 +4957,41 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
     return nLoaded > 0;
 }
 
+void ReindexBlockFiles(const CChainParams& chainparams)
+{
+    int64_t nStart = GetTimeMillis();
+    int nReaders = GetArg("-reindexthreads", DEFAULT_REINDEX_THREADS);
+    if (nReaders <= 0)
+        nReaders = std::max(GetNumCores() - 1, 1);
+    nReaders = std::min(nReaders, MAX_REINDEX_THREADS);
+    LogPrintf("Reindexing with %d block file readers\n", nReaders);
+
+    CReindexPipeline pipeline(chainparams, nReaders);
+    boost::thread_group readers;
+    for (int i = 0; i < nReaders; i++)
+        readers.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "reindex", boost::function<void()>(boost::bind(&CReindexPipeline::ThreadRead, &pipeline))));
+
+    int nLoaded = 0;
+    try {
+        for (int nFile = 0; ; nFile++) {
+            CFileBlock fileBlock;
+            while (pipeline.PopBlock(nFile, fileBlock)) {
+                if (!ImportFileBlock(chainparams, fileBlock, true, nLoaded))
+                    break;
+            }
+            if (!pipeline.FinishFile(nFile))
+                break;
+        }
+    } catch (...) {
+        readers.interrupt_all();
+        readers.join_all();
+        throw;
+    }
+    readers.interrupt_all();
+    readers.join_all();
+    LogPrintf("Reindexed %i blocks in %dms\n", nLoaded, GetTimeMillis() - nStart);
+}
+
 void static CheckBlockIndex(const Consensus::Params& consensusParams)
 {
     if (!fCheckBlockIndex) {
@@ -4706,14 +5261,39 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+namespace {
+/**
+ * The last block sent in full, as a ready-to-send message: right after a
+ * block is announced, most peers ask for that same block.
+ */
+CCriticalSection cs_lastBlockMessage;
+uint256 hashLastBlockMessage;
+CSharedMessage lastBlockMessage;
+} // anon namespace
+
+CSharedMessage GetBlockMessage(const uint256& hash, const CDiskBlockPos& pos)
+{
+    {
+        LOCK(cs_lastBlockMessage);
+        if (hashLastBlockMessage == hash)
+            return lastBlockMessage;
+    }
+    std::vector<unsigned char> vRawBlock;
+    if (!ReadRawBlockFromDisk(vRawBlock, pos, Params().MessageStart()))
+        return CSharedMessage();
+    CSharedMessage msg = MakeSharedMessage(NetMsgType::BLOCK, CFlatData(vRawBlock));
+    LOCK(cs_lastBlockMessage);
+    hashLastBlockMessage = hash;
+    lastBlockMessage = msg;
+    return msg;
+}
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -4724,48 +5304,83 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
+                // Decide under cs_main, but read and send the block without it.
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                bool fSendCmpct = false;
+                CBlockIndex* pindex = NULL;
+                CDiskBlockPos pos;
+                uint256 hashContinueTip;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        pindex = mi->second;
+                        if (chainActive.Contains(pindex)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = pindex->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - pindex->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, consensusParams) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
                         }
                     }
+                    // disconnect node in case we have reached the outbound limit for serving historical blocks
+                    // never disconnect whitelisted nodes
+                    static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
+                    if (send && CNode::OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - pindex->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+                    {
+                        LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+
+                        //disconnect node
+                        pfrom->fDisconnect = true;
+                        send = false;
+                    }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    send = send && (pindex->nStatus & BLOCK_HAVE_DATA);
+                    if (send) {
+                        pos = pindex->GetBlockPos();
+                        // Older blocks are unlikely to be reconstructed from
+                        // the peer's mempool; send those in full.
+                        fSendCmpct = inv.type == MSG_CMPCT_BLOCK && pindex->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                        if (inv.hash == pfrom->hashContinue)
+                            hashContinueTip = chainActive.Tip()->GetBlockHash();
+                    }
                 }
-                // disconnect node in case we have reached the outbound limit for serving historical blocks
-                // never disconnect whitelisted nodes
-                static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
-                if (send && CNode::OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+                // Full blocks are sent exactly as stored, without
+                // deserializing and reserializing them.
+                bool fSendRaw = inv.type == MSG_BLOCK || (inv.type == MSG_CMPCT_BLOCK && !fSendCmpct);
+                CBlock block;
+                CSharedMessage blockMessage;
+                if (send && fSendRaw)
+                    blockMessage = GetBlockMessage(inv.hash, pos);
+                if (send && (fSendRaw ? !blockMessage : !ReadBlockFromDisk(block, pos, inv.hash)))
                 {
-                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
-
-                    //disconnect node
-                    pfrom->fDisconnect = true;
+                    // The block may have been pruned since we looked.
+                    LOCK(cs_main);
+                    if (pindex->nStatus & BLOCK_HAVE_DATA)
+                        assert(!"cannot load block from disk");
                     send = false;
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                if (send)
                 {
                     // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
+                    if (fSendRaw)
+                        pfrom->PushSharedMessage(NetMsgType::BLOCK, blockMessage);
+                    else if (fSendCmpct)
+                    {
+                        CBlockHeaderAndShortTxIDs cmpctblock(block);
+                        pfrom->PushMessage(NetMsgType::CMPCTBLOCK, cmpctblock);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
@@ -4794,7 +5409,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
                         pfrom->PushMessage(NetMsgType::INV, vInv);
                         pfrom->hashContinue.SetNull();
                     }
@@ -4806,9 +5421,9 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<uint256, CTransaction>::iterator mi = mapRelay.find(inv.hash);
+                    map<uint256, CSharedMessage>::iterator mi = mapRelay.find(inv.hash);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage(inv.GetCommand(), (*mi).second);
                         pushed = true;
                     }
                 }
@@ -4827,7 +5442,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4846,6 +5461,178 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
+namespace {
+CGetDataQueue getDataQueue;
+int nServeThreads = 0;
+} // anon namespace
+
+/** Serve pfrom's pending getdata requests, on a -servethreads worker if there are any. */
+void static ServeGetData(CNode* pfrom, const Consensus::Params& consensusParams)
+{
+    if (nServeThreads > 0)
+        getDataQueue.Push(pfrom);
+    else
+        ProcessGetData(pfrom, consensusParams);
+}
+
+void ThreadServeGetData()
+{
+    RenameThread("bitcoin-getdata");
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    while (true)
+    {
+        CNode* pnode = getDataQueue.Pop();
+        bool fMore = false;
+        bool fDrained = false;
+        {
+            LOCK(pnode->cs_vRecvMsg);
+            if (!pnode->fDisconnect) {
+                ProcessGetData(pnode, consensusParams);
+                fDrained = pnode->vRecvGetData.empty();
+                fMore = !fDrained && pnode->nSendSize < SendBufferSize();
+            }
+        }
+        getDataQueue.Done(pnode, fMore);
+        // The message handler waits for the getdata queue to drain before
+        // processing the peer's next message. If it stopped on a full send
+        // buffer instead, SocketSendData wakes the handler once there is
+        // room again.
+        if (fDrained)
+            WakeMessageHandler();
+        boost::this_thread::interruption_point();
+    }
+}
+
+void StartServeThreads(boost::thread_group& threadGroup, int nThreads)
+{
+    nServeThreads = nThreads;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(&ThreadServeGetData);
+}
+
+/**
+ * Handle a compact block under cs_main. When every transaction of the block
+ * was available, fProcessBLOCKTXN is set and blockTxnMsg holds an empty
+ * BLOCKTXN message for it; when the block should be treated as a header
+ * announcement, fRevertToHeaderProcessing is set and vHeadersMsg holds a
+ * HEADERS message. Both are processed by the caller once cs_main is released.
+ */
+void static ProcessCompactBlock(CNode* pfrom, const CBlockHeaderAndShortTxIDs& cmpctblock, const CChainParams& chainparams,
+                                bool& fProcessBLOCKTXN, CDataStream& blockTxnMsg, bool& fRevertToHeaderProcessing, CDataStream& vHeadersMsg)
+{
+    LOCK(cs_main);
+
+    if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+        // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+        if (!IsInitialBlockDownload())
+            pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256());
+        return;
+    }
+
+    CBlockIndex *pindex = NULL;
+    CValidationState state;
+    if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex, false)) {
+        int nDoS;
+        if (state.IsInvalid(nDoS)) {
+            if (nDoS > 0)
+                Misbehaving(pfrom->GetId(), nDoS);
+            LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+            return;
+        }
+    }
+
+    // If AcceptBlockHeader returned true, it set pindex
+    assert(pindex);
+    UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+
+    std::map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
+    bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+
+    if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+        return;
+
+    if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+            pindex->nTx != 0) { // We had this block at some point, but pruned it
+        if (fAlreadyInFlight) {
+            // We requested this block for some reason, but our mempool will probably be useless
+            // so we just grab the block via normal getdata
+            std::vector<CInv> vInv(1, CInv(MSG_BLOCK, cmpctblock.header.GetHash()));
+            pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+        }
+        return;
+    }
+
+    // If we're not close to tip yet, give up and let parallel block fetch work its magic
+    if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+        return;
+
+    CNodeState *nodestate = State(pfrom->GetId());
+
+    // We want to be a bit conservative just to be extra careful about DoS
+    // possibilities in compact block processing...
+    if (pindex->nHeight <= chainActive.Height() + 2) {
+        if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+             (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
+            list<QueuedBlock>::iterator *queuedBlockIt = NULL;
+            if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt)) {
+                if (!(*queuedBlockIt)->partialBlock)
+                    (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                else {
+                    // The block was already in flight using compact blocks from the same peer
+                    LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                    return;
+                }
+            }
+
+            PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
+            ReadStatus status = partialBlock.InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                return;
+            } else if (status == READ_STATUS_FAILED) {
+                // Duplicate txindexes, the block is now in-flight, so just request it
+                std::vector<CInv> vInv(1, CInv(MSG_BLOCK, cmpctblock.header.GetHash()));
+                pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+                return;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock.IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (req.indexes.empty()) {
+                // Everything was in our mempool: go straight to the BLOCKTXN code.
+                BlockTransactions txn;
+                txn.blockhash = cmpctblock.header.GetHash();
+                blockTxnMsg << txn;
+                fProcessBLOCKTXN = true;
+            } else {
+                req.blockhash = pindex->GetBlockHash();
+                pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+            }
+        }
+    } else {
+        if (fAlreadyInFlight) {
+            // We requested this block, but its far into the future, so our
+            // mempool will probably be useless - request the block normally
+            std::vector<CInv> vInv(1, CInv(MSG_BLOCK, cmpctblock.header.GetHash()));
+            pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+            return;
+        } else {
+            // If this was an announce-cmpctblock, we want the same treatment as a header message
+            std::vector<CBlock> headers;
+            headers.push_back(cmpctblock.header);
+            vHeadersMsg << headers;
+            fRevertToHeaderProcessing = true;
+        }
+    }
+
+    CheckBlockIndex(chainparams.GetConsensus());
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams)
 {
     RandAddSeedPerfmon();
@@ -5013,6 +5800,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // nodes)
             pfrom->PushMessage(NetMsgType::SENDHEADERS);
         }
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell our peer we are willing to provide version-1 cmpctblocks
+            // However, we do not request new block announcements using
+            // cmpctblock messages.
+            // We send this to non-NODE NETWORK peers as well, because
+            // they may wish to request compact blocks from us
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
     }
 
 
@@ -5088,6 +5885,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         State(pfrom->GetId())->fPreferHeaders = true;
     }
 
+    else if (strCommand == NetMsgType::SENDCMPCT)
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 1;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
 
     else if (strCommand == NetMsgType::INV)
     {
@@ -5181,7 +5990,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LogPrint("net", "received getdata for: %s peer=%d\n", vInv[0].ToString(), pfrom->id);
 
         pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
-        ProcessGetData(pfrom, chainparams.GetConsensus());
+        ServeGetData(pfrom, chainparams.GetConsensus());
     }
 
 
@@ -5235,46 +6044,107 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
-        LOCK(cs_main);
-        if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
-            LogPrint("net", "Ignoring getheaders from peer=%d because node is in initial block download\n", pfrom->id);
-            return true;
+        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
+        vector<CBlock> vHeaders;
+        {
+            LOCK(cs_main);
+            if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
+                LogPrint("net", "Ignoring getheaders from peer=%d because node is in initial block download\n", pfrom->id);
+                return true;
+            }
+
+            CNodeState *nodestate = State(pfrom->GetId());
+            CBlockIndex* pindex = NULL;
+            if (locator.IsNull())
+            {
+                // If locator is null, return the hashStop block
+                BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+                if (mi == mapBlockIndex.end())
+                    return true;
+                pindex = (*mi).second;
+            }
+            else
+            {
+                // Find the last block the caller has in the main chain
+                pindex = FindForkInGlobalIndex(chainActive, locator);
+                if (pindex)
+                    pindex = chainActive.Next(pindex);
+            }
+
+            int nLimit = MAX_HEADERS_RESULTS;
+            LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
+            for (; pindex; pindex = chainActive.Next(pindex))
+            {
+                vHeaders.push_back(pindex->GetBlockHeader());
+                if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+                    break;
+            }
+            // pindex can be NULL either if we sent chainActive.Tip() OR
+            // if our peer has chainActive.Tip() (and thus we are sending an empty
+            // headers message). In both cases it's safe to update
+            // pindexBestHeaderSent to be our tip.
+            nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         }
+        // Serialize the response after releasing cs_main.
+        pfrom->PushMessage(NetMsgType::HEADERS, vHeaders);
+    }
 
-        CNodeState *nodestate = State(pfrom->GetId());
-        CBlockIndex* pindex = NULL;
-        if (locator.IsNull())
+
+    else if (strCommand == NetMsgType::GETBLOCKTXN)
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        CDiskBlockPos pos;
+        bool fServeBlock = false;
         {
-            // If locator is null, return the hashStop block
-            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end())
+            LOCK(cs_main);
+            BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+            if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+                LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
                 return true;
-            pindex = (*mi).second;
+            }
+            CBlockIndex* pindex = it->second;
+
+            if (pindex->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+                // If an older block is requested (should never happen in practice,
+                // but can happen in tests) send a block response instead of a
+                // blocktxn response. Sending a full block response instead of a
+                // small blocktxn response is preferable in the case where a peer
+                // might maliciously send lots of getblocktxn requests to trigger
+                // expensive disk reads, because it will require the peer to
+                // actually receive all the data read from disk over the network.
+                LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+                fServeBlock = true;
+            } else {
+                pos = pindex->GetBlockPos();
+            }
         }
-        else
-        {
-            // Find the last block the caller has in the main chain
-            pindex = FindForkInGlobalIndex(chainActive, locator);
-            if (pindex)
-                pindex = chainActive.Next(pindex);
+        if (fServeBlock) {
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ServeGetData(pfrom, chainparams.GetConsensus());
+            return true;
         }
 
-        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
-        vector<CBlock> vHeaders;
-        int nLimit = MAX_HEADERS_RESULTS;
-        LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex))
-        {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
+        // Read the block outside cs_main, like ProcessGetData does; it may
+        // have been pruned in the meantime.
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pos, req.blockhash)) {
+            LogPrint("net", "Could not read block %s for getblocktxn from peer=%d\n", req.blockhash.ToString(), pfrom->id);
+            return true;
         }
-        // pindex can be NULL either if we sent chainActive.Tip() OR
-        // if our peer has chainActive.Tip() (and thus we are sending an empty
-        // headers message). In both cases it's safe to update
-        // pindexBestHeaderSent to be our tip.
-        nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
-        pfrom->PushMessage(NetMsgType::HEADERS, vHeaders);
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage(NetMsgType::BLOCKTXN, resp);
     }
 
 
@@ -5416,6 +6286,80 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == NetMsgType::CMPCTBLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        // As for headers, check the proof of work outside cs_main.
+        if (!CheckProofOfWork(cmpctblock.header.GetPoWHash(), cmpctblock.header.nBits, chainparams.GetConsensus())) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 50);
+            return error("invalid header received via cmpctblock: proof of work failed for %s", cmpctblock.header.GetHash().ToString());
+        }
+
+        // Handed on to the BLOCKTXN or HEADERS code after cs_main is released
+        bool fProcessBLOCKTXN = false;
+        CDataStream blockTxnMsg(SER_NETWORK, PROTOCOL_VERSION);
+        bool fRevertToHeaderProcessing = false;
+        CDataStream vHeadersMsg(SER_NETWORK, PROTOCOL_VERSION);
+        ProcessCompactBlock(pfrom, cmpctblock, chainparams, fProcessBLOCKTXN, blockTxnMsg, fRevertToHeaderProcessing, vHeadersMsg);
+
+        if (fProcessBLOCKTXN)
+            return ProcessMessage(pfrom, NetMsgType::BLOCKTXN, blockTxnMsg, nTimeReceived, chainparams);
+
+        if (fRevertToHeaderProcessing)
+            return ProcessMessage(pfrom, NetMsgType::HEADERS, vHeadersMsg, nTimeReceived, chainparams);
+    }
+
+    else if (strCommand == NetMsgType::BLOCKTXN && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+            if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                    it->second.first != pfrom->GetId()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
+            ReadStatus status = partialBlock.FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to getdata now :(
+                std::vector<CInv> invs(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage(NetMsgType::GETDATA, invs);
+                return true;
+            }
+        }
+
+        // Don't hold cs_main when we call into ProcessNewBlock. The block is
+        // still marked in flight from this peer, so it counts as requested.
+        CValidationState state;
+        ProcessNewBlock(state, chainparams, pfrom, &block, false, NULL);
+        int nDoS;
+        if (state.IsInvalid(nDoS)) {
+            assert (state.GetRejectCode() < REJECT_INTERNAL); // Blocks are never rejected with internal reject codes
+            pfrom->PushMessage(NetMsgType::REJECT, (string)NetMsgType::BLOCK, (unsigned char)state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+            if (nDoS > 0) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+    }
+
+
     else if (strCommand == NetMsgType::HEADERS && !fImporting && !fReindex) // Ignore headers received while importing
     {
         std::vector<CBlockHeader> headers;
@@ -5432,6 +6376,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Check the proof of work of the whole message at once, and outside
+        // cs_main; AcceptBlockHeader can then skip it.
+        std::vector<uint256> vPoWHashes;
+        GetPoWHashes(headers, vPoWHashes);
+        for (unsigned int n = 0; n < nCount; n++) {
+            if (!CheckProofOfWork(vPoWHashes[n], headers[n].nBits, chainparams.GetConsensus())) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), 50);
+                return error("invalid header received: proof of work failed for %s", headers[n].GetHash().ToString());
+            }
+        }
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -5446,7 +6402,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
+            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast, false)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -5509,6 +6465,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                             pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
                 }
                 if (vGetData.size() > 0) {
+                    if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1 && mapBlocksInFlight.size() == 1 && pindexLast->pprev->IsValid(BLOCK_VALID_CHAIN)) {
+                        // We seem to be rather well-synced, so it appears pfrom was the first to provide us
+                        // with this block! Let's get them to announce using compact blocks in the future.
+                        MaybeSetPeerAsAnnouncingHeaderAndIDs(nodestate, pfrom);
+                        // In any case, we want to download using a compact block, not a regular one
+                        vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+                    }
                     pfrom->PushMessage(NetMsgType::GETDATA, vGetData);
                 }
             }
@@ -5804,8 +6767,9 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
-    if (!pfrom->vRecvGetData.empty())
-        ProcessGetData(pfrom, chainparams.GetConsensus());
+    // Leave getdata for when SocketSendData makes room in the send buffer
+    if (!pfrom->vRecvGetData.empty() && pfrom->nSendSize < SendBufferSize())
+        ServeGetData(pfrom, chainparams.GetConsensus());
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -5850,10 +6814,10 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, computed as the data arrived
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = ReadLE32((unsigned char*)&hash);
+        const uint256& hash = msg.GetMessageHash();
+        unsigned int nChecksum = ReadLE32(hash.begin());
         if (nChecksum != hdr.nChecksum)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n", __func__,
@@ -5902,12 +6866,34 @@ bool ProcessMessages(CNode* pfrom)
     }
 
     // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
+    if (!pfrom->fDisconnect) {
+        for (std::deque<CNetMessage>::iterator itDone = pfrom->vRecvMsg.begin(); itDone != it; ++itDone)
+            pfrom->RecycleRecvBuffer(*itDone);
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
 
+namespace {
+/** The last block announced as a compact block, serialized once for every high-bandwidth peer. Protected by cs_main. */
+uint256 hashCmpctBlockCached;
+CSharedMessage cmpctBlockCached;
+
+// Requires cs_main.
+// Returns an empty message if the block cannot be read.
+CSharedMessage GetCompactBlockMessage(const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    if (hashCmpctBlockCached != pindex->GetBlockHash()) {
+        CBlock block;
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) || !ReadBlockFromDisk(block, pindex, consensusParams))
+            return CSharedMessage();
+        cmpctBlockCached = MakeSharedMessage(NetMsgType::CMPCTBLOCK, CBlockHeaderAndShortTxIDs(block));
+        hashCmpctBlockCached = pindex->GetBlockHash();
+    }
+    return cmpctBlockCached;
+}
+} // anon namespace
 
 bool SendMessages(CNode* pto)
 {
@@ -6048,7 +7034,9 @@ bool SendMessages(CNode* pto)
             // add all to the inv queue.
             LOCK(pto->cs_inventory);
             vector<CBlock> vHeaders;
-            bool fRevertToInv = (!state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            bool fRevertToInv = ((!state.fPreferHeaders &&
+                                 (!state.fPreferHeaderAndIDs || pto->vBlockHashesToAnnounce.size() > 1)) ||
+                                pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
             CBlockIndex *pBestIndex = NULL; // last header queued for delivery
             ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
 
@@ -6086,6 +7074,33 @@ bool SendMessages(CNode* pto)
                     }
                 }
             }
+            if (!fRevertToInv && !vHeaders.empty()) {
+                if (vHeaders.size() == 1 && state.fPreferHeaderAndIDs) {
+                    // We only send up to 1 block as header-and-ids, as otherwise
+                    // probably means we're doing an initial-ish-sync or they're slow
+                    LogPrint("net", "%s sending header-and-ids %s to peer %d\n", __func__,
+                            vHeaders.front().GetHash().ToString(), pto->id);
+                    CSharedMessage cmpctblock = GetCompactBlockMessage(pBestIndex, consensusParams);
+                    if (cmpctblock) {
+                        pto->PushSharedMessage(NetMsgType::CMPCTBLOCK, cmpctblock);
+                        state.pindexBestHeaderSent = pBestIndex;
+                    } else
+                        fRevertToInv = true;
+                } else if (state.fPreferHeaders) {
+                    if (vHeaders.size() > 1) {
+                        LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
+                                vHeaders.size(),
+                                vHeaders.front().GetHash().ToString(),
+                                vHeaders.back().GetHash().ToString(), pto->id);
+                    } else {
+                        LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
+                                vHeaders.front().GetHash().ToString(), pto->id);
+                    }
+                    pto->PushMessage(NetMsgType::HEADERS, vHeaders);
+                    state.pindexBestHeaderSent = pBestIndex;
+                } else
+                    fRevertToInv = true;
+            }
             if (fRevertToInv) {
                 // If falling back to using an inv, just try to inv the tip.
                 // The last entry in vBlockHashesToAnnounce was our tip at some point
@@ -6113,18 +7128,6 @@ bool SendMessages(CNode* pto)
                             pto->id, hashToAnnounce.ToString());
                     }
                 }
-            } else if (!vHeaders.empty()) {
-                if (vHeaders.size() > 1) {
-                    LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
-                            vHeaders.size(),
-                            vHeaders.front().GetHash().ToString(),
-                            vHeaders.back().GetHash().ToString(), pto->id);
-                } else {
-                    LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
-                            vHeaders.front().GetHash().ToString(), pto->id);
-                }
-                pto->PushMessage(NetMsgType::HEADERS, vHeaders);
-                state.pindexBestHeaderSent = pBestIndex;
             }
             pto->vBlockHashesToAnnounce.clear();
         }
@@ -6287,6 +7290,145 @@ ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::D
     return VersionBitsState(chainActive.Tip(), params, pos, versionbitscache);
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+static const std::string MEMPOOL_FILENAME = "mempool.dat";
+
+namespace {
+
+bool CompareTxMemPoolIterByDepth(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b)
+{
+    return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+}
+
+bool HasClaimOutput(const CTransaction& tx)
+{
+    BOOST_FOREACH(const CTxOut& txout, tx.vout) {
+        int op;
+        std::vector<std::vector<unsigned char> > vvchParams;
+        if (DecodeClaimScript(txout.scriptPubKey, op, vvchParams))
+            return true;
+    }
+    return false;
+}
+
+}
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / MEMPOOL_FILENAME).string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nStart = GetTimeMicros();
+    int64_t nNow = GetTime();
+    uint64_t nCount = 0, nFailed = 0, nExpired = 0, nAlready = 0, nClaims = 0;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return false;
+
+        // Deltas go in first, so prioritised transactions are accepted on
+        // their modified fee, just as they were before the restart.
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t nTotal;
+        file >> nTotal;
+        uiInterface.ShowProgress(_("Loading mempool..."), 0);
+        int nLastProgress = 0;
+        for (uint64_t i = 0; i < nTotal; i++) {
+            CTransaction tx;
+            int64_t nTime;
+            file >> tx;
+            file >> nTime;
+
+            if (nTime + nExpiryTimeout > nNow) {
+                CValidationState state;
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime, NULL)) {
+                    ++nCount;
+                    if (HasClaimOutput(tx))
+                        ++nClaims;
+                } else if (mempool.exists(tx.GetHash())) {
+                    ++nAlready;
+                } else {
+                    ++nFailed;
+                }
+            } else {
+                ++nExpired;
+            }
+
+            int nProgress = (int)((i + 1) * 100 / nTotal);
+            if (nProgress / 10 > nLastProgress / 10) {
+                LogPrintf("Loading mempool... %d%%\n", nProgress);
+                uiInterface.ShowProgress(_("Loading mempool..."), std::min(99, nProgress));
+            }
+            nLastProgress = nProgress;
+            if (ShutdownRequested()) {
+                uiInterface.ShowProgress("", 100);
+                return false;
+            }
+        }
+    } catch (const std::exception& e) {
+        uiInterface.ShowProgress("", 100);
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    uiInterface.ShowProgress("", 100);
+
+    LogPrintf("Imported mempool transactions from disk: %u successes (%u claim/support), %u failed, %u expired, %u already there (%.2fms)\n",
+        nCount, nClaims, nFailed, nExpired, nAlready, 0.001 * (GetTimeMicros() - nStart));
+    return true;
+}
+
+void DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    try {
+        boost::filesystem::path pathTmp = GetDataDir() / (MEMPOOL_FILENAME + ".new");
+        FILE* filestr = fopen(pathTmp.string().c_str(), "wb");
+        if (!filestr)
+            return;
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        uint64_t nWritten = 0;
+        {
+            LOCK(mempool.cs);
+            // Parents have fewer in-mempool ancestors than their children, so
+            // writing by ancestor count lets every transaction find its
+            // inputs when the file is read back.
+            std::vector<CTxMemPool::txiter> vEntries;
+            vEntries.reserve(mempool.mapTx.size());
+            for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+                vEntries.push_back(it);
+            std::sort(vEntries.begin(), vEntries.end(), CompareTxMemPoolIterByDepth);
+
+            file << MEMPOOL_DUMP_VERSION;
+            file << mempool.mapDeltas;
+            file << (uint64_t)vEntries.size();
+            BOOST_FOREACH(const CTxMemPool::txiter& it, vEntries) {
+                file << it->GetTx();
+                file << it->GetTime();
+            }
+            nWritten = vEntries.size();
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(pathTmp, GetDataDir() / MEMPOOL_FILENAME);
+        LogPrintf("Dumped mempool: %u transactions (%.2fms)\n", nWritten, 0.001 * (GetTimeMicros() - nStart));
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+    }
+}
+
 class CMainCleanup
 {
 public:
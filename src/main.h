@@ -34,6 +34,8 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CChainParams;
+class CBlockFileMap;
+class CCoinsViewPrefetch;
 class CInv;
 class CScriptCheck;
 class CTxMemPool;
@@ -67,6 +69,8 @@ static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -78,6 +82,18 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of block file reader threads for -reindex */
+static const int MAX_REINDEX_THREADS = 8;
+/** -reindexthreads default (0 = one less than the number of cores) */
+static const int DEFAULT_REINDEX_THREADS = 0;
+/** Size of the blocks a -reindex reader thread queues for one block file */
+static const unsigned int MAX_REINDEX_QUEUE_SIZE = 8 * 1000 * 1000;
+/** Size of the out of order blocks -reindex keeps in memory until their parent is found */
+static const unsigned int MAX_REINDEX_UNKNOWN_PARENT_SIZE = 64 * 1000 * 1000;
+/** Maximum number of getdata serving threads allowed */
+static const int MAX_SERVE_THREADS = 16;
+/** -servethreads default (number of threads serving getdata requests, 0 = the message handler) */
+static const int DEFAULT_SERVE_THREADS = 2;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -85,6 +101,13 @@ static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Maximum depth of blocks we're willing to serve as compact blocks to peers
+ *  when requested. For older blocks, a regular BLOCK response will be sent. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of blocks we're willing to respond to GETBLOCKTXN requests for. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers we ask to announce new blocks to us as compact blocks (BIP152 high-bandwidth mode). */
+static const unsigned int MAX_CMPCTBLOCK_ANNOUNCERS = 3;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
@@ -94,6 +117,8 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Time between writes of the claim trie while it is rebuilt, in seconds */
+static const unsigned int CLAIMTRIE_REBUILD_WRITE_INTERVAL = 30;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 /** Average delay between local address broadcasts in seconds. */
@@ -226,6 +251,10 @@ boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char
 bool GetProofForName(const CBlockIndex* pindexProof, const std::string& name, CClaimTrieProof& proof);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Rebuild the block index from the blk?????.dat files, reading them on separate threads */
+void ReindexBlockFiles(const CChainParams& chainparams);
+/** Rebuild the (empty) claim trie from the claim operations of the blocks in the active chain */
+bool RebuildClaimTrie(const CChainParams& chainparams);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
@@ -242,6 +271,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Serve getdata requests (blocks and transactions) on nThreads threads instead of the message handler */
+void StartServeThreads(boost::thread_group& threadGroup, int nThreads);
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -297,6 +328,15 @@ void PruneAndFlush();
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, CFeeRate* txFeeRate, bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0);
 
+/** (try to) add transaction to memory pool with a specified acceptance time **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, CFeeRate* txFeeRate, bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0);
+
+/** Load the mempool from disk, feeding every transaction through AcceptToMemoryPool */
+bool LoadMempool();
+/** Dump the mempool, with entry times and fee deltas, to disk */
+void DumpMempool();
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
@@ -443,8 +483,20 @@ public:
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
+/** Read the block at pos, checking its proof of work */
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
+/** Read the block at pos, which the block index says has this hash; only the (cheap) hash is checked */
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hash);
+/** Read an indexed block, checked against the index's hash like the above */
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read the serialized block at pos as stored in the block file, without deserializing it */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vBlock, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
+/**
+ * The "block" message for block hash stored at pos, ready to send. The last
+ * one is kept, as most peers ask for the block that was just announced.
+ * Returns an empty message if the block cannot be read.
+ */
+CSharedMessage GetBlockMessage(const uint256& hash, const CDiskBlockPos& pos);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -550,6 +602,12 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coin prefetch layer beneath pcoinsTip, NULL if disabled */
+extern CCoinsViewPrefetch *pcoinsPrefetch;
+
+/** Global variable that points to the mapped block and undo files, NULL if reads go through stdio */
+extern CBlockFileMap *pblockfilemap;
+
 /** Global variable that points to the active CClaimTrie (protected by cs_main) */
 extern CClaimTrie *pclaimTrie;
 
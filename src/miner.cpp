@@ -29,7 +29,6 @@
 
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
-#include <queue>
 
 using namespace std;
 
@@ -41,23 +40,103 @@ using namespace std;
 //
 // Unconfirmed transactions in the memory pool often depend on other
 // transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
+// pool, we select by highest priority or by the fee rate of the transaction
+// together with its unconfirmed ancestors, so a transaction is always added
+// along with the ancestors that are not in the block yet.
 
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 
-class ScoreCompare
+namespace {
+/**
+ * A mempool entry whose ancestor state only counts the ancestors that are
+ * not in the block yet.
+ */
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+        nSigOpCountWithAncestors = entry->GetSigOpCountWithAncestors();
+    }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    unsigned int nSigOpCountWithAncestors;
+};
+
+/** Same ordering as CompareTxMemPoolEntryByAncestorFee, on the modified ancestor state */
+class CompareModifiedEntry
 {
 public:
-    ScoreCompare() {}
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2) {
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        }
+        return f1 > f2;
+    }
+};
 
-    bool operator()(const CTxMemPool::txiter a, const CTxMemPool::txiter b)
+/** Orders a package so that parents come before their children */
+class CompareTxIterByAncestorCount
+{
+public:
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
-        return CompareTxMemPoolEntryByScore()(*b,*a); // Convert to less than
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
     }
 };
 
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
+    {
+        return entry.iter;
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash
+        >,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            // Reuse same tag from CTxMemPool's similar index
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion
+{
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator() (CTxMemPoolModifiedEntry &e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+        e.nSigOpCountWithAncestors -= iter->GetSigOpCount();
+    }
+
+    CTxMemPool::txiter iter;
+};
+}
+
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     int64_t nOldTime = pblock->nTime;
@@ -73,317 +152,635 @@ int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParam
     return nNewTime - nOldTime;
 }
 
-CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn)
+static void GetBlockSizeLimits(unsigned int& nBlockMaxSize, unsigned int& nBlockPrioritySize, unsigned int& nBlockMinSize)
 {
-    // Create new block
-    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return NULL;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
-
-    // Create coinbase tx
-    CMutableTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
-
-    // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
-
     // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
     // Limit to between 1K and MAX_BLOCK_SIZE-1K for sanity:
     nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
 
     // How much of the block should be dedicated to high-priority transactions,
     // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
     nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
     // Minimum block size you want to create; block will be filled with free transactions
     // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
     nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+}
 
-    // Collect memory pool transactions into the block
+/**
+ * Selects the transactions of a block, tracking its size and sigops. It can
+ * be kept to continue the selection as the mempool changes, as long as no
+ * transactions leave the mempool in the meantime.
+ */
+class CBlockTxSelector
+{
+private:
+    CTxMemPool& pool;
+    const int nHeight;
+    const int64_t nLockTimeCutoff;
+    //! Selected transactions not yet handed out by TakeSelected, in block order
+    std::vector<CTxMemPool::txiter> vSelected;
+
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
     CTxMemPool::setEntries inBlock;
-    CTxMemPool::setEntries waitSet;
+    //! Candidates with their ancestor state reduced by the ancestors in the block
+    indexed_modified_transaction_set mapModifiedTx;
+    uint64_t nBlockSize;
+    unsigned int nBlockSigOps;
+    int lastFewTxs;
+    bool blockFinished;
+    //! Lowest fee rate of the packages added by AddPackageTxs
+    CFeeRate minPackageFeeRate;
+    //! Highest fee rate of the packages that were too large or had too many sigops
+    CFeeRate maxFailedPackageFeeRate;
+
+    void AddToBlock(CTxMemPool::txiter iter)
+    {
+        vSelected.push_back(iter);
+        nBlockSize += iter->GetTxSize();
+        nBlockSigOps += iter->GetSigOpCount();
+        inBlock.insert(iter);
+    }
 
-    // This vector will be sorted into a priority queue:
-    vector<TxCoinAgePriority> vecPriority;
-    TxCoinAgePriorityCompare pricomparer;
-    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
-    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
-    double actualPriority = -1;
+    /** Whether a single transaction still fits; flags the block finished when it is full. */
+    bool TestForBlock(CTxMemPool::txiter iter)
+    {
+        if (nBlockSize + iter->GetTxSize() >= nBlockMaxSize) {
+            if (nBlockSize > nBlockMaxSize - 100 || lastFewTxs > 50) {
+                blockFinished = true;
+                return false;
+            }
+            // Once we're within 1000 bytes of a full block, only look at 50 more txs
+            // to try to fill the remaining space.
+            if (nBlockSize > nBlockMaxSize - 1000) {
+                lastFewTxs++;
+            }
+            return false;
+        }
+        if (nBlockSigOps + iter->GetSigOpCount() >= MAX_BLOCK_SIGOPS) {
+            if (nBlockSigOps > MAX_BLOCK_SIGOPS - 2) {
+                blockFinished = true;
+            }
+            return false;
+        }
+        return IsFinalTx(iter->GetTx(), nHeight, nLockTimeCutoff);
+    }
 
-    std::priority_queue<CTxMemPool::txiter, std::vector<CTxMemPool::txiter>, ScoreCompare> clearedTxs;
-    bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
-    uint64_t nBlockSize = 1000;
-    uint64_t nBlockTx = 0;
-    unsigned int nBlockSigOps = 100;
-    int lastFewTxs = 0;
-    CAmount nFees = 0;
+    bool TestPackage(uint64_t packageSize, unsigned int packageSigOps) const
+    {
+        return nBlockSize + packageSize < nBlockMaxSize && nBlockSigOps + packageSigOps < MAX_BLOCK_SIGOPS;
+    }
 
+    bool TestPackageFinality(const CTxMemPool::setEntries& package) const
     {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        pblock->nTime = GetAdjustedTime();
-        CCoinsViewCache view(pcoinsTip);
-        if (!pclaimTrie)
-        {
-            return NULL;
+        BOOST_FOREACH(CTxMemPool::txiter it, package) {
+            if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
+                return false;
         }
-        CClaimTrieCache trieCache(pclaimTrie);
-        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
-
-        pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
-        // -regtest only: allow overriding block.nVersion with
-        // -blockversion=N to test forking scenarios
-        if (chainparams.MineBlocksOnDemand())
-            pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+        return true;
+    }
 
-        int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                ? nMedianTimePast
-                                : pblock->GetBlockTime();
+    bool IsStillDependent(CTxMemPool::txiter iter) const
+    {
+        BOOST_FOREACH(CTxMemPool::txiter parent, pool.GetMemPoolParents(iter)) {
+            if (!inBlock.count(parent))
+                return true;
+        }
+        return false;
+    }
 
-        bool fPriorityBlock = nBlockPrioritySize > 0;
-        if (fPriorityBlock) {
-            vecPriority.reserve(mempool.mapTx.size());
-            for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-                 mi != mempool.mapTx.end(); ++mi)
-            {
-                double dPriority = mi->GetPriority(nHeight);
-                CAmount dummy;
-                mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
-                vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    /** Account for the transactions just added in the ancestor state of their descendants. */
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded)
+    {
+        BOOST_FOREACH(CTxMemPool::txiter it, alreadyAdded) {
+            CTxMemPool::setEntries descendants;
+            pool.CalculateDescendants(it, descendants);
+            BOOST_FOREACH(CTxMemPool::txiter desc, descendants) {
+                if (alreadyAdded.count(desc))
+                    continue;
+                modtxiter mit = mapModifiedTx.find(desc);
+                if (mit == mapModifiedTx.end()) {
+                    CTxMemPoolModifiedEntry modEntry(desc);
+                    modEntry.nSizeWithAncestors -= it->GetTxSize();
+                    modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                    modEntry.nSigOpCountWithAncestors -= it->GetSigOpCount();
+                    mapModifiedTx.insert(modEntry);
+                } else {
+                    mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+                }
             }
-            std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
         }
+    }
+
+    /**
+     * Add packages until the block is full. Candidates come from mapModifiedTx
+     * and, starting at mi, from the entries of the mempool's ancestor_score
+     * index that are not in mapModifiedTx.
+     */
+    void AddPackages(CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi);
+
+public:
+    CBlockTxSelector(CTxMemPool& poolIn, int nHeightIn, int64_t nLockTimeCutoffIn)
+        : pool(poolIn), nHeight(nHeightIn), nLockTimeCutoff(nLockTimeCutoffIn),
+          nBlockSize(1000), nBlockSigOps(100), lastFewTxs(0), blockFinished(false), minPackageFeeRate(MAX_MONEY)
+    {
+        GetBlockSizeLimits(nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+    }
+
+    /** Count transactions that are in the block already, without selecting them again. */
+    void Include(const CTxMemPool::setEntries& entries)
+    {
+        BOOST_FOREACH(CTxMemPool::txiter iter, entries) {
+            nBlockSize += iter->GetTxSize();
+            nBlockSigOps += iter->GetSigOpCount();
+            inBlock.insert(iter);
+        }
+        UpdatePackagesForAdded(entries);
+    }
 
-        CTxMemPool::indexed_transaction_set::index<mining_score>::type::iterator mi = mempool.mapTx.get<mining_score>().begin();
-        CTxMemPool::txiter iter;
+    /** Hand out the transactions selected since the last call, in block order. */
+    void TakeSelected(std::vector<CTxMemPool::txiter>& vSelectedOut)
+    {
+        vSelectedOut.clear();
+        vSelectedOut.swap(vSelected);
+    }
 
-        while (mi != mempool.mapTx.get<mining_score>().end() || !clearedTxs.empty())
+    const CTxMemPool::setEntries& GetInBlock() const { return inBlock; }
+    uint64_t GetBlockSize() const { return nBlockSize; }
+    unsigned int GetBlockSigOps() const { return nBlockSigOps; }
+    CFeeRate GetMinPackageFeeRate() const { return minPackageFeeRate; }
+    CFeeRate GetMaxFailedPackageFeeRate() const { return maxFailedPackageFeeRate; }
+
+    /** Fill the first -blockprioritysize bytes by coin age priority. */
+    void AddPriorityTxs()
+    {
+        if (nBlockPrioritySize == 0)
+            return;
+
+        // This vector will be sorted into a priority queue:
+        vector<TxCoinAgePriority> vecPriority;
+        TxCoinAgePriorityCompare pricomparer;
+        std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+        typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+
+        vecPriority.reserve(pool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::iterator mi = pool.mapTx.begin();
+             mi != pool.mapTx.end(); ++mi)
         {
-            bool priorityTx = false;
-            if (fPriorityBlock && !vecPriority.empty()) { // add a tx from priority queue to fill the blockprioritysize
-                priorityTx = true;
-                iter = vecPriority.front().second;
-                actualPriority = vecPriority.front().first;
-                std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
-                vecPriority.pop_back();
-            }
-            else if (clearedTxs.empty()) { // add tx with next highest score
-                iter = mempool.mapTx.project<0>(mi);
-                mi++;
-            }
-            else {  // try to add a previously postponed child tx
-                iter = clearedTxs.top();
-                clearedTxs.pop();
-            }
+            double dPriority = mi->GetPriority(nHeight);
+            CAmount dummy;
+            pool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+            vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+        }
+        std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
 
-            if (inBlock.count(iter))
-            {
-                continue; // could have been added to the priorityBlock
+        while (!vecPriority.empty() && !blockFinished) {
+            CTxMemPool::txiter iter = vecPriority.front().second;
+            double actualPriority = vecPriority.front().first;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+            vecPriority.pop_back();
+
+            // Wait for the parents to be added first.
+            if (IsStillDependent(iter)) {
+                waitPriMap.insert(std::make_pair(iter, actualPriority));
+                continue;
             }
 
-            const CTransaction& tx = iter->GetTx();
+            if (TestForBlock(iter)) {
+                AddToBlock(iter);
 
-            bool fOrphan = false;
-            BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
-            {
-                if (!inBlock.count(parent)) {
-                    fOrphan = true;
+                // Stop once the priority area is full, or nothing else would be free.
+                if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority))
                     break;
+
+                BOOST_FOREACH(CTxMemPool::txiter child, pool.GetMemPoolChildren(iter)) {
+                    waitPriIter wpiter = waitPriMap.find(child);
+                    if (wpiter != waitPriMap.end()) {
+                        vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                        std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                        waitPriMap.erase(wpiter);
+                    }
                 }
             }
-            if (fOrphan) {
-                if (priorityTx)
-                    waitPriMap.insert(std::make_pair(iter,actualPriority));
-                else
-                    waitSet.insert(iter);
+        }
+    }
+
+    /**
+     * Fill the rest of the block by ancestor feerate. Transactions whose
+     * ancestors were partly added already are tracked in mapModifiedTx with
+     * their remaining package, and compete with the untouched entries of the
+     * mempool's ancestor_score index.
+     */
+    void AddPackageTxs()
+    {
+        mapModifiedTx.clear();
+        UpdatePackagesForAdded(inBlock);
+        AddPackages(pool.mapTx.get<ancestor_score>().begin());
+    }
+
+    /**
+     * Continue the selection with vNew, the transactions that entered the
+     * mempool or had their fee changed since the last one. Everything else
+     * was considered before, and what did not fit then does not fit now.
+     */
+    void AddNewPackageTxs(const std::vector<CTxMemPool::txiter>& vNew)
+    {
+        GetBlockSizeLimits(nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+        lastFewTxs = 0;
+        blockFinished = false;
+
+        BOOST_FOREACH(CTxMemPool::txiter it, vNew) {
+            if (inBlock.count(it))
                 continue;
+            mapModifiedTx.erase(it);
+            CTxMemPoolModifiedEntry modEntry(it);
+            CTxMemPool::setEntries ancestors;
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            pool.CalculateMemPoolAncestors(*it, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            BOOST_FOREACH(CTxMemPool::txiter parent, ancestors) {
+                if (inBlock.count(parent)) {
+                    update_for_parent_inclusion update(parent);
+                    update(modEntry);
+                }
             }
+            mapModifiedTx.insert(modEntry);
+        }
+        AddPackages(pool.mapTx.get<ancestor_score>().end());
+    }
+};
 
-            unsigned int nTxSize = iter->GetTxSize();
-            if (fPriorityBlock &&
-                (nBlockSize + nTxSize >= nBlockPrioritySize || !AllowFree(actualPriority))) {
-                fPriorityBlock = false;
-                waitPriMap.clear();
+void CBlockTxSelector::AddPackages(CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi)
+{
+    // Packages that did not fit, but are still in mapModifiedTx's ancestor_score order
+    CTxMemPool::setEntries failedTx;
+    int nConsecutiveFailed = 0;
+
+    CTxMemPool::txiter iter;
+    while (!blockFinished && (mi != pool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())) {
+        // Skip entries that were added, failed, or have a modified entry.
+        if (mi != pool.mapTx.get<ancestor_score>().end()) {
+            CTxMemPool::txiter it = pool.mapTx.project<0>(mi);
+            if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it)) {
+                ++mi;
+                continue;
             }
-            if (!priorityTx &&
-                (iter->GetModifiedFee() < ::minRelayTxFee.GetFee(nTxSize) && nBlockSize >= nBlockMinSize)) {
-                break;
+        }
+
+        // Take the better of the next mempool entry and the best modified entry.
+        bool fUsingModified = false;
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == pool.mapTx.get<ancestor_score>().end()) {
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            iter = pool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                    CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                ++mi;
             }
-            if (nBlockSize + nTxSize >= nBlockMaxSize) {
-                if (nBlockSize >  nBlockMaxSize - 100 || lastFewTxs > 50) {
-                    break;
-                }
-                // Once we're within 1000 bytes of a full block, only look at 50 more txs
-                // to try to fill the remaining space.
-                if (nBlockSize > nBlockMaxSize - 1000) {
-                    lastFewTxs++;
-                }
-                continue;
+        }
+
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        unsigned int packageSigOps = iter->GetSigOpCountWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+            packageSigOps = modit->nSigOpCountWithAncestors;
+        }
+
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
+
+        CTxMemPool::setEntries ancestors;
+        CFeeRate packageFeeRate(packageFees, packageSize);
+        bool fAdd = TestPackage(packageSize, packageSigOps);
+        if (!fAdd) {
+            if (maxFailedPackageFeeRate < packageFeeRate)
+                maxFailedPackageFeeRate = packageFeeRate;
+        } else {
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            pool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            // Only the ancestors that are not in the block yet
+            for (CTxMemPool::setEntries::iterator it = ancestors.begin(); it != ancestors.end(); ) {
+                if (inBlock.count(*it))
+                    ancestors.erase(it++);
+                else
+                    ++it;
+            }
+            ancestors.insert(iter);
+            fAdd = TestPackageFinality(ancestors);
+        }
+        if (!fAdd) {
+            if (fUsingModified) {
+                // We always look at the best modified entry, so it has
+                // to go for the next one to be considered.
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
             }
+            // Give up once the block is nearly full and nothing has fit for a while.
+            if (++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 1000)
+                return;
+            continue;
+        }
+        nConsecutiveFailed = 0;
+        if (packageFeeRate < minPackageFeeRate)
+            minPackageFeeRate = packageFeeRate;
+
+        // Add the package with parents before children.
+        std::vector<CTxMemPool::txiter> sortedEntries(ancestors.begin(), ancestors.end());
+        std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+        BOOST_FOREACH(CTxMemPool::txiter entry, sortedEntries) {
+            AddToBlock(entry);
+            mapModifiedTx.erase(entry);
+        }
 
-            if (!IsFinalTx(tx, nHeight, nLockTimeCutoff))
-                continue;
+        UpdatePackagesForAdded(ancestors);
+    }
+}
 
-            typedef std::vector<std::pair<std::string, uint160> > spentClaimsType;
-            spentClaimsType spentClaims;
+CFeeRate SelectBlockTransactions(CTxMemPool& pool, int nHeight, int64_t nLockTimeCutoff, std::vector<CTxMemPool::txiter>& vSelected)
+{
+    AssertLockHeld(pool.cs);
+    CBlockTxSelector selector(pool, nHeight, nLockTimeCutoff);
+    selector.AddPriorityTxs();
+    selector.AddPackageTxs();
+    selector.TakeSelected(vSelected);
+    return selector.GetMinPackageFeeRate();
+}
+
+static bool ApplyClaimTrieChange(const CClaimTrieCache& trieCache, const CClaimTrieChange& change)
+{
+    int throwaway;
+    switch (change.type) {
+    case CClaimTrieChange::SPEND_CLAIM:
+        return trieCache.spendClaim(change.name, change.outPoint, change.nHeight, throwaway);
+    case CClaimTrieChange::SPEND_SUPPORT:
+        return trieCache.spendSupport(change.name, change.outPoint, change.nHeight, throwaway);
+    case CClaimTrieChange::ADD_CLAIM:
+        return trieCache.addClaim(change.name, change.outPoint, change.claimId, change.nAmount, change.nHeight);
+    case CClaimTrieChange::ADD_SUPPORT:
+        return trieCache.addSupport(change.name, change.outPoint, change.nAmount, change.claimId, change.nHeight);
+    }
+    return false;
+}
 
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+static bool ApplyClaimTrieChange(const CClaimTrieCache& trieCache, CClaimTrieChange::Type type, const std::string& name, const COutPoint& outPoint, const uint160& claimId, CAmount nAmount, int nHeight, std::vector<CClaimTrieChange>& vChanges)
+{
+    CClaimTrieChange change;
+    change.type = type;
+    change.name = name;
+    change.outPoint = outPoint;
+    change.claimId = claimId;
+    change.nAmount = nAmount;
+    change.nHeight = nHeight;
+    if (!ApplyClaimTrieChange(trieCache, change))
+        return false;
+    vChanges.push_back(change);
+    return true;
+}
+
+/**
+ * Apply the claimtrie updates of a transaction about to be added to a block
+ * template, and record them in vChanges. Its inputs are looked up in view,
+ * or among the transactions already in the block (mapBlockTx).
+ */
+static void AddClaimTrieChanges(const CTransaction& tx, int nHeight, const CCoinsViewCache& view, const std::map<uint256, const CTransaction*>& mapBlockTx, const CClaimTrieCache& trieCache, std::vector<CClaimTrieChange>& vChanges)
+{
+    typedef std::vector<std::pair<std::string, uint160> > spentClaimsType;
+    spentClaimsType spentClaims;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+        int nTxinHeight = 0;
+        CScript scriptPubKey;
+        bool fGotCoins = false;
+        if (coins)
+        {
+            if (txin.prevout.n < coins->vout.size())
+            {
+                nTxinHeight = coins->nHeight;
+                scriptPubKey = coins->vout[txin.prevout.n].scriptPubKey;
+                fGotCoins = true;
+            }
+        }
+        else // must be in block or else
+        {
+            std::map<uint256, const CTransaction*>::const_iterator it = mapBlockTx.find(txin.prevout.hash);
+            if (it != mapBlockTx.end())
             {
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                int nTxinHeight = 0;
-                CScript scriptPubKey;
-                bool fGotCoins = false;
-                if (coins)
+                const CTransaction& inBlockTx = *it->second;
+                if (txin.prevout.n < inBlockTx.vout.size())
                 {
-                    if (txin.prevout.n < coins->vout.size())
-                    {
-                        nTxinHeight = coins->nHeight;
-                        scriptPubKey = coins->vout[txin.prevout.n].scriptPubKey;
-                        fGotCoins = true;
-                    }
+                    nTxinHeight = nHeight;
+                    scriptPubKey = inBlockTx.vout[txin.prevout.n].scriptPubKey;
+                    fGotCoins = true;
                 }
-                else // must be in block or else
+            }
+        }
+        if (!fGotCoins)
+        {
+            LogPrintf("Tried to include a transaction but could not find the txout it was spending. This is bad. Please send this log file to the maintainers of this program.\n");
+            throw std::runtime_error("Tried to include a transaction but could not find the txout it was spending.");
+        }
+
+        std::vector<std::vector<unsigned char> > vvchParams;
+        int op;
+
+        if (DecodeClaimScript(scriptPubKey, op, vvchParams))
+        {
+            if (op == OP_CLAIM_NAME || op == OP_UPDATE_CLAIM)
+            {
+                uint160 claimId;
+                if (op == OP_CLAIM_NAME)
                 {
-                    BOOST_FOREACH(CTxMemPool::txiter inBlockEntry, inBlock)
-                    {
-                        CTransaction inBlockTx = inBlockEntry->GetTx();
-                        if (inBlockTx.GetHash() == txin.prevout.hash)
-                        {
-                            if (inBlockTx.vout.size() >= txin.prevout.n)
-                            {
-                                nTxinHeight = nHeight;
-                                scriptPubKey = inBlockTx.vout[txin.prevout.n].scriptPubKey;
-                                fGotCoins = true;
-                            }
-                        }
-                    }
+                    assert(vvchParams.size() == 2);
+                    claimId = ClaimIdHash(txin.prevout.hash, txin.prevout.n);
+                }
+                else if (op == OP_UPDATE_CLAIM)
+                {
+                    assert(vvchParams.size() == 3);
+                    claimId = uint160(vvchParams[1]);
+                }
+                std::string name(vvchParams[0].begin(), vvchParams[0].end());
+                if (ApplyClaimTrieChange(trieCache, CClaimTrieChange::SPEND_CLAIM, name, txin.prevout, uint160(), 0, nTxinHeight, vChanges))
+                {
+                    std::pair<std::string, uint160> entry(name, claimId);
+                    spentClaims.push_back(entry);
+                }
+                else
+                {
+                    LogPrintf("%s(): The claim was not found in the trie or queue and therefore can't be updated\n", __func__);
                 }
-                if (!fGotCoins)
+            }
+            else if (op == OP_SUPPORT_CLAIM)
+            {
+                assert(vvchParams.size() == 2);
+                std::string name(vvchParams[0].begin(), vvchParams[0].end());
+                if (!ApplyClaimTrieChange(trieCache, CClaimTrieChange::SPEND_SUPPORT, name, txin.prevout, uint160(), 0, nTxinHeight, vChanges))
                 {
-                    LogPrintf("Tried to include a transaction but could not find the txout it was spending. This is bad. Please send this log file to the maintainers of this program.\n");
-                    throw std::runtime_error("Tried to include a transaction but could not find the txout it was spending.");
+                    LogPrintf("%s(): The support was not found in the trie or queue\n", __func__);
                 }
+            }
+        }
+    }
 
-                std::vector<std::vector<unsigned char> > vvchParams;
-                int op;
+    for (unsigned int i = 0; i < tx.vout.size(); ++i)
+    {
+        const CTxOut& txout = tx.vout[i];
 
-                if (DecodeClaimScript(scriptPubKey, op, vvchParams))
+        std::vector<std::vector<unsigned char> > vvchParams;
+        int op;
+        if (DecodeClaimScript(txout.scriptPubKey, op, vvchParams))
+        {
+            if (op == OP_CLAIM_NAME)
+            {
+                assert(vvchParams.size() == 2);
+                std::string name(vvchParams[0].begin(), vvchParams[0].end());
+                if (!ApplyClaimTrieChange(trieCache, CClaimTrieChange::ADD_CLAIM, name, COutPoint(tx.GetHash(), i), ClaimIdHash(tx.GetHash(), i), txout.nValue, nHeight, vChanges))
                 {
-                    if (op == OP_CLAIM_NAME || op == OP_UPDATE_CLAIM)
-                    {
-                        uint160 claimId;
-                        if (op == OP_CLAIM_NAME)
-                        {
-                            assert(vvchParams.size() == 2);
-                            claimId = ClaimIdHash(txin.prevout.hash, txin.prevout.n);
-                        }
-                        else if (op == OP_UPDATE_CLAIM)
-                        {
-                            assert(vvchParams.size() == 3);
-                            claimId = uint160(vvchParams[1]);
-                        }
-                        std::string name(vvchParams[0].begin(), vvchParams[0].end());
-                        int throwaway;
-                        if (trieCache.spendClaim(name, COutPoint(txin.prevout.hash, txin.prevout.n), nTxinHeight, throwaway))
-                        {
-                            std::pair<std::string, uint160> entry(name, claimId);
-                            spentClaims.push_back(entry);
-                        }
-                        else
-                        {
-                            LogPrintf("%s(): The claim was not found in the trie or queue and therefore can't be updated\n", __func__);
-                        }
-                    }
-                    else if (op == OP_SUPPORT_CLAIM)
-                    {
-                        assert(vvchParams.size() == 2);
-                        std::string name(vvchParams[0].begin(), vvchParams[0].end());
-                        int throwaway;
-                        if (!trieCache.spendSupport(name, COutPoint(txin.prevout.hash, txin.prevout.n), nTxinHeight, throwaway))
-                        {
-                            LogPrintf("%s(): The support was not found in the trie or queue\n", __func__);
-                        }
-                    }
+                    LogPrintf("%s: Something went wrong inserting the name\n", __func__);
                 }
             }
-            
-            for (unsigned int i = 0; i < tx.vout.size(); ++i)
+            else if (op == OP_UPDATE_CLAIM)
             {
-                const CTxOut& txout = tx.vout[i];
-            
-                std::vector<std::vector<unsigned char> > vvchParams;
-                int op;
-                if (DecodeClaimScript(txout.scriptPubKey, op, vvchParams))
+                assert(vvchParams.size() == 3);
+                std::string name(vvchParams[0].begin(), vvchParams[0].end());
+                uint160 claimId(vvchParams[1]);
+                spentClaimsType::iterator itSpent;
+                for (itSpent = spentClaims.begin(); itSpent != spentClaims.end(); ++itSpent)
                 {
-                    if (op == OP_CLAIM_NAME)
-                    {
-                        assert(vvchParams.size() == 2);
-                        std::string name(vvchParams[0].begin(), vvchParams[0].end());
-                        if (!trieCache.addClaim(name, COutPoint(tx.GetHash(), i), ClaimIdHash(tx.GetHash(), i), txout.nValue, nHeight))
-                        {
-                            LogPrintf("%s: Something went wrong inserting the name\n", __func__);
-                        }
-                    }
-                    else if (op == OP_UPDATE_CLAIM)
+                    if (itSpent->first == name && itSpent->second == claimId)
                     {
-                        assert(vvchParams.size() == 3);
-                        std::string name(vvchParams[0].begin(), vvchParams[0].end());
-                        uint160 claimId(vvchParams[1]);
-                        spentClaimsType::iterator itSpent;
-                        for (itSpent = spentClaims.begin(); itSpent != spentClaims.end(); ++itSpent)
-                        {
-                            if (itSpent->first == name && itSpent->second == claimId)
-                            {
-                                break;
-                            }
-                        }
-                        if (itSpent != spentClaims.end())
-                        {
-                            spentClaims.erase(itSpent);
-                            if (!trieCache.addClaim(name, COutPoint(tx.GetHash(), i), claimId, txout.nValue, nHeight))
-                            {
-                                LogPrintf("%s: Something went wrong updating a claim\n", __func__);
-                            }
-                        }
-                        else
-                        {
-                            LogPrintf("%s(): This update refers to a claim that was not found in the trie or queue, and therefore cannot be updated. The claim may have expired or it may have never existed.\n", __func__);
-                        }
+                        break;
                     }
-                    else if (op == OP_SUPPORT_CLAIM)
+                }
+                if (itSpent != spentClaims.end())
+                {
+                    spentClaims.erase(itSpent);
+                    if (!ApplyClaimTrieChange(trieCache, CClaimTrieChange::ADD_CLAIM, name, COutPoint(tx.GetHash(), i), claimId, txout.nValue, nHeight, vChanges))
                     {
-                        assert(vvchParams.size() == 2);
-                        std::string name(vvchParams[0].begin(), vvchParams[0].end());
-                        uint160 supportedClaimId(vvchParams[1]);
-                        if (!trieCache.addSupport(name, COutPoint(tx.GetHash(), i), txout.nValue, supportedClaimId, nHeight))
-                        {
-                            LogPrintf("%s: Something went wrong inserting the claim support\n", __func__);
-                        }
+                        LogPrintf("%s: Something went wrong updating a claim\n", __func__);
                     }
                 }
+                else
+                {
+                    LogPrintf("%s(): This update refers to a claim that was not found in the trie or queue, and therefore cannot be updated. The claim may have expired or it may have never existed.\n", __func__);
+                }
             }
-            CValidationState state;
-
-            unsigned int nTxSigOps = iter->GetSigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS) {
-                if (nBlockSigOps > MAX_BLOCK_SIGOPS - 2) {
-                    break;
+            else if (op == OP_SUPPORT_CLAIM)
+            {
+                assert(vvchParams.size() == 2);
+                std::string name(vvchParams[0].begin(), vvchParams[0].end());
+                uint160 supportedClaimId(vvchParams[1]);
+                if (!ApplyClaimTrieChange(trieCache, CClaimTrieChange::ADD_SUPPORT, name, COutPoint(tx.GetHash(), i), supportedClaimId, txout.nValue, nHeight, vChanges))
+                {
+                    LogPrintf("%s: Something went wrong inserting the claim support\n", __func__);
                 }
-                continue;
             }
+        }
+    }
+}
+
+/** Move the template's claimtrie to the next block and return the hash for the header. */
+static uint256 IncrementClaimTrie(const CClaimTrieCache& trieCache)
+{
+    insertUndoType dummyInsertUndo;
+    claimQueueRowType dummyExpireUndo;
+    insertUndoType dummyInsertSupportUndo;
+    supportQueueRowType dummyExpireSupportUndo;
+    std::vector<std::pair<std::string, int> > dummyTakeoverHeightUndo;
+    trieCache.incrementBlock(dummyInsertUndo, dummyExpireUndo, dummyInsertSupportUndo, dummyExpireSupportUndo, dummyTakeoverHeightUndo);
+    return trieCache.getMerkleHash();
+}
 
+/**
+ * CreateNewBlock, also handing out the transaction selection and the
+ * claimtrie cache (as it was before IncrementClaimTrie) for the template to
+ * be continued from, if pselectorOut and ptrieCacheOut are given.
+ */
+static CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn, std::auto_ptr<CBlockTxSelector>* pselectorOut, std::auto_ptr<CClaimTrieCache>* ptrieCacheOut)
+{
+    // Create new block
+    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
+    if(!pblocktemplate.get())
+        return NULL;
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+
+    // Create coinbase tx
+    CMutableTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+
+    // Add dummy coinbase tx as first transaction
+    pblock->vtx.push_back(CTransaction());
+    pblocktemplate->vTxFees.push_back(-1); // updated at end
+    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+
+    std::map<uint256, const CTransaction*> mapBlockTx;
+    bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
+    uint64_t nBlockSize = 1000;
+    uint64_t nBlockTx = 0;
+    unsigned int nBlockSigOps = 100;
+    CAmount nFees = 0;
+
+    {
+        LOCK2(cs_main, mempool.cs);
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        const int nHeight = pindexPrev->nHeight + 1;
+        pblock->nTime = GetAdjustedTime();
+        CCoinsViewCache view(pcoinsTip);
+        if (!pclaimTrie)
+        {
+            return NULL;
+        }
+        std::auto_ptr<CClaimTrieCache> ptrieCache(new CClaimTrieCache(pclaimTrie));
+        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
+
+        pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
+        // -regtest only: allow overriding block.nVersion with
+        // -blockversion=N to test forking scenarios
+        if (chainparams.MineBlocksOnDemand())
+            pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+
+        int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                                ? nMedianTimePast
+                                : pblock->GetBlockTime();
+
+        std::auto_ptr<CBlockTxSelector> pselector(new CBlockTxSelector(mempool, nHeight, nLockTimeCutoff));
+        pselector->AddPriorityTxs();
+        pselector->AddPackageTxs();
+        std::vector<CTxMemPool::txiter> vSelected;
+        pselector->TakeSelected(vSelected);
+        pblocktemplate->minPackageFeeRate = pselector->GetMinPackageFeeRate();
+
+        BOOST_FOREACH(CTxMemPool::txiter iter, vSelected)
+        {
+            const CTransaction& tx = iter->GetTx();
+
+            // Parents come first, so their claims are in the trie already.
+            AddClaimTrieChanges(tx, nHeight, view, mapBlockTx, *ptrieCache, pblocktemplate->vClaimTrieChanges);
+
+            unsigned int nTxSize = iter->GetTxSize();
+            unsigned int nTxSigOps = iter->GetSigOpCount();
             CAmount nTxFees = iter->GetFee();
             // Added
+            mapBlockTx[tx.GetHash()] = &tx;
             pblock->vtx.push_back(tx);
             pblocktemplate->vTxFees.push_back(nTxFees);
             pblocktemplate->vTxSigOps.push_back(nTxSigOps);
@@ -400,27 +797,6 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& s
                 LogPrintf("priority %.1f fee %s txid %s\n",
                           dPriority , CFeeRate(iter->GetModifiedFee(), nTxSize).ToString(), tx.GetHash().ToString());
             }
-
-            inBlock.insert(iter);
-
-            // Add transactions that depend on this one to the priority queue
-            BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
-            {
-                if (fPriorityBlock) {
-                    waitPriIter wpiter = waitPriMap.find(child);
-                    if (wpiter != waitPriMap.end()) {
-                        vecPriority.push_back(TxCoinAgePriority(wpiter->second,child));
-                        std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
-                        waitPriMap.erase(wpiter);
-                    }
-                }
-                else {
-                    if (waitSet.count(child)) {
-                        clearedTxs.push(child);
-                        waitSet.erase(child);
-                    }
-                }
-            }
         }
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
@@ -438,23 +814,185 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& s
         pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
         pblock->nNonce         = 0;
         pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
-        insertUndoType dummyInsertUndo;
-        claimQueueRowType dummyExpireUndo;
-        insertUndoType dummyInsertSupportUndo;
-        supportQueueRowType dummyExpireSupportUndo;
-        std::vector<std::pair<std::string, int> > dummyTakeoverHeightUndo;
-        trieCache.incrementBlock(dummyInsertUndo, dummyExpireUndo, dummyInsertSupportUndo, dummyExpireSupportUndo, dummyTakeoverHeightUndo);
-        pblock->hashClaimTrie = trieCache.getMerkleHash();
+        if (ptrieCacheOut) {
+            CClaimTrieCache trieCacheNext(*ptrieCache);
+            pblock->hashClaimTrie = IncrementClaimTrie(trieCacheNext);
+        } else {
+            pblock->hashClaimTrie = IncrementClaimTrie(*ptrieCache);
+        }
 
         CValidationState state;
         if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
             throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
         }
+        if (pselectorOut)
+            *pselectorOut = pselector;
+        if (ptrieCacheOut)
+            *ptrieCacheOut = ptrieCache;
     }
 
     return pblocktemplate.release();
 }
 
+CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn)
+{
+    return CreateNewBlock(chainparams, scriptPubKeyIn, NULL, NULL);
+}
+
+CBlockTemplateBuilder::CBlockTemplateBuilder() : pindexPrev(NULL), nTransactionsUpdatedLast(0), nTransactionsRemovedLast(0) {}
+
+CBlockTemplateBuilder::~CBlockTemplateBuilder() {}
+
+bool CBlockTemplateBuilder::Rebuild(const CChainParams& chainparams)
+{
+    pindexPrev = NULL;
+    unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    std::auto_ptr<CBlockTxSelector> pselectorNew;
+    std::auto_ptr<CClaimTrieCache> ptrieCacheNew;
+    std::auto_ptr<CBlockTemplate> pblocktemplateNew(CreateNewBlock(chainparams, scriptPubKey, &pselectorNew, &ptrieCacheNew));
+    if (!pblocktemplateNew.get())
+        return false;
+    pblocktemplate = pblocktemplateNew;
+    pselector = pselectorNew;
+    ptrieCache = ptrieCacheNew;
+    SetBlockTxs();
+    pindexPrev = chainActive.Tip();
+    nTransactionsUpdatedLast = nTransactionsUpdated;
+    return true;
+}
+
+void CBlockTemplateBuilder::SetBlockTxs()
+{
+    mapBlockTx.clear();
+    BOOST_FOREACH(CTxMemPool::txiter it, pselector->GetInBlock())
+        mapBlockTx[it->GetTx().GetHash()] = &it->GetTx();
+    nTransactionsRemovedLast = mempool.GetTransactionsRemoved();
+}
+
+bool CBlockTemplateBuilder::Update(const CChainParams& chainparams)
+{
+    CBlock* pblock = &pblocktemplate->block;
+    const int nHeight = pindexPrev->nHeight + 1;
+
+    // Transactions left the mempool, so the selection may refer to entries
+    // that are gone. Redo it from the transactions in the template.
+    if (!pselector.get() || mempool.GetTransactionsRemoved() != nTransactionsRemovedLast) {
+        pselector.reset();
+        CTxMemPool::setEntries setInBlock;
+        for (unsigned int i = 1; i < pblock->vtx.size(); i++) {
+            CTxMemPool::txiter it = mempool.mapTx.find(pblock->vtx[i].GetHash());
+            // A transaction of the template left the mempool, probably
+            // conflicted or replaced, so the template is no longer served.
+            if (it == mempool.mapTx.end())
+                return false;
+            setInBlock.insert(it);
+        }
+        int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                                ? pindexPrev->GetMedianTimePast()
+                                : pblock->GetBlockTime();
+        pselector.reset(new CBlockTxSelector(mempool, nHeight, nLockTimeCutoff));
+        pselector->Include(setInBlock);
+        SetBlockTxs();
+    }
+
+    // Only the transactions added or prioritised since the last update are
+    // new candidates; finding them is a pass over the entries, without any
+    // package or claimtrie work for the others.
+    std::vector<CTxMemPool::txiter> vNew;
+    for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it) {
+        if (it->GetLastUpdate() > nTransactionsUpdatedLast)
+            vNew.push_back(it);
+    }
+    pselector->AddNewPackageTxs(vNew);
+    std::vector<CTxMemPool::txiter> vSelected;
+    pselector->TakeSelected(vSelected);
+
+    // A package that did not fit pays a better fee rate than one in the
+    // template, so a rebuild would evict for it.
+    if (pblocktemplate->minPackageFeeRate < pselector->GetMaxFailedPackageFeeRate())
+        return false;
+    if (vSelected.empty())
+        return true;
+
+    // Work out the additions on the side, so that the template is only
+    // changed once all of them succeeded. The claimtrie continues from a
+    // copy of the template's cache.
+    std::auto_ptr<CClaimTrieCache> ptrieCacheNew(new CClaimTrieCache(*ptrieCache));
+    std::vector<CClaimTrieChange> vClaimTrieChanges;
+    std::map<uint256, const CTransaction*> mapBlockTxNew(mapBlockTx);
+    CCoinsViewCache view(pcoinsTip);
+    CAmount nFees = -pblocktemplate->vTxFees[0];
+    // Parents come first, so their claims are in the trie already.
+    BOOST_FOREACH(CTxMemPool::txiter iter, vSelected) {
+        const CTransaction& tx = iter->GetTx();
+        AddClaimTrieChanges(tx, nHeight, view, mapBlockTxNew, *ptrieCacheNew, vClaimTrieChanges);
+        mapBlockTxNew[tx.GetHash()] = &tx;
+        nFees += iter->GetFee();
+    }
+    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    txCoinbase.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
+    CClaimTrieCache trieCacheNext(*ptrieCacheNew);
+
+    // Not a copy of the block, which would carry over fChecked
+    CBlock block(pblock->GetBlockHeader());
+    block.vtx = pblock->vtx;
+    block.vtx[0] = txCoinbase;
+    BOOST_FOREACH(CTxMemPool::txiter iter, vSelected)
+        block.vtx.push_back(iter->GetTx());
+    block.hashClaimTrie = IncrementClaimTrie(trieCacheNext);
+    CValidationState state;
+    if (!TestBlockValidity(state, chainparams, block, pindexPrev, false, false))
+        throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+
+    BOOST_FOREACH(CTxMemPool::txiter iter, vSelected) {
+        pblocktemplate->vTxFees.push_back(iter->GetFee());
+        pblocktemplate->vTxSigOps.push_back(iter->GetSigOpCount());
+    }
+    pblocktemplate->vClaimTrieChanges.insert(pblocktemplate->vClaimTrieChanges.end(), vClaimTrieChanges.begin(), vClaimTrieChanges.end());
+    pblocktemplate->vTxFees[0] = -nFees;
+    pblock->vtx.swap(block.vtx);
+    pblock->hashClaimTrie = block.hashClaimTrie;
+    if (pselector->GetMinPackageFeeRate() < pblocktemplate->minPackageFeeRate)
+        pblocktemplate->minPackageFeeRate = pselector->GetMinPackageFeeRate();
+    ptrieCache = ptrieCacheNew;
+    mapBlockTx.swap(mapBlockTxNew);
+
+    nLastBlockTx = pblock->vtx.size() - 1;
+    nLastBlockSize = pselector->GetBlockSize();
+    LogPrintf("%s: added %u txs, total size %u txs: %u fees: %ld sigops %d\n", __func__, vSelected.size(), nLastBlockSize, nLastBlockTx, nFees, pselector->GetBlockSigOps());
+    return true;
+}
+
+CBlockTemplate* CBlockTemplateBuilder::GetTemplate(const CChainParams& chainparams, const CScript& scriptPubKeyIn)
+{
+    LOCK2(cs_main, mempool.cs);
+    if (!pclaimTrie)
+        return NULL;
+    bool fRebuild = !pblocktemplate.get() || pindexPrev != chainActive.Tip() || scriptPubKey != scriptPubKeyIn;
+    scriptPubKey = scriptPubKeyIn;
+    if (fRebuild)
+        return Rebuild(chainparams) ? pblocktemplate.get() : NULL;
+
+    // Nothing to add until the mempool changes. A removal is looked at as
+    // well, as it may have taken one of the template's transactions.
+    unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    if (nTransactionsUpdated == nTransactionsUpdatedLast && mempool.GetTransactionsRemoved() == nTransactionsRemovedLast)
+        return pblocktemplate.get();
+    bool fUpdated = false;
+    try {
+        fUpdated = Update(chainparams);
+    } catch (const std::runtime_error& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+    if (!fUpdated) {
+        // The selection went ahead of the template
+        pselector.reset();
+        return Rebuild(chainparams) ? pblocktemplate.get() : NULL;
+    }
+    nTransactionsUpdatedLast = nTransactionsUpdated;
+    return pblocktemplate.get();
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -474,6 +1012,122 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
 
+//! Number of nonces a search thread hashes between checks for a solution found elsewhere
+static const unsigned int POW_SEARCH_BATCH = 256;
+
+//! Leading header bytes that do not change with nNonce or nTime, hashed once into a SHA-256 midstate
+static const size_t POW_MIDSTATE_SIZE = 64;
+
+namespace {
+/**
+ * Computes the PoW hashes of one header at consecutive nonces. The PoW
+ * starts with SHA256d over the serialized header, whose first
+ * POW_MIDSTATE_SIZE bytes are the same for every nonce, so their SHA-256
+ * state is computed once here and only the remaining bytes are hashed per
+ * nonce.
+ */
+class CPoWNonceHasher
+{
+private:
+    uint32_t midstate[8];
+    std::vector<unsigned char> vTails;
+
+public:
+    static const size_t TAIL_SIZE = BLOCK_HEADER_SIZE - POW_MIDSTATE_SIZE;
+
+    CPoWNonceHasher(const CBlockHeader& header, unsigned int nMaxCount) : vTails(nMaxCount * TAIL_SIZE)
+    {
+        unsigned char buf[BLOCK_HEADER_SIZE];
+        header.SerializeHeader(buf);
+        CSHA256().Write(buf, POW_MIDSTATE_SIZE).GetMidstate(midstate);
+        for (unsigned int i = 0; i < nMaxCount; i++)
+            memcpy(&vTails[i * TAIL_SIZE], buf + POW_MIDSTATE_SIZE, TAIL_SIZE);
+    }
+
+    /** Hash nonces nNonce .. nNonce + nCount - 1 (nCount at most nMaxCount) into phashes. */
+    void Hash(uint32_t nNonce, unsigned int nCount, uint256* phashes)
+    {
+        assert(nCount * TAIL_SIZE <= vTails.size());
+        for (unsigned int i = 0; i < nCount; i++)
+            WriteLE32(&vTails[(i + 1) * TAIL_SIZE - 4], nNonce + i);
+        PoWHashBatchMidstate(midstate, POW_MIDSTATE_SIZE, &vTails[0], TAIL_SIZE, nCount, phashes);
+    }
+};
+
+/** State shared by the threads of one SearchProofOfWork call. */
+struct CPoWSearch
+{
+    boost::mutex mutex;
+    //! Hashes left to try over all threads
+    uint64_t nTriesLeft;
+    //! Index of the solved header, -1 while searching
+    int nFound;
+    uint32_t nNonceFound;
+};
+}
+
+static void SearchProofOfWorkThread(CPoWSearch* search, const CBlockHeader* pheader, int nIndex, uint32_t nNonceEnd, const Consensus::Params* params)
+{
+    CPoWNonceHasher hasher(*pheader, POW_SEARCH_BATCH);
+    uint256 hashes[POW_SEARCH_BATCH];
+
+    for (uint32_t nNonce = pheader->nNonce; nNonce < nNonceEnd; ) {
+        unsigned int nCount = std::min<uint32_t>(POW_SEARCH_BATCH, nNonceEnd - nNonce);
+        {
+            boost::unique_lock<boost::mutex> lock(search->mutex);
+            if (search->nFound >= 0)
+                return;
+            if (nCount > search->nTriesLeft)
+                nCount = search->nTriesLeft;
+            search->nTriesLeft -= nCount;
+        }
+        if (nCount == 0)
+            return;
+
+        hasher.Hash(nNonce, nCount, hashes);
+        for (unsigned int i = 0; i < nCount; i++) {
+            if (CheckProofOfWork(hashes[i], pheader->nBits, *params)) {
+                boost::unique_lock<boost::mutex> lock(search->mutex);
+                if (search->nFound < 0) {
+                    search->nFound = nIndex;
+                    search->nNonceFound = nNonce + i;
+                }
+                return;
+            }
+        }
+        nNonce += nCount;
+    }
+}
+
+int SearchProofOfWork(std::vector<CBlockHeader>& vHeaders, uint32_t nNonceEnd, uint64_t& nMaxTries, const Consensus::Params& params)
+{
+    CPoWSearch search;
+    search.nTriesLeft = nMaxTries;
+    search.nFound = -1;
+    search.nNonceFound = 0;
+
+    if (vHeaders.size() == 1) {
+        SearchProofOfWorkThread(&search, &vHeaders[0], 0, nNonceEnd, &params);
+    } else {
+        boost::thread_group threads;
+        for (size_t i = 0; i < vHeaders.size(); i++)
+            threads.create_thread(boost::bind(&SearchProofOfWorkThread, &search, &vHeaders[i], (int)i, nNonceEnd, &params));
+        try {
+            threads.join_all();
+        } catch (const boost::thread_interrupted&) {
+            // The workers reference our locals, so they have to be gone before we unwind.
+            threads.interrupt_all();
+            threads.join_all();
+            throw;
+        }
+    }
+
+    nMaxTries = search.nTriesLeft;
+    if (search.nFound >= 0)
+        vHeaders[search.nFound].nNonce = search.nNonceFound;
+    return search.nFound;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Internal miner
@@ -568,14 +1222,28 @@ void static BitcoinMiner(const CChainParams& chainparams)
             while (true)
             {
                 unsigned int nHashesDone = 0;
-                
+
+                // Hash consecutive nonces in batches that fill the multi-lane
+                // hash kernels; the batch size divides 0x100.
+                CPoWNonceHasher hasher(pblock->GetBlockHeader(), PoWHashLanes());
+                std::vector<uint256> vHashes(PoWHashLanes());
+
                 // Check if something found
                 while (true)
                 {
-                    hash = pblock->GetPoWHash();
-                    if (((uint16_t*)&hash)[15] == 0 && UintToArith256(hash) <= hashTarget)
+                    hasher.Hash(pblock->nNonce, vHashes.size(), &vHashes[0]);
+                    for (unsigned int i = 0; i < vHashes.size(); i++)
+                    {
+                        hash = vHashes[i];
+                        if (((uint16_t*)&hash)[15] == 0 && UintToArith256(hash) <= hashTarget)
+                        {
+                            pblock->nNonce += i;
+                            found = true;
+                            break;
+                        }
+                    }
+                    if (found)
                     {
-                        found = true;
                         // Found a solution
                         SetThreadPriority(THREAD_PRIORITY_NORMAL);
                         LogPrintf("LBRYcrdMiner:\n");
@@ -590,7 +1258,7 @@ void static BitcoinMiner(const CChainParams& chainparams)
 
                         break;
                     }
-                    pblock->nNonce += 1;
+                    pblock->nNonce += vHashes.size();
                     if ((pblock->nNonce & 0xFF) == 0)
                     {
                         nHashesDone = 0xFF+1;
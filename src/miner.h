@@ -7,11 +7,18 @@
 #define BITCOIN_MINER_H
 
 #include "primitives/block.h"
+#include "script/script.h"
+#include "txmempool.h"
 
+#include <map>
+#include <memory>
 #include <stdint.h>
+#include <string>
 
 class CBlockIndex;
+class CBlockTxSelector;
 class CChainParams;
+class CClaimTrieCache;
 class CReserveKey;
 class CScript;
 class CWallet;
@@ -22,19 +29,112 @@ static const int DEFAULT_GENERATE_THREADS = 1;
 
 static const bool DEFAULT_PRINTPRIORITY = false;
 
+/** A claimtrie update made by one of a block template's transactions */
+struct CClaimTrieChange
+{
+    enum Type { SPEND_CLAIM, SPEND_SUPPORT, ADD_CLAIM, ADD_SUPPORT };
+
+    Type type;
+    std::string name;
+    COutPoint outPoint;
+    //! ADD_CLAIM: the claim id, ADD_SUPPORT: the supported claim id
+    uint160 claimId;
+    CAmount nAmount;
+    int nHeight;
+};
+
 struct CBlockTemplate
 {
     CBlock block;
     std::vector<CAmount> vTxFees;
     std::vector<int64_t> vTxSigOps;
+    //! The claimtrie updates of block.vtx, in order, excluding incrementBlock
+    std::vector<CClaimTrieChange> vClaimTrieChanges;
+    //! Lowest fee rate of the packages selected by fee, MAX_MONEY if there are none
+    CFeeRate minPackageFeeRate;
+};
+
+/**
+ * Keeps the last block template around and updates it for getblocktemplate.
+ *
+ * While the tip stays the same, the package selection and the claimtrie
+ * cache the template was made from are kept as well. An update only
+ * considers the transactions that entered the mempool or were prioritised
+ * since the last one, appends the packages among them that still fit, and
+ * applies just their claimtrie changes. It is worked out on the side, and
+ * only replaces the template once it has succeeded and the block passes
+ * TestBlockValidity. When transactions leave the mempool the selection is
+ * redone from the template's transactions. A new tip, a changed coinbase
+ * script, the removal of one of the template's transactions from the
+ * mempool, or a package that does not fit but pays a better fee rate than
+ * one in the template causes a full CreateNewBlock.
+ */
+class CBlockTemplateBuilder
+{
+private:
+    std::auto_ptr<CBlockTemplate> pblocktemplate;
+    //! The selection the template was made from, NULL if it has to be redone
+    std::auto_ptr<CBlockTxSelector> pselector;
+    //! The claimtrie with the template's changes, before the block is incremented
+    std::auto_ptr<CClaimTrieCache> ptrieCache;
+    //! The template's transactions, as found in the mempool
+    std::map<uint256, const CTransaction*> mapBlockTx;
+    //! The tip the template builds on
+    CBlockIndex* pindexPrev;
+    CScript scriptPubKey;
+    //! The mempool's GetTransactionsUpdated() when the template was last brought up to date
+    unsigned int nTransactionsUpdatedLast;
+    //! The mempool's GetTransactionsRemoved() when the selection was made
+    unsigned int nTransactionsRemovedLast;
+
+    //! Replace the template with a new CreateNewBlock one
+    bool Rebuild(const CChainParams& chainparams);
+    //! Add new mempool transactions to the template, false if it needs a Rebuild
+    bool Update(const CChainParams& chainparams);
+    //! Index the transactions of the selection in mapBlockTx
+    void SetBlockTxs();
+
+public:
+    CBlockTemplateBuilder();
+    ~CBlockTemplateBuilder();
+
+    /**
+     * Get a template on top of the current tip. The template is owned by
+     * the builder and remains valid until the next call. It is only updated
+     * when the mempool changed since the last call.
+     */
+    CBlockTemplate* GetTemplate(const CChainParams& chainparams, const CScript& scriptPubKeyIn);
 };
 
+//! Number of packages in a row that may fail to fit a nearly full block before selection stops
+static const int MAX_CONSECUTIVE_FAILURES = 1000;
+
+/**
+ * Choose the mempool transactions for a block at nHeight: first by coin age
+ * priority to fill -blockprioritysize, then by the fee rate of each
+ * transaction together with its unconfirmed ancestors, so a child paying
+ * for its parents is selected with them. vSelected is in a valid block
+ * order. Returns the lowest fee rate of the packages selected by fee rate,
+ * MAX_MONEY if there are none. pool.cs must be held.
+ */
+CFeeRate SelectBlockTransactions(CTxMemPool& pool, int nHeight, int64_t nLockTimeCutoff, std::vector<CTxMemPool::txiter>& vSelected);
+
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, int nThreads, const CChainParams& chainparams);
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn);
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+/**
+ * Search for a proof of work on every header at once, one thread per header,
+ * each trying the nonces from its own nNonce up to nNonceEnd. The headers
+ * should differ in more than the nonce (e.g. in their extra nonce) so the
+ * threads do not repeat each other's work. All threads stop as soon as one
+ * of them succeeds or nMaxTries hashes have been tried in total; nMaxTries is
+ * decreased by the number of hashes tried. Returns the index of the solved
+ * header, whose nNonce is updated, or -1.
+ */
+int SearchProofOfWork(std::vector<CBlockHeader>& vHeaders, uint32_t nNonceEnd, uint64_t& nMaxTries, const Consensus::Params& params);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
 extern double dHashesPerSec;
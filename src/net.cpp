@@ -26,6 +26,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -34,6 +38,7 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/thread.hpp>
 
 #include <math.h>
@@ -76,6 +81,7 @@ const static std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
 //
 bool fDiscover = true;
 bool fListen = true;
+bool fSocketEpoll = false;
 uint64_t nLocalServices = NODE_NETWORK;
 CCriticalSection cs_mapLocalHost;
 map<CNetAddr, LocalServiceInfo> mapLocalHost;
@@ -90,7 +96,7 @@ std::string strSubVersion;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<uint256, CTransaction> mapRelay;
+map<uint256, CSharedMessage> mapRelay;
 deque<pair<int64_t, uint256> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<uint256, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -109,6 +115,25 @@ CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
 boost::condition_variable messageHandlerCondition;
+static boost::mutex messageHandlerMutex;
+//! Set by WakeMessageHandler, so a wakeup is not lost while the handler is busy
+static bool fMessageHandlerWoken = false;
+
+//! Nodes the -socketevents=epoll loop has to look at without waiting for a
+//! socket event: new nodes, queued sends, and sockets it could not finish
+//! with. Only the socket handler deletes nodes, and it erases them from here
+//! first.
+static CCriticalSection cs_setNodesSocketPending;
+static std::set<CNode*> setNodesSocketPending;
+
+/** Have the -socketevents=epoll loop service pnode on its next wakeup. */
+static void MarkSocketPending(CNode* pnode)
+{
+    if (!fSocketEpoll)
+        return;
+    LOCK(cs_setNodesSocketPending);
+    setNodesSocketPending.insert(pnode);
+}
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -397,7 +422,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!fSocketEpoll && !IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -413,6 +438,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        MarkSocketPending(pnode);
 
         pnode->nTimeConnected = GetTime();
 
@@ -663,19 +689,30 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         // absorb network data
         int handled;
-        if (!msg.in_data)
+        if (!msg.in_data) {
             handled = msg.readHeader(pch, nBytes);
-        else
+            if (handled < 0)
+                return false;
+
+            if (msg.in_data) {
+                if (msg.hdr.nMessageSize > MAX_PROTOCOL_MESSAGE_LENGTH) {
+                    LogPrint("net", "Oversized message from peer=%i, disconnecting\n", GetId());
+                    return false;
+                }
+                // Size the payload buffer from the header, reusing the
+                // allocation of an earlier message if we kept one.
+                if (!vRecvBufferPool.empty()) {
+                    msg.vRecv.SwapData(vRecvBufferPool.back());
+                    vRecvBufferPool.pop_back();
+                }
+                msg.vRecv.resize(std::min(msg.hdr.nMessageSize, MAX_RECV_PREALLOC_SIZE));
+            }
+        } else
             handled = msg.readData(pch, nBytes);
 
         if (handled < 0)
                 return false;
 
-        if (msg.in_data && msg.hdr.nMessageSize > MAX_PROTOCOL_MESSAGE_LENGTH) {
-            LogPrint("net", "Oversized message from peer=%i, disconnecting\n", GetId());
-            return false;
-        }
-
         pch += handled;
         nBytes -= handled;
 
@@ -690,7 +727,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
             i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
 
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            WakeMessageHandler();
         }
     }
 
@@ -735,15 +772,39 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
     if (vRecv.size() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + MAX_RECV_PREALLOC_SIZE));
     }
 
+    hasher.Write((const unsigned char*)pch, nCopy);
     memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+const uint256& CNetMessage::GetMessageHash() const
+{
+    assert(complete());
+    if (data_hash.IsNull())
+        hasher.Finalize(data_hash.begin());
+    return data_hash;
+}
+
+void CNode::RecycleRecvBuffer(CNetMessage& msg)
+{
+    if (vRecvBufferPool.size() >= MAX_RECV_BUFFER_POOL)
+        return;
+    CSerializeData vData;
+    msg.vRecv.SwapData(vData);
+    // A buffer that grew past what is allocated ahead for any message (for
+    // a block, say) is freed here rather than kept for the connection.
+    if (vData.capacity() > MAX_RECV_PREALLOC_SIZE)
+        return;
+    vData.clear();
+    vRecvBufferPool.push_back(CSerializeData());
+    vRecvBufferPool.back().swap(vData);
+}
+
 
 
 
@@ -755,10 +816,11 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    bool fWasFull = pnode->nSendSize >= SendBufferSize();
+    std::deque<CSharedMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -794,6 +856,11 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+    // Requests held back by the full send buffer (getdata in particular)
+    // can be served again.
+    if (fWasFull && pnode->nSendSize < SendBufferSize())
+        WakeMessageHandler();
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -980,7 +1047,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!fSocketEpoll && !IsSelectableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1023,76 +1090,339 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
+    MarkSocketPending(pnode);
 }
 
-void ThreadSocketHandler()
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        LOCK(cs_setNodesSocketPending);
+                        setNodesSocketPending.erase(pnode);
                     }
+                    delete pnode;
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+/** Whether there is room to receive more data for pnode. cs_vRecvMsg must be held. */
+static bool ReceiveBufferHasRoom(CNode *pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+//! Size of the buffer SocketRecvData reads into
+static const int SOCKET_RECV_BUFFER_SIZE = 0x10000;
+
+/**
+ * Read once from pnode's socket into its receive buffer. Returns the number
+ * of bytes read, or 0 if nothing was read (the socket would block, or was
+ * closed). cs_vRecvMsg must be held.
+ */
+static int SocketRecvData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[SOCKET_RECV_BUFFER_SIZE];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return nBytes;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return 0;
+}
+
+static void InactivityCheck(CNode *pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+//! Maximum number of socket events handled per epoll_wait call
+static const int MAX_EPOLL_EVENTS = 1024;
+
+/**
+ * Socket handler loop for -socketevents=epoll. Every socket is registered
+ * once, edge-triggered, and the readiness it reports is kept in the node
+ * (fSocketRecvReady/fSocketSendReady) until a read or write finds the
+ * socket drained or full. Unlike select() this has no FD_SETSIZE limit.
+ * Each wakeup only services the nodes epoll_wait returned and those in
+ * setNodesSocketPending; the whole of vNodes is only walked once a second,
+ * to disconnect nodes and check for inactivity.
+ */
+static void ThreadSocketHandlerEpoll(int hEpoll)
+{
+    BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket) {
+        // Level-triggered: one connection is accepted per wakeup.
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &hListenSocket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+            LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(WSAGetLastError()));
+    }
+
+    std::vector<struct epoll_event> vEvents(MAX_EPOLL_EVENTS);
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastSweep = 0;
+    while (true)
+    {
+        int64_t nTime = GetTime();
+        bool fSweep = nTime != nLastSweep;
+        if (fSweep) {
+            nLastSweep = nTime;
+            DisconnectNodes(nPrevNodeCount);
+        }
+
+        // Nodes are only deleted by DisconnectNodes above, so every node
+        // taken from setNodesSocketPending or reported by epoll_wait stays
+        // alive until the end of this iteration. A node is only deleted
+        // after its socket has been closed, which also removes it from
+        // hEpoll.
+        std::set<CNode*> setService;
+        {
+            LOCK(cs_setNodesSocketPending);
+            setService.swap(setNodesSocketPending);
+        }
+        BOOST_FOREACH(CNode* pnode, setService)
+        {
+            if (pnode->fSocketRegistered || pnode->hSocket == INVALID_SOCKET)
+                continue;
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.ptr = pnode;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+                LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(WSAGetLastError()));
+                pnode->CloseSocketDisconnect();
+                continue;
+            }
+            pnode->fSocketRegistered = true;
+        }
+
+        // Wake up at least as often as the select() loop, to pick up
+        // messages queued by the message handler.
+        int nEvents = epoll_wait(hEpoll, &vEvents[0], vEvents.size(), 50);
+        boost::this_thread::interruption_point();
+        if (nEvents < 0)
+        {
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEINTR)
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+            nEvents = 0;
         }
 
+        for (int i = 0; i < nEvents; i++)
+        {
+            const struct epoll_event& event = vEvents[i];
+            bool fListenSocket = false;
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+                if (event.data.ptr == &hListenSocket) {
+                    AcceptConnection(hListenSocket);
+                    fListenSocket = true;
+                }
+            }
+            if (fListenSocket)
+                continue;
+            CNode* pnode = (CNode*)event.data.ptr;
+            if (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fSocketRecvReady = true;
+            if (event.events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                pnode->fSocketSendReady = true;
+            setService.insert(pnode);
+        }
+
+        //
+        // Service each socket
+        //
+        BOOST_FOREACH(CNode* pnode, setService)
+        {
+            boost::this_thread::interruption_point();
+
+            // Same policy as the select() loop: drain pending sends before
+            // receiving more.
+            bool fSendLocked = false;
+            bool fSendPending = false;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                fSendLocked = lockSend;
+                if (lockSend && !pnode->vSendMsg.empty() && pnode->hSocket != INVALID_SOCKET) {
+                    if (pnode->fSocketSendReady) {
+                        SocketSendData(pnode);
+                        // Anything left means the socket buffer is full; wait
+                        // for the next EPOLLOUT edge.
+                        if (!pnode->vSendMsg.empty())
+                            pnode->fSocketSendReady = false;
+                    }
+                    fSendPending = !pnode->vSendMsg.empty();
+                }
+            }
+
+            if (!fSendPending && pnode->fSocketRecvReady)
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv)
+                {
+                    // Read until the socket is drained, unless the receive
+                    // buffer fills up first. A short read drains the socket:
+                    // anything arriving later raises a new edge.
+                    while (pnode->hSocket != INVALID_SOCKET && ReceiveBufferHasRoom(pnode)) {
+                        int nBytes = SocketRecvData(pnode);
+                        if (nBytes < SOCKET_RECV_BUFFER_SIZE) {
+                            pnode->fSocketRecvReady = false;
+                            break;
+                        }
+                    }
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        pnode->fSocketRecvReady = false;
+                }
+            }
+
+            // No new edge will come for a socket left readable (busy lock or
+            // full receive buffer), or for sends skipped on a busy lock: look
+            // at it again next time. A full send buffer waits for EPOLLOUT.
+            if (pnode->hSocket != INVALID_SOCKET && (!fSendLocked || (!fSendPending && pnode->fSocketRecvReady)))
+                MarkSocketPending(pnode);
+        }
+
+        if (fSweep) {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                InactivityCheck(pnode);
+        }
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (fSocketEpoll)
+    {
+        int hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll >= 0)
+        {
+            try {
+                ThreadSocketHandlerEpoll(hEpoll);
+            } catch (...) {
+                close(hEpoll);
+                throw;
+            }
+            close(hEpoll);
+            return;
+        }
+        LogPrintf("socket epoll_create error %s, falling back to select\n", NetworkErrorString(WSAGetLastError()));
+        fSocketEpoll = false;
+    }
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
+
         //
         // Find which sockets have data to receive
         //
@@ -1149,9 +1479,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && ReceiveBufferHasRoom(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -1209,39 +1537,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1259,30 +1555,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1707,11 +1980,17 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+void WakeMessageHandler()
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
+    {
+        boost::unique_lock<boost::mutex> lock(messageHandlerMutex);
+        fMessageHandlerWoken = true;
+    }
+    messageHandlerCondition.notify_one();
+}
 
+void ThreadMessageHandler()
+{
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
@@ -1765,8 +2044,10 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
+        boost::unique_lock<boost::mutex> lock(messageHandlerMutex);
+        if (fSleep && !fMessageHandlerWoken)
             messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        fMessageHandlerWoken = false;
     }
 }
 
@@ -2065,7 +2346,8 @@ void RelayTransaction(const CTransaction& tx, CFeeRate feerate)
             vRelayExpiration.pop_front();
         }
 
-        mapRelay.insert(std::make_pair(inv.hash, tx));
+        // Serialize once for every peer that will ask for it.
+        mapRelay.insert(std::make_pair(inv.hash, MakeSharedMessage(NetMsgType::TX, tx)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv.hash));
     }
     LOCK(cs_vNodes);
@@ -2364,6 +2646,9 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fSocketRegistered = false;
+    fSocketRecvReady = false;
+    fSocketSendReady = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -2451,6 +2736,22 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+/** Set the size and checksum in the header at the start of ss. Returns the payload size. */
+static unsigned int FinalizeMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    return nSize;
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
@@ -2487,33 +2788,66 @@ void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+    unsigned int nSize = FinalizeMessageHeader(ssSend);
 
     //log total amount of bytes per command
     mapSendBytesPerMsgCmd[std::string(pszCommand)] += nSize + CMessageHeader::HEADER_SIZE;
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
-
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    boost::shared_ptr<CSerializeData> msg = boost::make_shared<CSerializeData>();
+    ssSend.GetAndClear(*msg);
+    nSendSize += msg->size();
+    vSendMsg.push_back(msg);
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
+    if (!vSendMsg.empty())
+        MarkSocketPending(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+void CNode::PushSharedMessage(const char* pszCommand, const CSharedMessage& msg)
+{
+    LOCK(cs_vSend);
+    if (mapArgs.count("-dropmessagestest") && GetRand(GetArg("-dropmessagestest", 2)) == 0)
+    {
+        LogPrint("net", "dropmessages DROPPING SEND MESSAGE\n");
+        return;
+    }
+
+    //log total amount of bytes per command
+    mapSendBytesPerMsgCmd[std::string(pszCommand)] += msg->size();
+
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n", SanitizeString(pszCommand), msg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    nSendSize += msg->size();
+    vSendMsg.push_back(msg);
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+    if (!vSendMsg.empty())
+        MarkSocketPending(this);
+}
+
+CDataStream BeginSharedMessage(const char* pszCommand)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+    return ss;
+}
+
+CSharedMessage EndSharedMessage(CDataStream& ss)
+{
+    FinalizeMessageHeader(ss);
+    boost::shared_ptr<CSerializeData> msg = boost::make_shared<CSerializeData>();
+    ss.GetAndClear(*msg);
+    return msg;
+}
+
 //
 // CBanDB
 //
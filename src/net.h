@@ -9,6 +9,7 @@
 #include "amount.h"
 #include "bloom.h"
 #include "compat.h"
+#include "hash.h"
 #include "limitedmap.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -26,6 +27,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -46,6 +48,10 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
+/** Payload bytes allocated ahead of what a peer has actually sent (256 KiB). */
+static const unsigned int MAX_RECV_PREALLOC_SIZE = 256 * 1024;
+/** Receive buffers of processed messages each peer keeps for reuse. */
+static const unsigned int MAX_RECV_BUFFER_POOL = 1;
 /** Maximum length of strSubVer in `version` message */
 static const unsigned int MAX_SUBVERSION_LENGTH = 256;
 /** -listen default */
@@ -70,6 +76,8 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** -socketevents default */
+static const char * const DEFAULT_SOCKET_EVENTS = "select";
 
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
@@ -91,6 +99,33 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Wake up the message handler thread, e.g. once a peer has work for it again */
+void WakeMessageHandler();
+
+/**
+ * A complete wire message, header and checksum included. It is immutable
+ * once built, so one serialization can be queued on any number of peers
+ * with CNode::PushSharedMessage.
+ */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+/** Start a shared message: a stream holding the header for pszCommand, to append the payload to. */
+CDataStream BeginSharedMessage(const char* pszCommand);
+/** Fill in the size and checksum of a stream started by BeginSharedMessage, and take its contents. */
+CSharedMessage EndSharedMessage(CDataStream& ss);
+
+/**
+ * Serialize a message once for sending to several peers. Only for payloads
+ * whose encoding does not depend on the peer's protocol version (blocks,
+ * transactions).
+ */
+template<typename T1>
+CSharedMessage MakeSharedMessage(const char* pszCommand, const T1& a1)
+{
+    CDataStream ss = BeginSharedMessage(pszCommand);
+    ss << a1;
+    return EndSharedMessage(ss);
+}
 
 typedef int NodeId;
 
@@ -152,6 +187,8 @@ CAddress GetLocalAddress(const CNetAddr *paddrPeer = NULL);
 
 extern bool fDiscover;
 extern bool fListen;
+/** Whether the socket handler waits for socket events with epoll instead of select (-socketevents) */
+extern bool fSocketEpoll;
 extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
@@ -161,7 +198,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<uint256, CTransaction> mapRelay;
+extern std::map<uint256, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, uint256> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
@@ -226,6 +263,11 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
+private:
+    mutable CHash256 hasher;        // hash of the data received so far
+    mutable uint256 data_hash;      // set once the message is complete and hashed
+
+public:
     CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
@@ -249,6 +291,9 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** The double-SHA256 of the payload, hashed as it arrived. Only valid once complete(). */
+    const uint256& GetMessageHash() const;
 };
 
 
@@ -324,11 +369,12 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
+    std::vector<CSerializeData> vRecvBufferPool; // requires LOCK(cs_vRecvMsg)
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
@@ -353,6 +399,11 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Socket registration and readiness for -socketevents=epoll, only
+    // touched by the socket handler thread
+    bool fSocketRegistered;
+    bool fSocketRecvReady;
+    bool fSocketSendReady;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in its version message that we should not relay tx invs
@@ -466,6 +517,10 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    /** Keep the payload buffer of a processed message for the next one, unless it
+     *  grew past MAX_RECV_PREALLOC_SIZE. requires LOCK(cs_vRecvMsg) */
+    void RecycleRecvBuffer(CNetMessage& msg);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -544,6 +599,9 @@ public:
 
     void PushVersion();
 
+    /** Queue a message built with MakeSharedMessage, without copying it. */
+    void PushSharedMessage(const char* pszCommand, const CSharedMessage& msg);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -13,42 +13,66 @@
 #include "txmempool.h"
 #include "util.h"
 
+#include <math.h>
+
 void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
-                                unsigned int maxConfirms, double _decay, std::string _dataTypeString)
+                                unsigned int _maxConfirms, double _decay, std::string _dataTypeString)
 {
     decay = _decay;
     dataTypeString = _dataTypeString;
-    for (unsigned int i = 0; i < defaultBuckets.size(); i++) {
-        buckets.push_back(defaultBuckets[i]);
-        bucketMap[defaultBuckets[i]] = i;
-    }
-    confAvg.resize(maxConfirms);
-    curBlockConf.resize(maxConfirms);
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        confAvg[i].resize(buckets.size());
-        curBlockConf[i].resize(buckets.size());
-        unconfTxs[i].resize(buckets.size());
-    }
+    buckets = defaultBuckets;
+    maxConfirms = _maxConfirms;
+    Resize();
+}
+
+void TxConfirmStats::Resize()
+{
+    confAvg.resize(maxConfirms * buckets.size());
+    curBlockConf.resize(maxConfirms * buckets.size());
+    unconfTxs.resize(maxConfirms * buckets.size());
 
     oldUnconfTxs.resize(buckets.size());
     curBlockTxCt.resize(buckets.size());
     txCtAvg.resize(buckets.size());
     curBlockVal.resize(buckets.size());
     avg.resize(buckets.size());
+
+    logFirstBucket = 0;
+    logBucketSpacing = 0;
+    if (buckets.size() > 1 && buckets[0] > 0 && buckets[1] > buckets[0]) {
+        logFirstBucket = log(buckets[0]);
+        logBucketSpacing = log(buckets[1]) - logFirstBucket;
+    }
+}
+
+unsigned int TxConfirmStats::FindBucketIndex(double val) const
+{
+    // Start from where the bucket would be if the spacing were exact, then
+    // walk the few steps rounding may have put us off by
+    unsigned int maxbucketindex = buckets.size() - 1;
+    unsigned int bucketindex = 0;
+    if (logBucketSpacing > 0 && val > buckets[0]) {
+        double guess = ceil((log(val) - logFirstBucket) / logBucketSpacing);
+        bucketindex = guess < maxbucketindex ? (unsigned int)guess : maxbucketindex;
+    }
+    while (bucketindex > 0 && buckets[bucketindex - 1] >= val)
+        bucketindex--;
+    while (bucketindex < maxbucketindex && buckets[bucketindex] < val)
+        bucketindex++;
+    return bucketindex;
 }
 
 // Zero out the data for the current block
 void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
 {
+    int *blockUnconfTxs = &unconfTxs[(nBlockHeight % maxConfirms) * buckets.size()];
     for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight%unconfTxs.size()][j];
-        unconfTxs[nBlockHeight%unconfTxs.size()][j] = 0;
-        for (unsigned int i = 0; i < curBlockConf.size(); i++)
-            curBlockConf[i][j] = 0;
-        curBlockTxCt[j] = 0;
-        curBlockVal[j] = 0;
+        oldUnconfTxs[j] += blockUnconfTxs[j];
+        blockUnconfTxs[j] = 0;
     }
+    std::fill(curBlockConf.begin(), curBlockConf.end(), 0);
+    std::fill(curBlockTxCt.begin(), curBlockTxCt.end(), 0);
+    std::fill(curBlockVal.begin(), curBlockVal.end(), 0);
 }
 
 
@@ -57,19 +81,23 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
     // blocksToConfirm is 1-based
     if (blocksToConfirm < 1)
         return;
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
-        curBlockConf[i - 1][bucketindex]++;
-    }
+    unsigned int bucketindex = FindBucketIndex(val);
+    if ((unsigned int)blocksToConfirm <= maxConfirms)
+        curBlockConf[(blocksToConfirm - 1) * buckets.size() + bucketindex]++;
     curBlockTxCt[bucketindex]++;
     curBlockVal[bucketindex] += val;
 }
 
 void TxConfirmStats::UpdateMovingAverages()
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
+    // A tx confirmed in Y blocks was also confirmed within any Z >= Y blocks,
+    // so turn the current block's counts into running totals over Y first
+    const unsigned int nBuckets = buckets.size();
+    for (unsigned int k = nBuckets; k < curBlockConf.size(); k++)
+        curBlockConf[k] += curBlockConf[k - nBuckets];
+    for (unsigned int k = 0; k < confAvg.size(); k++)
+        confAvg[k] = confAvg[k] * decay + curBlockConf[k];
+    for (unsigned int j = 0; j < nBuckets; j++) {
         avg[j] = avg[j] * decay + curBlockVal[j];
         txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
     }
@@ -105,15 +133,15 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     unsigned int bestFarBucket = startbucket;
 
     bool foundAnswer = false;
-    unsigned int bins = unconfTxs.size();
+    unsigned int bins = maxConfirms;
 
     // Start counting from highest(default) or lowest fee/pri transactions
     for (int bucket = startbucket; bucket >= 0 && bucket <= maxbucketindex; bucket += step) {
         curFarBucket = bucket;
-        nConf += confAvg[confTarget - 1][bucket];
+        nConf += confAvg[(confTarget - 1) * buckets.size() + bucket];
         totalNum += txCtAvg[bucket];
         for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
-            extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
+            extraNum += unconfTxs[(nBlockHeight - confct)%bins * buckets.size() + bucket];
         extraNum += oldUnconfTxs[bucket];
         // If we have enough transaction data points in this range of buckets,
         // we can test for success
@@ -174,16 +202,22 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     return median;
 }
 
-void TxConfirmStats::Write(CAutoFile& fileout)
+void TxConfirmStats::Write(CDataStream& fileout)
 {
     fileout << decay;
     fileout << buckets;
     fileout << avg;
     fileout << txCtAvg;
-    fileout << confAvg;
+    // Same format as a std::vector<std::vector<double> > confAvg[Y][X]
+    WriteCompactSize(fileout, maxConfirms);
+    for (unsigned int i = 0; i < maxConfirms; i++) {
+        WriteCompactSize(fileout, buckets.size());
+        for (unsigned int j = 0; j < buckets.size(); j++)
+            fileout << confAvg[i * buckets.size() + j];
+    }
 }
 
-void TxConfirmStats::Read(CAutoFile& filein)
+void TxConfirmStats::Read(CDataStream& filein)
 {
     // Read data file into temporary variables and do some very basic sanity checking
     std::vector<double> fileBuckets;
@@ -191,7 +225,7 @@ void TxConfirmStats::Read(CAutoFile& filein)
     std::vector<std::vector<double> > fileConfAvg;
     std::vector<double> fileTxCtAvg;
     double fileDecay;
-    size_t maxConfirms;
+    size_t fileMaxConfirms;
     size_t numBuckets;
 
     filein >> fileDecay;
@@ -208,10 +242,10 @@ void TxConfirmStats::Read(CAutoFile& filein)
     if (fileTxCtAvg.size() != numBuckets)
         throw std::runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
     filein >> fileConfAvg;
-    maxConfirms = fileConfAvg.size();
-    if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) // one week
+    fileMaxConfirms = fileConfAvg.size();
+    if (fileMaxConfirms <= 0 || fileMaxConfirms > 6 * 24 * 7) // one week
         throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
-    for (unsigned int i = 0; i < maxConfirms; i++) {
+    for (unsigned int i = 0; i < fileMaxConfirms; i++) {
         if (fileConfAvg[i].size() != numBuckets)
             throw std::runtime_error("Corrupt estimates file. Mismatch in fee/pri conf average bucket count");
     }
@@ -220,27 +254,16 @@ void TxConfirmStats::Read(CAutoFile& filein)
     decay = fileDecay;
     buckets = fileBuckets;
     avg = fileAvg;
-    confAvg = fileConfAvg;
     txCtAvg = fileTxCtAvg;
-    bucketMap.clear();
+    maxConfirms = fileMaxConfirms;
+    confAvg.clear();
+    confAvg.reserve(maxConfirms * numBuckets);
+    for (unsigned int i = 0; i < maxConfirms; i++)
+        confAvg.insert(confAvg.end(), fileConfAvg[i].begin(), fileConfAvg[i].end());
 
     // Resize the current block variables which aren't stored in the data file
     // to match the number of confirms and buckets
-    curBlockConf.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        curBlockConf[i].resize(buckets.size());
-    }
-    curBlockTxCt.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
-
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        unconfTxs[i].resize(buckets.size());
-    }
-    oldUnconfTxs.resize(buckets.size());
-
-    for (unsigned int i = 0; i < buckets.size(); i++)
-        bucketMap[buckets[i]] = i;
+    Resize();
 
     LogPrint("estimatefee", "Reading estimates: %u %s buckets counting confirms up to %u blocks\n",
              numBuckets, dataTypeString, maxConfirms);
@@ -248,9 +271,9 @@ void TxConfirmStats::Read(CAutoFile& filein)
 
 unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
 {
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    unsigned int blockIndex = nBlockHeight % unconfTxs.size();
-    unconfTxs[blockIndex][bucketindex]++;
+    unsigned int bucketindex = FindBucketIndex(val);
+    unsigned int blockIndex = nBlockHeight % maxConfirms;
+    unconfTxs[blockIndex * buckets.size() + bucketindex]++;
     LogPrint("estimatefee", "adding to %s", dataTypeString);
     return bucketindex;
 }
@@ -266,7 +289,7 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
         return;  //This can't happen because we call this with our best seen height, no entries can have higher
     }
 
-    if (blocksAgo >= (int)unconfTxs.size()) {
+    if (blocksAgo >= (int)maxConfirms) {
         if (oldUnconfTxs[bucketindex] > 0)
             oldUnconfTxs[bucketindex]--;
         else
@@ -274,9 +297,9 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
                      bucketindex);
     }
     else {
-        unsigned int blockIndex = entryHeight % unconfTxs.size();
-        if (unconfTxs[blockIndex][bucketindex] > 0)
-            unconfTxs[blockIndex][bucketindex]--;
+        unsigned int blockIndex = entryHeight % maxConfirms;
+        if (unconfTxs[blockIndex * buckets.size() + bucketindex] > 0)
+            unconfTxs[blockIndex * buckets.size() + bucketindex]--;
         else
             LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
                      blockIndex, bucketindex);
@@ -435,7 +458,7 @@ void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxM
 }
 
 void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
-                                         std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate)
+                                         std::vector<const CTxMemPoolEntry*>& entries, bool fCurrentEstimate)
 {
     if (nBlockHeight <= nBestSeenHeight) {
         // Ignore side chains and re-orgs; assuming they are random
@@ -482,7 +505,7 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
 
     // Repopulate the current block states
     for (unsigned int i = 0; i < entries.size(); i++)
-        processBlockTx(nBlockHeight, entries[i]);
+        processBlockTx(nBlockHeight, *entries[i]);
 
     // Update all exponential averages with the current block states
     feeStats.UpdateMovingAverages();
@@ -568,17 +591,31 @@ double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerF
 
 void CBlockPolicyEstimator::Write(CAutoFile& fileout)
 {
-    fileout << nBestSeenHeight;
-    feeStats.Write(fileout);
-    priStats.Write(fileout);
+    // Serialize everything in memory and hand it to the file in one write
+    CDataStream ss(fileout.GetType(), fileout.GetVersion());
+    ss << nBestSeenHeight;
+    feeStats.Write(ss);
+    priStats.Write(ss);
+    fileout.write(&ss[0], ss.size());
 }
 
 void CBlockPolicyEstimator::Read(CAutoFile& filein)
 {
+    // The estimates run to the end of the file; read them in one go
+    CDataStream ss(filein.GetType(), filein.GetVersion());
+    if (!filein.IsNull()) {
+        char buf[65536];
+        size_t nRead;
+        while ((nRead = fread(buf, 1, sizeof(buf), filein.Get())) > 0)
+            ss.write(buf, nRead);
+        if (ferror(filein.Get()))
+            throw std::ios_base::failure("CBlockPolicyEstimator::Read: fread failed");
+    }
+
     int nFileBestSeenHeight;
-    filein >> nFileBestSeenHeight;
-    feeStats.Read(filein);
-    priStats.Read(filein);
+    ss >> nFileBestSeenHeight;
+    feeStats.Read(ss);
+    priStats.Read(ss);
     nBestSeenHeight = nFileBestSeenHeight;
 }
 
@@ -13,6 +13,7 @@
 #include <vector>
 
 class CAutoFile;
+class CDataStream;
 class CFeeRate;
 class CTxMemPoolEntry;
 class CTxMemPool;
@@ -81,7 +82,14 @@ class TxConfirmStats
 private:
     //Define the buckets we will group transactions into (both fee buckets and priority buckets)
     std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
+    // The buckets are spaced exponentially, so the log of a value gives its
+    // bucket index up to rounding, see FindBucketIndex
+    double logFirstBucket;
+    double logBucketSpacing;
+
+    // The per confirmation count stats below are flat arrays of
+    // maxConfirms rows of buckets.size() entries, indexed [Y * buckets.size() + X]
+    unsigned int maxConfirms;
 
     // For each bucket X:
     // Count the total # of txs in each bucket
@@ -92,9 +100,10 @@ private:
 
     // Count the total # of txs confirmed within Y blocks in each bucket
     // Track the historical moving average of theses totals over blocks
-    std::vector<std::vector<double> > confAvg; // confAvg[Y][X]
-    // and calculate the totals for the current block to update the moving averages
-    std::vector<std::vector<int> > curBlockConf; // curBlockConf[Y][X]
+    std::vector<double> confAvg; // confAvg[Y][X]
+    // and count the txs of the current block confirmed in exactly Y blocks,
+    // which UpdateMovingAverages sums up into the within Y blocks totals
+    std::vector<int> curBlockConf; // curBlockConf[Y][X]
 
     // Sum the total priority/fee of all tx's in each bucket
     // Track the historical moving average of this total over blocks
@@ -111,10 +120,16 @@ private:
     // Mempool counts of outstanding transactions
     // For each bucket X, track the number of transactions in the mempool
     // that are unconfirmed for each possible confirmation value Y
-    std::vector<std::vector<int> > unconfTxs;  //unconfTxs[Y][X]
+    std::vector<int> unconfTxs;  //unconfTxs[Y][X]
     // transactions still unconfirmed after MAX_CONFIRMS for each bucket
     std::vector<int> oldUnconfTxs;
 
+    /** Return the index of the lowest bucket whose upper bound is at least val */
+    unsigned int FindBucketIndex(double val) const;
+
+    /** Size the per bucket stats to buckets and maxConfirms and set up the bucket lookup */
+    void Resize();
+
 public:
     /**
      * Initialize the data structures.  This is called by BlockPolicyEstimator's
@@ -163,16 +178,16 @@ public:
                              double minSuccess, bool requireGreater, unsigned int nBlockHeight);
 
     /** Return the max number of confirms we're tracking */
-    unsigned int GetMaxConfirms() { return confAvg.size(); }
+    unsigned int GetMaxConfirms() { return maxConfirms; }
 
     /** Write state of estimation data to a file*/
-    void Write(CAutoFile& fileout);
+    void Write(CDataStream& fileout);
 
     /**
      * Read saved state of estimation data from a file and replace all internal data structures and
      * variables with this state.
      */
-    void Read(CAutoFile& filein);
+    void Read(CDataStream& filein);
 };
 
 
@@ -223,7 +238,7 @@ public:
 
     /** Process all the transactions that have been included in a block */
     void processBlock(unsigned int nBlockHeight,
-                      std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate);
+                      std::vector<const CTxMemPoolEntry*>& entries, bool fCurrentEstimate);
 
     /** Process a transaction confirmed in a block*/
     void processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry);
@@ -35,7 +35,9 @@ RBFTransactionState IsRBFOptIn(const CTransaction &tx, CTxMemPool &pool)
     // signaled for RBF if any unconfirmed parents have signaled.
     uint64_t noLimit = std::numeric_limits<uint64_t>::max();
     std::string dummy;
-    CTxMemPoolEntry entry = *pool.mapTx.find(tx.GetHash());
+    // The ancestor walk looks the entry up by address, so it must be the
+    // pool's own entry rather than a copy
+    const CTxMemPoolEntry& entry = *pool.mapTx.find(tx.GetHash());
     pool.CalculateMemPoolAncestors(entry, setAncestors, noLimit, noLimit, noLimit, noLimit, dummy, false);
 
     BOOST_FOREACH(CTxMemPool::txiter it, setAncestors) {
@@ -11,6 +11,11 @@
 #include "uint256.h"
 #include "lbry.h"
 
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
 unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params)
 {
     unsigned int nProofOfWorkLimit = UintToArith256(params.powLimit).GetCompact();
@@ -99,3 +104,65 @@ bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&
 
     return true;
 }
+
+//! Number of headers hashed together by CheckBlockIndexProofOfWork (divides 1024)
+static const size_t POW_HASH_BATCH = 64;
+
+static void CheckBlockIndexProofOfWorkRange(const std::vector<CBlockIndex*>* pvIndex, size_t nBegin, size_t nEnd, const Consensus::Params* params, const CBlockIndex** ppindexFailed)
+{
+    // Hash in small batches to keep the multi-lane hash kernels busy.
+    std::vector<CBlockHeader> vHeaders;
+    std::vector<uint256> vHashes;
+    for (size_t i = nBegin; i < nEnd; i += POW_HASH_BATCH) {
+        if ((i - nBegin) % 1024 == 0)
+            boost::this_thread::interruption_point();
+        size_t nBatchEnd = std::min(nEnd, i + POW_HASH_BATCH);
+        vHeaders.clear();
+        for (size_t j = i; j < nBatchEnd; j++)
+            vHeaders.push_back((*pvIndex)[j]->GetBlockHeader());
+        GetPoWHashes(vHeaders, vHashes);
+        for (size_t j = i; j < nBatchEnd; j++) {
+            const CBlockIndex* pindex = (*pvIndex)[j];
+            if (!CheckProofOfWork(vHashes[j - i], pindex->nBits, *params)) {
+                *ppindexFailed = pindex;
+                return;
+            }
+        }
+    }
+}
+
+const CBlockIndex* CheckBlockIndexProofOfWork(const std::vector<CBlockIndex*>& vIndex, const Consensus::Params& params, int nThreads)
+{
+    // Not worth starting threads for a handful of headers.
+    if (nThreads > (int)(vIndex.size() / 1024))
+        nThreads = vIndex.size() / 1024;
+    if (nThreads <= 1) {
+        const CBlockIndex* pindexFailed = NULL;
+        CheckBlockIndexProofOfWorkRange(&vIndex, 0, vIndex.size(), &params, &pindexFailed);
+        return pindexFailed;
+    }
+
+    // Each thread checks one contiguous range and records its first failure.
+    std::vector<const CBlockIndex*> vFailed(nThreads, NULL);
+    boost::thread_group threads;
+    size_t nChunk = (vIndex.size() + nThreads - 1) / nThreads;
+    for (int i = 0; i < nThreads; i++) {
+        size_t nBegin = std::min(vIndex.size(), i * nChunk);
+        size_t nEnd = std::min(vIndex.size(), nBegin + nChunk);
+        threads.create_thread(boost::bind(&CheckBlockIndexProofOfWorkRange, &vIndex, nBegin, nEnd, &params, &vFailed[i]));
+    }
+    try {
+        threads.join_all();
+    } catch (const boost::thread_interrupted&) {
+        // The workers reference our locals, so they have to be gone before we unwind.
+        threads.interrupt_all();
+        threads.join_all();
+        throw;
+    }
+
+    for (int i = 0; i < nThreads; i++) {
+        if (vFailed[i])
+            return vFailed[i];
+    }
+    return NULL;
+}
@@ -9,6 +9,7 @@
 #include "consensus/params.h"
 
 #include <stdint.h>
+#include <vector>
 
 class CBlockHeader;
 class CBlockIndex;
@@ -21,4 +22,11 @@ unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nF
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&);
 
+/**
+ * Check the proof of work of many block index entries, spreading the work
+ * over nThreads threads. Returns the first entry (in vIndex order) that
+ * fails, or NULL if all of them are valid.
+ */
+const CBlockIndex* CheckBlockIndexProofOfWork(const std::vector<CBlockIndex*>& vIndex, const Consensus::Params&, int nThreads);
+
 #endif // BITCOIN_POW_H
@@ -18,10 +18,31 @@ uint256 CBlockHeader::GetHash() const
 
 uint256 CBlockHeader::GetPoWHash() const
 {
-    CDataStream ds(SER_GETHASH, PROTOCOL_VERSION);
-    ds << *this;
-    std::vector<unsigned char> input(ds.begin(), ds.end());
-    return PoWHash(input);
+    unsigned char buf[BLOCK_HEADER_SIZE];
+    SerializeHeader(buf);
+    return PoWHash(buf, sizeof(buf));
+}
+
+void CBlockHeader::SerializeHeader(unsigned char* buf) const
+{
+    WriteLE32(buf, nVersion);
+    memcpy(buf + 4, hashPrevBlock.begin(), 32);
+    memcpy(buf + 36, hashMerkleRoot.begin(), 32);
+    memcpy(buf + 68, hashClaimTrie.begin(), 32);
+    WriteLE32(buf + 100, nTime);
+    WriteLE32(buf + 104, nBits);
+    WriteLE32(buf + 108, nNonce);
+}
+
+void GetPoWHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes)
+{
+    vHashes.resize(vHeaders.size());
+    if (vHeaders.empty())
+        return;
+    std::vector<unsigned char> vInput(vHeaders.size() * BLOCK_HEADER_SIZE);
+    for (size_t i = 0; i < vHeaders.size(); i++)
+        vHeaders[i].SerializeHeader(&vInput[i * BLOCK_HEADER_SIZE]);
+    PoWHashBatch(&vInput[0], BLOCK_HEADER_SIZE, vHeaders.size(), &vHashes[0]);
 }
 
 std::string CBlock::ToString() const
@@ -10,6 +10,9 @@
 #include "serialize.h"
 #include "uint256.h"
 
+//! Size of a serialized block header, the input of the proof-of-work hash
+static const size_t BLOCK_HEADER_SIZE = 112;
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -68,12 +71,18 @@ public:
 
     uint256 GetPoWHash() const;
 
+    /** Write the BLOCK_HEADER_SIZE byte serialization of this header to buf. */
+    void SerializeHeader(unsigned char* buf) const;
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
     }
 };
 
+/** Compute GetPoWHash() for every header, using the multi-lane hash kernels. */
+void GetPoWHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes);
+
 
 class CBlock : public CBlockHeader
 {
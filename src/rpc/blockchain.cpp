@@ -991,25 +991,25 @@ UniValue reconsiderblock(const UniValue& params, bool fHelp)
 }
 
 static const CRPCCommand commands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
-    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true  },
-    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true  },
-    { "blockchain",         "getblockcount",          &getblockcount,          true  },
-    { "blockchain",         "getblock",               &getblock,               true  },
-    { "blockchain",         "getblockhash",           &getblockhash,           true  },
-    { "blockchain",         "getblockheader",         &getblockheader,         true  },
-    { "blockchain",         "getchaintips",           &getchaintips,           true  },
-    { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
-    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
-    { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
-    { "blockchain",         "gettxout",               &gettxout,               true  },
-    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
-    { "blockchain",         "verifychain",            &verifychain,            true  },
+{ //  category              name                      actor (function)         okSafeMode  okParallel
+  //  --------------------- ------------------------  -----------------------  ----------  ----------
+    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true,       true  },
+    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true,       true  },
+    { "blockchain",         "getblockcount",          &getblockcount,          true,       true  },
+    { "blockchain",         "getblock",               &getblock,               true,       true  },
+    { "blockchain",         "getblockhash",           &getblockhash,           true,       true  },
+    { "blockchain",         "getblockheader",         &getblockheader,         true,       true  },
+    { "blockchain",         "getchaintips",           &getchaintips,           true,       true  },
+    { "blockchain",         "getdifficulty",          &getdifficulty,          true,       true  },
+    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,       true  },
+    { "blockchain",         "getrawmempool",          &getrawmempool,          true,       true  },
+    { "blockchain",         "gettxout",               &gettxout,               true,       true  },
+    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,       false },
+    { "blockchain",         "verifychain",            &verifychain,            true,       false },
 
     /* Not shown in help */
-    { "hidden",             "invalidateblock",        &invalidateblock,        true  },
-    { "hidden",             "reconsiderblock",        &reconsiderblock,        true  },
+    { "hidden",             "invalidateblock",        &invalidateblock,        true,       false },
+    { "hidden",             "reconsiderblock",        &reconsiderblock,        true,       false },
 };
 
 void RegisterBlockchainRPCCommands(CRPCTable &tableRPC)
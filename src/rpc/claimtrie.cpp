@@ -748,18 +748,18 @@ UniValue getnameproof(const UniValue& params, bool fHelp)
 }
 
 static const CRPCCommand commands[] =
-{ //  category              name                           actor (function)        okSafeMode
-  //  --------------------- ------------------------     -----------------------  ----------
-    { "Claimtrie",             "getclaimsintrie",         &getclaimsintrie,         true  },
-    { "Claimtrie",             "getclaimtrie",            &getclaimtrie,            true  },
-    { "Claimtrie",             "getvalueforname",         &getvalueforname,         true  },
-    { "Claimtrie",             "getclaimsforname",        &getclaimsforname,        true  },
-    { "Claimtrie",             "gettotalclaimednames",    &gettotalclaimednames,    true  },
-    { "Claimtrie",             "gettotalclaims",          &gettotalclaims,          true  },
-    { "Claimtrie",             "gettotalvalueofclaims",   &gettotalvalueofclaims,   true  },
-    { "Claimtrie",             "getclaimsfortx",          &getclaimsfortx,          true  },
-    { "Claimtrie",             "getnameproof",            &getnameproof,            true  },
-    { "Claimtrie",             "getclaimbyid",            &getclaimbyid,            true  },
+{ //  category              name                           actor (function)        okSafeMode  okParallel
+  //  --------------------- ------------------------     -----------------------  ----------  ----------
+    { "Claimtrie",             "getclaimsintrie",         &getclaimsintrie,         true,       true  },
+    { "Claimtrie",             "getclaimtrie",            &getclaimtrie,            true,       true  },
+    { "Claimtrie",             "getvalueforname",         &getvalueforname,         true,       true  },
+    { "Claimtrie",             "getclaimsforname",        &getclaimsforname,        true,       true  },
+    { "Claimtrie",             "gettotalclaimednames",    &gettotalclaimednames,    true,       true  },
+    { "Claimtrie",             "gettotalclaims",          &gettotalclaims,          true,       true  },
+    { "Claimtrie",             "gettotalvalueofclaims",   &gettotalvalueofclaims,   true,       true  },
+    { "Claimtrie",             "getclaimsfortx",          &getclaimsfortx,          true,       true  },
+    { "Claimtrie",             "getnameproof",            &getnameproof,            true,       true  },
+    { "Claimtrie",             "getclaimbyid",            &getclaimbyid,            true,       true  },
 };
 
 void RegisterClaimTrieRPCCommands(CRPCTable &tableRPC)
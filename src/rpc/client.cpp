@@ -31,8 +31,10 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "setgenerate", 1 },
     { "generate", 0 },
     { "generate", 1 },
+    { "generate", 2 },
     { "generatetoaddress", 0 },
     { "generatetoaddress", 2 },
+    { "generatetoaddress", 3 },
     { "getnetworkhashps", 0 },
     { "getnetworkhashps", 1 },
     { "sendtoaddress", 1 },
@@ -10,6 +10,8 @@
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
 #include "core_io.h"
+#include "crypto/common.h"
+#include "hash.h"
 #include "init.h"
 #include "main.h"
 #include "miner.h"
@@ -133,13 +135,30 @@ UniValue getgenerate(const UniValue& params, bool fHelp)
     return GetBoolArg("-gen", DEFAULT_GENERATE);
 }
 
-UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nGenerate, uint64_t nMaxTries, bool keepScript)
+/**
+ * The nthreads argument of generate and generatetoaddress, -1 for all cores.
+ * More threads than cores would only compete for them, so that is the limit.
+ */
+static int ParseGenerateThreads(const UniValue& param)
+{
+    int nMaxThreads = std::max(GetNumCores(), 1);
+    int nThreads = param.get_int();
+    if (nThreads == -1)
+        return nMaxThreads;
+    if (nThreads < 1 || nThreads > nMaxThreads)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Invalid nthreads, must be between 1 and %d, or -1 for all cores", nMaxThreads));
+    return nThreads;
+}
+
+UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nGenerate, uint64_t nMaxTries, bool keepScript, int nThreads)
 {
     static const int nInnerLoopCount = 0x10000;
     int nHeightStart = 0;
     int nHeightEnd = 0;
     int nHeight = 0;
 
+    assert(nThreads >= 1);
+
     {   // Don't keep cs_main locked
         LOCK(cs_main);
         nHeightStart = chainActive.Height();
@@ -153,21 +172,25 @@ UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nG
         auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(Params(), coinbaseScript->reserveScript));
         if (!pblocktemplate.get())
             throw JSONRPCError(RPC_INTERNAL_ERROR, "Couldn't create new block");
-        CBlock *pblock = &pblocktemplate->block;
+        // Give every thread its own extra nonce, and so its own nonce space.
+        std::vector<CBlock> vBlocks(nThreads, pblocktemplate->block);
+        std::vector<CBlockHeader> vHeaders;
         {
             LOCK(cs_main);
-            IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
-        }
-        while (nMaxTries > 0 && pblock->nNonce < nInnerLoopCount && !CheckProofOfWork(pblock->GetPoWHash(), pblock->nBits, Params().GetConsensus())) {
-            ++pblock->nNonce;
-            --nMaxTries;
-        }
-        if (nMaxTries == 0) {
-            break;
+            for (int i = 0; i < nThreads; i++) {
+                IncrementExtraNonce(&vBlocks[i], chainActive.Tip(), nExtraNonce);
+                vHeaders.push_back(vBlocks[i].GetBlockHeader());
+            }
         }
-        if (pblock->nNonce == nInnerLoopCount) {
+        int nFound = SearchProofOfWork(vHeaders, nInnerLoopCount, nMaxTries, Params().GetConsensus());
+        if (nFound < 0) {
+            if (nMaxTries == 0) {
+                break;
+            }
             continue;
         }
+        CBlock *pblock = &vBlocks[nFound];
+        pblock->nNonce = vHeaders[nFound].nNonce;
         CValidationState state;
         if (!ProcessNewBlock(state, Params(), NULL, pblock, true, NULL))
             throw JSONRPCError(RPC_INTERNAL_ERROR, "ProcessNewBlock, block not accepted");
@@ -229,18 +252,21 @@ UniValue setgenerate(const UniValue& params, bool fHelp)
 
 UniValue generate(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() < 1 || params.size() > 2)
+    if (fHelp || params.size() < 1 || params.size() > 3)
         throw runtime_error(
-            "generate numblocks ( maxtries )\n"
+            "generate numblocks ( maxtries nthreads )\n"
             "\nMine up to numblocks blocks immediately (before the RPC call returns)\n"
             "\nArguments:\n"
             "1. numblocks    (numeric, required) How many blocks are generated immediately.\n"
             "2. maxtries     (numeric, optional) How many iterations to try (default = 1000000).\n"
+            "3. nthreads     (numeric, optional) How many threads to search with, up to one per core, -1 for all cores (default = 1).\n"
             "\nResult\n"
             "[ blockhashes ]     (array) hashes of blocks generated\n"
             "\nExamples:\n"
             "\nGenerate 11 blocks\n"
             + HelpExampleCli("generate", "11")
+            + "\nGenerate 11 blocks on 4 threads\n"
+            + HelpExampleCli("generate", "11 1000000 4")
         );
 
     int nGenerate = params[0].get_int();
@@ -248,6 +274,10 @@ UniValue generate(const UniValue& params, bool fHelp)
     if (params.size() > 1) {
         nMaxTries = params[1].get_int();
     }
+    int nThreads = 1;
+    if (params.size() > 2) {
+        nThreads = ParseGenerateThreads(params[2]);
+    }
 
     boost::shared_ptr<CReserveScript> coinbaseScript;
     GetMainSignals().ScriptForMining(coinbaseScript);
@@ -260,19 +290,20 @@ UniValue generate(const UniValue& params, bool fHelp)
     if (coinbaseScript->reserveScript.empty())
         throw JSONRPCError(RPC_INTERNAL_ERROR, "No coinbase script available (mining requires a wallet)");
 
-    return generateBlocks(coinbaseScript, nGenerate, nMaxTries, true);
+    return generateBlocks(coinbaseScript, nGenerate, nMaxTries, true, nThreads);
 }
 
 UniValue generatetoaddress(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() < 2 || params.size() > 3)
+    if (fHelp || params.size() < 2 || params.size() > 4)
         throw runtime_error(
-            "generatetoaddress numblocks address (maxtries)\n"
+            "generatetoaddress numblocks address (maxtries nthreads)\n"
             "\nMine blocks immediately to a specified address (before the RPC call returns)\n"
             "\nArguments:\n"
             "1. numblocks    (numeric, required) How many blocks are generated immediately.\n"
             "2. address    (string, required) The address to send the newly generated bitcoin to.\n"
             "3. maxtries     (numeric, optional) How many iterations to try (default = 1000000).\n"
+            "4. nthreads     (numeric, optional) How many threads to search with, up to one per core, -1 for all cores (default = 1).\n"
             "\nResult\n"
             "[ blockhashes ]     (array) hashes of blocks generated\n"
             "\nExamples:\n"
@@ -285,6 +316,10 @@ UniValue generatetoaddress(const UniValue& params, bool fHelp)
     if (params.size() > 2) {
         nMaxTries = params[2].get_int();
     }
+    int nThreads = 1;
+    if (params.size() > 3) {
+        nThreads = ParseGenerateThreads(params[3]);
+    }
 
     CBitcoinAddress address(params[1].get_str());
     if (!address.IsValid())
@@ -293,7 +328,7 @@ UniValue generatetoaddress(const UniValue& params, bool fHelp)
     boost::shared_ptr<CReserveScript> coinbaseScript(new CReserveScript());
     coinbaseScript->reserveScript = GetScriptForDestination(address.Get());
 
-    return generateBlocks(coinbaseScript, nGenerate, nMaxTries, false);
+    return generateBlocks(coinbaseScript, nGenerate, nMaxTries, false, nThreads);
 }
 
 UniValue getmininginfo(const UniValue& params, bool fHelp)
@@ -562,31 +597,25 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
 
     // Update block
     static CBlockIndex* pindexPrev;
-    static int64_t nStart;
+    static CBlockTemplateBuilder templateBuilder;
     static CBlockTemplate* pblocktemplate;
     if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+        mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast)
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = NULL;
 
-        // Store the pindexBest used before CreateNewBlock, to avoid races
+        // Store the pindexBest used before updating the template, to avoid races
         nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
         CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
 
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
+        // Update the previous template, or create a new one
         CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(Params(), scriptDummy);
+        pblocktemplate = templateBuilder.GetTemplate(Params(), scriptDummy);
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        // Need to update only after we know CreateNewBlock succeeded
+        // Need to update only after we know the template is up to date
         pindexPrev = pindexPrevNew;
     }
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
@@ -873,24 +902,24 @@ UniValue estimatesmartpriority(const UniValue& params, bool fHelp)
 }
 
 static const CRPCCommand commands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
-    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true  },
-    { "mining",             "gethashespersec",        &gethashespersec,        true  },
-    { "mining",             "getmininginfo",          &getmininginfo,          true  },
-    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true  },
-    { "mining",             "getblocktemplate",       &getblocktemplate,       true  },
-    { "mining",             "submitblock",            &submitblock,            true  },
-    { "mining",             "setgenerate",            &setgenerate,            true  },
-    { "mining",             "getgenerate",            &getgenerate,            true  },
-
-    { "generating",         "generate",               &generate,               true  },
-    { "generating",         "generatetoaddress",      &generatetoaddress,      true  },
-
-    { "util",               "estimatefee",            &estimatefee,            true  },
-    { "util",               "estimatepriority",       &estimatepriority,       true  },
-    { "util",               "estimatesmartfee",       &estimatesmartfee,       true  },
-    { "util",               "estimatesmartpriority",  &estimatesmartpriority,  true  },
+{ //  category              name                      actor (function)         okSafeMode  okParallel
+  //  --------------------- ------------------------  -----------------------  ----------  ----------
+    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true,       false },
+    { "mining",             "gethashespersec",        &gethashespersec,        true,       false },
+    { "mining",             "getmininginfo",          &getmininginfo,          true,       false },
+    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true,       false },
+    { "mining",             "getblocktemplate",       &getblocktemplate,       true,       false },
+    { "mining",             "submitblock",            &submitblock,            true,       false },
+    { "mining",             "setgenerate",            &setgenerate,            true,       false },
+    { "mining",             "getgenerate",            &getgenerate,            true,       false },
+
+    { "generating",         "generate",               &generate,               true,       false },
+    { "generating",         "generatetoaddress",      &generatetoaddress,      true,       false },
+
+    { "util",               "estimatefee",            &estimatefee,            true,       false },
+    { "util",               "estimatepriority",       &estimatepriority,       true,       false },
+    { "util",               "estimatesmartfee",       &estimatesmartfee,       true,       false },
+    { "util",               "estimatesmartpriority",  &estimatesmartpriority,  true,       false },
 };
 
 void RegisterMiningRPCCommands(CRPCTable &tableRPC)
@@ -398,15 +398,15 @@ UniValue setmocktime(const UniValue& params, bool fHelp)
 }
 
 static const CRPCCommand commands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
-    { "control",            "getinfo",                &getinfo,                true  }, /* uses wallet if enabled */
-    { "util",               "validateaddress",        &validateaddress,        true  }, /* uses wallet if enabled */
-    { "util",               "createmultisig",         &createmultisig,         true  },
-    { "util",               "verifymessage",          &verifymessage,          true  },
+{ //  category              name                      actor (function)         okSafeMode  okParallel
+  //  --------------------- ------------------------  -----------------------  ----------  ----------
+    { "control",            "getinfo",                &getinfo,                true,       false }, /* uses wallet if enabled */
+    { "util",               "validateaddress",        &validateaddress,        true,       false }, /* uses wallet if enabled */
+    { "util",               "createmultisig",         &createmultisig,         true,       false },
+    { "util",               "verifymessage",          &verifymessage,          true,       false },
 
     /* Not shown in help */
-    { "hidden",             "setmocktime",            &setmocktime,            true  },
+    { "hidden",             "setmocktime",            &setmocktime,            true,       false },
 };
 
 void RegisterMiscRPCCommands(CRPCTable &tableRPC)
@@ -843,17 +843,17 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
 }
 
 static const CRPCCommand commands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
-    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true  },
-    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true  },
-    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true  },
-    { "rawtransactions",    "decodescript",           &decodescript,           true  },
-    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false },
-    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false }, /* uses wallet if enabled */
-
-    { "blockchain",         "gettxoutproof",          &gettxoutproof,          true  },
-    { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true  },
+{ //  category              name                      actor (function)         okSafeMode  okParallel
+  //  --------------------- ------------------------  -----------------------  ----------  ----------
+    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true,       false },
+    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true,       false },
+    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true,       false },
+    { "rawtransactions",    "decodescript",           &decodescript,           true,       false },
+    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false,      false },
+    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false,      false }, /* uses wallet if enabled */
+
+    { "blockchain",         "gettxoutproof",          &gettxoutproof,          true,       false },
+    { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true,       false },
 };
 
 void RegisterRawTransactionRPCCommands(CRPCTable &tableRPC)
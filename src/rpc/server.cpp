@@ -38,6 +38,50 @@ static RPCTimerInterface* timerInterface = NULL;
  * @note Can be changed to std::unique_ptr when C++11 */
 static std::map<std::string, boost::shared_ptr<RPCTimerBase> > deadlineTimers;
 
+/** Consecutive requests of a batch that may run at the same time. Guarded by
+ * the executor lock, except for the results, which are each written by the
+ * one thread that took the request.
+ */
+struct CRPCBatchRun
+{
+    const UniValue& vReq;
+    std::vector<UniValue>& vResults;
+    unsigned int nNext;
+    unsigned int nEnd;
+    //! Requests taken but not finished yet
+    unsigned int nRunning;
+
+    CRPCBatchRun(const UniValue& vReqIn, std::vector<UniValue>& vResultsIn, unsigned int nBegin, unsigned int nEndIn) :
+        vReq(vReqIn), vResults(vResultsIn), nNext(nBegin), nEnd(nEndIn), nRunning(0) {}
+};
+
+/** Threads that help the HTTP worker that received a batch run its requests */
+class CRPCBatchExecutor
+{
+private:
+    CWaitableCriticalSection cs;
+    CConditionVariable condWork;
+    CConditionVariable condDone;
+    //! One entry for every thread asked to help with a run
+    std::deque<boost::shared_ptr<CRPCBatchRun> > queue;
+    boost::thread_group threads;
+    bool fRunning;
+    int nMaxConcurrency;
+
+    void Work(CRPCBatchRun& run, boost::unique_lock<boost::mutex>& lock);
+    void ThreadWorker();
+
+public:
+    CRPCBatchExecutor() : fRunning(false), nMaxConcurrency(1) {}
+
+    void Start(int nThreads, int nMaxConcurrencyIn);
+    void Stop();
+    /** Run requests [nBegin, nEnd) of vReq and store their replies in vResults */
+    void Execute(const UniValue& vReq, unsigned int nBegin, unsigned int nEnd, std::vector<UniValue>& vResults);
+};
+
+static CRPCBatchExecutor rpcBatchExecutor;
+
 static struct CRPCSignals
 {
     boost::signals2::signal<void ()> Started;
@@ -266,11 +310,11 @@ UniValue stop(const UniValue& params, bool fHelp)
  * Call Table
  */
 static const CRPCCommand vRPCCommands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
+{ //  category              name                      actor (function)         okSafeMode  okParallel
+  //  --------------------- ------------------------  -----------------------  ----------  ----------
     /* Overall control/query calls */
-    { "control",            "help",                   &help,                   true  },
-    { "control",            "stop",                   &stop,                   true  },
+    { "control",            "help",                   &help,                   true,       false },
+    { "control",            "stop",                   &stop,                   true,       false },
 };
 
 CRPCTable::CRPCTable()
@@ -311,6 +355,12 @@ bool StartRPC()
 {
     LogPrint("rpc", "Starting RPC\n");
     fRPCRunning = true;
+    int nBatchThreads = GetArg("-rpcbatchthreads", DEFAULT_RPC_BATCH_THREADS);
+    int nBatchConcurrency = GetArg("-rpcbatchconcurrency", DEFAULT_RPC_BATCH_CONCURRENCY);
+    if (nBatchThreads > 0 && nBatchConcurrency > 1) {
+        LogPrint("rpc", "Starting %d RPC batch threads\n", nBatchThreads);
+        rpcBatchExecutor.Start(nBatchThreads, nBatchConcurrency);
+    }
     g_rpcSignals.Started();
     return true;
 }
@@ -326,6 +376,7 @@ void StopRPC()
 {
     LogPrint("rpc", "Stopping RPC\n");
     deadlineTimers.clear();
+    rpcBatchExecutor.Stop();
     g_rpcSignals.Stopped();
 }
 
@@ -409,11 +460,107 @@ static UniValue JSONRPCExecOne(const UniValue& req)
     return rpc_result;
 }
 
+void CRPCBatchExecutor::Start(int nThreads, int nMaxConcurrencyIn)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fRunning = true;
+        nMaxConcurrency = nMaxConcurrencyIn;
+    }
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CRPCBatchExecutor::ThreadWorker, this));
+}
+
+void CRPCBatchExecutor::Stop()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fRunning = false;
+        queue.clear();
+        condWork.notify_all();
+    }
+    // Batches still being received finish their requests on the HTTP workers
+    threads.join_all();
+}
+
+void CRPCBatchExecutor::Work(CRPCBatchRun& run, boost::unique_lock<boost::mutex>& lock)
+{
+    while (run.nNext < run.nEnd) {
+        unsigned int reqIdx = run.nNext++;
+        run.nRunning++;
+        lock.unlock();
+        run.vResults[reqIdx] = JSONRPCExecOne(run.vReq[reqIdx]);
+        lock.lock();
+        if (--run.nRunning == 0 && run.nNext == run.nEnd)
+            condDone.notify_all();
+    }
+}
+
+void CRPCBatchExecutor::ThreadWorker()
+{
+    RenameThread("bitcoin-rpcbatch");
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (true) {
+        while (fRunning && queue.empty())
+            condWork.wait(lock);
+        if (!fRunning)
+            return;
+        // Runs finished before this thread got to them are left with nothing to do
+        boost::shared_ptr<CRPCBatchRun> run = queue.front();
+        queue.pop_front();
+        Work(*run, lock);
+    }
+}
+
+void CRPCBatchExecutor::Execute(const UniValue& vReq, unsigned int nBegin, unsigned int nEnd, std::vector<UniValue>& vResults)
+{
+    boost::shared_ptr<CRPCBatchRun> run(new CRPCBatchRun(vReq, vResults, nBegin, nEnd));
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (fRunning) {
+        // The calling thread counts towards the batch's concurrency
+        unsigned int nHelpers = std::min(nEnd - nBegin, (unsigned int)nMaxConcurrency) - 1;
+        for (unsigned int i = 0; i < nHelpers; i++) {
+            queue.push_back(run);
+            condWork.notify_one();
+        }
+    }
+    Work(*run, lock);
+    while (run->nRunning > 0)
+        condDone.wait(lock);
+}
+
+/** Whether a batch request only reads state, so it may run alongside its neighbours */
+static bool IsParallelRequest(const UniValue& req)
+{
+    if (!req.isObject())
+        return false;
+    const UniValue& method = find_value(req, "method");
+    if (!method.isStr())
+        return false;
+    const CRPCCommand *pcmd = tableRPC[method.get_str()];
+    return pcmd && pcmd->okParallel;
+}
+
 std::string JSONRPCExecBatch(const UniValue& vReq)
 {
+    // Consecutive requests that only read state are spread over the batch
+    // threads. Any other request waits for the ones before it and runs alone,
+    // so the batch behaves as if its requests ran in order.
+    std::vector<UniValue> vResults(vReq.size());
+    unsigned int reqIdx = 0;
+    while (reqIdx < vReq.size()) {
+        unsigned int reqEnd = reqIdx + 1;
+        if (IsParallelRequest(vReq[reqIdx])) {
+            while (reqEnd < vReq.size() && IsParallelRequest(vReq[reqEnd]))
+                reqEnd++;
+        }
+        rpcBatchExecutor.Execute(vReq, reqIdx, reqEnd, vResults);
+        reqIdx = reqEnd;
+    }
+
     UniValue ret(UniValue::VARR);
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    for (reqIdx = 0; reqIdx < vResults.size(); reqIdx++)
+        ret.push_back(vResults[reqIdx]);
 
     return ret.write() + "\n";
 }
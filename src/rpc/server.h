@@ -21,6 +21,11 @@
 
 class CRPCCommand;
 
+//! Threads that run the requests of JSON-RPC batches in parallel
+static const int DEFAULT_RPC_BATCH_THREADS = 4;
+//! Maximum number of threads, including the one that received it, one batch runs on
+static const int DEFAULT_RPC_BATCH_CONCURRENCY = 4;
+
 namespace RPCServer
 {
     void OnStarted(boost::function<void ()> slot);
@@ -122,6 +127,8 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
+    //! Only reads state, so may run alongside its neighbours in a batch
+    bool okParallel;
 };
 
 /**
@@ -6,8 +6,10 @@
 #include <string>
 #include <boost/test/unit_test.hpp>
 
+#include "clientversion.h"
 #include "hash.h"
 #include "random.h"
+#include "streams.h"
 
 using namespace std;
 
@@ -180,9 +182,9 @@ BOOST_AUTO_TEST_CASE(addrman_select)
     BOOST_CHECK(addrman.size() == 7);
 
     // Test 12: Select pulls from new and tried regardless of port number.
-    BOOST_CHECK(addrman.Select().ToString() == "250.4.6.6:8333");
-    BOOST_CHECK(addrman.Select().ToString() == "250.3.2.2:9999");
-    BOOST_CHECK(addrman.Select().ToString() == "250.3.3.3:9999");
+    BOOST_CHECK(addrman.Select().ToString() == "250.4.4.4:8333");
+    BOOST_CHECK(addrman.Select().ToString() == "250.4.5.5:7777");
+    BOOST_CHECK(addrman.Select().ToString() == "250.3.1.1:8333");
     BOOST_CHECK(addrman.Select().ToString() == "250.4.4.4:8333");
 }
 
@@ -331,6 +333,52 @@ BOOST_AUTO_TEST_CASE(addrman_delete)
     BOOST_CHECK(info2 == NULL);
 }
 
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrManTest addrman;
+
+    // Set addrman addr placement to be deterministic.
+    addrman.MakeDeterministic();
+
+    CNetAddr source = CNetAddr("252.2.2.2");
+    for (int i = 1; i < 8; i++)
+        addrman.Add(CAddress(CService("250.5." + boost::to_string(i) + ".1", 8333)), source);
+    addrman.Good(CAddress(CService("250.5.1.1", 8333)));
+    addrman.Good(CAddress(CService("250.5.2.1", 8333)));
+
+    // Test 22: ids of deleted entries are handed out again.
+    CAddrManTest addrmanIds;
+    int nId, nId2;
+    addrmanIds.Create(CAddress(CService("250.6.1.1", 8333)), source, &nId);
+    addrmanIds.Create(CAddress(CService("250.6.2.1", 8333)), source, &nId2);
+    addrmanIds.Delete(nId);
+    addrmanIds.Create(CAddress(CService("250.6.3.1", 8333)), source, &nId2);
+    BOOST_CHECK(nId == nId2);
+    BOOST_CHECK(addrmanIds.Find(CNetAddr("250.6.1.1")) == NULL);
+    BOOST_CHECK(addrmanIds.Find(CNetAddr("250.6.3.1")) != NULL);
+
+    // Test 23: a serialization round trip keeps every entry, and which table it is in.
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CAddrManTest addrman2;
+    ss >> addrman2;
+    BOOST_CHECK(addrman2.size() == 7);
+    for (int i = 1; i < 8; i++)
+        BOOST_CHECK(addrman2.Find(CNetAddr("250.5." + boost::to_string(i) + ".1")) != NULL);
+    BOOST_CHECK(addrman2.Find(CNetAddr("250.6.1.1")) == NULL);
+    for (int i = 0; i < 20; i++) {
+        CAddrInfo addr = addrman2.Select(true);
+        BOOST_CHECK(addr.ToString() != "250.5.1.1:8333" && addr.ToString() != "250.5.2.1:8333");
+    }
+
+    // Test 24: serializing again gives the same bytes.
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << addrman2;
+    CDataStream ss3(SER_DISK, CLIENT_VERSION);
+    ss3 << addrman;
+    BOOST_CHECK(ss2.str() == ss3.str());
+}
+
 BOOST_AUTO_TEST_CASE(addrman_getaddr)
 {
     CAddrManTest addrman;
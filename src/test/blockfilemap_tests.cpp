@@ -0,0 +1,112 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "streams.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilemap_tests, TestingSetup)
+
+#ifndef WIN32
+
+// Append a record the way WriteBlockToDisk does and return its position
+static CDiskBlockPos AppendRecord(int nFile, const std::string& strData)
+{
+    CDiskBlockPos pos(nFile, 0);
+    CAutoFile file(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    fseek(file.Get(), 0, SEEK_END);
+    file << FLATDATA(Params().MessageStart()) << (unsigned int)strData.size();
+    pos.nPos = ftell(file.Get());
+    file.write(strData.data(), strData.size());
+    return pos;
+}
+
+static std::string RecordData(const CMappedRecord& record)
+{
+    return std::string(record.begin, record.end);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilemap_genesis)
+{
+    // The genesis block was written by the test setup
+    CBlockFileMap blockfilemap(2);
+    CMappedRecord record;
+    BOOST_REQUIRE(blockfilemap.MapRecord(chainActive.Genesis()->GetBlockPos(), "blk", 0, record));
+    CBufferReader reader(record.begin, record.end, SER_DISK, CLIENT_VERSION);
+    CBlock block;
+    reader >> block;
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK(block.GetHash() == chainActive.Genesis()->GetBlockHash());
+}
+
+BOOST_AUTO_TEST_CASE(blockfilemap_records)
+{
+    CBlockFileMap blockfilemap(2);
+    CMappedRecord record;
+
+    CDiskBlockPos pos1 = AppendRecord(100, "first");
+    BOOST_REQUIRE(blockfilemap.MapRecord(pos1, "blk", 0, record));
+    BOOST_CHECK_EQUAL(RecordData(record), "first");
+    BOOST_CHECK(!blockfilemap.MapRecord(pos1, "blk", 1, record));
+
+    // A record appended after the file was mapped maps it again, and a
+    // record held from the old mapping stays readable
+    CMappedRecord recordOld = record;
+    CDiskBlockPos pos2 = AppendRecord(100, "second");
+    BOOST_REQUIRE(blockfilemap.MapRecord(pos2, "blk", 0, record));
+    BOOST_CHECK_EQUAL(RecordData(record), "second");
+    BOOST_CHECK_EQUAL(RecordData(recordOld), "first");
+    BOOST_CHECK_EQUAL(blockfilemap.GetMappedFiles(), 1U);
+
+    // The trailer counts towards the record
+    CDiskBlockPos pos3 = AppendRecord(100, "third");
+    BOOST_REQUIRE(blockfilemap.MapRecord(pos2, "blk", 8, record));
+    BOOST_CHECK_EQUAL(RecordData(record), std::string("second") + std::string(Params().MessageStart(), Params().MessageStart() + 4) + std::string("\x05\x00\x00\x00", 4));
+    BOOST_REQUIRE(blockfilemap.MapRecord(pos3, "blk", 0, record));
+    BOOST_CHECK_EQUAL(RecordData(record), "third");
+
+    // Missing files and positions before the first record are not mapped
+    BOOST_CHECK(!blockfilemap.MapRecord(CDiskBlockPos(999, 8), "blk", 0, record));
+    BOOST_CHECK(!blockfilemap.MapRecord(CDiskBlockPos(100, 0), "blk", 0, record));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilemap_eviction)
+{
+    CBlockFileMap blockfilemap(2);
+    CMappedRecord record;
+    CDiskBlockPos pos1 = AppendRecord(101, "one");
+    CDiskBlockPos pos2 = AppendRecord(102, "two");
+    CDiskBlockPos pos3 = AppendRecord(103, "three");
+
+    BOOST_REQUIRE(blockfilemap.MapRecord(pos1, "blk", 0, record));
+    BOOST_REQUIRE(blockfilemap.MapRecord(pos2, "blk", 0, record));
+    BOOST_REQUIRE(blockfilemap.MapRecord(pos1, "blk", 0, record));
+    CMappedRecord recordHeld;
+    BOOST_REQUIRE(blockfilemap.MapRecord(pos2, "blk", 0, recordHeld));
+    BOOST_REQUIRE(blockfilemap.MapRecord(pos3, "blk", 0, record));
+    BOOST_CHECK_EQUAL(blockfilemap.GetMappedFiles(), 2U);
+
+    // File 101 was the least recently used, so it went first
+    blockfilemap.Invalidate(101);
+    BOOST_CHECK_EQUAL(blockfilemap.GetMappedFiles(), 2U);
+
+    // Dropped mappings stay valid for whoever still holds a record
+    blockfilemap.Invalidate(102);
+    BOOST_CHECK_EQUAL(blockfilemap.GetMappedFiles(), 1U);
+    BOOST_CHECK_EQUAL(RecordData(recordHeld), "two");
+    BOOST_CHECK_EQUAL(RecordData(record), "three");
+}
+
+#endif // WIN32
+
+BOOST_AUTO_TEST_SUITE_END()
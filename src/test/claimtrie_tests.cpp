@@ -2828,4 +2828,250 @@ BOOST_AUTO_TEST_CASE(bogus_claimtrie_hash)
 
 }
 
+BOOST_AUTO_TEST_CASE(claimtrie_template_builder)
+{
+    fRequireStandard = false;
+    LOCK(cs_main);
+
+    std::string sName("atest");
+    std::string sValue1("testa");
+    std::string sValue2("testb");
+    std::vector<unsigned char> vchName(sName.begin(), sName.end());
+    std::vector<unsigned char> vchValue1(sValue1.begin(), sValue1.end());
+    std::vector<unsigned char> vchValue2(sValue2.begin(), sValue2.end());
+
+    std::vector<CTransaction> coinbases;
+    BOOST_CHECK(CreateCoinbases(2, coinbases));
+
+    CMutableTransaction tx1 = BuildTransaction(coinbases[0]);
+    tx1.vout[0].scriptPubKey = CScript() << OP_CLAIM_NAME << vchName << vchValue1 << OP_2DROP << OP_DROP << OP_TRUE;
+    uint160 tx1ClaimId = ClaimIdHash(tx1.GetHash(), 0);
+    std::vector<unsigned char> vchTx1ClaimId(tx1ClaimId.begin(), tx1ClaimId.end());
+
+    CMutableTransaction tx2 = BuildTransaction(coinbases[1]);
+    tx2.vout[0].scriptPubKey = CScript() << OP_SUPPORT_CLAIM << vchName << vchTx1ClaimId << OP_2DROP << OP_DROP << OP_TRUE;
+
+    CMutableTransaction tx3 = BuildTransaction(tx1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_UPDATE_CLAIM << vchName << vchTx1ClaimId << vchValue2 << OP_2DROP << OP_2DROP << OP_TRUE;
+
+    CBlockTemplateBuilder builder;
+    AddToMempool(tx1);
+    CBlockTemplate* pblocktemplate = builder.GetTemplate(Params(), scriptPubKey);
+    BOOST_CHECK(pblocktemplate);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK_EQUAL(pblocktemplate->vClaimTrieChanges.size(), 1U);
+
+    // The support and the update (which spends a template transaction) are
+    // appended to the same template.
+    AddToMempool(tx2);
+    AddToMempool(tx3);
+    BOOST_CHECK(builder.GetTemplate(Params(), scriptPubKey) == pblocktemplate);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 4U);
+    BOOST_CHECK_EQUAL(pblocktemplate->vClaimTrieChanges.size(), 4U);
+
+    // It commits to the same claimtrie as a template built from scratch.
+    CBlockTemplate* pblocktemplateFull = CreateNewBlock(Params(), scriptPubKey);
+    BOOST_CHECK(pblocktemplateFull);
+    BOOST_CHECK_EQUAL(pblocktemplateFull->block.vtx.size(), 4U);
+    BOOST_CHECK(pblocktemplate->block.hashClaimTrie == pblocktemplateFull->block.hashClaimTrie);
+    delete pblocktemplateFull;
+    CValidationState state;
+    BOOST_CHECK(TestBlockValidity(state, Params(), pblocktemplate->block, chainActive.Tip(), false, false));
+
+    BOOST_CHECK(CreateBlock(pblocktemplate));
+    BOOST_CHECK(mempool.size() == 0);
+    CClaimValue val;
+    BOOST_CHECK(pclaimTrie->getInfoForName(sName, val));
+    BOOST_CHECK(val.outPoint == COutPoint(tx3.GetHash(), 0));
+
+    // A new tip means a new template.
+    pblocktemplate = builder.GetTemplate(Params(), scriptPubKey);
+    BOOST_CHECK(pblocktemplate);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1U);
+    BOOST_CHECK(pblocktemplate->block.hashPrevBlock == chainActive.Tip()->GetBlockHash());
+}
+
+BOOST_AUTO_TEST_CASE(claimtrie_template_builder_packages)
+{
+    fRequireStandard = false;
+    LOCK(cs_main);
+    int64_t nTime = GetTime();
+    SetMockTime(nTime);
+    minRelayTxFee = CFeeRate(1000);
+
+    std::vector<CTransaction> coinbases;
+    BOOST_CHECK(CreateCoinbases(6, coinbases));
+
+    // Below the relay fee, so it is passed over until it is prioritised
+    CMutableTransaction txFree = BuildTransaction(coinbases[0]);
+    AddToMempool(txFree);
+    CBlockTemplateBuilder builder;
+    CBlockTemplate* pblocktemplate = builder.GetTemplate(Params(), scriptPubKey);
+    BOOST_CHECK(pblocktemplate);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1U);
+    unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    mempool.PrioritiseTransaction(txFree.GetHash(), txFree.GetHash().ToString(), 0, COIN);
+    BOOST_CHECK(mempool.GetTransactionsUpdated() != nTransactionsUpdated);
+    BOOST_CHECK(builder.GetTemplate(Params(), scriptPubKey) == pblocktemplate);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+
+    // A transaction leaving the mempool makes the selection start over
+    // from the template, which is then continued as before
+    CMutableTransaction txGone = BuildTransaction(coinbases[5]);
+    AddToMempool(txGone);
+    std::list<CTransaction> removed;
+    mempool.removeRecursive(txGone, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1U);
+
+    // A child pays for its parent, as in a template built from scratch
+    CMutableTransaction txParent = BuildTransaction(coinbases[1]);
+    txParent.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    AddToMempool(txParent);
+    CMutableTransaction txChild = BuildTransaction(txParent);
+    txChild.vout[0].nValue -= 100000;
+    AddToMempool(txChild);
+    BOOST_CHECK(builder.GetTemplate(Params(), scriptPubKey) == pblocktemplate);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 4U);
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == txParent.GetHash());
+    BOOST_CHECK(pblocktemplate->block.vtx[3].GetHash() == txChild.GetHash());
+    CBlockTemplate* pblocktemplateFull = CreateNewBlock(Params(), scriptPubKey);
+    BOOST_CHECK(pblocktemplateFull);
+    BOOST_CHECK_EQUAL(pblocktemplateFull->block.vtx.size(), 4U);
+    delete pblocktemplateFull;
+
+    // Once the block is nearly full, what still fits is added and what does
+    // not is skipped, as long as it pays less than the template's packages
+    unsigned int nBlockSize = 1000;
+    for (unsigned int i = 1; i < pblocktemplate->block.vtx.size(); i++)
+        nBlockSize += ::GetSerializeSize(pblocktemplate->block.vtx[i], SER_NETWORK, PROTOCOL_VERSION);
+    CMutableTransaction txSmall = BuildTransaction(coinbases[2]);
+    txSmall.vout[0].nValue -= 5000;
+    CMutableTransaction txLarge = BuildTransaction(coinbases[3], 0, 16);
+    txLarge.vout[0].nValue -= 2000;
+    unsigned int nSmallSize = ::GetSerializeSize(txSmall, SER_NETWORK, PROTOCOL_VERSION);
+    mapArgs["-blockmaxsize"] = strprintf("%u", nBlockSize + nSmallSize + 1);
+    AddToMempool(txSmall);
+    AddToMempool(txLarge);
+    BOOST_CHECK(builder.GetTemplate(Params(), scriptPubKey) == pblocktemplate);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 5U);
+    BOOST_CHECK(pblocktemplate->block.vtx[4].GetHash() == txSmall.GetHash());
+
+    // A package that does not fit but pays more than one in the template
+    // causes a rebuild, which swaps it for the small transaction
+    CMutableTransaction txRich = BuildTransaction(coinbases[4]);
+    txRich.vout[0].nValue -= 100000;
+    AddToMempool(txRich);
+    pblocktemplate = builder.GetTemplate(Params(), scriptPubKey);
+    BOOST_REQUIRE(pblocktemplate);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 5U);
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == txRich.GetHash());
+    BOOST_CHECK(builder.GetTemplate(Params(), scriptPubKey) == pblocktemplate);
+
+    // A transaction of the template leaving the mempool causes a rebuild
+    // without it, although nothing was added
+    removed.clear();
+    mempool.removeRecursive(txRich, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1U);
+    pblocktemplate = builder.GetTemplate(Params(), scriptPubKey);
+    BOOST_REQUIRE(pblocktemplate);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 5U);
+    for (unsigned int i = 1; i < pblocktemplate->block.vtx.size(); i++)
+        BOOST_CHECK(pblocktemplate->block.vtx[i].GetHash() != txRich.GetHash());
+    BOOST_CHECK(pblocktemplate->block.vtx[4].GetHash() == txSmall.GetHash());
+    CValidationState state;
+    BOOST_CHECK(TestBlockValidity(state, Params(), pblocktemplate->block, chainActive.Tip(), false, false));
+
+    mapArgs.erase("-blockmaxsize");
+    minRelayTxFee = CFeeRate(0);
+    SetMockTime(0);
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(claimtrie_rebuild)
+{
+    fRequireStandard = false;
+    LOCK(cs_main);
+
+    std::string sName1("atest");
+    std::string sName2("btest");
+    std::string sValue1("testa");
+    std::string sValue2("testb");
+
+    std::vector<unsigned char> vchName1(sName1.begin(), sName1.end());
+    std::vector<unsigned char> vchName2(sName2.begin(), sName2.end());
+    std::vector<unsigned char> vchValue1(sValue1.begin(), sValue1.end());
+    std::vector<unsigned char> vchValue2(sValue2.begin(), sValue2.end());
+
+    std::vector<CTransaction> coinbases;
+    BOOST_CHECK(CreateCoinbases(4, coinbases));
+
+    // Two claims for the same name, a support for the first, and a claim
+    // for another name
+    CMutableTransaction tx1 = BuildTransaction(coinbases[0]);
+    tx1.vout[0].scriptPubKey = CScript() << OP_CLAIM_NAME << vchName1 << vchValue1 << OP_2DROP << OP_DROP << OP_TRUE;
+    tx1.vout[0].nValue = 1;
+    uint160 tx1ClaimId = ClaimIdHash(tx1.GetHash(), 0);
+    std::vector<unsigned char> vchTx1ClaimId(tx1ClaimId.begin(), tx1ClaimId.end());
+
+    CMutableTransaction tx2 = BuildTransaction(coinbases[1]);
+    tx2.vout[0].scriptPubKey = CScript() << OP_CLAIM_NAME << vchName1 << vchValue2 << OP_2DROP << OP_DROP << OP_TRUE;
+    tx2.vout[0].nValue = 3;
+
+    CMutableTransaction tx3 = BuildTransaction(coinbases[2]);
+    tx3.vout[0].scriptPubKey = CScript() << OP_SUPPORT_CLAIM << vchName1 << vchTx1ClaimId << OP_2DROP << OP_DROP << OP_TRUE;
+    tx3.vout[0].nValue = 5;
+
+    CMutableTransaction tx4 = BuildTransaction(coinbases[3]);
+    tx4.vout[0].scriptPubKey = CScript() << OP_CLAIM_NAME << vchName2 << vchValue1 << OP_2DROP << OP_DROP << OP_TRUE;
+    tx4.vout[0].nValue = 2;
+
+    AddToMempool(tx1);
+    AddToMempool(tx3);
+    AddToMempool(tx4);
+    BOOST_CHECK(CreateBlocks(1, 4));
+    AddToMempool(tx2);
+    BOOST_CHECK(CreateBlocks(1, 2));
+    BOOST_CHECK(CreateBlocks(5, 1));
+
+    // Update the first claim, spend the support so the second claim takes
+    // over, and spend the claim for the other name
+    CMutableTransaction tx5 = BuildTransaction(tx1);
+    tx5.vout[0].scriptPubKey = CScript() << OP_UPDATE_CLAIM << vchName1 << vchTx1ClaimId << vchValue2 << OP_2DROP << OP_2DROP << OP_TRUE;
+    CMutableTransaction tx6 = BuildTransaction(tx3);
+    tx6.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    CMutableTransaction tx7 = BuildTransaction(tx4);
+    tx7.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    AddToMempool(tx5);
+    AddToMempool(tx6);
+    AddToMempool(tx7);
+    BOOST_CHECK(CreateBlocks(1, 4));
+    BOOST_CHECK(CreateBlocks(5, 1));
+
+    CClaimValue val;
+    BOOST_CHECK(pclaimTrie->getInfoForName(sName1, val));
+    BOOST_CHECK(val.outPoint == COutPoint(tx2.GetHash(), 0));
+    BOOST_CHECK(!pclaimTrie->getInfoForName(sName2, val));
+    uint256 hashTrie = pclaimTrie->getMerkleHash();
+    BOOST_CHECK(hashTrie == chainActive.Tip()->hashClaimTrie);
+
+    // Rebuilding an empty trie from the blocks ends up in the same state
+    delete pclaimTrie;
+    pclaimTrie = new CClaimTrie(true, false, 1);
+    BOOST_CHECK(RebuildClaimTrie(Params()));
+    BOOST_CHECK(pclaimTrie->getMerkleHash() == hashTrie);
+    BOOST_CHECK(pclaimTrie->nCurrentHeight == chainActive.Height() + 1);
+    BOOST_CHECK(pclaimTrie->getInfoForName(sName1, val));
+    BOOST_CHECK(val.outPoint == COutPoint(tx2.GetHash(), 0));
+    bool fReindexing = true;
+    BOOST_CHECK(pblocktree->ReadFlag("reindexclaimtrie", fReindexing));
+    BOOST_CHECK(!fReindexing);
+
+    // The chain carries on from the rebuilt trie
+    BOOST_CHECK(CreateBlocks(1, 1));
+    BOOST_CHECK(pclaimTrie->getMerkleHash() == chainActive.Tip()->hashClaimTrie);
+
+    // A trie that is not empty is not rebuilt
+    BOOST_CHECK(!RebuildClaimTrie(Params()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
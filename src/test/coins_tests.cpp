@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "coinsprefetch.h"
 #include "random.h"
 #include "uint256.h"
 #include "test/test_bitcoin.h"
@@ -345,4 +346,65 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
     BOOST_CHECK(spent_a_duplicate_coinbase);
 }
 
+// Prefetched coins are served once, and never after the underlying entry
+// has been overwritten through the prefetch layer.
+BOOST_AUTO_TEST_CASE(coins_prefetch_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewPrefetch prefetch(&base, &base);
+
+    std::vector<uint256> vHash;
+    {
+        CCoinsViewCache cache(&base);
+        for (int i = 0; i < 3; i++) {
+            uint256 hash = GetRandHash();
+            CCoinsModifier coins = cache.ModifyCoins(hash);
+            coins->nVersion = 1;
+            coins->nHeight = i + 1;
+            coins->vout.resize(1);
+            coins->vout[0].nValue = i + 1;
+            vHash.push_back(hash);
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // Unknown txids are not cached.
+    std::vector<uint256> vPrefetch(vHash);
+    vPrefetch.push_back(GetRandHash());
+    prefetch.Prefetch(vPrefetch);
+    BOOST_CHECK_EQUAL(prefetch.GetCacheSize(), vHash.size());
+
+    CCoins coins;
+    BOOST_CHECK(prefetch.HaveCoins(vHash[0]));
+    BOOST_CHECK(prefetch.GetCoins(vHash[0], coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, 1);
+    BOOST_CHECK_EQUAL(prefetch.GetCacheSize(), vHash.size() - 1);
+    uint64_t nHits;
+    int64_t nSaved;
+    prefetch.GetStats(nHits, nSaved);
+    BOOST_CHECK_EQUAL(nHits, 1);
+
+    // Writing through the prefetch layer drops the stale copy.
+    {
+        CCoinsViewCache cache(&base);
+        BOOST_CHECK(cache.AccessCoins(vHash[1]));
+        {
+            CCoinsModifier modified = cache.ModifyCoins(vHash[1]);
+            modified->nHeight = 100;
+        }
+        CCoinsMap mapCoins;
+        CCoinsCacheEntry& entry = mapCoins[vHash[1]];
+        entry.coins = *cache.AccessCoins(vHash[1]);
+        entry.flags = CCoinsCacheEntry::DIRTY;
+        BOOST_CHECK(prefetch.BatchWrite(mapCoins, uint256()));
+    }
+    BOOST_CHECK_EQUAL(prefetch.GetCacheSize(), 1);
+    BOOST_CHECK(prefetch.GetCoins(vHash[1], coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, 100);
+    BOOST_CHECK(prefetch.GetCoins(vHash[2], coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, 3);
+    prefetch.GetStats(nHits, nSaved);
+    BOOST_CHECK_EQUAL(nHits, 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,7 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "crypto/multihash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
@@ -248,4 +249,53 @@ BOOST_AUTO_TEST_CASE(hmac_sha512_testvectors) {
                    "b6022cac3c4982b10d5eeb55c3e4de15134676fb6de0446065c97440fa8c6a58");
 }
 
+template<typename Hasher>
+void TestMultiHash(Hasher h, multihash::HashLanesFn fn, size_t nLanes, size_t nLen) {
+    std::vector<unsigned char> in(nLanes * nLen);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = insecure_rand();
+    std::vector<unsigned char> out(nLanes * Hasher::OUTPUT_SIZE);
+    fn(&out[0], in.empty() ? NULL : &in[0], nLen);
+    for (size_t l = 0; l < nLanes; l++) {
+        unsigned char hash[Hasher::OUTPUT_SIZE];
+        Hasher(h).Write(in.empty() ? NULL : &in[l * nLen], nLen).Finalize(hash);
+        BOOST_CHECK(memcmp(hash, &out[l * Hasher::OUTPUT_SIZE], Hasher::OUTPUT_SIZE) == 0);
+    }
+}
+
+void TestMultiHashMidstate(multihash::HashLanesMidstateFn fn, size_t nLanes, size_t nPrefixLen, size_t nLen) {
+    std::vector<unsigned char> prefix(nPrefixLen), in(nLanes * nLen);
+    for (size_t i = 0; i < prefix.size(); i++)
+        prefix[i] = insecure_rand();
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = insecure_rand();
+    uint32_t midstate[8];
+    CSHA256().Write(prefix.empty() ? NULL : &prefix[0], nPrefixLen).GetMidstate(midstate);
+    std::vector<unsigned char> out(nLanes * CSHA256::OUTPUT_SIZE);
+    fn(&out[0], midstate, nPrefixLen, in.empty() ? NULL : &in[0], nLen);
+    for (size_t l = 0; l < nLanes; l++) {
+        unsigned char hash[CSHA256::OUTPUT_SIZE];
+        CSHA256().Write(prefix.empty() ? NULL : &prefix[0], nPrefixLen).Write(in.empty() ? NULL : &in[l * nLen], nLen).Finalize(hash);
+        BOOST_CHECK(memcmp(hash, &out[l * CSHA256::OUTPUT_SIZE], CSHA256::OUTPUT_SIZE) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(multihash_implementations) {
+    std::vector<const multihash::Implementation*> impls = multihash::Available();
+    BOOST_CHECK_EQUAL(impls.front()->nLanes, 1U);
+    for (size_t i = 0; i < impls.size(); i++) {
+        const multihash::Implementation* impl = impls[i];
+        BOOST_CHECK(impl->nLanes <= multihash::MAX_LANES);
+        // Cover the padding edge cases around one and two blocks.
+        for (size_t nLen = 0; nLen <= 260; nLen++) {
+            TestMultiHash(CSHA256(), impl->sha256, impl->nLanes, nLen);
+            TestMultiHash(CSHA512(), impl->sha512, impl->nLanes, nLen);
+            TestMultiHash(CRIPEMD160(), impl->ripemd160, impl->nLanes, nLen);
+        }
+        for (size_t nPrefixLen = 0; nPrefixLen <= 128; nPrefixLen += 64)
+            for (size_t nLen = 0; nLen <= 130; nLen++)
+                TestMultiHashMidstate(impl->sha256Midstate, impl->nLanes, nPrefixLen, nLen);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
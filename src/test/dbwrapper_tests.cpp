@@ -82,6 +82,21 @@ BOOST_AUTO_TEST_CASE(dbwrapper_batch)
 
         // key3 never should've been written
         BOOST_CHECK(dbw.Read(key3, res) == false);
+
+        // Entries shorter than the previous one must not pick up its tail
+        CDBBatch batch2(&dbw.GetObfuscateKey());
+        batch2.Write(std::make_pair('s', std::string("long key")), std::string(100, 'x'));
+        batch2.Write(std::make_pair('s', std::string("k")), std::string("y"));
+        batch2.Erase(std::make_pair('s', std::string("long key")));
+        batch2.Write(std::make_pair('s', std::string("")), std::string(""));
+        dbw.WriteBatch(batch2);
+
+        std::string strRes;
+        BOOST_CHECK(!dbw.Exists(std::make_pair('s', std::string("long key"))));
+        BOOST_CHECK(dbw.Read(std::make_pair('s', std::string("k")), strRes));
+        BOOST_CHECK_EQUAL(strRes, "y");
+        BOOST_CHECK(dbw.Read(std::make_pair('s', std::string("")), strRes));
+        BOOST_CHECK_EQUAL(strRes, "");
     }
 }
 
@@ -126,6 +141,65 @@ BOOST_AUTO_TEST_CASE(dbwrapper_iterator)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_prefix_iterator)
+{
+    // Perform tests both obfuscated and non-obfuscated.
+    for (int i = 0; i < 2; i++) {
+        bool obfuscate = (bool)i;
+        path ph = temp_directory_path() / unique_path();
+        CDBWrapper dbw(ph, (1 << 20), true, false, obfuscate);
+
+        // Keys of the types before and after 'k', with values that do not
+        // deserialize as the ones of type 'k'
+        BOOST_CHECK(dbw.Write(make_pair('j', 1), 'a'));
+        BOOST_CHECK(dbw.IsEmpty('k'));
+        BOOST_CHECK(dbw.Write(make_pair('l', string()), 'b'));
+        BOOST_CHECK(dbw.IsEmpty('k'));
+        boost::scoped_ptr<CDBPrefixIterator> itEmpty(dbw.NewPrefixIterator('k'));
+        BOOST_CHECK(!itEmpty->Valid());
+
+        vector<uint256> vIn;
+        for (int j = 0; j < 10; j++) {
+            vIn.push_back(GetRandHash());
+            BOOST_CHECK(dbw.Write(make_pair('k', j), vIn.back()));
+        }
+        BOOST_CHECK(!dbw.IsEmpty('k'));
+        BOOST_CHECK(!dbw.IsEmpty('j'));
+        BOOST_CHECK(dbw.IsEmpty('m'));
+
+        // Keys are serialized little endian, so they come in order up to 255
+        boost::scoped_ptr<CDBPrefixIterator> it(dbw.NewPrefixIterator('k'));
+        for (int j = 0; j < 10; j++) {
+            BOOST_REQUIRE(it->Valid());
+            pair<char, int> key;
+            uint256 value;
+            BOOST_CHECK(it->GetKey(key));
+            BOOST_CHECK_EQUAL(key.first, 'k');
+            BOOST_CHECK_EQUAL(key.second, j);
+            BOOST_CHECK(it->GetValue(value));
+            BOOST_CHECK_EQUAL(value.ToString(), vIn[j].ToString());
+            BOOST_CHECK_EQUAL(it->GetValueSize(), 32U);
+
+            CBufferReader reader = it->GetValueReader();
+            BOOST_CHECK_EQUAL(reader.size(), 32U);
+            reader >> value;
+            BOOST_CHECK(reader.empty());
+            BOOST_CHECK_EQUAL(value.ToString(), vIn[j].ToString());
+            it->Next();
+        }
+        BOOST_CHECK(!it->Valid());
+
+        // The last key type of the database
+        boost::scoped_ptr<CDBPrefixIterator> itLast(dbw.NewPrefixIterator('l'));
+        BOOST_REQUIRE(itLast->Valid());
+        char value;
+        BOOST_CHECK(itLast->GetValue(value));
+        BOOST_CHECK_EQUAL(value, 'b');
+        itLast->Next();
+        BOOST_CHECK(!itLast->Valid());
+    }
+}
+
 // Test that we do not obfuscation if there is existing data.
 BOOST_AUTO_TEST_CASE(existing_data_no_obfuscate)
 {
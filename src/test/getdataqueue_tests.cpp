@@ -0,0 +1,83 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "getdataqueue.h"
+#include "net.h"
+#include "netbase.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(getdataqueue_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(getdataqueue_order)
+{
+    CNode nodeA(INVALID_SOCKET, CAddress(CService("250.2.1.1", 8333)), "", true);
+    CNode nodeB(INVALID_SOCKET, CAddress(CService("250.2.1.2", 8333)), "", true);
+    CGetDataQueue queue;
+
+    // Peers are served in the order they asked, each queued only once and
+    // held on to while it is
+    queue.Push(&nodeA);
+    queue.Push(&nodeB);
+    queue.Push(&nodeA);
+    BOOST_CHECK_EQUAL(nodeA.GetRefCount(), 1);
+    BOOST_CHECK_EQUAL(nodeB.GetRefCount(), 1);
+    BOOST_CHECK(queue.Pop() == &nodeA);
+
+    // A peer still being served is not queued again
+    queue.Push(&nodeA);
+    BOOST_CHECK_EQUAL(nodeA.GetRefCount(), 1);
+
+    // With more to serve it goes to the back, behind the peers waiting
+    queue.Done(&nodeA, true);
+    BOOST_CHECK(queue.Pop() == &nodeB);
+    BOOST_CHECK(queue.Pop() == &nodeA);
+
+    // Once done it is released, and can be queued again
+    queue.Done(&nodeB, false);
+    BOOST_CHECK_EQUAL(nodeB.GetRefCount(), 0);
+    queue.Push(&nodeB);
+    BOOST_CHECK_EQUAL(nodeB.GetRefCount(), 1);
+    queue.Done(&nodeA, false);
+    BOOST_CHECK_EQUAL(nodeA.GetRefCount(), 0);
+    BOOST_CHECK(queue.Pop() == &nodeB);
+    queue.Done(&nodeB, false);
+    BOOST_CHECK_EQUAL(nodeB.GetRefCount(), 0);
+}
+
+static void PopInto(CGetDataQueue* queue, CNode** ppnode)
+{
+    *ppnode = queue->Pop();
+}
+
+BOOST_AUTO_TEST_CASE(getdataqueue_wait)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("250.2.1.3", 8333)), "", true);
+    CGetDataQueue queue;
+
+    // A worker waits until a peer is pushed, or requeued
+    CNode* pnode = NULL;
+    boost::thread worker(PopInto, &queue, &pnode);
+    queue.Push(&node);
+    worker.join();
+    BOOST_CHECK(pnode == &node);
+
+    pnode = NULL;
+    boost::thread worker2(PopInto, &queue, &pnode);
+    queue.Done(&node, true);
+    worker2.join();
+    BOOST_CHECK(pnode == &node);
+    queue.Done(&node, false);
+    BOOST_CHECK_EQUAL(node.GetRefCount(), 0);
+
+    // A waiting worker can be interrupted
+    boost::thread worker3(PopInto, &queue, &pnode);
+    worker3.interrupt();
+    worker3.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,7 @@
 #include "chainparams.h"
 #include "lbry.h"
 #include "main.h"
+#include "random.h"
 #include "test/test_bitcoin.h"
 #include "hash.h" 
 #include <cstdio> 
@@ -126,6 +127,68 @@ BOOST_AUTO_TEST_CASE(lbry_pow_test)
 
 }
 
+BOOST_AUTO_TEST_CASE(lbry_pow_header_test)
+{
+    CBlockHeader header;
+    header.nVersion = insecure_rand();
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.hashClaimTrie = GetRandHash();
+    header.nTime = insecure_rand();
+    header.nBits = insecure_rand();
+    header.nNonce = insecure_rand();
+
+    CDataStream ds(SER_GETHASH, PROTOCOL_VERSION);
+    ds << header;
+    std::vector<unsigned char> vSerialized(ds.begin(), ds.end());
+    BOOST_CHECK_EQUAL(vSerialized.size(), BLOCK_HEADER_SIZE);
+
+    unsigned char buf[BLOCK_HEADER_SIZE];
+    header.SerializeHeader(buf);
+    BOOST_CHECK(std::vector<unsigned char>(buf, buf + BLOCK_HEADER_SIZE) == vSerialized);
+    BOOST_CHECK(header.GetPoWHash() == PoWHash(vSerialized));
+}
+
+BOOST_AUTO_TEST_CASE(lbry_pow_batch_test)
+{
+    // Batches shorter than, equal to and not a multiple of the lane count
+    const size_t nLen = 112;
+    for (size_t nCount = 1; nCount <= 3 * PoWHashLanes() + 1; nCount++) {
+        std::vector<unsigned char> vInput(nCount * nLen);
+        for (size_t i = 0; i < vInput.size(); i++)
+            vInput[i] = insecure_rand();
+        std::vector<uint256> vHashes(nCount);
+        PoWHashBatch(&vInput[0], nLen, nCount, &vHashes[0]);
+        for (size_t i = 0; i < nCount; i++) {
+            std::vector<unsigned char> vOne(vInput.begin() + i * nLen, vInput.begin() + (i + 1) * nLen);
+            BOOST_CHECK(vHashes[i] == PoWHash(vOne));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(lbry_pow_batch_midstate_test)
+{
+    // Inputs sharing their first 64 bytes, hashed on from the prefix's midstate
+    const size_t nPrefixLen = 64, nLen = 48;
+    unsigned char prefix[nPrefixLen];
+    for (size_t i = 0; i < nPrefixLen; i++)
+        prefix[i] = insecure_rand();
+    uint32_t midstate[8];
+    CSHA256().Write(prefix, nPrefixLen).GetMidstate(midstate);
+    for (size_t nCount = 1; nCount <= 2 * PoWHashLanes() + 1; nCount++) {
+        std::vector<unsigned char> vInput(nCount * nLen);
+        for (size_t i = 0; i < vInput.size(); i++)
+            vInput[i] = insecure_rand();
+        std::vector<uint256> vHashes(nCount);
+        PoWHashBatchMidstate(midstate, nPrefixLen, &vInput[0], nLen, nCount, &vHashes[0]);
+        for (size_t i = 0; i < nCount; i++) {
+            std::vector<unsigned char> vOne(prefix, prefix + nPrefixLen);
+            vOne.insert(vOne.end(), vInput.begin() + i * nLen, vInput.begin() + (i + 1) * nLen);
+            BOOST_CHECK(vHashes[i] == PoWHash(vOne));
+        }
+    }
+}
+
 
 
 
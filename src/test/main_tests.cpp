@@ -89,4 +89,25 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+BOOST_FIXTURE_TEST_CASE(read_raw_block, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    CBlockIndex* pindex = chainActive.Tip();
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()));
+    std::vector<unsigned char> vRaw;
+    BOOST_CHECK(ReadRawBlockFromDisk(vRaw, pindex->GetBlockPos(), chainparams.MessageStart()));
+
+    // The raw bytes are the network serialization of the block.
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    BOOST_CHECK(std::vector<unsigned char>(ss.begin(), ss.end()) == vRaw);
+
+    // A position that is not the start of a block is rejected.
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    pos.nPos += 1;
+    BOOST_CHECK(!ReadRawBlockFromDisk(vRaw, pos, chainparams.MessageStart()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,12 +2,15 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "policy/rbf.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <algorithm>
 #include <list>
 #include <vector>
 
@@ -178,6 +181,7 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     sortedOrder.insert(sortedOrder.begin(), tx6.GetHash().ToString());
     CheckSort<descendant_score>(pool, sortedOrder);
 
+    LOCK(pool.cs);
     CTxMemPool::setEntries setAncestors;
     setAncestors.insert(pool.mapTx.find(tx6.GetHash()));
     CMutableTransaction tx7 = CMutableTransaction();
@@ -422,6 +426,180 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
 }
 
 
+static CMutableTransaction CreateSpend(const COutPoint& prevout, int nOutputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++)
+    {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = 10 * COIN;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolRemoveForBlockTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // txParent and txChild1 are confirmed, their descendants txChild2 and
+    // txGrandChild stay:
+    //   txParent -> txChild1 -> txGrandChild
+    //            -> txChild2
+    CMutableTransaction txParent = CreateSpend(COutPoint(GetRandHash(), 0), 2);
+    CMutableTransaction txChild1 = CreateSpend(COutPoint(txParent.GetHash(), 0), 1);
+    CMutableTransaction txChild2 = CreateSpend(COutPoint(txParent.GetHash(), 1), 1);
+    CMutableTransaction txGrandChild = CreateSpend(COutPoint(txChild1.GetHash(), 0), 1);
+    // The block also double spends txConflict, so it goes with its child,
+    // but its parent txFunding stays.
+    CMutableTransaction txFunding = CreateSpend(COutPoint(GetRandHash(), 0), 1);
+    CMutableTransaction txConflict = CreateSpend(COutPoint(txFunding.GetHash(), 0), 1);
+    txConflict.vin.resize(2);
+    txConflict.vin[1].prevout = COutPoint(GetRandHash(), 0);
+    CMutableTransaction txConflictChild = CreateSpend(COutPoint(txConflict.GetHash(), 0), 1);
+    CMutableTransaction txDoubleSpend = CreateSpend(txConflict.vin[1].prevout, 1);
+
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(10000LL).FromTx(txParent));
+    pool.addUnchecked(txChild1.GetHash(), entry.Fee(20000LL).FromTx(txChild1));
+    pool.addUnchecked(txChild2.GetHash(), entry.Fee(30000LL).FromTx(txChild2));
+    pool.addUnchecked(txGrandChild.GetHash(), entry.Fee(40000LL).FromTx(txGrandChild));
+    pool.addUnchecked(txFunding.GetHash(), entry.Fee(1000LL).FromTx(txFunding));
+    pool.addUnchecked(txConflict.GetHash(), entry.Fee(2000LL).FromTx(txConflict));
+    pool.addUnchecked(txConflictChild.GetHash(), entry.Fee(3000LL).FromTx(txConflictChild));
+    pool.PrioritiseTransaction(txDoubleSpend.GetHash(), txDoubleSpend.GetHash().ToString(), 0, 5000LL);
+    pool.PrioritiseTransaction(txConflict.GetHash(), txConflict.GetHash().ToString(), 0, 5000LL);
+    BOOST_CHECK_EQUAL(pool.size(), 7);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txGrandChild.GetHash())->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txFunding.GetHash())->GetCountWithDescendants(), 3);
+
+    std::vector<CTransaction> vtx;
+    vtx.push_back(txParent);
+    vtx.push_back(txChild1);
+    vtx.push_back(txDoubleSpend);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts, false);
+
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK_EQUAL(conflicts.size(), 2);
+    BOOST_CHECK(std::find(conflicts.begin(), conflicts.end(), CTransaction(txConflict)) != conflicts.end());
+    BOOST_CHECK(std::find(conflicts.begin(), conflicts.end(), CTransaction(txConflictChild)) != conflicts.end());
+
+    // The remaining entries are packages of their own again
+    CTxMemPool::txiter it = pool.mapTx.find(txChild2.GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), it->GetTxSize());
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 30000LL);
+    BOOST_CHECK_EQUAL(it->GetSigOpCountWithAncestors(), 1);
+    BOOST_CHECK(pool.GetMemPoolParents(it).empty());
+    it = pool.mapTx.find(txGrandChild.GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), it->GetTxSize());
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 40000LL);
+    BOOST_CHECK_EQUAL(it->GetSigOpCountWithAncestors(), 1);
+    BOOST_CHECK(pool.GetMemPoolParents(it).empty());
+    it = pool.mapTx.find(txFunding.GetHash());
+    BOOST_REQUIRE(it != pool.mapTx.end());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(it->GetSizeWithDescendants(), it->GetTxSize());
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 1000LL);
+    BOOST_CHECK(pool.GetMemPoolChildren(it).empty());
+
+    // Fee deltas of confirmed and conflicted transactions are dropped
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    pool.ApplyDeltas(txDoubleSpend.GetHash(), dPriorityDelta, nFeeDelta);
+    pool.ApplyDeltas(txConflict.GetHash(), dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(nFeeDelta, 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorLimitTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    LOCK(pool.cs);
+    TestMemPoolEntryHelper entry;
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+
+    // A diamond: txRoot's outputs are spent by three children, and txJoin
+    // spends all of the children.
+    CMutableTransaction txRoot = CreateSpend(COutPoint(GetRandHash(), 0), 3);
+    pool.addUnchecked(txRoot.GetHash(), entry.FromTx(txRoot));
+    CMutableTransaction txJoin = CreateSpend(COutPoint(GetRandHash(), 0), 1);
+    for (int i = 0; i < 3; i++) {
+        CMutableTransaction txChild = CreateSpend(COutPoint(txRoot.GetHash(), i), 1);
+        pool.addUnchecked(txChild.GetHash(), entry.FromTx(txChild));
+        txJoin.vin.push_back(CTxIn(COutPoint(txChild.GetHash(), 0)));
+    }
+    uint64_t nJoinSize = ::GetSerializeSize(txJoin, SER_NETWORK, PROTOCOL_VERSION);
+    uint64_t nRootSize = pool.mapTx.find(txRoot.GetHash())->GetTxSize();
+
+    // txRoot is counted once, however many paths lead to it. Asking twice
+    // gives the same answer.
+    for (int i = 0; i < 2; i++) {
+        setAncestors.clear();
+        BOOST_CHECK(pool.CalculateMemPoolAncestors(entry.FromTx(txJoin), setAncestors, 5, 1000000, 1000, 1000000, errString));
+        BOOST_CHECK_EQUAL(setAncestors.size(), 4);
+    }
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry.FromTx(txJoin), setAncestors, 4, 1000000, 1000, 1000000, errString));
+    BOOST_CHECK_EQUAL(errString, "too many unconfirmed ancestors [limit: 4]");
+
+    // A chain of five. The parent's ancestor state rules out a sixth
+    // transaction, by count and by size.
+    CMutableTransaction txTip = CreateSpend(COutPoint(GetRandHash(), 0), 1);
+    uint64_t nChainSize = 0;
+    for (int i = 0; i < 5; i++) {
+        pool.addUnchecked(txTip.GetHash(), entry.FromTx(txTip));
+        nChainSize += ::GetSerializeSize(txTip, SER_NETWORK, PROTOCOL_VERSION);
+        txTip = CreateSpend(COutPoint(txTip.GetHash(), 0), 1);
+    }
+    uint64_t nTipSize = ::GetSerializeSize(txTip, SER_NETWORK, PROTOCOL_VERSION);
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry.FromTx(txTip), setAncestors, 6, nChainSize + nTipSize, 1000, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 5);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry.FromTx(txTip), setAncestors, 5, 1000000, 1000, 1000000, errString));
+    BOOST_CHECK_EQUAL(errString, "too many unconfirmed ancestors [limit: 5]");
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry.FromTx(txTip), setAncestors, 6, nChainSize + nTipSize - 1, 1000, 1000000, errString));
+    BOOST_CHECK_EQUAL(errString, strprintf("exceeds ancestor size limit [limit: %u]", nChainSize + nTipSize - 1));
+
+    // The size of the diamond counts txRoot once too
+    setAncestors.clear();
+    uint64_t nDiamondSize = nJoinSize + nRootSize + 3 * pool.mapTx.find(txJoin.vin[1].prevout.hash)->GetTxSize();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry.FromTx(txJoin), setAncestors, 5, nDiamondSize, 1000, 1000000, errString));
+}
+
+
+BOOST_AUTO_TEST_CASE(MempoolRBFOptInTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    // A child that does not signal inherits the state of its in-pool parent
+    CMutableTransaction txParent = CreateSpend(COutPoint(GetRandHash(), 0), 1);
+    pool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    CMutableTransaction txChild = CreateSpend(COutPoint(txParent.GetHash(), 0), 1);
+    pool.addUnchecked(txChild.GetHash(), entry.FromTx(txChild));
+    BOOST_CHECK(IsRBFOptIn(txChild, pool) == RBF_TRANSACTIONSTATE_FINAL);
+
+    CMutableTransaction txOptInParent = CreateSpend(COutPoint(GetRandHash(), 0), 1);
+    txOptInParent.vin[0].nSequence = 0;
+    pool.addUnchecked(txOptInParent.GetHash(), entry.FromTx(txOptInParent));
+    CMutableTransaction txOptInChild = CreateSpend(COutPoint(txOptInParent.GetHash(), 0), 1);
+    pool.addUnchecked(txOptInChild.GetHash(), entry.FromTx(txOptInChild));
+    BOOST_CHECK(IsRBFOptIn(txOptInChild, pool) == RBF_TRANSACTIONSTATE_REPLACEABLE_BIP125);
+
+    CMutableTransaction txUnknown = CreateSpend(COutPoint(txChild.GetHash(), 0), 1);
+    BOOST_CHECK(IsRBFOptIn(txUnknown, pool) == RBF_TRANSACTIONSTATE_UNKNOWN);
+}
+
 BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
     CTxMemPool pool(CFeeRate(1000));
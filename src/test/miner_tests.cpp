@@ -9,6 +9,7 @@
 #include "consensus/validation.h"
 #include "main.h"
 #include "miner.h"
+#include "pow.h"
 #include "pubkey.h"
 #include "script/standard.h"
 #include "txmempool.h"
@@ -423,4 +424,91 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+// Build a one-input, one-output transaction spending prevout
+static CMutableTransaction PackageTx(const COutPoint& prevout)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 5000000000LL;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(SelectBlockTransactions_packages)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    // A parent without fee, and a child paying for both
+    CMutableTransaction txParent = PackageTx(COutPoint(GetRandHash(), 0));
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(0).FromTx(txParent, &pool));
+    CMutableTransaction txChild = PackageTx(COutPoint(txParent.GetHash(), 0));
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(100000).FromTx(txChild, &pool));
+    // An unrelated transaction with a better fee rate than the child alone
+    // would have with its parent, but worse than the child by itself
+    CMutableTransaction txHigh = PackageTx(COutPoint(GetRandHash(), 0));
+    pool.addUnchecked(txHigh.GetHash(), entry.Fee(60000).FromTx(txHigh, &pool));
+    CMutableTransaction txMedium = PackageTx(COutPoint(GetRandHash(), 0));
+    pool.addUnchecked(txMedium.GetHash(), entry.Fee(40000).FromTx(txMedium, &pool));
+    // Below the relay fee
+    CMutableTransaction txLow = PackageTx(COutPoint(GetRandHash(), 0));
+    pool.addUnchecked(txLow.GetHash(), entry.Fee(0).FromTx(txLow, &pool));
+
+    std::vector<CTxMemPool::txiter> vSelected;
+    SelectBlockTransactions(pool, 1, 0, vSelected);
+    BOOST_CHECK_EQUAL(vSelected.size(), 4U);
+    BOOST_CHECK(vSelected[0]->GetTx().GetHash() == txHigh.GetHash());
+    BOOST_CHECK(vSelected[1]->GetTx().GetHash() == txParent.GetHash());
+    BOOST_CHECK(vSelected[2]->GetTx().GetHash() == txChild.GetHash());
+    BOOST_CHECK(vSelected[3]->GetTx().GetHash() == txMedium.GetHash());
+
+    // Once the parent is taken by the priority area, the child competes on its own.
+    mapArgs["-blockprioritysize"] = "1000";
+    pool.PrioritiseTransaction(txParent.GetHash(), txParent.GetHash().ToString(), 1e16, 0);
+    SelectBlockTransactions(pool, 1, 0, vSelected);
+    mapArgs.erase("-blockprioritysize");
+    BOOST_CHECK_EQUAL(vSelected.size(), 4U);
+    BOOST_CHECK(vSelected[0]->GetTx().GetHash() == txParent.GetHash());
+    BOOST_CHECK(vSelected[1]->GetTx().GetHash() == txChild.GetHash());
+    BOOST_CHECK(vSelected[2]->GetTx().GetHash() == txHigh.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(SearchProofOfWork_threads)
+{
+    const Consensus::Params& params = Params(CBaseChainParams::MAIN).GetConsensus();
+    std::vector<CBlockHeader> vHeaders(4);
+    for (size_t i = 0; i < vHeaders.size(); i++) {
+        vHeaders[i].nVersion = 1;
+        vHeaders[i].hashMerkleRoot = ArithToUint256(arith_uint256(i + 1));
+        vHeaders[i].nTime = 1466646588;
+        vHeaders[i].nBits = UintToArith256(params.powLimit).GetCompact();
+        vHeaders[i].nNonce = 0;
+    }
+
+    // One of the threads finds a solution and the tries are accounted for.
+    uint64_t nMaxTries = 100000000;
+    int nFound = SearchProofOfWork(vHeaders, 0x1000000, nMaxTries, params);
+    BOOST_CHECK(nFound >= 0 && nFound < (int)vHeaders.size());
+    BOOST_CHECK(nMaxTries < 100000000);
+    BOOST_CHECK(CheckProofOfWork(vHeaders[nFound].GetPoWHash(), vHeaders[nFound].nBits, params));
+
+    // An unreachable target uses up exactly the allowed number of tries.
+    for (size_t i = 0; i < vHeaders.size(); i++) {
+        vHeaders[i].nBits = 0x1b00ffff;
+        vHeaders[i].nNonce = 0;
+    }
+    nMaxTries = 1000;
+    BOOST_CHECK_EQUAL(SearchProofOfWork(vHeaders, 0x1000000, nMaxTries, params), -1);
+    BOOST_CHECK_EQUAL(nMaxTries, 0);
+
+    // ... or stops at the end of the nonce range.
+    nMaxTries = 1000;
+    BOOST_CHECK_EQUAL(SearchProofOfWork(vHeaders, 100, nMaxTries, params), -1);
+    BOOST_CHECK_EQUAL(nMaxTries, 1000 - 4 * 100);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
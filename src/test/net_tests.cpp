@@ -0,0 +1,178 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "crypto/common.h"
+#include "hash.h"
+#include "main.h"
+#include "net.h"
+#include "netbase.h"
+#include "primitives/transaction.h"
+#include "protocol.h"
+
+#include "test/test_bitcoin.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
+
+// Feed a serialized message to node in chunks of nChunk bytes.
+static bool ReceiveInChunks(CNode& node, const CSerializeData& msg, size_t nChunk)
+{
+    for (size_t nPos = 0; nPos < msg.size(); nPos += nChunk) {
+        if (!node.ReceiveMsgBytes(&msg[nPos], std::min(nChunk, msg.size() - nPos)))
+            return false;
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_incremental_checksum)
+{
+    CAddress addr(CService("250.1.1.1", 8333));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    // Larger than MAX_RECV_PREALLOC_SIZE, so the buffer grows while receiving
+    std::vector<unsigned char> payload(MAX_RECV_PREALLOC_SIZE + 12345);
+    for (size_t i = 0; i < payload.size(); i++)
+        payload[i] = i * 7;
+    CSharedMessage msg = MakeSharedMessage(NetMsgType::BLOCK, CFlatData(payload));
+    CSharedMessage ping = MakeSharedMessage(NetMsgType::PING, (uint64_t)42);
+
+    BOOST_CHECK(ReceiveInChunks(node, *msg, 1000));
+    BOOST_CHECK(ReceiveInChunks(node, *ping, 1));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 2U);
+
+    const CNetMessage& recv = node.vRecvMsg[0];
+    BOOST_CHECK(recv.complete());
+    BOOST_CHECK_EQUAL(recv.vRecv.size(), payload.size());
+    BOOST_CHECK(memcmp(&payload[0], &recv.vRecv[0], payload.size()) == 0);
+    uint256 hash = Hash(payload.begin(), payload.end());
+    BOOST_CHECK_EQUAL(recv.GetMessageHash().ToString(), hash.ToString());
+    BOOST_CHECK_EQUAL(ReadLE32(recv.GetMessageHash().begin()), recv.hdr.nChecksum);
+
+    const CNetMessage& recvPing = node.vRecvMsg[1];
+    BOOST_CHECK(recvPing.complete());
+    BOOST_CHECK_EQUAL(ReadLE32(recvPing.GetMessageHash().begin()), recvPing.hdr.nChecksum);
+
+    // A processed message hands its buffer on to the next one, unless the
+    // buffer grew past MAX_RECV_PREALLOC_SIZE
+    node.RecycleRecvBuffer(node.vRecvMsg[0]);
+    BOOST_CHECK(node.vRecvBufferPool.empty());
+    const char* pBuffer = &node.vRecvMsg[1].vRecv[0];
+    node.RecycleRecvBuffer(node.vRecvMsg[1]);
+    BOOST_REQUIRE_EQUAL(node.vRecvBufferPool.size(), MAX_RECV_BUFFER_POOL);
+    node.vRecvMsg.clear();
+
+    BOOST_CHECK(ReceiveInChunks(node, *ping, 7));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK(node.vRecvBufferPool.empty());
+    BOOST_CHECK(&node.vRecvMsg[0].vRecv[0] == pBuffer);
+    BOOST_CHECK_EQUAL(ReadLE32(node.vRecvMsg[0].GetMessageHash().begin()), node.vRecvMsg[0].hdr.nChecksum);
+    node.vRecvMsg.clear();
+
+    BOOST_CHECK(ReceiveInChunks(node, *msg, 4096));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK_EQUAL(node.vRecvMsg[0].GetMessageHash().ToString(), hash.ToString());
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_oversized)
+{
+    CAddress addr(CService("250.1.1.2", 8333));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    CMessageHeader hdr(Params().MessageStart(), NetMsgType::BLOCK, MAX_PROTOCOL_MESSAGE_LENGTH + 1);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    BOOST_CHECK(!node.ReceiveMsgBytes(&ss[0], ss.size()));
+}
+
+BOOST_AUTO_TEST_CASE(sharedmessage_matches_pushmessage)
+{
+    CAddress addr(CService("250.1.1.3", 8333));
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1;
+    CTransaction tx(mtx);
+
+    // Without a socket to send on, the message stays queued
+    node.PushMessage(NetMsgType::TX, tx);
+    BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), 1U);
+    const CSerializeData& pushed = *node.vSendMsg[0];
+
+    CSharedMessage msg = MakeSharedMessage(NetMsgType::TX, tx);
+    BOOST_CHECK(*msg == pushed);
+
+    // Header and checksum are those of the payload
+    CDataStream ss(*msg, SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(Params().MessageStart());
+    ss >> hdr;
+    BOOST_CHECK(hdr.IsValid(Params().MessageStart()));
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), NetMsgType::TX);
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ss.size());
+    uint256 hash = Hash(ss.begin(), ss.end());
+    BOOST_CHECK_EQUAL(ReadLE32(hash.begin()), hdr.nChecksum);
+    CTransaction txRead;
+    ss >> txRead;
+    BOOST_CHECK(txRead == tx);
+}
+
+BOOST_AUTO_TEST_CASE(pushsharedmessage_queues_buffer)
+{
+    CAddress addr(CService("250.1.1.4", 8333));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    std::vector<unsigned char> payload(1000, 0x42);
+    CSharedMessage msg = MakeSharedMessage(NetMsgType::BLOCK, CFlatData(payload));
+
+    // Each peer queues the one buffer, without a copy
+    node.PushSharedMessage(NetMsgType::BLOCK, msg);
+    BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), 1U);
+    BOOST_CHECK(node.vSendMsg[0] == msg);
+    BOOST_CHECK_EQUAL(node.nSendSize, msg->size());
+    node.PushSharedMessage(NetMsgType::BLOCK, msg);
+    BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), 2U);
+    BOOST_CHECK(node.vSendMsg[1] == msg);
+    BOOST_CHECK_EQUAL(node.nSendSize, 2 * msg->size());
+    BOOST_CHECK_EQUAL(msg.use_count(), 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(block_message_cache, TestChain100Setup)
+{
+    CBlockIndex* pindexA = chainActive.Tip();
+    CBlockIndex* pindexB = pindexA->pprev;
+
+    // Asking for the same block again gets the cached message
+    CSharedMessage msgA = GetBlockMessage(pindexA->GetBlockHash(), pindexA->GetBlockPos());
+    BOOST_REQUIRE(msgA);
+    BOOST_CHECK(GetBlockMessage(pindexA->GetBlockHash(), pindexA->GetBlockPos()) == msgA);
+
+    // It holds the block as a "block" message would
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, pindexA, Params().GetConsensus()));
+    BOOST_CHECK(*msgA == *MakeSharedMessage(NetMsgType::BLOCK, block));
+
+    // Another block replaces it
+    CSharedMessage msgB = GetBlockMessage(pindexB->GetBlockHash(), pindexB->GetBlockPos());
+    BOOST_REQUIRE(msgB);
+    BOOST_CHECK(*msgB != *msgA);
+    BOOST_CHECK(GetBlockMessage(pindexB->GetBlockHash(), pindexB->GetBlockPos()) == msgB);
+    CSharedMessage msgA2 = GetBlockMessage(pindexA->GetBlockHash(), pindexA->GetBlockPos());
+    BOOST_CHECK(msgA2 != msgA);
+    BOOST_CHECK(*msgA2 == *msgA);
+
+    // A block that cannot be read gives an empty message
+    CDiskBlockPos pos = pindexB->GetBlockPos();
+    pos.nPos += 1;
+    BOOST_CHECK(!GetBlockMessage(GetRandHash(), pos));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
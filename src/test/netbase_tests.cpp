@@ -6,6 +6,12 @@
 #include "test/test_bitcoin.h"
 
 #include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
 
 #include <boost/assign/list_of.hpp>
 #include <boost/test/unit_test.hpp>
@@ -251,4 +257,46 @@ BOOST_AUTO_TEST_CASE(netbase_getgroup)
     BOOST_CHECK(CNetAddr("2001:2001:9999:9999:9999:9999:9999:9999").GetGroup() == boost::assign::list_of((unsigned char)NET_IPV6)(32)(1)(32)(1)); //IPv6
 }
 
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(netbase_connect_high_fd)
+{
+    // -socketevents=epoll allows descriptors past FD_SETSIZE, which
+    // ConnectSocket has to wait on without select()
+    struct rlimit limit;
+    BOOST_REQUIRE(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < FD_SETSIZE + 16) {
+        BOOST_TEST_MESSAGE("Skipping netbase_connect_high_fd, descriptor limit too low");
+        return;
+    }
+
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&addr, len) == 0);
+    BOOST_REQUIRE(listen(hListen, 1) == 0);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&addr, &len) == 0);
+
+    std::vector<int> vFillers;
+    int fd;
+    while ((fd = dup(hListen)) >= 0 && fd < (int)FD_SETSIZE)
+        vFillers.push_back(fd);
+    BOOST_REQUIRE(fd >= 0);
+    vFillers.push_back(fd);
+
+    SOCKET hSocket = INVALID_SOCKET;
+    BOOST_CHECK(ConnectSocket(CService(CNetAddr("127.0.0.1"), ntohs(addr.sin_port)), hSocket, 1000));
+    BOOST_CHECK(hSocket != INVALID_SOCKET && hSocket >= FD_SETSIZE);
+    if (hSocket != INVALID_SOCKET)
+        CloseSocket(hSocket);
+
+    BOOST_FOREACH(int fdFiller, vFillers)
+        close(fdFiller);
+    CloseSocket(hListen);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
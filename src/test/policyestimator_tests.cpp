@@ -2,8 +2,10 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "policy/fees.h"
 #include "txmempool.h"
+#include "streams.h"
 #include "uint256.h"
 #include "util.h"
 
@@ -173,6 +175,20 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
         BOOST_CHECK(mpool.estimatePriority(i) > origPriEst[i-1] - deltaPri);
     }
 
+    // With nothing left in the mempool, the estimates only depend on what
+    // is written to fee_estimates.dat, and survive a round trip through it
+    {
+        CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(mpool.WriteFeeEstimates(file));
+        rewind(file.Get());
+        CTxMemPool mpoolReloaded(CFeeRate(1000));
+        BOOST_CHECK(mpoolReloaded.ReadFeeEstimates(file));
+        for (unsigned int i = 1; i <= MAX_BLOCK_CONFIRMS; i++) {
+            BOOST_CHECK(mpoolReloaded.estimateFee(i) == mpool.estimateFee(i));
+            BOOST_CHECK_EQUAL(mpoolReloaded.estimatePriority(i), mpool.estimatePriority(i));
+        }
+    }
+
     // Mine 200 more blocks where everything is mined every block
     // Estimates should be below original estimates
     while (blocknum < 465) {
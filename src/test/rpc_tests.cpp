@@ -6,7 +6,9 @@
 #include "rpc/client.h"
 
 #include "base58.h"
+#include "main.h"
 #include "netbase.h"
+#include "util.h"
 
 #include "test/test_bitcoin.h"
 
@@ -332,4 +334,72 @@ BOOST_AUTO_TEST_CASE(rpc_convert_values_generatetoaddress)
     BOOST_CHECK_EQUAL(result[2].get_int(), 9);
 }
 
+static bool IsInvalidThreads(const runtime_error& e)
+{
+    return string(e.what()).find("nthreads") != string::npos;
+}
+
+static bool IsNotInvalidThreads(const runtime_error& e)
+{
+    return !IsInvalidThreads(e);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_generate_threads)
+{
+    // The thread count is checked first; valid ones fail on the testnet
+    // address instead, before anything is mined.
+    string strPrefix = "generatetoaddress 1 mkESjLZW66TmHhiFX8MCaBjrhZ543PPh9a 1 ";
+    int nMaxThreads = std::max(GetNumCores(), 1);
+    BOOST_CHECK_EXCEPTION(CallRPC(strPrefix + "0"), runtime_error, IsInvalidThreads);
+    BOOST_CHECK_EXCEPTION(CallRPC(strPrefix + "-2"), runtime_error, IsInvalidThreads);
+    BOOST_CHECK_EXCEPTION(CallRPC(strPrefix + strprintf("%d", nMaxThreads + 1)), runtime_error, IsInvalidThreads);
+    BOOST_CHECK_EXCEPTION(CallRPC("generate 1 1 1000000"), runtime_error, IsInvalidThreads);
+    BOOST_CHECK_EXCEPTION(CallRPC(strPrefix + "-1"), runtime_error, IsNotInvalidThreads);
+    BOOST_CHECK_EXCEPTION(CallRPC(strPrefix + strprintf("%d", nMaxThreads)), runtime_error, IsNotInvalidThreads);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_batch)
+{
+    mapArgs["-rpcbatchthreads"] = "3";
+    StartRPC();
+    SetRPCWarmupFinished();
+
+    // Read-only requests run in parallel between requests that run alone,
+    // and every reply keeps the position of its request
+    UniValue vReq(UniValue::VARR);
+    std::vector<std::string> vMethods;
+    for (int i = 0; i < 60; i++) {
+        std::string strMethod = i % 20 == 10 ? "help" : i % 7 == 3 ? "nosuchmethod" : i % 2 ? "getblockcount" : "getblockhash";
+        UniValue params(UniValue::VARR);
+        if (strMethod == "getblockhash")
+            params.push_back(UniValue(0));
+        UniValue req(UniValue::VOBJ);
+        req.push_back(Pair("method", strMethod));
+        req.push_back(Pair("params", params));
+        req.push_back(Pair("id", i));
+        vReq.push_back(req);
+        vMethods.push_back(strMethod);
+    }
+
+    UniValue vReply;
+    BOOST_REQUIRE(vReply.read(JSONRPCExecBatch(vReq)));
+    BOOST_REQUIRE_EQUAL(vReply.size(), vReq.size());
+    for (unsigned int i = 0; i < vReply.size(); i++) {
+        BOOST_CHECK_EQUAL(find_value(vReply[i], "id").get_int(), (int)i);
+        const UniValue& result = find_value(vReply[i], "result");
+        if (vMethods[i] == "nosuchmethod")
+            BOOST_CHECK_EQUAL(find_value(find_value(vReply[i], "error"), "code").get_int(), RPC_METHOD_NOT_FOUND);
+        else if (vMethods[i] == "getblockhash")
+            BOOST_CHECK_EQUAL(result.get_str(), chainActive.Genesis()->GetBlockHash().GetHex());
+        else if (vMethods[i] == "getblockcount")
+            BOOST_CHECK_EQUAL(result.get_int(), chainActive.Height());
+        else
+            BOOST_CHECK(result.isStr());
+    }
+
+    InterruptRPC();
+    StopRPC();
+    mapArgs.erase("-rpcbatchthreads");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
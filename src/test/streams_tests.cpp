@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "streams.h"
 #include "support/allocators/zeroafterfree.h"
 #include "test/test_bitcoin.h"
@@ -64,4 +65,26 @@ BOOST_AUTO_TEST_CASE(streams_serializedata_xor)
             std::string(ds.begin(), ds.end()));  
 }         
 
+BOOST_AUTO_TEST_CASE(streams_buffer_reader)
+{
+    CDataStream ds(SER_DISK, CLIENT_VERSION);
+    ds << (uint32_t)0x01020304 << std::string("hello") << (uint8_t)7;
+    std::vector<char> buf(ds.begin(), ds.end());
+
+    CBufferReader reader(&buf[0], &buf[0] + buf.size(), SER_DISK, CLIENT_VERSION);
+    uint32_t n;
+    std::string str;
+    reader >> n >> str;
+    BOOST_CHECK_EQUAL(n, 0x01020304U);
+    BOOST_CHECK_EQUAL(str, "hello");
+    BOOST_CHECK_EQUAL(reader.size(), 1U);
+
+    // Reading past the end throws and leaves the rest in place
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+    uint8_t c;
+    reader >> c;
+    BOOST_CHECK_EQUAL(c, 7);
+    BOOST_CHECK(reader.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
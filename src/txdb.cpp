@@ -96,13 +96,10 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 
 CCoinsViewCursor *CCoinsViewDB::Cursor() const
 {
-    CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper*>(&db)->NewIterator(), GetBestBlock());
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    i->pcursor->Seek(DB_COINS);
+    CCoinsViewDBCursor *i = new CCoinsViewDBCursor(db.NewPrefixIterator(DB_COINS), GetBestBlock());
     // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    if (i->pcursor->Valid())
+        i->pcursor->GetKey(i->keyTmp);
     return i;
 }
 
@@ -179,15 +176,14 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
 
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    boost::scoped_ptr<CDBPrefixIterator> pcursor(NewPrefixIterator(DB_BLOCK_INDEX));
 
-    pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
-
-    // Load mapBlockIndex
+    // Load mapBlockIndex; the proof of work is checked afterwards, in parallel
+    std::vector<CBlockIndex*> vIndex;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         std::pair<char, uint256> key;
-        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
+        if (pcursor->GetKey(key)) {
             CDiskBlockIndex diskindex;
             if (pcursor->GetValue(diskindex)) {
                 // Construct block index object
@@ -205,9 +201,7 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 pindexNew->nNonce         = diskindex.nNonce;
                 pindexNew->nStatus        = diskindex.nStatus;
                 pindexNew->nTx            = diskindex.nTx;
-
-                if (!CheckProofOfWork(pindexNew->GetBlockPoWHash(), pindexNew->nBits, Params().GetConsensus()))
-                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
+                vIndex.push_back(pindexNew);
 
                 pcursor->Next();
             } else {
@@ -218,5 +212,12 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
         }
     }
 
+    int64_t nStart = GetTimeMillis();
+    int nThreads = std::max(GetNumCores(), 1);
+    const CBlockIndex* pindexFailed = CheckBlockIndexProofOfWork(vIndex, Params().GetConsensus(), nThreads);
+    if (pindexFailed)
+        return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexFailed->ToString());
+    LogPrint("bench", "LoadBlockIndex(): checked proof of work of %u headers using %d threads: %dms\n", vIndex.size(), nThreads, GetTimeMillis() - nStart);
+
     return true;
 }
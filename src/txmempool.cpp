@@ -43,11 +43,16 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
     nSizeWithAncestors = nTxSize;
     nModFeesWithAncestors = nFee;
     nSigOpCountWithAncestors = sigOpCount;
+
+    nLastTraversal = 0;
+    nLastUpdate = 0;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
 {
     *this = other;
+    // Traversal numbers only mean something within the pool that made them
+    nLastTraversal = 0;
 }
 
 double
@@ -167,7 +172,13 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
-    setEntries parentHashes;
+    AssertLockHeld(cs);
+
+    // Entries are marked as they are reached, and the ones still to be walked
+    // are kept in a reused vector, so the walk itself does not allocate.
+    const uint64_t nThisTraversal = ++nTraversal;
+    std::vector<txiter>& vStage = vTraversalStage;
+    vStage.clear();
     const CTransaction &tx = entry.GetTx();
 
     if (fSearchForParents) {
@@ -176,9 +187,9 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
-                if (parentHashes.size() + 1 > limitAncestorCount) {
+            if (piter != mapTx.end() && !piter->Visit(nThisTraversal)) {
+                vStage.push_back(piter);
+                if (vStage.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
                 }
@@ -188,16 +199,33 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        it->Visit(nThisTraversal);
+        BOOST_FOREACH(const txiter &piter, GetMemPoolParents(it)) {
+            piter->Visit(nThisTraversal);
+            vStage.push_back(piter);
+        }
+    }
+
+    // Each parent's ancestor state already sums up its own ancestors, and the
+    // new entry has all of them too. That rules out a transaction at the end
+    // of a chain that is too long or too large without walking the chain.
+    BOOST_FOREACH(const txiter &piter, vStage) {
+        if (piter->GetCountWithAncestors() + 1 > limitAncestorCount) {
+            errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+            return false;
+        } else if (piter->GetSizeWithAncestors() + entry.GetTxSize() > limitAncestorSize) {
+            errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+            return false;
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
-    while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
+    while (!vStage.empty()) {
+        txiter stageit = vStage.back();
+        vStage.pop_back();
 
         setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -214,10 +242,10 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
         BOOST_FOREACH(const txiter &phash, setMemPoolParents) {
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (!phash->Visit(nThisTraversal)) {
+                vStage.push_back(phash);
             }
-            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
+            if (vStage.size() + setAncestors.size() + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
                 return false;
             }
@@ -266,57 +294,96 @@ void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 
 void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants)
 {
-    // For each entry, walk back all ancestors and decrement size associated with this
-    // transaction
+    // Every entry that stays in the mempool but has an ancestor or descendant
+    // being removed needs its package state reduced by all of those. Gather
+    // these entries first and update each of them once, rather than once per
+    // removed transaction: every modify() re-sorts the entry in all of mapTx's
+    // indices, and entries that are themselves being removed need no update.
+    //
+    // Ancestors and descendants are walked through mapLinks only. If we happen
+    // to be in the middle of processing a reorg, the mempool can be in an
+    // inconsistent state: in-mempool children aren't linked to the in-block
+    // txs until UpdateTransactionsFromBlock() is called, because when we add a
+    // new transaction to the mempool in addUnchecked() we assume it has no
+    // children. The set of ancestors reachable via mapLinks is then the same
+    // as the set of ancestors whose packages include the removed transaction,
+    // and that is the set that has to be updated.
     const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+
+    setEntries setKeptAncestors;
+    setEntries setVisited(entriesToRemove);
+    std::vector<txiter> vStage(entriesToRemove.begin(), entriesToRemove.end());
+    while (!vStage.empty()) {
+        txiter it = vStage.back();
+        vStage.pop_back();
+        BOOST_FOREACH(txiter parentIt, GetMemPoolParents(it)) {
+            if (setVisited.insert(parentIt).second) {
+                setKeptAncestors.insert(parentIt);
+                vStage.push_back(parentIt);
+            }
+        }
+    }
+    BOOST_FOREACH(txiter ancestorIt, setKeptAncestors) {
+        setEntries setDescendants;
+        CalculateDescendants(ancestorIt, setDescendants);
+        int64_t modifySize = 0;
+        CAmount modifyFee = 0;
+        int64_t modifyCount = 0;
+        BOOST_FOREACH(txiter dit, setDescendants) {
+            if (entriesToRemove.count(dit)) {
+                modifySize -= dit->GetTxSize();
+                modifyFee -= dit->GetModifiedFee();
+                modifyCount--;
+            }
+        }
+        mapTx.modify(ancestorIt, update_descendant_state(modifySize, modifyFee, modifyCount));
+    }
+
     if (updateDescendants) {
         // updateDescendants should be true whenever we're not recursively
         // removing a tx and all its descendants, eg when a transaction is
         // confirmed in a block.
-        // Here we only update statistics and not data in mapLinks (which
-        // we need to preserve until we're finished with all operations that
-        // need to traverse the mempool).
-        BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-            setEntries setDescendants;
-            CalculateDescendants(removeIt, setDescendants);
-            setDescendants.erase(removeIt); // don't update state for self
-            int64_t modifySize = -((int64_t)removeIt->GetTxSize());
-            CAmount modifyFee = -removeIt->GetModifiedFee();
-            int modifySigOps = -removeIt->GetSigOpCount();
-            BOOST_FOREACH(txiter dit, setDescendants) {
-                mapTx.modify(dit, update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
+        setEntries setKeptDescendants;
+        setVisited = entriesToRemove;
+        vStage.assign(entriesToRemove.begin(), entriesToRemove.end());
+        while (!vStage.empty()) {
+            txiter it = vStage.back();
+            vStage.pop_back();
+            BOOST_FOREACH(txiter childIt, GetMemPoolChildren(it)) {
+                if (setVisited.insert(childIt).second) {
+                    setKeptDescendants.insert(childIt);
+                    vStage.push_back(childIt);
+                }
+            }
+        }
+        BOOST_FOREACH(txiter descendantIt, setKeptDescendants) {
+            setEntries setAncestors;
+            CalculateMemPoolAncestors(*descendantIt, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            int64_t modifySize = 0;
+            CAmount modifyFee = 0;
+            int64_t modifyCount = 0;
+            int modifySigOps = 0;
+            BOOST_FOREACH(txiter ait, setAncestors) {
+                if (entriesToRemove.count(ait)) {
+                    modifySize -= ait->GetTxSize();
+                    modifyFee -= ait->GetModifiedFee();
+                    modifyCount--;
+                    modifySigOps -= ait->GetSigOpCount();
+                }
             }
+            mapTx.modify(descendantIt, update_ancestor_state(modifySize, modifyFee, modifyCount, modifySigOps));
         }
     }
+
+    // Only now that all the package state is updated can we sever the links
+    // between each transaction being removed and its mempool parents and
+    // children.
     BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-        setEntries setAncestors;
-        const CTxMemPoolEntry &entry = *removeIt;
-        std::string dummy;
-        // Since this is a tx that is already in the mempool, we can call CMPA
-        // with fSearchForParents = false.  If the mempool is in a consistent
-        // state, then using true or false should both be correct, though false
-        // should be a bit faster.
-        // However, if we happen to be in the middle of processing a reorg, then
-        // the mempool can be in an inconsistent state.  In this case, the set
-        // of ancestors reachable via mapLinks will be the same as the set of 
-        // ancestors whose packages include this transaction, because when we
-        // add a new transaction to the mempool in addUnchecked(), we assume it
-        // has no children, and in the case of a reorg where that assumption is
-        // false, the in-mempool children aren't linked to the in-block tx's
-        // until UpdateTransactionsFromBlock() is called.
-        // So if we're being called during a reorg, ie before
-        // UpdateTransactionsFromBlock() has been called, then mapLinks[] will
-        // differ from the set of mempool parents we'd calculate by searching,
-        // and it's important that we use the mapLinks[] notion of ancestor
-        // transactions as the set of things to update for removal.
-        CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
-        // Note that UpdateAncestorsOf severs the child links that point to
-        // removeIt in the entries for the parents of removeIt.
-        UpdateAncestorsOf(false, removeIt, setAncestors);
+        BOOST_FOREACH(txiter parentIt, GetMemPoolParents(removeIt)) {
+            UpdateChild(parentIt, removeIt, false);
+        }
     }
-    // After updating all the ancestor sizes, we can now sever the link between each
-    // transaction being removed and any mempool children (ie, update setMemPoolParents
-    // for each direct child of a transaction being removed).
     BOOST_FOREACH(txiter removeIt, entriesToRemove) {
         UpdateChildrenForRemoval(removeIt);
     }
@@ -343,7 +410,7 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
 }
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minReasonableRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), nTransactionsRemoved(0), nTraversal(0)
 {
     _clear(); //lock free clear
 
@@ -386,6 +453,12 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+unsigned int CTxMemPool::GetTransactionsRemoved() const
+{
+    LOCK(cs);
+    return nTransactionsRemoved;
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate)
 {
     // Add to memory pool without checking anything.
@@ -435,6 +508,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     UpdateEntryForAncestors(newit, setAncestors);
 
     nTransactionsUpdated++;
+    mapTx.modify(newit, set_last_update(nTransactionsUpdated));
     totalTxSize += entry.GetTxSize();
     minerPolicyEstimator->processTransaction(entry, fCurrentEstimate);
 
@@ -453,6 +527,7 @@ void CTxMemPool::removeUnchecked(txiter it)
     mapLinks.erase(it);
     mapTx.erase(it);
     nTransactionsUpdated++;
+    nTransactionsRemoved++;
     minerPolicyEstimator->removeTx(hash);
 }
 
@@ -575,33 +650,53 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
 
 /**
  * Called when a block is connected. Removes from mempool and updates the miner fee estimator.
+ *
+ * The confirmed transactions and everything that conflicts with them are
+ * removed in one batch, so a package that loses several members to the block
+ * has its state updated once, not once per member.
  */
 void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
                                 std::list<CTransaction>& conflicts, bool fCurrentEstimate)
 {
     LOCK(cs);
-    std::vector<CTxMemPoolEntry> entries;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        uint256 hash = tx.GetHash();
-
-        indexed_transaction_set::iterator i = mapTx.find(hash);
-        if (i != mapTx.end())
-            entries.push_back(*i);
-    }
+    std::vector<const CTxMemPoolEntry*> entries;
+    setEntries stage;
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
         txiter it = mapTx.find(tx.GetHash());
         if (it != mapTx.end()) {
-            setEntries stage;
+            entries.push_back(&*it);
             stage.insert(it);
-            RemoveStaged(stage, true);
         }
-        removeConflicts(tx, conflicts);
-        ClearPrioritisation(tx.GetHash());
     }
-    // After the txs in the new block have been removed from the mempool, update policy estimates
+    // Update policy estimates with the confirmed entries while they are still around
     minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
+
+    // Transactions which depend on inputs of the block, and their descendants
+    setEntries setConflicts;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+            if (it == mapNextTx.end())
+                continue;
+            const uint256& hashConflict = it->second.ptx->GetHash();
+            if (hashConflict == tx.GetHash())
+                continue;
+            txiter conflictIt = mapTx.find(hashConflict);
+            assert(conflictIt != mapTx.end());
+            CalculateDescendants(conflictIt, setConflicts);
+            ClearPrioritisation(hashConflict);
+        }
+    }
+    BOOST_FOREACH(txiter it, setConflicts) {
+        conflicts.push_back(it->GetTx());
+        stage.insert(it);
+    }
+
+    RemoveStaged(stage, true);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        ClearPrioritisation(tx.GetHash());
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = true;
 }
@@ -617,6 +712,7 @@ void CTxMemPool::_clear()
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
+    ++nTransactionsRemoved;
 }
 
 void CTxMemPool::clear()
@@ -855,6 +951,8 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
             BOOST_FOREACH(txiter ancestorIt, setAncestors) {
                 mapTx.modify(ancestorIt, update_descendant_state(0, nFeeDelta, 0));
             }
+            ++nTransactionsUpdated;
+            mapTx.modify(it, set_last_update(nTransactionsUpdated));
         }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
@@ -1016,7 +1114,7 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRe
 
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
-    while (DynamicMemoryUsage() > sizelimit) {
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
         indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
 
         // We set the new mempool min fee to the feerate of the removed set, plus the
@@ -17,6 +17,7 @@
 #undef foreach
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
+#include "boost/unordered_map.hpp"
 
 class CAutoFile;
 class CBlockIndex;
@@ -87,6 +88,8 @@ private:
     unsigned int sigOpCount;   //!< Legacy sig ops plus P2SH sig op count
     int64_t feeDelta;          //!< Used for determining the priority of the transaction for mining in a block
     LockPoints lockPoints;     //!< Track the height and time at which tx was final
+    mutable uint64_t nLastTraversal; //!< Last mempool traversal that reached this entry (guarded by the pool's cs)
+    unsigned int nLastUpdate;  //!< The pool's GetTransactionsUpdated() when this entry was added or its fee delta last changed
 
     // Information about descendants of this transaction that are in the
     // mempool; if we remove this transaction we must remove all of these
@@ -125,6 +128,7 @@ public:
     int64_t GetModifiedFee() const { return nFee + feeDelta; }
     size_t DynamicMemoryUsage() const { return nUsageSize; }
     const LockPoints& GetLockPoints() const { return lockPoints; }
+    unsigned int GetLastUpdate() const { return nLastUpdate; }
 
     // Adjusts the descendant state, if this entry is not dirty.
     void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
@@ -135,6 +139,7 @@ public:
     void UpdateFeeDelta(int64_t feeDelta);
     // Update the LockPoints after a reorg
     void UpdateLockPoints(const LockPoints& lp);
+    void SetLastUpdate(unsigned int n) { nLastUpdate = n; }
 
     uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
     uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
@@ -146,6 +151,16 @@ public:
     uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
     CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
     unsigned int GetSigOpCountWithAncestors() const { return nSigOpCountWithAncestors; }
+
+    // Mark the entry as reached by traversal nTraversal. Returns whether it
+    // already was, so a walk needs no set of its own to avoid revisiting.
+    bool Visit(uint64_t nTraversal) const
+    {
+        if (nLastTraversal == nTraversal)
+            return true;
+        nLastTraversal = nTraversal;
+        return false;
+    }
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -190,6 +205,16 @@ private:
     int64_t feeDelta;
 };
 
+struct set_last_update
+{
+    set_last_update(unsigned int _n) : n(_n) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.SetLastUpdate(n); }
+
+private:
+    unsigned int n;
+};
+
 struct update_lock_points
 {
     update_lock_points(const LockPoints& _lp) : lp(_lp) { }
@@ -217,7 +242,7 @@ struct mempoolentry_txid
 class CompareTxMemPoolEntryByDescendantScore
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         bool fUseADescendants = UseDescendantScore(a);
         bool fUseBDescendants = UseDescendantScore(b);
@@ -239,7 +264,7 @@ public:
     }
 
     // Calculate which score to use for an entry (avoiding division).
-    bool UseDescendantScore(const CTxMemPoolEntry &a)
+    bool UseDescendantScore(const CTxMemPoolEntry &a) const
     {
         double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
         double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
@@ -254,7 +279,7 @@ public:
 class CompareTxMemPoolEntryByScore
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
         double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
@@ -268,7 +293,7 @@ public:
 class CompareTxMemPoolEntryByEntryTime
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         return a.GetTime() < b.GetTime();
     }
@@ -277,7 +302,7 @@ public:
 class CompareTxMemPoolEntryByAncestorFee
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         double aFees = a.GetModFeesWithAncestors();
         double aSize = a.GetSizeWithAncestors();
@@ -401,6 +426,7 @@ class CTxMemPool
 private:
     uint32_t nCheckFrequency; //!< Value n means that n times in 2^32 we check.
     unsigned int nTransactionsUpdated;
+    unsigned int nTransactionsRemoved; //!< Like nTransactionsUpdated, but only counting removals
     CBlockPolicyEstimator* minerPolicyEstimator;
 
     uint64_t totalTxSize;      //!< sum of all mempool tx' byte sizes
@@ -470,9 +496,19 @@ private:
         setEntries children;
     };
 
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    // Every walk over a package looks its entries up in mapLinks, so it is
+    // hashed on the address of the entry instead of ordered by txid.
+    struct TxiterHasher {
+        size_t operator()(const txiter &it) const {
+            return boost::hash<const CTxMemPoolEntry*>()(&*it);
+        }
+    };
+    typedef boost::unordered_map<txiter, TxLinks, TxiterHasher> txlinksMap;
     txlinksMap mapLinks;
 
+    mutable uint64_t nTraversal;                //!< Number of the last walk over the mempool, see CTxMemPoolEntry::Visit (guarded by cs)
+    mutable std::vector<txiter> vTraversalStage; //!< Scratch space of CalculateMemPoolAncestors (guarded by cs)
+
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
@@ -515,6 +551,11 @@ public:
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
+    /**
+     * Changes whenever transactions leave the pool, so iterators into mapTx
+     * kept while GetTransactionsRemoved() stays the same remain valid.
+     */
+    unsigned int GetTransactionsRemoved() const;
     /**
      * Check that none of this transactions inputs are in the mempool, and thus
      * the tx is not dependent on other mempool transactions to be included in a block.
@@ -556,6 +597,8 @@ public:
      *  errString = populated with error reason if any limits are hit
      *  fSearchForParents = whether to search a tx's vin for in-mempool parents, or
      *    look up parents from mapLinks. Must be true for entries not in the mempool
+     *  The walk marks the entries it reaches and uses scratch space of the pool,
+     *  so cs must be held even though the mempool itself is not modified.
      */
     bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents = true) const;
 
@@ -78,6 +78,19 @@ public:
         return sizeof(data);
     }
 
+    uint64_t GetUint64(int pos) const
+    {
+        const uint8_t* ptr = data + pos * 8;
+        return ((uint64_t)ptr[0]) |
+               ((uint64_t)ptr[1]) << 8 |
+               ((uint64_t)ptr[2]) << 16 |
+               ((uint64_t)ptr[3]) << 24 |
+               ((uint64_t)ptr[4]) << 32 |
+               ((uint64_t)ptr[5]) << 40 |
+               ((uint64_t)ptr[6]) << 48 |
+               ((uint64_t)ptr[7]) << 56;
+    }
+
     unsigned int GetSerializeSize(int nType, int nVersion) const
     {
         return sizeof(data);
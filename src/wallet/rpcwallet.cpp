@@ -3108,59 +3108,59 @@ extern UniValue importprunedfunds(const UniValue& params, bool fHelp);
 extern UniValue removeprunedfunds(const UniValue& params, bool fHelp);
 
 static const CRPCCommand commands[] =
-{ //  category              name                        actor (function)           okSafeMode
-    //  --------------------- ------------------------    -----------------------    ----------
-    { "rawtransactions",    "fundrawtransaction",       &fundrawtransaction,       false },
-    { "hidden",             "resendwallettransactions", &resendwallettransactions, true  },
-    { "wallet",             "abandontransaction",       &abandontransaction,       false },
-    { "wallet",             "addmultisigaddress",       &addmultisigaddress,       true  },
-    { "wallet",             "backupwallet",             &backupwallet,             true  },
-    { "wallet",             "dumpprivkey",              &dumpprivkey,              true  },
-    { "wallet",             "dumpwallet",               &dumpwallet,               true  },
-    { "wallet",             "encryptwallet",            &encryptwallet,            true  },
-    { "wallet",             "getaccountaddress",        &getaccountaddress,        true  },
-    { "wallet",             "getaccount",               &getaccount,               true  },
-    { "wallet",             "getaddressesbyaccount",    &getaddressesbyaccount,    true  },
-    { "wallet",             "getbalance",               &getbalance,               false },
-    { "wallet",             "getnewaddress",            &getnewaddress,            true  },
-    { "wallet",             "getrawchangeaddress",      &getrawchangeaddress,      true  },
-    { "wallet",             "getreceivedbyaccount",     &getreceivedbyaccount,     false },
-    { "wallet",             "getreceivedbyaddress",     &getreceivedbyaddress,     false },
-    { "wallet",             "gettransaction",           &gettransaction,           false },
-    { "wallet",             "getunconfirmedbalance",    &getunconfirmedbalance,    false },
-    { "wallet",             "getwalletinfo",            &getwalletinfo,            false },
-    { "wallet",             "importprivkey",            &importprivkey,            true  },
-    { "wallet",             "importwallet",             &importwallet,             true  },
-    { "wallet",             "importaddress",            &importaddress,            true  },
-    { "wallet",             "importprunedfunds",        &importprunedfunds,        true  },
-    { "wallet",             "importpubkey",             &importpubkey,             true  },
-    { "wallet",             "keypoolrefill",            &keypoolrefill,            true  },
-    { "wallet",             "listaccounts",             &listaccounts,             false },
-    { "wallet",             "listaddressgroupings",     &listaddressgroupings,     false },
-    { "wallet",             "listlockunspent",          &listlockunspent,          false },
-    { "wallet",             "listreceivedbyaccount",    &listreceivedbyaccount,    false },
-    { "wallet",             "listreceivedbyaddress",    &listreceivedbyaddress,    false },
-    { "wallet",             "listsinceblock",           &listsinceblock,           false },
-    { "wallet",             "listtransactions",         &listtransactions,         false },
-    { "wallet",             "listunspent",              &listunspent,              false },
-    { "wallet",             "lockunspent",              &lockunspent,              true  },
-    { "wallet",             "move",                     &movecmd,                  false },
-    { "wallet",             "sendfrom",                 &sendfrom,                 false },
-    { "wallet",             "sendmany",                 &sendmany,                 false },
-    { "wallet",             "sendtoaddress",            &sendtoaddress,            false },
-    { "wallet",             "setaccount",               &setaccount,               true  },
-    { "wallet",             "settxfee",                 &settxfee,                 true  },
-    { "wallet",             "signmessage",              &signmessage,              true  },
-    { "wallet",             "walletlock",               &walletlock,               true  },
-    { "wallet",             "walletpassphrasechange",   &walletpassphrasechange,   true  },
-    { "wallet",             "walletpassphrase",         &walletpassphrase,         true  },
-    { "wallet",             "removeprunedfunds",        &removeprunedfunds,        true  },
-    { "Claimtrie",           "claimname",               &claimname,                true  },
-    { "Claimtrie",           "updateclaim",             &updateclaim,              true  },
-    { "Claimtrie",           "abandonclaim",            &abandonclaim,             true  },
-    { "Claimtrie",           "listnameclaims",          &listnameclaims,           true  },
-    { "Claimtrie",           "supportclaim",            &supportclaim,             true  },
-    { "Claimtrie",           "abandonsupport",          &abandonsupport,           true  },
+{ //  category              name                        actor (function)           okSafeMode  okParallel
+    //  --------------------- ------------------------    -----------------------    ----------  ----------
+    { "rawtransactions",    "fundrawtransaction",       &fundrawtransaction,       false,      false },
+    { "hidden",             "resendwallettransactions", &resendwallettransactions, true,       false },
+    { "wallet",             "abandontransaction",       &abandontransaction,       false,      false },
+    { "wallet",             "addmultisigaddress",       &addmultisigaddress,       true,       false },
+    { "wallet",             "backupwallet",             &backupwallet,             true,       false },
+    { "wallet",             "dumpprivkey",              &dumpprivkey,              true,       false },
+    { "wallet",             "dumpwallet",               &dumpwallet,               true,       false },
+    { "wallet",             "encryptwallet",            &encryptwallet,            true,       false },
+    { "wallet",             "getaccountaddress",        &getaccountaddress,        true,       false },
+    { "wallet",             "getaccount",               &getaccount,               true,       false },
+    { "wallet",             "getaddressesbyaccount",    &getaddressesbyaccount,    true,       false },
+    { "wallet",             "getbalance",               &getbalance,               false,      false },
+    { "wallet",             "getnewaddress",            &getnewaddress,            true,       false },
+    { "wallet",             "getrawchangeaddress",      &getrawchangeaddress,      true,       false },
+    { "wallet",             "getreceivedbyaccount",     &getreceivedbyaccount,     false,      false },
+    { "wallet",             "getreceivedbyaddress",     &getreceivedbyaddress,     false,      false },
+    { "wallet",             "gettransaction",           &gettransaction,           false,      false },
+    { "wallet",             "getunconfirmedbalance",    &getunconfirmedbalance,    false,      false },
+    { "wallet",             "getwalletinfo",            &getwalletinfo,            false,      false },
+    { "wallet",             "importprivkey",            &importprivkey,            true,       false },
+    { "wallet",             "importwallet",             &importwallet,             true,       false },
+    { "wallet",             "importaddress",            &importaddress,            true,       false },
+    { "wallet",             "importprunedfunds",        &importprunedfunds,        true,       false },
+    { "wallet",             "importpubkey",             &importpubkey,             true,       false },
+    { "wallet",             "keypoolrefill",            &keypoolrefill,            true,       false },
+    { "wallet",             "listaccounts",             &listaccounts,             false,      false },
+    { "wallet",             "listaddressgroupings",     &listaddressgroupings,     false,      false },
+    { "wallet",             "listlockunspent",          &listlockunspent,          false,      false },
+    { "wallet",             "listreceivedbyaccount",    &listreceivedbyaccount,    false,      false },
+    { "wallet",             "listreceivedbyaddress",    &listreceivedbyaddress,    false,      false },
+    { "wallet",             "listsinceblock",           &listsinceblock,           false,      false },
+    { "wallet",             "listtransactions",         &listtransactions,         false,      false },
+    { "wallet",             "listunspent",              &listunspent,              false,      false },
+    { "wallet",             "lockunspent",              &lockunspent,              true,       false },
+    { "wallet",             "move",                     &movecmd,                  false,      false },
+    { "wallet",             "sendfrom",                 &sendfrom,                 false,      false },
+    { "wallet",             "sendmany",                 &sendmany,                 false,      false },
+    { "wallet",             "sendtoaddress",            &sendtoaddress,            false,      false },
+    { "wallet",             "setaccount",               &setaccount,               true,       false },
+    { "wallet",             "settxfee",                 &settxfee,                 true,       false },
+    { "wallet",             "signmessage",              &signmessage,              true,       false },
+    { "wallet",             "walletlock",               &walletlock,               true,       false },
+    { "wallet",             "walletpassphrasechange",   &walletpassphrasechange,   true,       false },
+    { "wallet",             "walletpassphrase",         &walletpassphrase,         true,       false },
+    { "wallet",             "removeprunedfunds",        &removeprunedfunds,        true,       false },
+    { "Claimtrie",           "claimname",               &claimname,                true,       false },
+    { "Claimtrie",           "updateclaim",             &updateclaim,              true,       false },
+    { "Claimtrie",           "abandonclaim",            &abandonclaim,             true,       false },
+    { "Claimtrie",           "listnameclaims",          &listnameclaims,           true,       false },
+    { "Claimtrie",           "supportclaim",            &supportclaim,             true,       false },
+    { "Claimtrie",           "abandonsupport",          &abandonsupport,           true,       false },
 };
 
 void RegisterWalletRPCCommands(CRPCTable &tableRPC)